@@ -0,0 +1,127 @@
+#!/bin/bash
+
+# Banco de pruebas de assoofs: formatea una imagen con mkassoofs, la monta en un dispositivo loop y lanza
+# una matriz fija de cargas con assoofs-bench. Cada prueba añade una línea JSON al fichero de resultados
+# (operaciones/s, MiB/s y latencias p50/p99/máxima), etiquetada con el commit del módulo, así que los
+# resultados de dos compilaciones se pueden comparar línea a línea. Hay que ejecutarlo como root.
+#
+# Uso: ./Benchmark.sh [-s tamaño] [-t hilos] [-n operaciones] [-o resultados] [-m "opciones de mkassoofs"] [-d directorio]
+#   -d lanza la matriz sobre un directorio ya montado (sin formatear ni montar nada), para comparar con
+#      otros sistemas de ficheros
+
+SIZE=2G
+THREADS=$(nproc)
+OPS=20000
+RESULTS=bench-results.jsonl
+MKFS_OPTS=
+TARGET=
+
+while getopts "s:t:n:o:m:d:h" opt
+do
+    case $opt in
+        s) SIZE=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        n) OPS=$OPTARG ;;
+        o) RESULTS=$OPTARG ;;
+        m) MKFS_OPTS=$OPTARG ;;
+        d) TARGET=$OPTARG ;;
+        *) echo "Usage: $0 [-s size] [-t threads] [-n ops] [-o results] [-m \"mkassoofs options\"] [-d mounted directory]"; exit 2 ;;
+    esac
+done
+
+set -e -o pipefail
+cd "$(dirname "$0")"
+LABEL=$(git rev-parse --short HEAD 2>/dev/null || echo local)
+git diff --quiet HEAD 2>/dev/null || LABEL=$LABEL-dirty
+
+WORK=$(mktemp -d)
+LOADED=
+cleanup()
+{
+    if [ -z "$TARGET" ]
+    then
+        umount "$WORK/mnt" 2>/dev/null || true
+        [ -n "$LOADED" ] && rmmod assoofs
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+if [ -z "$TARGET" ]
+then
+    make ko mkassoofs assoofs-bench
+    modprobe jbd2
+    if ! grep -q '^assoofs ' /proc/modules
+    then
+        insmod assoofs.ko
+        LOADED=1
+    fi
+    ./mkassoofs -s "$SIZE" $MKFS_OPTS "$WORK/image"
+    mkdir "$WORK/mnt"
+    mount -o loop -t assoofs "$WORK/image" "$WORK/mnt"
+    TARGET=$WORK/mnt
+    LABEL="$LABEL $SIZE $MKFS_OPTS"
+else
+    make assoofs-bench
+    LABEL="$LABEL $(stat -f -c %T "$TARGET")"
+    TARGET=$TARGET/assoofs-bench.$$
+    mkdir "$TARGET"
+    trap 'rm -rf "$TARGET"; cleanup' EXIT
+fi
+
+# Cada fichero grande (uno por hilo) ocupa como mucho una cuarta parte de la imagen entre todos
+BYTES=$(numfmt --from=iec "$SIZE")
+BIG=$((BYTES / 4 / THREADS))
+[ $BIG -gt $((256 << 20)) ] && BIG=$((256 << 20))
+BIG=$((BIG >> 20 << 20))
+
+# run <prueba> <carga> <directorio> [opciones de assoofs-bench]
+# Antes de cada carga se vacían las cachés, para que las lecturas y las búsquedas vayan al disco
+run()
+{
+    local test=$1 workload=$2 dir=$TARGET/$3
+    shift 3
+    mkdir -p "$dir"
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+    ./assoofs-bench -l "$LABEL" -t "$THREADS" "$@" "$workload" "$dir" | sed "s/^{/{\"test\":\"$test\",/" | tee -a "$RESULTS"
+}
+
+# Tormentas de metadatos: todos los hilos en un mismo directorio y cada uno en el suyo
+for w in create stat readdir unlink
+do
+    run meta-shared $w meta-shared -n "$OPS"
+done
+for w in create stat readdir unlink
+do
+    run meta-private $w meta-private -n "$OPS" -P
+done
+
+# Ficheros pequeños: en línea dentro del inodo (128 bytes) y de un bloque (4 KiB). Se borran al
+# terminar para dejar sitio (e inodos) a las pruebas siguientes
+for w in small-write small-read unlink
+do
+    run small-inline $w small-inline -n "$OPS" -s 128
+done
+for w in small-write small-read unlink
+do
+    run small-4k $w small-4k -n "$OPS" -s 4K
+done
+
+# Ficheros grandes: secuencial por MiB, aleatorio por 4 KiB, con y sin caché de páginas
+for w in seq-write seq-read rand-write rand-read
+do
+    run big $w big -n "$OPS" -s "$BIG"
+done
+for w in seq-read rand-read
+do
+    run big-direct $w big -n "$OPS" -s "$BIG" -D
+done
+
+# Árbol profundo: 4 niveles con 6 subdirectorios y 6 ficheros en cada directorio, por hilo
+for w in tree-create tree-walk
+do
+    run tree $w tree -d 4 -F 6
+done
+
+echo "Results appended to $RESULTS"
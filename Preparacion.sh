@@ -11,6 +11,7 @@ make clean
 make
 dd bs=4096 count=100 if=/dev/zero of=image
 ./mkassoofs image
+modprobe jbd2
 insmod assoofs.ko
 mkdir mnt
 mount -o loop -t assoofs image mnt
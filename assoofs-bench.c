@@ -0,0 +1,569 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Generador de carga para medir un sistema de ficheros montado (lo usa Benchmark.sh con assoofs, pero
+ * sirve para cualquiera). Cada ejecución lanza una carga con varios hilos sobre un directorio, mide la
+ * latencia de cada operación y escribe una línea JSON con el resultado: operaciones por segundo, MiB/s
+ * en las de E/S y latencias p50, p99 y máxima. Las cargas que leen o borran usan lo que dejó la que
+ * crea con los mismos parámetros (-t, -n, -P, -s), así que se encadenan:
+ *   create, stat, readdir, unlink          tormenta de metadatos en un directorio (o uno por hilo con -P)
+ *   small-write, small-read                ficheros pequeños: crear+escribir+cerrar, abrir+leer+cerrar
+ *   seq-write, seq-read                    un fichero grande por hilo, por bloques de -b bytes
+ *   rand-write, rand-read                  E/S aleatoria de -b bytes sobre esos ficheros
+ *   tree-create, tree-walk                 árbol de -d niveles con -F directorios y -F ficheros en cada uno
+ */
+
+#define MAX_THREADS 256
+#define DIRENT_BUF (32 << 10)
+
+enum workload
+{
+    W_CREATE,
+    W_STAT,
+    W_READDIR,
+    W_UNLINK,
+    W_SMALL_WRITE,
+    W_SMALL_READ,
+    W_SEQ_WRITE,
+    W_SEQ_READ,
+    W_RAND_WRITE,
+    W_RAND_READ,
+    W_TREE_CREATE,
+    W_TREE_WALK,
+};
+
+static const char *workloads[] = {
+    "create", "stat", "readdir", "unlink", "small-write", "small-read",
+    "seq-write", "seq-read", "rand-write", "rand-read", "tree-create", "tree-walk",
+};
+
+/* Opciones */
+static int workload = -1;
+static const char *dir;
+static const char *label = "";
+static int threads = 1;
+static uint64_t ops = 10000;          /* Operaciones en total (entre todos los hilos) */
+static uint64_t file_size = 4096;     /* Tamaño de los ficheros pequeños o de cada fichero grande */
+static uint64_t io_size = 0;          /* Bytes de cada read/write; por defecto depende de la carga */
+static int private_dirs;              /* -P: un directorio por hilo en vez de uno compartido */
+static int direct_io;                 /* -D: O_DIRECT en las cargas de ficheros grandes */
+static int tree_depth = 4;
+static int tree_fanout = 8;
+
+struct worker
+{
+    pthread_t thread;
+    int id;
+    uint64_t *lat;  /* Latencia de cada operación, en ns */
+    uint64_t nlat;
+    uint64_t cap;
+    uint64_t items; /* Operaciones hechas (en readdir, entradas leídas) */
+    uint64_t bytes;
+    int err;
+    char path[4096];
+};
+
+static struct worker workers[MAX_THREADS];
+static pthread_barrier_t start_barrier;
+static struct timespec start_time;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int record(struct worker *w, uint64_t since)
+{
+    uint64_t *grown;
+
+    if (w->nlat == w->cap)
+    {
+        w->cap = w->cap ? w->cap * 2 : 4096;
+        grown = realloc(w->lat, w->cap * sizeof(*w->lat));
+        if (!grown)
+            return -1;
+        w->lat = grown;
+    }
+    w->lat[w->nlat++] = now_ns() - since;
+    return 0;
+}
+
+/* Falla la operación de un hilo: se guarda el error y el hilo deja de trabajar */
+static int fail(struct worker *w, const char *what)
+{
+    w->err = errno ? errno : EIO;
+    fprintf(stderr, "Thread %d: %s %s: %s\n", w->id, what, w->path, strerror(w->err));
+    return -1;
+}
+
+/* Nombre del fichero i del hilo: dir/f<hilo>-<i>, o dir/t<hilo>/f<i> con directorios por hilo */
+static void file_name(struct worker *w, uint64_t i)
+{
+    if (private_dirs)
+        snprintf(w->path, sizeof(w->path), "%s/t%d/f%llu", dir, w->id, (unsigned long long)i);
+    else
+        snprintf(w->path, sizeof(w->path), "%s/f%d-%llu", dir, w->id, (unsigned long long)i);
+}
+
+static uint64_t thread_ops(struct worker *w)
+{
+    return ops / threads + ((uint64_t)w->id < ops % threads);
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/*
+ * Cargas de metadatos y de ficheros pequeños
+ */
+static int run_files(struct worker *w, char *buf)
+{
+    uint64_t i, n = thread_ops(w), t;
+    struct stat st;
+    ssize_t done;
+    int fd;
+
+    for (i = 0; i < n; i++)
+    {
+        file_name(w, i);
+        t = now_ns();
+        switch (workload)
+        {
+        case W_CREATE:
+            fd = open(w->path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (fd == -1 || close(fd))
+                return fail(w, "create");
+            break;
+        case W_STAT:
+            if (stat(w->path, &st))
+                return fail(w, "stat");
+            break;
+        case W_UNLINK:
+            if (unlink(w->path))
+                return fail(w, "unlink");
+            break;
+        case W_SMALL_WRITE:
+            fd = open(w->path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (fd == -1)
+                return fail(w, "create");
+            done = write(fd, buf, file_size);
+            if (close(fd) || done != (ssize_t)file_size)
+                return fail(w, "write");
+            w->bytes += file_size;
+            break;
+        case W_SMALL_READ:
+            fd = open(w->path, O_RDONLY);
+            if (fd == -1)
+                return fail(w, "open");
+            done = read(fd, buf, file_size);
+            close(fd);
+            if (done != (ssize_t)file_size)
+                return fail(w, "read");
+            w->bytes += file_size;
+            break;
+        }
+        if (record(w, t))
+            return fail(w, "record");
+        w->items++;
+    }
+    return 0;
+}
+
+/* readdir: cada hilo lista el directorio (el suyo con -P) hasta sumar sus operaciones en entradas.
+ * La latencia es la de cada llamada a getdents64 */
+static int run_readdir(struct worker *w, char *buf)
+{
+    uint64_t n = thread_ops(w), t;
+    struct dirent64 *de;
+    long got, off;
+    int fd;
+
+    if (private_dirs)
+        snprintf(w->path, sizeof(w->path), "%s/t%d", dir, w->id);
+    else
+        snprintf(w->path, sizeof(w->path), "%s", dir);
+    while (w->items < n)
+    {
+        fd = open(w->path, O_RDONLY | O_DIRECTORY);
+        if (fd == -1)
+            return fail(w, "open");
+        for (;;)
+        {
+            t = now_ns();
+            got = getdents64(fd, buf, DIRENT_BUF);
+            if (got < 0)
+            {
+                close(fd);
+                return fail(w, "getdents64");
+            }
+            if (record(w, t))
+                return fail(w, "record");
+            if (got == 0)
+                break;
+            for (off = 0; off < got; off += de->d_reclen)
+            {
+                de = (struct dirent64 *)(buf + off);
+                if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+                    w->items++;
+            }
+        }
+        close(fd);
+        if (w->items == 0)
+        {
+            errno = ENOENT;
+            return fail(w, "empty directory");
+        }
+    }
+    return 0;
+}
+
+/*
+ * Cargas de ficheros grandes: dir/big<hilo>, de file_size bytes
+ */
+static int run_big(struct worker *w, char *buf)
+{
+    int writing = workload == W_SEQ_WRITE || workload == W_RAND_WRITE;
+    int flags = (writing ? O_WRONLY : O_RDONLY) | (direct_io ? O_DIRECT : 0);
+    uint64_t blocks = file_size / io_size, i, n, t, seed = 0x9E3779B97F4A7C15ULL * (w->id + 1);
+    off_t off;
+    ssize_t done;
+    int fd;
+
+    snprintf(w->path, sizeof(w->path), "%s/big%d", dir, w->id);
+    fd = open(w->path, flags | (workload == W_SEQ_WRITE ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd == -1)
+        return fail(w, "open");
+    n = (workload == W_SEQ_WRITE || workload == W_SEQ_READ) ? blocks : thread_ops(w);
+    for (i = 0; i < n; i++)
+    {
+        off = (workload == W_SEQ_WRITE || workload == W_SEQ_READ ? i : xorshift(&seed) % blocks) * io_size;
+        t = now_ns();
+        done = writing ? pwrite(fd, buf, io_size, off) : pread(fd, buf, io_size, off);
+        if (done != (ssize_t)io_size)
+        {
+            close(fd);
+            return fail(w, writing ? "write" : "read");
+        }
+        if (record(w, t))
+            return fail(w, "record");
+        w->items++;
+        w->bytes += io_size;
+    }
+    /* Lo escrito cuenta cuando llega al disco: el fsync entra en el tiempo total */
+    if ((writing && fsync(fd)) || close(fd))
+        return fail(w, "fsync");
+    return 0;
+}
+
+/*
+ * Árbol: dir/tree<hilo> con tree_depth niveles; cada directorio tiene tree_fanout ficheros y, salvo
+ * los del último nivel, tree_fanout subdirectorios
+ */
+static int tree_create(struct worker *w, size_t len, int depth)
+{
+    uint64_t t;
+    int i, fd, sub;
+
+    for (i = 0; i < 2 * tree_fanout; i++)
+    {
+        sub = i < tree_fanout;
+        if (sub && depth == tree_depth)
+            continue;
+        snprintf(w->path + len, sizeof(w->path) - len, "/%c%d", sub ? 'd' : 'f', i % tree_fanout);
+        t = now_ns();
+        if (sub ? mkdir(w->path, 0755) : ((fd = open(w->path, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1 || close(fd)))
+            return fail(w, sub ? "mkdir" : "create");
+        if (record(w, t))
+            return fail(w, "record");
+        w->items++;
+        if (sub && tree_create(w, strlen(w->path), depth + 1))
+            return -1;
+    }
+    w->path[len] = '\0';
+    return 0;
+}
+
+/* Recorrido tipo find -ls: se lista cada directorio y se hace stat de cada entrada */
+static int tree_walk(struct worker *w, size_t len)
+{
+    struct dirent *de;
+    struct stat st;
+    uint64_t t;
+    DIR *d;
+
+    d = opendir(w->path);
+    if (!d)
+        return fail(w, "opendir");
+    while ((errno = 0, de = readdir(d)))
+    {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        snprintf(w->path + len, sizeof(w->path) - len, "/%s", de->d_name);
+        t = now_ns();
+        if (lstat(w->path, &st))
+        {
+            closedir(d);
+            return fail(w, "stat");
+        }
+        if (record(w, t))
+            return fail(w, "record");
+        w->items++;
+        if (S_ISDIR(st.st_mode) && tree_walk(w, strlen(w->path)))
+        {
+            closedir(d);
+            return -1;
+        }
+        w->path[len] = '\0';
+    }
+    if (errno)
+        return fail(w, "readdir");
+    closedir(d);
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    char *buf;
+
+    /* Buffer alineado para O_DIRECT, con un patrón que no sea todo ceros */
+    if (posix_memalign((void **)&buf, 4096, io_size > DIRENT_BUF ? io_size : DIRENT_BUF))
+    {
+        w->err = ENOMEM;
+        pthread_barrier_wait(&start_barrier);
+        return NULL;
+    }
+    memset(buf, 0x5A + w->id, io_size > DIRENT_BUF ? io_size : DIRENT_BUF);
+
+    /* Los directorios por hilo se crean antes de empezar a medir */
+    if (workload == W_CREATE || workload == W_SMALL_WRITE || workload == W_TREE_CREATE)
+    {
+        if (workload == W_TREE_CREATE)
+            snprintf(w->path, sizeof(w->path), "%s/tree%d", dir, w->id);
+        else
+            snprintf(w->path, sizeof(w->path), "%s/t%d", dir, w->id);
+        if ((private_dirs || workload == W_TREE_CREATE) && mkdir(w->path, 0755) && errno != EEXIST)
+            fail(w, "mkdir");
+    }
+    pthread_barrier_wait(&start_barrier);
+    if (w->err)
+        goto out;
+
+    switch (workload)
+    {
+    case W_READDIR:
+        run_readdir(w, buf);
+        break;
+    case W_SEQ_WRITE:
+    case W_SEQ_READ:
+    case W_RAND_WRITE:
+    case W_RAND_READ:
+        run_big(w, buf);
+        break;
+    case W_TREE_CREATE:
+        tree_create(w, strlen(w->path), 1);
+        break;
+    case W_TREE_WALK:
+        snprintf(w->path, sizeof(w->path), "%s/tree%d", dir, w->id);
+        tree_walk(w, strlen(w->path));
+        break;
+    default:
+        run_files(w, buf);
+        break;
+    }
+out:
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void)
+{
+    int i;
+
+    printf("Usage: assoofs-bench [options] <workload> <directory>\n"
+           "  -t threads    worker threads (default 1)\n"
+           "  -n ops        operations in total; for readdir, entries to list (default 10000)\n"
+           "  -s size       small file size, or size of each thread's big file (default 4096)\n"
+           "  -b size       bytes per read/write in the big file workloads (default 1M sequential, 4K random)\n"
+           "  -P            one directory per thread instead of a shared one\n"
+           "  -D            O_DIRECT in the big file workloads\n"
+           "  -d depth      tree levels (default 4)\n"
+           "  -F fanout     subdirectories and files per tree directory (default 8)\n"
+           "  -l label      label copied to the result (e.g. the module build)\n"
+           "Workloads:");
+    for (i = 0; i < (int)(sizeof(workloads) / sizeof(workloads[0])); i++)
+        printf(" %s", workloads[i]);
+    printf("\n");
+}
+
+/* Tamaño con sufijo opcional K, M o G */
+static int parse_size(const char *arg, uint64_t *size)
+{
+    char *end;
+
+    *size = strtoull(arg, &end, 10);
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        *size <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        *size <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        *size <<= 10;
+        end++;
+    }
+    return *end || !*size ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t total_lat = 0, items = 0, bytes = 0, *lat, n = 0, elapsed, p50, p99, max;
+    struct timespec end_time;
+    double secs;
+    int opt, i, err = 0;
+
+    while ((opt = getopt(argc, argv, "t:n:s:b:PDd:F:l:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            ops = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            if (parse_size(optarg, &file_size))
+                threads = 0;
+            break;
+        case 'b':
+            if (parse_size(optarg, &io_size))
+                threads = 0;
+            break;
+        case 'P':
+            private_dirs = 1;
+            break;
+        case 'D':
+            direct_io = 1;
+            break;
+        case 'd':
+            tree_depth = atoi(optarg);
+            break;
+        case 'F':
+            tree_fanout = atoi(optarg);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind == argc - 2)
+    {
+        for (i = 0; i < (int)(sizeof(workloads) / sizeof(workloads[0])); i++)
+        {
+            if (!strcmp(argv[optind], workloads[i]))
+                workload = i;
+        }
+        dir = argv[optind + 1];
+    }
+    if (workload < 0 || threads < 1 || threads > MAX_THREADS || tree_depth < 1 || tree_fanout < 1)
+    {
+        usage();
+        return 2;
+    }
+    if (!io_size)
+        io_size = (workload == W_RAND_WRITE || workload == W_RAND_READ) ? 4096 : 1 << 20;
+    if (workload >= W_SEQ_WRITE && workload <= W_RAND_READ && file_size < io_size)
+    {
+        printf("The file size (-s) must be at least one read/write (-b).\n");
+        return 2;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    for (i = 0; i < threads; i++)
+    {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+        {
+            perror("Error creating the threads");
+            return 1;
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    for (i = 0; i < threads; i++)
+    {
+        total_lat += workers[i].nlat;
+        items += workers[i].items;
+        bytes += workers[i].bytes;
+        err |= workers[i].err;
+    }
+    if (err)
+        return 1;
+
+    /* Percentiles sobre las latencias de todos los hilos juntas */
+    lat = malloc((total_lat ? total_lat : 1) * sizeof(*lat));
+    if (!lat)
+    {
+        perror("Error");
+        return 1;
+    }
+    for (i = 0; i < threads; i++)
+    {
+        memcpy(lat + n, workers[i].lat, workers[i].nlat * sizeof(*lat));
+        n += workers[i].nlat;
+        free(workers[i].lat);
+    }
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    p50 = n ? lat[(n - 1) * 50 / 100] : 0;
+    p99 = n ? lat[(n - 1) * 99 / 100] : 0;
+    max = n ? lat[n - 1] : 0;
+    free(lat);
+
+    elapsed = (end_time.tv_sec - start_time.tv_sec) * 1000000000ULL + end_time.tv_nsec - start_time.tv_nsec;
+    secs = elapsed / 1e9;
+    printf("{\"label\":\"%s\",\"workload\":\"%s\",\"threads\":%d,\"ops\":%llu,\"seconds\":%.6f,"
+           "\"ops_per_sec\":%.1f,\"mib_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+           label, workloads[workload], threads, (unsigned long long)items, secs, items / secs,
+           bytes / secs / (1 << 20), p50 / 1e3, p99 / 1e3, max / 1e3);
+    return 0;
+}
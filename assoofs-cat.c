@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "libassoofs.h"
+
+/* Escribe en la salida estándar el contenido de ficheros de una imagen assoofs sin montarla */
+
+int main(int argc, char *argv[])
+{
+    struct assoofs_image img;
+    uint64_t ino;
+    int i, ret = 0;
+
+    if (argc < 3)
+    {
+        printf("Usage: assoofs-cat <image> <path>...\n");
+        return 2;
+    }
+    if (assoofs_image_open(&img, argv[1]))
+    {
+        perror("Error opening the image");
+        return 1;
+    }
+    for (i = 2; i < argc; i++)
+    {
+        if (assoofs_image_resolve(&img, argv[i], &ino) || assoofs_image_copy(&img, ino, STDOUT_FILENO))
+        {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            ret = 1;
+        }
+    }
+    assoofs_image_close(&img);
+    return ret;
+}
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "libassoofs.h"
+
+/*
+ * Copia un árbol de una imagen assoofs a un directorio del anfitrión sin montarla. Los ficheros se
+ * copian con assoofs_image_copy: los datos van de la imagen al fichero nuevo dentro del kernel
+ * (copy_file_range), sin pasar por un buffer del proceso.
+ */
+
+struct extract
+{
+    const struct assoofs_image *img;
+    unsigned char *visited; /* Directorios ya copiados: una imagen corrupta podría tener ciclos */
+    unsigned long long dirs, files, bytes;
+    int failed;
+};
+
+static void extract_dir(struct extract *x, uint64_t ino, int dirfd, const char *path);
+
+static void fail(struct extract *x, const char *path, const char *name)
+{
+    fprintf(stderr, "%s/%s: %s\n", path, name, strerror(errno));
+    x->failed = 1;
+}
+
+/* Permisos del inodo, o los de por defecto si la imagen no los guarda (mkassoofs sin -d) */
+static mode_t perms(const struct assoofs_inode_info *info)
+{
+    if (info->mode & 07777)
+        return info->mode & 07777;
+    return S_ISDIR(info->mode) ? 0755 : 0644;
+}
+
+static void extract_file(struct extract *x, const struct assoofs_inode_info *info, int dirfd, const char *path, const char *name)
+{
+    int fd;
+
+    fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, perms(info));
+    if (fd == -1 || assoofs_image_copy(x->img, info->inode_no, fd))
+    {
+        fail(x, path, name);
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    if (close(fd))
+    {
+        fail(x, path, name);
+        return;
+    }
+    x->files++;
+    x->bytes += info->file_size;
+}
+
+static void extract_entry(struct extract *x, uint64_t ino, int dirfd, const char *path, const char *name)
+{
+    const struct assoofs_inode_info *info = assoofs_image_inode(x->img, ino);
+    char *subpath;
+    int fd;
+
+    if (!info)
+    {
+        fail(x, path, name);
+        return;
+    }
+    if (!S_ISDIR(info->mode))
+    {
+        extract_file(x, info, dirfd, path, name);
+        return;
+    }
+
+    if (x->visited[ino / 8] & (1 << (ino % 8)))
+    {
+        errno = ELOOP;
+        fail(x, path, name);
+        return;
+    }
+    x->visited[ino / 8] |= 1 << (ino % 8);
+
+    if ((mkdirat(dirfd, name, perms(info) | S_IRWXU) && errno != EEXIST) ||
+        (fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY)) == -1)
+    {
+        fail(x, path, name);
+        return;
+    }
+    subpath = malloc(strlen(path) + strlen(name) + 2);
+    if (!subpath)
+    {
+        close(fd);
+        fail(x, path, name);
+        return;
+    }
+    sprintf(subpath, "%s/%s", path, name);
+    x->dirs++;
+    extract_dir(x, ino, fd, subpath);
+    /* El directorio se creó con permiso de escritura para poder llenarlo: ahora lleva los suyos */
+    fchmod(fd, perms(info));
+    free(subpath);
+    close(fd);
+}
+
+struct dir_walk
+{
+    struct extract *x;
+    int dirfd;
+    const char *path;
+};
+
+static int extract_dir_entry(void *arg, const struct assoofs_dir_entry *de)
+{
+    struct dir_walk *w = arg;
+    char name[ASSOOFS_FILENAME_MAXLEN + 1];
+
+    memcpy(name, de->name, de->name_len);
+    name[de->name_len] = '\0';
+    if (!de->name_len || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, ".."))
+    {
+        errno = EIO;
+        fail(w->x, w->path, name);
+        return 0;
+    }
+    extract_entry(w->x, de->inode_no, w->dirfd, w->path, name);
+    return 0;
+}
+
+static void extract_dir(struct extract *x, uint64_t ino, int dirfd, const char *path)
+{
+    struct dir_walk w = {x, dirfd, path};
+
+    if (assoofs_image_readdir(x->img, ino, extract_dir_entry, &w))
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        x->failed = 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct assoofs_image img;
+    struct extract x = {&img, NULL, 0, 0, 0, 0};
+    const struct assoofs_inode_info *info;
+    const char *path, *dest, *name;
+    uint64_t ino;
+    int dirfd;
+
+    if (argc != 3 && argc != 4)
+    {
+        printf("Usage: assoofs-extract <image> [path] <directory>\n"
+               "  Copies path (by default, the whole filesystem) into directory, which is created if needed.\n");
+        return 2;
+    }
+    path = argc == 4 ? argv[2] : "/";
+    dest = argv[argc - 1];
+
+    if (assoofs_image_open(&img, argv[1]))
+    {
+        perror("Error opening the image");
+        return 1;
+    }
+    x.visited = calloc(img.inodes / 8 + 1, 1);
+    if (!x.visited)
+    {
+        perror("Error");
+        return 1;
+    }
+    if (assoofs_image_resolve(&img, path, &ino) || !(info = assoofs_image_inode(&img, ino)))
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if ((mkdir(dest, 0755) && errno != EEXIST) || (dirfd = open(dest, O_RDONLY | O_DIRECTORY)) == -1)
+    {
+        perror(dest);
+        return 1;
+    }
+
+    /* Un directorio se copia dentro de dest (su contenido); un fichero, a dest con su nombre */
+    if (S_ISDIR(info->mode))
+    {
+        x.visited[ino / 8] |= 1 << (ino % 8);
+        extract_dir(&x, ino, dirfd, dest);
+    }
+    else
+    {
+        name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+        extract_file(&x, info, dirfd, dest, name);
+    }
+    close(dirfd);
+    assoofs_image_close(&img);
+
+    printf("Extracted %llu directories and %llu files (%llu bytes) into %s.\n", x.dirs, x.files, x.bytes, dest);
+    return x.failed;
+}
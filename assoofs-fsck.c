@@ -0,0 +1,942 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "assoofs.h"
+
+/*
+ * Comprobación de una imagen assoofs desmontada. La imagen se proyecta entera en memoria (mmap) y se
+ * recorre en varias fases; las que van inodo a inodo o palabra a palabra del mapa de bits se reparten
+ * entre varios hilos por tramos:
+ *  1. Ranuras de la tabla de inodos: número, modo, flags, tamaño y mapa de extents.
+ *  2. Directorios: formato de sus bloques (o de su contenido en línea) y de su índice, hash y hoja de
+ *     cada entrada, y a qué inodo apunta. Cada inodo apunta a su padre: la primera entrada que lo nombra.
+ *  3. Desde la raíz (secuencial): qué inodos son alcanzables. Los que no, están huérfanos.
+ *  4. Bloques de los inodos que se quedan: nadie puede compartir un bloque.
+ *  5. Mapas de bits de bloques y de inodos contra lo calculado, y contadores del superbloque.
+ * Con -y se reparan los mapas de bits, los contadores, dir_children_count, las entradas que apuntan a
+ * inodos que no existen (o que repiten uno) y los inodos huérfanos o rotos, que se liberan (no hay
+ * lost+found). Los bloques compartidos, los directorios con bloques o índices rotos y las entradas en
+ * la hoja equivocada no se reparan: la imagen se deja como está.
+ */
+
+#define INODES_PER_BLOCK ASSOOFS_INODES_PER_BLOCK(block_size)
+#define CHUNK 4096        /* Inodos o palabras del mapa de bits de cada tramo que coge un hilo */
+#define MAX_THREADS 64
+#define MAX_REPORTS 10    /* Problemas de cada tipo que se muestran; del resto solo se cuentan */
+
+/* Códigos de salida, como los de e2fsck */
+#define EXIT_OK 0
+#define EXIT_FIXED 1
+#define EXIT_UNCORRECTED 4
+#define EXIT_ERROR 8
+
+/* Superbloque de un diario jbd2 (campos en big-endian), solo lo necesario para saber si hay que recuperarlo */
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+struct jbd2_superblock_head
+{
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+    uint32_t s_blocksize;
+    uint32_t s_maxlen;
+    uint32_t s_first;
+    uint32_t s_sequence;
+    uint32_t s_start;
+};
+
+enum problem
+{
+    P_SUPER,        /* Superbloque */
+    P_JOURNAL,      /* Diario pendiente de recuperar */
+    P_INODE,        /* Ranura de inodo en uso pero incoherente, o mapa de extents roto */
+    P_DIR,          /* Bloque, índice o entrada de directorio con formato roto */
+    P_HASH,         /* Entrada con un hash que no es el de su nombre o fuera de la hoja que le toca */
+    P_DANGLING,     /* Entrada que apunta a un inodo que no existe o con otro tipo */
+    P_DUP_REF,      /* Entrada que apunta a un inodo que ya tiene otra entrada */
+    P_CHILDREN,     /* dir_children_count distinto del número de entradas */
+    P_ORPHAN,       /* Inodo en uso al que no se llega desde la raíz */
+    P_CROSSLINK,    /* Bloque que usan dos inodos */
+    P_BLOCK_FREE,   /* Bloque en uso marcado como libre */
+    P_BLOCK_LEAK,   /* Bloque marcado como ocupado que no usa nadie */
+    P_INODE_BITMAP, /* Bit del mapa de inodos que no corresponde con el inodo */
+    P_COUNTERS,     /* Contadores del superbloque */
+    P_COUNT
+};
+
+static const struct
+{
+    const char *name;
+    int fixable;
+} problems[P_COUNT] = {
+    [P_SUPER] = {"superblock", 0},
+    [P_JOURNAL] = {"journal", 0},
+    [P_INODE] = {"broken inodes", 1},
+    [P_DIR] = {"broken directory blocks", 0},
+    [P_HASH] = {"misplaced directory entries", 0},
+    [P_DANGLING] = {"dangling directory entries", 1},
+    [P_DUP_REF] = {"duplicated directory entries", 1},
+    [P_CHILDREN] = {"wrong directory entry counts", 1},
+    [P_ORPHAN] = {"orphan inodes", 1},
+    [P_CROSSLINK] = {"blocks shared by several inodes", 0},
+    [P_BLOCK_FREE] = {"used blocks marked free", 1},
+    [P_BLOCK_LEAK] = {"unused blocks marked used", 1},
+    [P_INODE_BITMAP] = {"wrong inode bitmap bits", 1},
+    [P_COUNTERS] = {"superblock counters", 1},
+};
+
+/* Estado de cada ranura de la tabla de inodos */
+enum slot_state
+{
+    SLOT_FREE,   /* Libre (o sin inicializar todavía) */
+    SLOT_BROKEN, /* Marcada en uso pero incoherente: se libera */
+    SLOT_VALID,  /* Inodo coherente; se queda si se llega a él desde la raíz */
+    SLOT_KEPT,   /* Inodo válido y alcanzable */
+};
+
+static unsigned char *img;
+static uint64_t img_size;
+static struct assoofs_super_block_info *sb; /* Dentro de la proyección */
+static uint64_t block_size;
+static uint64_t slots;        /* Ranuras de la tabla de inodos, la 0 incluida */
+static uint64_t meta_end;     /* Primer bloque detrás de los metadatos fijos */
+static int repair;
+static int nthreads;
+
+static atomic_ulong counts[P_COUNT];
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char *slot_state;     /* enum slot_state de cada ranura */
+static _Atomic uint64_t *parent;      /* Directorio de la primera entrada que apunta a cada inodo */
+static uint64_t *children;            /* Entradas válidas de cada directorio */
+static _Atomic uint64_t *used_map;    /* Mapa de bits de bloques calculado */
+
+/* Entradas de directorio que hay que borrar al reparar */
+static struct assoofs_dir_entry **stale;
+static size_t nstale, stale_cap;
+
+static void report(enum problem p, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void report(enum problem p, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (atomic_fetch_add(&counts[p], 1) >= MAX_REPORTS)
+        return;
+    pthread_mutex_lock(&report_lock);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    putchar('\n');
+    pthread_mutex_unlock(&report_lock);
+}
+
+static void add_stale(struct assoofs_dir_entry *de)
+{
+    struct assoofs_dir_entry **grown;
+
+    pthread_mutex_lock(&report_lock);
+    if (nstale == stale_cap)
+    {
+        stale_cap = stale_cap ? stale_cap * 2 : 1024;
+        grown = realloc(stale, stale_cap * sizeof(*stale));
+        if (!grown)
+        {
+            /* Sin memoria la entrada no se borra: se avisa de que queda un error */
+            pthread_mutex_unlock(&report_lock);
+            report(P_DIR, "out of memory recording the entries to remove");
+            return;
+        }
+        stale = grown;
+    }
+    stale[nstale++] = de;
+    pthread_mutex_unlock(&report_lock);
+}
+
+static inline unsigned char *block_at(uint64_t block)
+{
+    return img + block * block_size;
+}
+
+static inline struct assoofs_inode_info *inode_at(uint64_t ino)
+{
+    return (struct assoofs_inode_info *)(block_at(sb->inode_table_start) + ino * ASSOOFS_INODE_SIZE);
+}
+
+static inline int test_bit(const unsigned char *map, uint64_t bit)
+{
+    return map[bit / 8] & (1 << (bit % 8));
+}
+
+/* Marca [from, to) en el mapa de bloques calculado (antes de lanzar los hilos) */
+static void set_bits(uint64_t from, uint64_t to)
+{
+    uint64_t bit;
+
+    for (bit = from; bit < to; bit++)
+        used_map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+/*
+ * Reparto del trabajo: cada hilo va cogiendo el siguiente tramo de CHUNK elementos de [0, count)
+ */
+struct job
+{
+    void (*fn)(uint64_t from, uint64_t to);
+    uint64_t count;
+    atomic_ulong next;
+};
+
+static void *worker(void *arg)
+{
+    struct job *job = arg;
+    uint64_t from;
+
+    while ((from = atomic_fetch_add(&job->next, CHUNK)) < job->count)
+        job->fn(from, from + CHUNK < job->count ? from + CHUNK : job->count);
+    return NULL;
+}
+
+static void parallel_for(uint64_t count, void (*fn)(uint64_t from, uint64_t to))
+{
+    pthread_t threads[MAX_THREADS];
+    struct job job = {fn, count, 0};
+    int started;
+
+    for (started = 0; started < nthreads; started++)
+    {
+        if (pthread_create(&threads[started], NULL, worker, &job))
+            break;
+    }
+    worker(&job);
+    while (started > 0)
+        pthread_join(threads[--started], NULL);
+}
+
+/*
+ * Fase 0: superbloque y diario
+ */
+static int check_super(void)
+{
+    struct jbd2_superblock_head *jsb;
+    uint64_t bits;
+
+    if (img_size < ASSOOFS_MIN_BLOCK_SIZE || sb->magic != ASSOOFS_MAGIC)
+    {
+        printf("Not an assoofs image (bad magic number).\n");
+        return -1;
+    }
+    block_size = sb->block_size;
+    if (block_size < ASSOOFS_MIN_BLOCK_SIZE || block_size > ASSOOFS_MAX_BLOCK_SIZE || (block_size & (block_size - 1)))
+    {
+        report(P_SUPER, "Unsupported block size %llu.", (unsigned long long)block_size);
+        return -1;
+    }
+    bits = block_size * 8;
+    if (sb->blocks_count == 0 || sb->blocks_count > img_size / block_size)
+    {
+        report(P_SUPER, "The filesystem has %llu blocks but the image only %llu.", (unsigned long long)sb->blocks_count, (unsigned long long)(img_size / block_size));
+        return -1;
+    }
+    if (sb->bitmap_start != ASSOOFS_SUPERBLOCK_BLOCK_NUMBER + 1 || sb->bitmap_blocks * bits < sb->blocks_count ||
+        sb->inode_bitmap_start != sb->bitmap_start + sb->bitmap_blocks || sb->inode_table_blocks == 0 ||
+        sb->inode_bitmap_blocks * bits < sb->inode_table_blocks * INODES_PER_BLOCK ||
+        sb->inode_table_start != sb->inode_bitmap_start + sb->inode_bitmap_blocks ||
+        sb->journal_start != sb->inode_table_start + sb->inode_table_blocks ||
+        sb->journal_start + sb->journal_blocks > sb->blocks_count ||
+        (sb->journal_blocks && sb->journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS))
+    {
+        report(P_SUPER, "The superblock geometry is inconsistent.");
+        return -1;
+    }
+    if ((sb->features & ~(uint64_t)(ASSOOFS_FEATURE_BLOCK_DIRS | ASSOOFS_FEATURE_LAZY_ITABLE)) ||
+        ((sb->features & ASSOOFS_FEATURE_LAZY_ITABLE) && sb->inode_table_zeroed > sb->inode_table_blocks))
+    {
+        report(P_SUPER, "Unknown features 0x%llx or bad inode table state.", (unsigned long long)sb->features);
+        return -1;
+    }
+    slots = sb->inode_table_blocks * INODES_PER_BLOCK;
+    meta_end = sb->journal_start + sb->journal_blocks;
+
+    /* Con transacciones pendientes en el diario, lo que hay en su sitio no es lo último */
+    if (sb->journal_blocks)
+    {
+        jsb = (struct jbd2_superblock_head *)block_at(sb->journal_start);
+        if (ntohl(jsb->h_magic) != JBD2_MAGIC_NUMBER || ntohl(jsb->s_blocksize) != block_size)
+            report(P_JOURNAL, "The journal superblock is corrupted.");
+        else if (jsb->s_start)
+            report(P_JOURNAL, "The journal has transactions to recover: mount the image once before checking it.");
+    }
+    return 0;
+}
+
+/*
+ * Fase 1: ranuras de la tabla de inodos
+ */
+
+/* Recorre un nodo del árbol de extents: cada tramo debe seguir al anterior (sin huecos) y caer en la zona
+ * de datos. Con mark, marca sus bloques (y los de los nodos) en el mapa calculado */
+static int walk_extents(uint64_t ino, struct assoofs_extent_header *hdr, struct assoofs_extent *ext, int level, uint64_t *next, int mark);
+
+static int mark_block(uint64_t ino, uint64_t block, uint64_t count, int mark)
+{
+    uint64_t i, bit;
+
+    if (block < meta_end || block >= sb->blocks_count || count > sb->blocks_count - block)
+        return -1;
+    for (i = 0; mark && i < count; i++)
+    {
+        bit = block + i;
+        if (atomic_fetch_or(&used_map[bit / 64], 1ULL << (bit % 64)) & (1ULL << (bit % 64)))
+            report(P_CROSSLINK, "Block %llu of inode %llu is also used by another inode.", (unsigned long long)bit, (unsigned long long)ino);
+    }
+    return 0;
+}
+
+static int walk_extents(uint64_t ino, struct assoofs_extent_header *hdr, struct assoofs_extent *ext, int level, uint64_t *next, int mark)
+{
+    struct assoofs_extent_header *child;
+    int i;
+
+    if (hdr->magic != ASSOOFS_EXTENT_MAGIC || hdr->entries > hdr->max || level > ASSOOFS_EXTENT_MAX_DEPTH)
+        return -1;
+    for (i = 0; i < hdr->entries; i++)
+    {
+        if (ext[i].block != *next)
+            return -1;
+        if (hdr->depth == 0)
+        {
+            if (ext[i].len == 0 || mark_block(ino, ext[i].start, ext[i].len, mark))
+                return -1;
+            *next += ext[i].len;
+            continue;
+        }
+        if (mark_block(ino, ext[i].start, 1, mark))
+            return -1;
+        child = (struct assoofs_extent_header *)block_at(ext[i].start);
+        if (child->depth != hdr->depth - 1 ||
+            child->max != (block_size - sizeof(*child)) / sizeof(struct assoofs_extent) ||
+            walk_extents(ino, child, (struct assoofs_extent *)(child + 1), level + 1, next, mark))
+            return -1;
+    }
+    return 0;
+}
+
+static int check_extents(uint64_t ino, struct assoofs_inode_info *info, int mark)
+{
+    uint64_t next = 0;
+
+    if (info->flags & ASSOOFS_INODE_INLINE)
+        return 0;
+    if (info->extent_header.max != ASSOOFS_INLINE_EXTENTS ||
+        walk_extents(ino, &info->extent_header, info->extents, 0, &next, mark) || next != info->blocks)
+        return -1;
+    return 0;
+}
+
+/* ¿Está la ranura en uso? Lo dice el mapa de bits de inodos o su estado; con la tabla a medio poner a
+ * cero, las ranuras libres de los bloques sin inicializar pueden tener cualquier cosa */
+static int slot_in_use(uint64_t ino)
+{
+    const unsigned char *ibitmap = block_at(sb->inode_bitmap_start);
+
+    if (test_bit(ibitmap, ino))
+        return 1;
+    if ((sb->features & ASSOOFS_FEATURE_LAZY_ITABLE) && ino / INODES_PER_BLOCK >= sb->inode_table_zeroed)
+        return 0;
+    return inode_at(ino)->state_flag != ASSOOFS_FLAG_FREE;
+}
+
+static const char *check_slot(uint64_t ino, struct assoofs_inode_info *info)
+{
+    int dir = S_ISDIR(info->mode);
+
+    if (info->inode_no != ino || info->state_flag != ASSOOFS_FLAG_USED)
+        return "is marked in use but its slot is not";
+    if (!dir && !S_ISREG(info->mode))
+        return "has an unsupported mode";
+    if ((info->flags & ~(uint32_t)(ASSOOFS_INODE_INDEXED | ASSOOFS_INODE_INLINE)) ||
+        ((info->flags & ASSOOFS_INODE_INDEXED) && (!dir || (info->flags & ASSOOFS_INODE_INLINE))))
+        return "has bad flags";
+    if ((info->flags & ASSOOFS_INODE_INLINE) && (info->blocks || (!dir && info->file_size > ASSOOFS_INLINE_DATA_SIZE)))
+        return "has inline data that does not fit";
+    if (check_extents(ino, info, 0))
+        return "has a corrupted extent map";
+    if (!dir && !(info->flags & ASSOOFS_INODE_INLINE) && info->file_size > info->blocks * block_size)
+        return "is bigger than its blocks";
+    if (dir && !(info->flags & (ASSOOFS_INODE_INLINE | ASSOOFS_INODE_INDEXED)) && info->blocks != 1)
+        return "is a linear directory without exactly one block";
+    if ((info->flags & ASSOOFS_INODE_INDEXED) && info->blocks < 2)
+        return "is an indexed directory without leaves";
+    return NULL;
+}
+
+static void check_slots(uint64_t from, uint64_t to)
+{
+    struct assoofs_inode_info *info;
+    const char *why;
+    uint64_t ino;
+
+    for (ino = from ? from : ASSOOFS_ROOTDIR_INODE_NUMBER; ino < to; ino++)
+    {
+        if (!slot_in_use(ino))
+            continue;
+        info = inode_at(ino);
+        why = check_slot(ino, info);
+        if (why)
+        {
+            report(P_INODE, "Inode %llu %s.", (unsigned long long)ino, why);
+            slot_state[ino] = SLOT_BROKEN;
+            continue;
+        }
+        slot_state[ino] = SLOT_VALID;
+    }
+}
+
+/*
+ * Fase 2: directorios
+ */
+
+static unsigned char *dir_block(struct assoofs_inode_info *dir, uint64_t lblk)
+{
+    struct assoofs_extent_header *hdr = &dir->extent_header;
+    struct assoofs_extent *ext = dir->extents;
+    int i;
+
+    /* El mapa ya se ha comprobado en la fase 1 */
+    for (;;)
+    {
+        for (i = hdr->entries - 1; i > 0 && ext[i].block > lblk; i--)
+            ;
+        if (hdr->depth == 0)
+            return block_at(ext[i].start + (lblk - ext[i].block));
+        hdr = (struct assoofs_extent_header *)block_at(ext[i].start);
+        ext = (struct assoofs_extent *)(hdr + 1);
+    }
+}
+
+/* Entradas de un bloque de directorio (o del contenido de un inodo en línea). Las vivas deben tener el
+ * hash de su nombre dentro de [lo, hi] y apuntar a un inodo válido del tipo que dicen */
+static int check_entries(uint64_t ino, unsigned char *data, size_t size, uint32_t lo, uint32_t hi, int in_index)
+{
+    struct assoofs_dir_entry *de;
+    struct assoofs_inode_info *target;
+    uint64_t expected;
+    size_t offset;
+    int live = 0;
+
+    for (offset = 0; offset < size; offset += de->rec_len)
+    {
+        de = (struct assoofs_dir_entry *)(data + offset);
+        if (de->rec_len < ASSOOFS_DIR_ENTRY_SIZE(0) || (de->rec_len & 7) || offset + de->rec_len > size ||
+            (de->inode_no && (de->name_len == 0 || ASSOOFS_DIR_ENTRY_SIZE(de->name_len) > de->rec_len)))
+        {
+            report(P_DIR, "Directory %llu has a corrupted entry at offset %zu.", (unsigned long long)ino, offset);
+            return -1;
+        }
+        if (!de->inode_no)
+            continue;
+
+        if (de->hash != assoofs_name_hash(de->name, de->name_len) || memchr(de->name, '/', de->name_len) || memchr(de->name, '\0', de->name_len))
+        {
+            report(P_HASH, "Directory %llu: entry \"%.*s\" has a bad name or hash.", (unsigned long long)ino, de->name_len, de->name);
+            continue;
+        }
+        if (!in_index || de->hash < lo || de->hash > hi)
+        {
+            report(P_HASH, "Directory %llu: entry \"%.*s\" is not in the leaf of its hash.", (unsigned long long)ino, de->name_len, de->name);
+            continue;
+        }
+
+        target = de->inode_no < slots ? inode_at(de->inode_no) : NULL;
+        if (!target || de->inode_no == ASSOOFS_ROOTDIR_INODE_NUMBER || slot_state[de->inode_no] != SLOT_VALID ||
+            de->file_type != (S_ISDIR(target->mode) ? ASSOOFS_FT_DIR : ASSOOFS_FT_REG))
+        {
+            report(P_DANGLING, "Directory %llu: entry \"%.*s\" points to the missing inode %llu.", (unsigned long long)ino, de->name_len, de->name, (unsigned long long)de->inode_no);
+            add_stale(de);
+            continue;
+        }
+        expected = 0;
+        if (!atomic_compare_exchange_strong(&parent[de->inode_no], &expected, ino))
+        {
+            report(P_DUP_REF, "Directory %llu: entry \"%.*s\" points to inode %llu, which already has an entry in directory %llu.", (unsigned long long)ino, de->name_len, de->name, (unsigned long long)de->inode_no, (unsigned long long)expected);
+            add_stale(de);
+            continue;
+        }
+        live++;
+    }
+    children[ino] += live;
+    return 0;
+}
+
+/* Nodo del índice (la raíz o uno intermedio): entradas ordenadas, la primera de la raíz con hash 0
+ * y bloques lógicos dentro del directorio */
+static struct assoofs_dir_index_header *check_index(uint64_t ino, struct assoofs_inode_info *dir, unsigned char *data, int node)
+{
+    struct assoofs_dir_index_header *hdr = (struct assoofs_dir_index_header *)(data + (node ? ASSOOFS_DIR_NODE_OFFSET : 0));
+    struct assoofs_dir_index_entry *e = (struct assoofs_dir_index_entry *)(hdr + 1);
+    struct assoofs_dir_entry *free_de = (struct assoofs_dir_entry *)data;
+    uint64_t limit = (block_size - (node ? ASSOOFS_DIR_NODE_OFFSET : 0) - sizeof(*hdr)) / sizeof(*e);
+    uint32_t i;
+
+    if (hdr->magic != ASSOOFS_DIR_INDEX_MAGIC || hdr->count == 0 || hdr->limit != limit || hdr->count > limit ||
+        (node ? (free_de->inode_no || free_de->rec_len != block_size || hdr->levels) : hdr->levels > ASSOOFS_DIR_INDEX_MAX_LEVELS) ||
+        (!node && e[0].hash != 0))
+        goto bad;
+    for (i = 0; i < hdr->count; i++)
+    {
+        if (e[i].block == 0 || e[i].block >= dir->blocks || (i && e[i].hash < e[i - 1].hash))
+            goto bad;
+    }
+    return hdr;
+
+bad:
+    report(P_DIR, "Directory %llu has a corrupted index %s.", (unsigned long long)ino, node ? "node" : "root");
+    return NULL;
+}
+
+/* Directorio indexado: se recorren el índice y las hojas a las que apunta, cada una con su rango de hashes.
+ * Los bloques que no son ni nodos ni hojas del índice no deberían tener entradas vivas */
+static void check_indexed_dir(uint64_t ino, struct assoofs_inode_info *dir)
+{
+    struct assoofs_dir_index_header *root, *node;
+    struct assoofs_dir_index_entry *re, *ne;
+    unsigned char *seen;
+    uint32_t i, j, lo, hi;
+    uint64_t lblk;
+
+    seen = calloc(dir->blocks, 1);
+    root = seen ? check_index(ino, dir, dir_block(dir, 0), 0) : NULL;
+    if (!root)
+    {
+        free(seen);
+        return;
+    }
+    seen[0] = 1;
+    re = (struct assoofs_dir_index_entry *)(root + 1);
+    for (i = 0; i < root->count; i++)
+    {
+        lo = re[i].hash;
+        hi = i + 1 < root->count ? re[i + 1].hash - (re[i + 1].hash > lo) : UINT32_MAX;
+        if (seen[re[i].block]++)
+            goto twice;
+        if (root->levels == 0)
+        {
+            if (check_entries(ino, dir_block(dir, re[i].block), block_size, lo, hi, 1))
+                goto out;
+            continue;
+        }
+        node = check_index(ino, dir, dir_block(dir, re[i].block), 1);
+        if (!node)
+            goto out;
+        ne = (struct assoofs_dir_index_entry *)(node + 1);
+        for (j = 0; j < node->count; j++)
+        {
+            lblk = ne[j].block;
+            if (seen[lblk]++ || (j == 0 && ne[j].hash > lo) || ne[j].hash < lo || ne[j].hash > hi)
+                goto twice;
+            if (check_entries(ino, dir_block(dir, lblk), block_size, j ? ne[j].hash : lo,
+                              j + 1 < node->count ? ne[j + 1].hash - (ne[j + 1].hash > ne[j].hash) : hi, 1))
+                goto out;
+        }
+    }
+
+    /* Bloques que no cuelgan del índice: el módulo los lista pero no encuentra sus nombres */
+    for (lblk = 1; lblk < dir->blocks; lblk++)
+    {
+        if (!seen[lblk] && check_entries(ino, dir_block(dir, lblk), block_size, 0, 0, 0))
+            goto out;
+    }
+    goto out;
+
+twice:
+    report(P_DIR, "Directory %llu has an index that points twice to a block or out of order.", (unsigned long long)ino);
+out:
+    free(seen);
+}
+
+static void check_dirs(uint64_t from, uint64_t to)
+{
+    struct assoofs_inode_info *dir;
+    uint64_t ino;
+
+    for (ino = from; ino < to; ino++)
+    {
+        if (slot_state[ino] != SLOT_VALID || !S_ISDIR(inode_at(ino)->mode))
+            continue;
+        dir = inode_at(ino);
+        if (dir->flags & ASSOOFS_INODE_INLINE)
+            check_entries(ino, (unsigned char *)dir->inline_data, ASSOOFS_INLINE_DATA_SIZE, 0, UINT32_MAX, 1);
+        else if (dir->flags & ASSOOFS_INODE_INDEXED)
+            check_indexed_dir(ino, dir);
+        else
+            check_entries(ino, dir_block(dir, 0), block_size, 0, UINT32_MAX, 1);
+    }
+}
+
+/*
+ * Fase 3: alcanzables desde la raíz. Se sube por los padres de cada inodo hasta llegar a uno ya resuelto;
+ * el camino recorrido se resuelve igual que él. Un ciclo de directorios sin salida a la raíz acaba en un
+ * inodo que ya está en el camino
+ */
+static void find_reachable(void)
+{
+    uint64_t *path, ino, up, n;
+    unsigned char *mark; /* 0 sin resolver, 1 en el camino actual, 2 alcanzable, 3 huérfano */
+    unsigned char result;
+
+    path = malloc(slots * sizeof(*path));
+    mark = calloc(slots, 1);
+    if (!path || !mark)
+    {
+        printf("Not enough memory.\n");
+        exit(EXIT_ERROR);
+    }
+    mark[ASSOOFS_ROOTDIR_INODE_NUMBER] = 2;
+
+    for (ino = ASSOOFS_ROOTDIR_INODE_NUMBER + 1; ino < slots; ino++)
+    {
+        if (slot_state[ino] != SLOT_VALID || mark[ino])
+            continue;
+        n = 0;
+        for (up = ino; !mark[up]; up = parent[up])
+        {
+            mark[up] = 1;
+            path[n++] = up;
+            if (!parent[up])
+            {
+                up = 0;
+                break;
+            }
+        }
+        result = (up && mark[up] == 2) ? 2 : 3;
+        while (n > 0)
+            mark[path[--n]] = result;
+    }
+
+    for (ino = ASSOOFS_ROOTDIR_INODE_NUMBER; ino < slots; ino++)
+    {
+        if (slot_state[ino] != SLOT_VALID)
+            continue;
+        if (mark[ino] == 2)
+        {
+            slot_state[ino] = SLOT_KEPT;
+            continue;
+        }
+        report(P_ORPHAN, "Inode %llu is not reachable from the root directory.", (unsigned long long)ino);
+        /* Sin reparar se queda como está (y sus bloques, ocupados); al reparar se libera */
+        if (!repair)
+            slot_state[ino] = SLOT_KEPT;
+    }
+    free(mark);
+    free(path);
+}
+
+/*
+ * Fase 4: bloques de los inodos que se quedan
+ */
+static void mark_inodes(uint64_t from, uint64_t to)
+{
+    uint64_t ino;
+
+    for (ino = from; ino < to; ino++)
+    {
+        if (slot_state[ino] == SLOT_KEPT)
+            check_extents(ino, inode_at(ino), 1);
+    }
+}
+
+/*
+ * Fase 5: mapas de bits, palabra a palabra (64 bloques o inodos)
+ */
+static atomic_ulong used_blocks, used_inodes;
+
+static void check_block_bitmap(uint64_t from, uint64_t to)
+{
+    uint64_t *disk = (uint64_t *)block_at(sb->bitmap_start);
+    uint64_t w, want, diff, used = 0, bit;
+
+    for (w = from; w < to; w++)
+    {
+        want = atomic_load(&used_map[w]);
+        diff = want ^ disk[w];
+        used += __builtin_popcountll(want);
+        if (w * 64 + 64 > sb->blocks_count)
+            used -= __builtin_popcountll(want & (sb->blocks_count > w * 64 ? ~0ULL << (sb->blocks_count - w * 64) : ~0ULL));
+        while (diff)
+        {
+            bit = w * 64 + __builtin_ctzll(diff);
+            diff &= diff - 1;
+            if (bit >= sb->blocks_count)
+                continue;
+            if (test_bit((unsigned char *)&want, bit % 64))
+                report(P_BLOCK_FREE, "Block %llu is in use but marked free.", (unsigned long long)bit);
+            else
+                report(P_BLOCK_LEAK, "Block %llu is marked used but nobody uses it.", (unsigned long long)bit);
+        }
+        if (repair)
+            disk[w] = want;
+    }
+    atomic_fetch_add(&used_blocks, used);
+}
+
+static void check_inode_bitmap(uint64_t from, uint64_t to)
+{
+    uint64_t *disk = (uint64_t *)block_at(sb->inode_bitmap_start);
+    uint64_t w, want, diff, ino, used = 0;
+    int i;
+
+    for (w = from; w < to; w++)
+    {
+        want = 0;
+        for (i = 0; i < 64; i++)
+        {
+            ino = w * 64 + i;
+            if (ino == 0 || ino >= slots || slot_state[ino] == SLOT_KEPT)
+                want |= 1ULL << i;
+            if (ino && ino < slots && slot_state[ino] == SLOT_KEPT)
+                used++;
+        }
+        diff = want ^ disk[w];
+        while (diff)
+        {
+            ino = w * 64 + __builtin_ctzll(diff);
+            diff &= diff - 1;
+            report(P_INODE_BITMAP, "Inode %llu is %s but marked %s.", (unsigned long long)ino, (want >> (ino % 64)) & 1 ? "in use" : "free", (want >> (ino % 64)) & 1 ? "free" : "used");
+        }
+        if (repair)
+            disk[w] = want;
+    }
+    atomic_fetch_add(&used_inodes, used);
+}
+
+static void check_counters(void)
+{
+    uint64_t ino, free_blocks = sb->blocks_count - atomic_load(&used_blocks);
+    struct assoofs_inode_info *info;
+
+    for (ino = ASSOOFS_ROOTDIR_INODE_NUMBER; ino < slots; ino++)
+    {
+        if (slot_state[ino] != SLOT_KEPT || !S_ISDIR(inode_at(ino)->mode))
+            continue;
+        info = inode_at(ino);
+        if (info->dir_children_count != children[ino])
+        {
+            report(P_CHILDREN, "Directory %llu has %llu entries, not %llu.", (unsigned long long)ino, (unsigned long long)children[ino], (unsigned long long)info->dir_children_count);
+            if (repair)
+                info->dir_children_count = children[ino];
+        }
+    }
+
+    if (sb->inodes_count != atomic_load(&used_inodes) || sb->free_blocks != free_blocks)
+    {
+        report(P_COUNTERS, "The superblock counts %llu inodes and %llu free blocks, not %llu and %llu.",
+               (unsigned long long)sb->inodes_count, (unsigned long long)sb->free_blocks,
+               (unsigned long long)atomic_load(&used_inodes), (unsigned long long)free_blocks);
+        if (repair)
+        {
+            sb->inodes_count = atomic_load(&used_inodes);
+            sb->free_blocks = free_blocks;
+        }
+    }
+}
+
+/* Borra las entradas sobrantes y libera las ranuras de los inodos rotos y huérfanos */
+static void fix_entries_and_slots(void)
+{
+    uint64_t ino;
+    size_t i;
+
+    for (i = 0; i < nstale; i++)
+        stale[i]->inode_no = 0;
+    for (ino = ASSOOFS_ROOTDIR_INODE_NUMBER + 1; ino < slots; ino++)
+    {
+        if ((slot_state[ino] == SLOT_BROKEN || slot_state[ino] == SLOT_VALID) && inode_at(ino)->state_flag != ASSOOFS_FLAG_FREE)
+            inode_at(ino)->state_flag = ASSOOFS_FLAG_FREE;
+    }
+}
+
+/* Con problemas que no se pueden reparar no se toca nada: liberar lo que no se alcanza podría llevarse
+ * ficheros de un directorio roto. Los huérfanos se quedan como están. Devuelve 1 si se renuncia a reparar */
+static int keep_unfixable(void)
+{
+    uint64_t ino;
+    int p;
+
+    for (p = 0; repair && p < P_COUNT; p++)
+    {
+        if (!counts[p] || problems[p].fixable)
+            continue;
+        printf("Found %s, which cannot be repaired: not changing the image.\n", problems[p].name);
+        repair = 0;
+        for (ino = 0; ino < slots; ino++)
+        {
+            if (slot_state[ino] == SLOT_VALID)
+                slot_state[ino] = SLOT_KEPT;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* Calcula el mapa de bloques: los metadatos fijos y los bits que caen fuera del dispositivo están
+ * siempre ocupados, el resto según los inodos que se quedan */
+static void mark_blocks(uint64_t bitmap_words)
+{
+    memset(used_map, 0, bitmap_words * sizeof(*used_map));
+    set_bits(0, meta_end);
+    set_bits(sb->blocks_count, bitmap_words * 64);
+    parallel_for(slots, mark_inodes);
+}
+
+static void usage(void)
+{
+    printf("Usage: assoofs-fsck [-n | -y] [-j threads] <image>\n"
+           "  -n          only check, opening the image read-only (default)\n"
+           "  -y          repair the problems that can be repaired\n"
+           "  -j threads  threads for the parallel phases (default: one per CPU)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t bitmap_words, inode_words;
+    unsigned long total = 0, left = 0;
+    struct stat st;
+    int fd, opt, p;
+    long cpus;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+    while ((opt = getopt(argc, argv, "nyj:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            repair = 0;
+            break;
+        case 'y':
+            repair = 1;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            if (nthreads < 1 || nthreads > MAX_THREADS)
+            {
+                printf("Invalid number of threads: %s\n", optarg);
+                return EXIT_ERROR;
+            }
+            break;
+        default:
+            usage();
+            return EXIT_ERROR;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage();
+        return EXIT_ERROR;
+    }
+    nthreads--; /* El hilo principal también trabaja */
+
+    fd = open(argv[optind], repair ? O_RDWR : O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror("Error opening the image");
+        return EXIT_ERROR;
+    }
+    img_size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &img_size) == -1)
+    {
+        perror("Error getting the device size");
+        return EXIT_ERROR;
+    }
+    img = mmap(NULL, img_size, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (img == MAP_FAILED)
+    {
+        perror("Error mapping the image");
+        return EXIT_ERROR;
+    }
+    madvise(img, img_size, MADV_WILLNEED);
+    sb = (struct assoofs_super_block_info *)img;
+
+    if (check_super())
+        return EXIT_UNCORRECTED;
+    if (counts[P_JOURNAL] && repair)
+    {
+        printf("Not repairing an image with a journal to recover.\n");
+        repair = 0;
+    }
+
+    slot_state = calloc(slots, 1);
+    parent = calloc(slots, sizeof(*parent));
+    children = calloc(slots, sizeof(*children));
+    bitmap_words = sb->bitmap_blocks * block_size / 8;
+    inode_words = sb->inode_bitmap_blocks * block_size / 8;
+    used_map = calloc(bitmap_words, sizeof(*used_map));
+    if (!slot_state || !parent || !children || !used_map)
+    {
+        printf("Not enough memory.\n");
+        return EXIT_ERROR;
+    }
+    printf("Checking inodes (%llu slots, %d threads)...\n", (unsigned long long)slots, nthreads + 1);
+    parallel_for(slots, check_slots);
+    if (slot_state[ASSOOFS_ROOTDIR_INODE_NUMBER] != SLOT_VALID || !S_ISDIR(inode_at(ASSOOFS_ROOTDIR_INODE_NUMBER)->mode))
+    {
+        report(P_INODE, "The root directory is missing or corrupted.");
+        printf("Cannot check an image without a root directory.\n");
+        return EXIT_UNCORRECTED;
+    }
+    printf("Checking directories...\n");
+    parallel_for(slots, check_dirs);
+    find_reachable();
+    keep_unfixable();
+
+    printf("Checking blocks and bitmaps...\n");
+    mark_blocks(bitmap_words);
+    /* Un bloque compartido solo se ve al marcar los bloques; si aparece hay que volver a marcarlos
+     * contando también los de los huérfanos, que ya no se liberan */
+    if (keep_unfixable())
+    {
+        counts[P_CROSSLINK] = 0;
+        mark_blocks(bitmap_words);
+    }
+    parallel_for(bitmap_words, check_block_bitmap);
+    parallel_for(inode_words, check_inode_bitmap);
+    check_counters();
+    if (repair)
+    {
+        fix_entries_and_slots();
+        if (msync(img, img_size, MS_SYNC))
+        {
+            perror("Error writing the repairs");
+            return EXIT_ERROR;
+        }
+    }
+
+    for (p = 0; p < P_COUNT; p++)
+    {
+        if (!counts[p])
+            continue;
+        printf("%s: %lu%s\n", problems[p].name, (unsigned long)counts[p], repair && problems[p].fixable ? " (repaired)" : "");
+        total += counts[p];
+        if (!repair || !problems[p].fixable)
+            left += counts[p];
+    }
+    if (!total)
+    {
+        printf("%s: clean, %llu inodes, %llu/%llu blocks.\n", argv[optind], (unsigned long long)atomic_load(&used_inodes),
+               (unsigned long long)atomic_load(&used_blocks), (unsigned long long)sb->blocks_count);
+        return EXIT_OK;
+    }
+    return left ? EXIT_UNCORRECTED : EXIT_FIXED;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "libassoofs.h"
+
+/* Lista el contenido de un directorio de una imagen assoofs (o un fichero suelto) sin montarla */
+
+struct list
+{
+    const struct assoofs_image *img;
+    int long_format;
+};
+
+static void print_entry(const struct list *l, const char *name, int name_len, uint64_t ino, int dir)
+{
+    const struct assoofs_inode_info *info;
+
+    if (!l->long_format)
+    {
+        printf("%.*s%s\n", name_len, name, dir ? "/" : "");
+        return;
+    }
+    info = assoofs_image_inode(l->img, ino);
+    if (!info)
+    {
+        printf("%10llu %c %12s %.*s (%s)\n", (unsigned long long)ino, '?', "?", name_len, name, strerror(errno));
+        return;
+    }
+    printf("%10llu %c %12llu %.*s%s\n", (unsigned long long)ino, S_ISDIR(info->mode) ? 'd' : '-',
+           (unsigned long long)(S_ISDIR(info->mode) ? info->dir_children_count : info->file_size), name_len, name, dir ? "/" : "");
+}
+
+static int list_entry(void *arg, const struct assoofs_dir_entry *de)
+{
+    print_entry(arg, de->name, de->name_len, de->inode_no, de->file_type == ASSOOFS_FT_DIR);
+    return 0;
+}
+
+static void usage(void)
+{
+    printf("Usage: assoofs-ls [-l] <image> [path]\n"
+           "  -l  show the inode number, type and size (entries for directories) of each entry\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct assoofs_image img;
+    struct list l = {&img, 0};
+    const struct assoofs_inode_info *info;
+    const char *path;
+    uint64_t ino;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "lh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            l.long_format = 1;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2)
+    {
+        usage();
+        return 2;
+    }
+    path = optind == argc - 2 ? argv[optind + 1] : "/";
+
+    if (assoofs_image_open(&img, argv[optind]))
+    {
+        perror("Error opening the image");
+        return 1;
+    }
+    if (assoofs_image_resolve(&img, path, &ino) || !(info = assoofs_image_inode(&img, ino)))
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        assoofs_image_close(&img);
+        return 1;
+    }
+
+    ret = 0;
+    if (!S_ISDIR(info->mode))
+        print_entry(&l, path, strlen(path), ino, 0);
+    else if (assoofs_image_readdir(&img, ino, list_entry, &l))
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        ret = 1;
+    }
+    assoofs_image_close(&img);
+    return ret;
+}
@@ -3,411 +3,3789 @@
 #include <linux/init.h>        /* Needed for the macros */
 #include <linux/fs.h>          /* libfs stuff           */
 #include <linux/buffer_head.h> /* buffer_head           */
+#include <linux/mpage.h>       /* mpage_readahead       */
+#include <linux/writeback.h>   /* write_cache_pages     */
 #include <linux/slab.h>        /* kmem_cache            */
+#include <linux/blkdev.h>      /* sync_blockdev         */
+#include <linux/sort.h>        /* sort                  */
+#include <linux/iomap.h>       /* E/S directa           */
+#include <linux/jbd2.h>        /* diario de metadatos   */
+#include <linux/kobject.h>     /* /sys/fs/assoofs       */
+#include <linux/percpu.h>      /* estadísticas          */
+#include <linux/percpu_counter.h> /* statfs             */
+#include <linux/statfs.h>      /* statfs                */
+#include <linux/workqueue.h>   /* puesta a cero diferida */
 #include "assoofs.h"
 
 MODULE_LICENSE("GPL");
 
 // Variables globales
 static struct kmem_cache *assoofs_inode_cache;
+static struct kset *assoofs_kset; // /sys/fs/assoofs
 
-// Semáforos para recursos compartidos
-static DEFINE_MUTEX(assoofs_sb_lock);
-static DEFINE_MUTEX(assoofs_inodes_lock);
+// Operaciones con contador e histograma de latencias (en /sys/fs/assoofs/<dispositivo>/<operación>)
+enum assoofs_stat_op
+{
+    ASSOOFS_OP_READ,
+    ASSOOFS_OP_WRITE,
+    ASSOOFS_OP_LOOKUP,
+    ASSOOFS_OP_CREATE,
+    ASSOOFS_OP_UNLINK,
+    ASSOOFS_OP_RENAME,
+    ASSOOFS_OP_ALLOC,
+    ASSOOFS_OP_FREE,
+    ASSOOFS_OP_COUNT
+};
+
+// Histograma log2: el cubo b cuenta las latencias de [2^(b-1), 2^b) ns (el 0, las de 0 ns) y el último
+// acumula todas las que no caben en los anteriores
+#define ASSOOFS_LAT_BUCKETS 32
+
+struct assoofs_op_stats
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[ASSOOFS_LAT_BUCKETS];
+};
+
+// Estadísticas de un montaje, una copia por CPU para que las operaciones no compartan líneas de caché
+struct assoofs_stats
+{
+    struct assoofs_op_stats ops[ASSOOFS_OP_COUNT];
+};
+
+// Bloques liberados en transacciones que aún no se han confirmado, de un bloque del mapa de bits. No se
+// pueden volver a asignar hasta la confirmación: si no, tras un fallo acabarían con datos de su nuevo dueño
+// y seguirían perteneciendo al anterior
+struct assoofs_pending_map
+{
+    unsigned long *bits; // Con el formato del bloque del mapa; NULL hasta que se libera algo en él
+    uint32_t count;      // Bits a 1 en bits
+};
+
+// Un tramo de bloques liberados (dentro de un mismo bloque del mapa), en la lista de su transacción
+struct assoofs_pending_free
+{
+    struct list_head list;
+    uint64_t block;
+    uint64_t count;
+};
+
+// Información del superbloque en memoria, una por cada montaje (campo s_fs_info)
+struct assoofs_sb_info
+{
+    struct assoofs_super_block_info persistent; // Copia en memoria de la información persistente
+    uint32_t *bitmap_free;                      // Resumen del mapa de bits: bloques libres en cada bloque del mapa
+    struct assoofs_pending_map *bitmap_pending; // Bloques liberados sin confirmar, por bloque del mapa
+    uint64_t next_block;                        // Cursor next-fit del asignador de bloques
+    uint64_t next_inode;                        // Cursor next-fit del asignador de números de inodo
+    journal_t *journal;                         // Diario de metadatos, NULL si el dispositivo no tiene
+    spinlock_t lock;                            // Protege los contadores de persistent, bitmap_free, bitmap_pending y los cursores
+    struct percpu_counter free_blocks;          // Bloques libres, para statfs (sin coger lock)
+    struct percpu_counter free_inodes;          // Ranuras libres de la tabla de inodos, para statfs
+    struct assoofs_stats __percpu *stats;       // Contadores e histogramas de latencias de las operaciones
+    struct kobject kobj;                        // Directorio /sys/fs/assoofs/<dispositivo>
+    struct completion kobj_unregister;          // Se completa cuando se libera kobj
+    struct super_block *sb;                     // Superbloque del montaje (para itable_work)
+    struct mutex itable_lock;                   // Serializa la puesta a cero de la tabla de inodos
+    struct delayed_work itable_work;            // Pone a cero en segundo plano el resto de la tabla de inodos
+#ifdef ASSOOFS_KUNIT_TEST
+    struct assoofs_test_disk *test_disk;        // Bloques en memoria de la batería de KUnit, NULL con un dispositivo
+#endif
+};
+
+// Inodo en memoria: el inodo del VFS junto a su información persistente. Sale de assoofs_inode_cache
+// (alloc_inode) y vive en la caché de inodos mientras se use
+struct assoofs_inode
+{
+    struct assoofs_inode_info info; // Copia en memoria de la ranura de la tabla de inodos
+    struct rw_semaphore map_lock;   // Protege el mapa de extents de un fichero
+    struct inode vfs_inode;
+};
+
+static inline struct assoofs_sb_info *ASSOOFS_SB(struct super_block *sb)
+{
+    return sb->s_fs_info;
+}
+
+static inline struct assoofs_inode *ASSOOFS_I(struct inode *inode)
+{
+    return container_of(inode, struct assoofs_inode, vfs_inode);
+}
+
+static inline struct assoofs_inode_info *ASSOOFS_INFO(struct inode *inode)
+{
+    return &ASSOOFS_I(inode)->info;
+}
+
+/*
+ *  Acceso a los bloques del dispositivo. Todo pasa por aquí para que la batería de KUnit (assoofs_test.c)
+ *  pueda montar un superbloque sobre bloques en memoria y probar las funciones del módulo sin dispositivo
+ */
+#ifdef ASSOOFS_KUNIT_TEST
+static struct buffer_head *assoofs_test_getblk(struct super_block *sb, sector_t block);
+#endif
+
+static inline struct buffer_head *assoofs_getblk(struct super_block *sb, sector_t block)
+{
+#ifdef ASSOOFS_KUNIT_TEST
+    if (ASSOOFS_SB(sb)->test_disk)
+    {
+        return assoofs_test_getblk(sb, block);
+    }
+#endif
+    return sb_getblk(sb, block);
+}
+
+static inline struct buffer_head *assoofs_bread(struct super_block *sb, sector_t block)
+{
+#ifdef ASSOOFS_KUNIT_TEST
+    if (ASSOOFS_SB(sb)->test_disk)
+    {
+        return assoofs_test_getblk(sb, block); // Los bloques en memoria siempre están al día
+    }
+#endif
+    return sb_bread(sb, block);
+}
+
+static inline void assoofs_breadahead(struct super_block *sb, sector_t block)
+{
+#ifdef ASSOOFS_KUNIT_TEST
+    if (ASSOOFS_SB(sb)->test_disk)
+    {
+        return;
+    }
+#endif
+    sb_breadahead(sb, block);
+}
+
+/**
+ * @brief Descarta los buffers de la caché del dispositivo de los bloques [block, block + count)
+ */
+static inline void assoofs_clean_aliases(struct super_block *sb, sector_t block, sector_t count)
+{
+#ifdef ASSOOFS_KUNIT_TEST
+    if (ASSOOFS_SB(sb)->test_disk)
+    {
+        return;
+    }
+#endif
+    clean_bdev_aliases(sb->s_bdev, block, count);
+}
+
+/*
+ *  Estadísticas y tracepoints
+ */
+#define CREATE_TRACE_POINTS
+#include "assoofs_trace.h"
+
+/**
+ * @brief Apunta en las estadísticas del montaje una operación que empezó en start (ktime_get_ns)
+ * y devuelve su duración en nanosegundos, para el tracepoint de la operación
+ */
+static uint64_t assoofs_stat_end(struct super_block *sb, enum assoofs_stat_op op, uint64_t start)
+{
+    uint64_t ns = ktime_get_ns() - start;
+    struct assoofs_stats *stats;
+    struct assoofs_op_stats *st;
+
+    stats = get_cpu_ptr(ASSOOFS_SB(sb)->stats);
+    st = &stats->ops[op];
+    st->count++;
+    st->total_ns += ns;
+    st->max_ns = max(st->max_ns, ns);
+    st->hist[min(fls64(ns), ASSOOFS_LAT_BUCKETS - 1)]++;
+    put_cpu_ptr(ASSOOFS_SB(sb)->stats);
+    return ns;
+}
+
+// Bits (bloques) que describe cada bloque del mapa de bits
+#define ASSOOFS_BITS_PER_BLOCK(sb) ((sb)->s_blocksize * 8)
+
+// Inodos que caben en la tabla de inodos (la ranura 0 no se usa)
+static inline uint64_t assoofs_max_inodes(struct super_block *sb)
+{
+    return ASSOOFS_SB(sb)->persistent.inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(sb->s_blocksize) - 1;
+}
+
+/*
+ *  Cerrojos. Todos son de cada montaje:
+ *  - sbi->lock (spinlock) protege el estado del asignador en memoria y los contadores del superbloque.
+ *    Los bits del mapa de bits y las ranuras de la tabla de inodos se modifican con el buffer bloqueado.
+ *  - El i_rwsem de cada directorio (que el VFS ya coge en lookup, create, unlink y rename) protege
+ *    sus entradas, su mapa de extents y su contador de hijos.
+ *  - El mapa de extents de un fichero lo protege assoofs_map_lock(inode): la escritura diferida y la
+ *    lectura anticipada traducen bloques sin el i_rwsem del fichero, que solo serializa a los escritores.
+ *  - sbi->itable_lock (mutex) serializa la puesta a cero diferida de la tabla de inodos.
+ *  Orden: i_rwsem -> página -> transacción del diario -> assoofs_map_lock / itable_lock -> buffer -> sbi->lock
+ */
+static inline struct rw_semaphore *assoofs_map_lock(struct inode *inode)
+{
+    return &ASSOOFS_I(inode)->map_lock;
+}
+
+// Bloques de metadatos que puede modificar una transacción: las operaciones sobre el espacio de nombres
+// (crear, borrar) y una asignación de bloques para datos
+#define ASSOOFS_NAMESPACE_CREDITS 64
+#define ASSOOFS_ALLOC_CREDITS 16
+// Registros de revocación que se piden de más cada vez que una transacción se queda sin ellos
+#define ASSOOFS_REVOKE_CREDITS 64
+// Bloques lógicos que libera cada transacción al recortar un fichero grande (assoofs_truncate_extents)
+#define ASSOOFS_TRUNCATE_STEP 8
 
 /*
  *  Funciones auxiliares
  */
 void assoofs_save_sb_info(struct super_block *vsb);
+int assoofs_sb_get_freeblocks(struct super_block *sb, uint64_t goal, uint64_t wanted, uint64_t *block, uint64_t *count);
 int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
+void assoofs_sb_set_freeblocks(struct super_block *sb, uint64_t block, uint64_t count);
 void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search);
+struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, uint64_t inode_no, struct buffer_head **bhp);
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no);
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
+int assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *info);
+static void assoofs_free_inode_no(struct super_block *sb, uint64_t ino);
+static void assoofs_journal_commit_callback(journal_t *journal, transaction_t *transaction);
+static int assoofs_release_inode(struct super_block *sb, struct inode *inode);
+static struct inode *assoofs_get_inode(struct super_block *sb, uint64_t ino);
 static int assoofs_create_inode(bool isDir, struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode);
 
-/*
- *  Apartados extra (parte opcional)
+/*
+ *  Mapa de extents
+ */
+void assoofs_extent_init(struct assoofs_inode_info *inode_info);
+int assoofs_extent_lookup(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t lblk, uint64_t *block, uint64_t *count);
+int assoofs_extent_append(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t block, uint64_t count);
+void assoofs_extent_free_all(struct super_block *sb, struct assoofs_inode_info *inode_info);
+int assoofs_extent_truncate(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t lblk);
+uint64_t assoofs_bmap(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t lblk);
+
+/*
+ *  Apartados extra (parte opcional)
+ */
+static struct inode *assoofs_alloc_inode(struct super_block *sb);
+static void assoofs_free_inode(struct inode *inode);
+static int assoofs_remove(struct inode *dir, struct dentry *dentry);
+static int assoofs_move_file(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags);
+
+/*
+ *  Diario de metadatos (jbd2)
+ *
+ *  Las operaciones que modifican metadatos abren una transacción (handle) con assoofs_journal_start.
+ *  jbd2 la guarda en current->journal_info, así que las funciones auxiliares no la reciben como
+ *  parámetro: piden acceso al buffer antes de modificarlo y lo marcan con assoofs_journal_dirty.
+ *  Sin diario (o fuera de una transacción) todo se reduce a mark_buffer_dirty.
+ */
+
+/**
+ * @brief Abre (o anida en la que ya está abierta) una transacción del diario
+ *
+ * @return handle_t* transacción, NULL si no hay diario o ERR_PTR en caso de error
+ */
+static handle_t *assoofs_journal_start(struct super_block *sb, int credits)
+{
+    journal_t *journal = ASSOOFS_SB(sb)->journal;
+
+    if (!journal)
+    {
+        return NULL;
+    }
+    return jbd2_journal_start(journal, credits);
+}
+
+static int assoofs_journal_stop(handle_t *handle)
+{
+    if (!handle)
+    {
+        return 0;
+    }
+    return jbd2_journal_stop(handle);
+}
+
+/**
+ * @brief Pide acceso a un bloque de metadatos que ya existe antes de modificarlo
+ */
+static int assoofs_journal_get_access(struct buffer_head *bh)
+{
+    handle_t *handle = journal_current_handle();
+
+    if (!handle)
+    {
+        return 0;
+    }
+    return jbd2_journal_get_write_access(handle, bh);
+}
+
+/**
+ * @brief Pide acceso a un bloque de metadatos nuevo, cuyo contenido en disco no importa
+ */
+static int assoofs_journal_get_create_access(struct buffer_head *bh)
+{
+    handle_t *handle = journal_current_handle();
+
+    if (!handle)
+    {
+        return 0;
+    }
+    return jbd2_journal_get_create_access(handle, bh);
+}
+
+/**
+ * @brief Aborta el diario tras un error que deja a medias los cambios de una transacción, para que no
+ * llegue a confirmarse, y pasa el sistema de ficheros a solo lectura
+ */
+static void assoofs_journal_abort(struct super_block *sb, int err)
+{
+    printk(KERN_ERR "Error %d in a transaction: aborting the journal and remounting read-only\n", err);
+    if (ASSOOFS_SB(sb)->journal)
+    {
+        jbd2_journal_abort(ASSOOFS_SB(sb)->journal, err);
+    }
+    sb->s_flags |= SB_RDONLY;
+}
+
+/**
+ * @brief Marca como sucio un bloque de metadatos modificado: entra en la transacción en curso
+ * o, sin diario, queda para la escritura diferida. Si no puede entrar en la transacción, el resto
+ * de sus cambios tampoco debe confirmarse: se aborta el diario
+ */
+static int assoofs_journal_dirty(struct buffer_head *bh)
+{
+    handle_t *handle = journal_current_handle();
+    int ret;
+
+    if (!handle)
+    {
+        mark_buffer_dirty(bh);
+        return 0;
+    }
+    ret = jbd2_journal_dirty_metadata(handle, bh);
+    // Un handle sin transacción es que él o el diario ya estaban abortados
+    if (ret && handle->h_transaction)
+    {
+        printk(KERN_ERR "Couldn't add block %llu to the journal\n", (unsigned long long)bh->b_blocknr);
+        assoofs_journal_abort(handle->h_transaction->t_journal->j_private, ret);
+    }
+    return ret;
+}
+
+/**
+ * @brief Se asegura de que a la transacción en curso le quedan al menos credits bloques. Si no se puede
+ * ampliar, se confirma lo hecho hasta ahora y se sigue en una transacción nueva: el llamante debe dejar
+ * los metadatos coherentes antes de llamarla
+ */
+static int assoofs_journal_ensure_credits(int credits)
+{
+    handle_t *handle = journal_current_handle();
+    int ret;
+
+    if (!handle || jbd2_handle_buffer_credits(handle) >= credits)
+    {
+        return 0;
+    }
+    ret = jbd2_journal_extend(handle, credits - jbd2_handle_buffer_credits(handle), 0);
+    if (ret <= 0)
+    {
+        return ret;
+    }
+    return jbd2_journal_restart(handle, credits);
+}
+
+/**
+ * @brief Olvida un bloque de metadatos que se va a liberar. Con diario además se revoca, para que al
+ * recuperar el diario tras un fallo no se reescriba encima del contenido de su siguiente dueño.
+ *
+ * @param sb superbloque
+ * @param block bloque liberado
+ * @param bh su buffer si el llamante lo tiene (se libera aquí), NULL si no
+ */
+static void assoofs_journal_forget(struct super_block *sb, uint64_t block, struct buffer_head *bh)
+{
+    handle_t *handle = journal_current_handle();
+
+    if (!handle)
+    {
+        bforget(bh);
+        return;
+    }
+    if (!bh)
+    {
+        bh = sb_find_get_block(sb, block);
+    }
+    if (handle->h_revoke_credits <= 0 && jbd2_journal_extend(handle, 0, ASSOOFS_REVOKE_CREDITS))
+    {
+        printk(KERN_WARNING "Block %llu freed without a journal revoke record\n", block);
+        if (bh)
+        {
+            jbd2_journal_forget(handle, bh);
+        }
+        return;
+    }
+    jbd2_journal_revoke(handle, block, bh);
+}
+
+/**
+ * @brief Abre el diario de metadatos del dispositivo (si tiene) y lo recupera si no se desmontó bien
+ */
+static int assoofs_load_journal(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    journal_t *journal;
+    int ret;
+
+    if (!sbi->persistent.journal_blocks)
+    {
+        printk(KERN_INFO "No journal in this assoofs device\n");
+        return 0;
+    }
+
+    journal = jbd2_journal_init_dev(sb->s_bdev, sb->s_bdev, sbi->persistent.journal_start, sbi->persistent.journal_blocks, sb->s_blocksize);
+    if (!journal)
+    {
+        printk(KERN_ERR "Couldn't open the journal\n");
+        return -EIO;
+    }
+    journal->j_flags |= JBD2_BARRIER;
+    journal->j_private = sb;
+    journal->j_commit_callback = assoofs_journal_commit_callback;
+
+    ret = jbd2_journal_load(journal);
+    if (ret)
+    {
+        printk(KERN_ERR "Couldn't load the journal\n");
+        jbd2_journal_destroy(journal);
+        return ret;
+    }
+    sbi->journal = journal;
+    return 0;
+}
+
+static void assoofs_destroy_journal(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    if (sbi->journal)
+    {
+        jbd2_journal_destroy(sbi->journal);
+        sbi->journal = NULL;
+    }
+}
+
+/**
+ * @brief Copia la información persistente del superbloque en su buffer y lo marca como sucio
+ *
+ * @param vsb superbloque
+ * @param wait si es true se espera a que el bloque llegue a disco
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
+ */
+static int __assoofs_save_sb_info(struct super_block *vsb, bool wait)
+{
+    struct buffer_head *bh;
+    struct assoofs_super_block_info *sb;
+    handle_t *handle;
+    int ret;
+
+    sb = &ASSOOFS_SB(vsb)->persistent; // Información persistente del superbloque en memoria
+    bh = assoofs_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+    if (!bh)
+    {
+        printk(KERN_ERR "Couldn't read the superblock\n");
+        return -EIO;
+    }
+
+    handle = assoofs_journal_start(vsb, 1);
+    if (IS_ERR(handle))
+    {
+        brelse(bh);
+        return PTR_ERR(handle);
+    }
+    ret = assoofs_journal_get_access(bh);
+    if (!ret)
+    {
+        // Sobreescribimos los datos de disco con la información en memoria
+        lock_buffer(bh);
+        spin_lock(&ASSOOFS_SB(vsb)->lock);
+        memcpy(bh->b_data, sb, sizeof(*sb));
+        spin_unlock(&ASSOOFS_SB(vsb)->lock);
+        unlock_buffer(bh);
+
+        // Marcamos como sucio: el cambio pasa a disco con la escritura diferida (o con el diario)
+        ret = assoofs_journal_dirty(bh);
+    }
+    assoofs_journal_stop(handle);
+
+    // Si se pide esperar (sync_fs): con diario se confirma la transacción, sin él se escribe el bloque
+    if (!ret && wait)
+    {
+        if (ASSOOFS_SB(vsb)->journal)
+        {
+            ret = journal_current_handle() ? 0 : jbd2_journal_force_commit(ASSOOFS_SB(vsb)->journal);
+        }
+        else
+        {
+            ret = sync_dirty_buffer(bh);
+        }
+    }
+    brelse(bh);
+    return ret;
+}
+
+/**
+ * @brief Actualiza la información persistente del superbloque.
+ * Es conveniente llamar a esta función cuando se produzcan cambios en el superbloque
+ * (la escritura a disco es diferida)
+ */
+void assoofs_save_sb_info(struct super_block *vsb)
+{
+    __assoofs_save_sb_info(vsb, false);
+}
+
+/**
+ * @brief Lee el mapa de bits de bloques libres y construye su resumen en memoria
+ * (bloques libres en cada bloque del mapa). Se llama una vez al montar.
+ *
+ * @param sb superbloque a inicializar
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
+ */
+static int assoofs_load_bitmap(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct buffer_head *bh;
+    uint64_t i, free_blocks = 0;
+
+    sbi->bitmap_free = kvcalloc(sbi->persistent.bitmap_blocks, sizeof(*sbi->bitmap_free), GFP_KERNEL);
+    sbi->bitmap_pending = kvcalloc(sbi->persistent.bitmap_blocks, sizeof(*sbi->bitmap_pending), GFP_KERNEL);
+    if (!sbi->bitmap_free || !sbi->bitmap_pending)
+    {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < sbi->persistent.bitmap_blocks; i++)
+    {
+        bh = assoofs_bread(sb, sbi->persistent.bitmap_start + i);
+        if (!bh)
+        {
+            return -EIO;
+        }
+        // Un bit a 1 es un bloque ocupado (también los bits que quedan más allá del final del dispositivo)
+        sbi->bitmap_free[i] = ASSOOFS_BITS_PER_BLOCK(sb) - memweight(bh->b_data, sb->s_blocksize);
+        free_blocks += sbi->bitmap_free[i];
+        brelse(bh);
+    }
+
+    // El resumen manda: el contador del superbloque solo es orientativo si no se desmontó bien
+    sbi->persistent.free_blocks = free_blocks;
+    sbi->next_block = 0;
+    return 0;
+}
+
+/**
+ * @brief Libera el resumen del mapa de bits y los bloques pendientes de confirmar (al desmontar, con el diario ya cerrado)
+ */
+static void assoofs_put_bitmap(struct assoofs_sb_info *sbi)
+{
+    uint64_t i;
+
+    for (i = 0; sbi->bitmap_pending && i < sbi->persistent.bitmap_blocks; i++)
+    {
+        kfree(sbi->bitmap_pending[i].bits);
+    }
+    kvfree(sbi->bitmap_pending);
+    kvfree(sbi->bitmap_free);
+}
+
+/*
+ *  Operaciones sobre un bloque de un mapa de bits ya leído. No tocan el dispositivo, el diario ni los
+ *  cerrojos (de eso se encargan quienes las llaman), así que también funcionan sobre bloques en memoria
+ */
+
+/**
+ * @brief Reserva el primer tramo libre de un bloque del mapa de bits a partir del bit from: marca como
+ * ocupados hasta wanted bits seguidos
+ *
+ * @param map contenido del bloque del mapa de bits
+ * @param bits bits del bloque
+ * @param from primer bit desde el que buscar
+ * @param wanted bits deseados
+ * @param count bits reservados (entre 1 y wanted)
+ * @return unsigned long primer bit reservado, bits si no hay ninguno libre desde from
+ */
+static unsigned long assoofs_bitmap_alloc(void *map, unsigned long bits, unsigned long from, uint64_t wanted, unsigned long *count)
+{
+    unsigned long bit, end;
+
+    bit = find_next_zero_bit_le(map, bits, from);
+    if (bit >= bits)
+    {
+        return bits;
+    }
+
+    // Alargamos el tramo mientras los bits siguientes también estén libres
+    end = find_next_bit_le(map, min_t(uint64_t, bits, bit + wanted), bit);
+    for (from = bit; from < end; from++)
+    {
+        __set_bit_le(from, map);
+    }
+    *count = end - bit;
+    return bit;
+}
+
+/**
+ * @brief Libera los bits [bit, end) de un bloque del mapa de bits. Si pending no es NULL, los bits
+ * liberados se marcan también en él
+ *
+ * @return unsigned long cuántos de esos bits estaban ocupados
+ */
+static unsigned long assoofs_bitmap_release(void *map, unsigned long bit, unsigned long end, void *pending)
+{
+    unsigned long freed = 0;
+
+    for (; bit < end; bit++)
+    {
+        if (__test_and_clear_bit_le(bit, map))
+        {
+            if (pending)
+            {
+                __set_bit_le(bit, pending);
+            }
+            freed++;
+        }
+    }
+    return freed;
+}
+
+/**
+ * @brief Busca y reserva un tramo de hasta wanted bloques libres contiguos. La búsqueda empieza en
+ * goal (si es válido) o en el cursor next-fit, se salta los bloques del mapa sin bloques libres gracias
+ * al resumen en memoria y recorre cada bloque del mapa palabra a palabra con find_next_zero_bit.
+ *
+ * @param sb superbloque del dispositivo
+ * @param goal bloque preferido para empezar (0 si no hay preferencia)
+ * @param wanted número de bloques deseados
+ * @param block primer bloque reservado
+ * @param count número de bloques contiguos reservados (entre 1 y wanted)
+ * @return int 0 si todo fue correcto, -ENOSPC si no quedan bloques libres
+ */
+int assoofs_sb_get_freeblocks(struct super_block *sb, uint64_t goal, uint64_t wanted, uint64_t *block, uint64_t *count)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    unsigned long bits = ASSOOFS_BITS_PER_BLOCK(sb);
+    struct buffer_head *bh;
+    uint64_t start, map, n;
+    unsigned long bit, got;
+    unsigned long *pending;
+    uint64_t begin = ktime_get_ns(), ns;
+    int ret = -ENOSPC;
+
+    spin_lock(&sbi->lock);
+    start = (goal && goal < sbi->persistent.blocks_count) ? goal : sbi->next_block;
+    spin_unlock(&sbi->lock);
+
+    // Damos una vuelta completa al mapa; el bloque del mapa inicial se visita dos veces por si
+    // hay huecos antes de start. El resumen se consulta sin cerrojo: solo sirve para saltar bloques
+    // del mapa, y quien reserva de verdad es el bloqueo del buffer
+    for (n = 0; n <= sbi->persistent.bitmap_blocks; n++)
+    {
+        map = (start / bits + n) % sbi->persistent.bitmap_blocks;
+        if (READ_ONCE(sbi->bitmap_free[map]) == 0)
+        {
+            continue;
+        }
+
+        bh = assoofs_bread(sb, sbi->persistent.bitmap_start + map);
+        if (!bh)
+        {
+            ret = -EIO;
+            break;
+        }
+
+        // El acceso al diario se pide antes de bloquear el buffer (jbd2 también lo bloquea)
+        ret = assoofs_journal_get_access(bh);
+        if (ret)
+        {
+            brelse(bh);
+            break;
+        }
+
+        // Con el buffer bloqueado nadie más puede reservar bits de este bloque del mapa. Los liberados sin
+        // confirmar cuentan como ocupados mientras se busca: solo pueden dejar de estar pendientes (con
+        // sbi->lock), porque para añadir más hace falta el buffer
+        lock_buffer(bh);
+        pending = NULL;
+        if (READ_ONCE(sbi->bitmap_pending[map].count))
+        {
+            spin_lock(&sbi->lock);
+            pending = sbi->bitmap_pending[map].bits;
+            bitmap_or((unsigned long *)bh->b_data, (unsigned long *)bh->b_data, pending, bits);
+        }
+        bit = assoofs_bitmap_alloc(bh->b_data, bits, (n == 0) ? start % bits : 0, wanted, &got);
+        if (pending)
+        {
+            bitmap_andnot((unsigned long *)bh->b_data, (unsigned long *)bh->b_data, pending, bits);
+            spin_unlock(&sbi->lock);
+        }
+        unlock_buffer(bh);
+        if (bit >= bits)
+        {
+            brelse(bh);
+            ret = -ENOSPC;
+            continue;
+        }
+        ret = assoofs_journal_dirty(bh);
+        brelse(bh);
+        if (ret)
+        {
+            break;
+        }
+
+        *block = map * bits + bit;
+        *count = got;
+        spin_lock(&sbi->lock);
+        sbi->bitmap_free[map] -= *count;
+        sbi->persistent.free_blocks -= *count;
+        sbi->next_block = *block + *count;
+        spin_unlock(&sbi->lock);
+        percpu_counter_sub(&sbi->free_blocks, *count);
+        ret = 0;
+        break;
+    }
+
+    if (ret == -ENOSPC)
+    {
+        printk(KERN_ERR "No free blocks left\n");
+    }
+    else if (ret == 0)
+    {
+        assoofs_save_sb_info(sb);
+    }
+    ns = assoofs_stat_end(sb, ASSOOFS_OP_ALLOC, begin);
+    trace_assoofs_alloc_blocks(sb, goal, wanted, ret ? 0 : *block, ret ? 0 : *count, ret, ns);
+    return ret;
+}
+
+/**
+ * @brief Gives a free block to the given inode and updates the superblock info
+ *
+ */
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block)
+{
+    uint64_t count;
+
+    return assoofs_sb_get_freeblocks(sb, 0, 1, block, &count);
+}
+
+/*
+ *  Puesta a cero diferida de la tabla de inodos: con ASSOOFS_FEATURE_LAZY_ITABLE, mkassoofs solo escribe
+ *  los primeros persistent.inode_table_zeroed bloques de la tabla y el resto lo pone a cero el módulo,
+ *  en segundo plano (itable_work) o, si hace falta antes, al reservar un inodo que cae más allá
+ */
+
+// Bloques de la tabla que se ponen a cero de una vez, y pausa entre tandas del trabajo en segundo plano
+#define ASSOOFS_ITABLE_ZERO_CHUNK 1024
+#define ASSOOFS_ITABLE_ZERO_DELAY msecs_to_jiffies(10)
+
+/**
+ * @brief Pone a cero la siguiente tanda de bloques de la tabla de inodos, sin pasar del bloque end.
+ * Al terminar la tabla se quita ASSOOFS_FEATURE_LAZY_ITABLE. Se llama con itable_lock cogido.
+ *
+ * @param sb superbloque
+ * @param end bloque de la tabla (relativo a su inicio) hasta el que hay que llegar, sin incluirlo
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
+ */
+static int assoofs_itable_zero_chunk(struct super_block *sb, uint64_t end)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t start = sbi->persistent.inode_table_zeroed;
+    uint64_t count = min_t(uint64_t, end - start, ASSOOFS_ITABLE_ZERO_CHUNK);
+    int ret;
+
+    // Los bloques no tienen ningún inodo en uso (las reservas esperan a que estén a cero) ni están en la
+    // caché de buffers, así que se ponen a cero directamente en el dispositivo, sin pasar por el diario
+    ret = sb_issue_zeroout(sb, sbi->persistent.inode_table_start + start, count, GFP_NOFS);
+    if (ret)
+    {
+        return ret;
+    }
+
+    // El nuevo límite llega a disco con el siguiente guardado del superbloque, que es a más tardar el de la
+    // reserva del primer inodo que lo usa: un superbloque anterior solo hace que se vuelva a poner a cero
+    spin_lock(&sbi->lock);
+    sbi->persistent.inode_table_zeroed = start + count;
+    if (sbi->persistent.inode_table_zeroed >= sbi->persistent.inode_table_blocks)
+    {
+        sbi->persistent.features &= ~ASSOOFS_FEATURE_LAZY_ITABLE;
+    }
+    spin_unlock(&sbi->lock);
+    return 0;
+}
+
+/**
+ * @brief Se asegura de que el bloque de la tabla que contiene la ranura de ino esté a cero antes de usarla
+ *
+ * @param sb superbloque
+ * @param ino número de inodo recién reservado
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
+ */
+static int assoofs_itable_ensure_zeroed(struct super_block *sb, uint64_t ino)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t block = ino / ASSOOFS_INODES_PER_BLOCK(sb->s_blocksize);
+    int ret = 0;
+
+    // El límite solo crece y la característica solo se quita, así que leerlos sin cerrojo es seguro
+    if (!(READ_ONCE(sbi->persistent.features) & ASSOOFS_FEATURE_LAZY_ITABLE) || READ_ONCE(sbi->persistent.inode_table_zeroed) > block)
+    {
+        return 0;
+    }
+
+    mutex_lock(&sbi->itable_lock);
+    while (!ret && (sbi->persistent.features & ASSOOFS_FEATURE_LAZY_ITABLE) && sbi->persistent.inode_table_zeroed <= block)
+    {
+        ret = assoofs_itable_zero_chunk(sb, block + 1);
+    }
+    mutex_unlock(&sbi->itable_lock);
+    return ret;
+}
+
+/**
+ * @brief Trabajo en segundo plano: pone a cero una tanda de la tabla de inodos y se vuelve a programar
+ * hasta terminarla. assoofs_put_super lo cancela al desmontar
+ */
+static void assoofs_itable_work(struct work_struct *work)
+{
+    struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, itable_work);
+    bool done = true;
+    int ret = 0;
+
+    mutex_lock(&sbi->itable_lock);
+    if (sbi->persistent.features & ASSOOFS_FEATURE_LAZY_ITABLE)
+    {
+        ret = assoofs_itable_zero_chunk(sbi->sb, sbi->persistent.inode_table_blocks);
+        done = !(sbi->persistent.features & ASSOOFS_FEATURE_LAZY_ITABLE);
+    }
+    mutex_unlock(&sbi->itable_lock);
+
+    if (ret)
+    {
+        // Las reservas siguen poniendo a cero los bloques que necesitan
+        printk(KERN_WARNING "assoofs: couldn't zero the inode table of %s (%d)\n", sbi->sb->s_id, ret);
+    }
+    else if (!done)
+    {
+        queue_delayed_work(system_long_wq, &sbi->itable_work, ASSOOFS_ITABLE_ZERO_DELAY);
+    }
+}
+
+/**
+ * @brief Reserva un número de inodo libre en el mapa de bits de inodos (bit a 1 = ranura en uso).
+ * Empieza a buscar en el cursor next-fit, así que normalmente basta con leer un bloque del mapa,
+ * y las ranuras de los inodos borrados se reutilizan al dar la vuelta.
+ *
+ * @param sb superbloque del dispositivo
+ * @param ino número de inodo reservado
+ * @return int 0 si todo fue correcto, -ENOSPC si la tabla de inodos está llena
+ */
+static int assoofs_new_inode_no(struct super_block *sb, uint64_t *ino)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    unsigned long bits = ASSOOFS_BITS_PER_BLOCK(sb);
+    struct buffer_head *bh;
+    uint64_t start, map, n;
+    unsigned long bit, got;
+    int ret = -ENOSPC;
+
+    // Si ya están todas las ranuras ocupadas no hace falta buscar
+    spin_lock(&sbi->lock);
+    if (sbi->persistent.inodes_count >= assoofs_max_inodes(sb))
+    {
+        spin_unlock(&sbi->lock);
+        printk(KERN_ERR "Max filesystem objects created\n");
+        return -ENOSPC;
+    }
+    start = sbi->next_inode;
+    spin_unlock(&sbi->lock);
+
+    // Igual que con los bloques: el bloque del mapa inicial se visita dos veces por si hay huecos antes de start
+    for (n = 0; n <= sbi->persistent.inode_bitmap_blocks; n++)
+    {
+        map = (start / bits + n) % sbi->persistent.inode_bitmap_blocks;
+        bh = assoofs_bread(sb, sbi->persistent.inode_bitmap_start + map);
+        if (!bh)
+        {
+            ret = -EIO;
+            break;
+        }
+        ret = assoofs_journal_get_access(bh);
+        if (ret)
+        {
+            brelse(bh);
+            break;
+        }
+
+        // mkassoofs marca como ocupados los bits de la ranura 0 y los que quedan más allá de la tabla
+        lock_buffer(bh);
+        bit = assoofs_bitmap_alloc(bh->b_data, bits, (n == 0) ? start % bits : 0, 1, &got);
+        unlock_buffer(bh);
+        if (bit >= bits)
+        {
+            brelse(bh);
+            ret = -ENOSPC;
+            continue;
+        }
+        ret = assoofs_journal_dirty(bh);
+        brelse(bh);
+        if (ret)
+        {
+            break;
+        }
+
+        *ino = map * bits + bit;
+        spin_lock(&sbi->lock);
+        sbi->persistent.inodes_count++;
+        sbi->next_inode = *ino + 1;
+        spin_unlock(&sbi->lock);
+        percpu_counter_dec(&sbi->free_inodes);
+        trace_assoofs_alloc_ino(sb, *ino);
+        ret = 0;
+        break;
+    }
+
+    if (ret == -ENOSPC)
+    {
+        printk(KERN_ERR "Max filesystem objects created\n");
+    }
+    else if (!ret)
+    {
+        // Con la tabla de inodos a medio poner a cero, la ranura no puede tener restos de otros datos
+        ret = assoofs_itable_ensure_zeroed(sb, *ino);
+        if (ret)
+        {
+            assoofs_free_inode_no(sb, *ino);
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Libera en el mapa de bits de inodos el número de un inodo borrado (o reservado y no usado)
+ *
+ * @param sb superbloque del dispositivo
+ * @param ino número de inodo a liberar
+ */
+static void assoofs_free_inode_no(struct super_block *sb, uint64_t ino)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    unsigned long bits = ASSOOFS_BITS_PER_BLOCK(sb);
+    struct buffer_head *bh;
+    bool freed;
+
+    if (ino <= ASSOOFS_LAST_RESERVED_INODE || ino / bits >= sbi->persistent.inode_bitmap_blocks)
+    {
+        printk(KERN_ERR "Trying to free the reserved or invalid inode %llu\n", ino);
+        return;
+    }
+
+    bh = assoofs_bread(sb, sbi->persistent.inode_bitmap_start + ino / bits);
+    if (!bh)
+    {
+        printk(KERN_ERR "Couldn't read the inode bitmap block of inode %llu\n", ino);
+        return;
+    }
+    if (assoofs_journal_get_access(bh))
+    {
+        brelse(bh);
+        return;
+    }
+    lock_buffer(bh);
+    freed = assoofs_bitmap_release(bh->b_data, ino % bits, ino % bits + 1, NULL);
+    unlock_buffer(bh);
+    assoofs_journal_dirty(bh);
+    brelse(bh);
+
+    if (!freed)
+    {
+        printk(KERN_ERR "Inode %llu was already free\n", ino);
+        return;
+    }
+
+    // La ranura liberada se reutiliza cuanto antes: así la tabla de inodos se mantiene compacta
+    spin_lock(&sbi->lock);
+    sbi->persistent.inodes_count--;
+    if (ino < sbi->next_inode)
+    {
+        sbi->next_inode = ino;
+    }
+    spin_unlock(&sbi->lock);
+    percpu_counter_inc(&sbi->free_inodes);
+    trace_assoofs_free_ino(sb, ino);
+}
+
+/**
+ * @brief Posición de la ranura de un inodo en la tabla de inodos (el inodo número n ocupa la ranura n)
+ *
+ * @param afs_sb información persistente del superbloque
+ * @param blocksize tamaño de bloque del dispositivo
+ * @param inode_no número de inodo
+ * @param block bloque de la tabla, relativo a su inicio, que contiene la ranura
+ * @return int desplazamiento de la ranura dentro del bloque, -EINVAL si el número cae fuera de la tabla
+ */
+static inline int assoofs_inode_slot(const struct assoofs_super_block_info *afs_sb, unsigned long blocksize, uint64_t inode_no, uint64_t *block)
+{
+    uint64_t per_block = ASSOOFS_INODES_PER_BLOCK(blocksize);
+
+    if (inode_no == 0 || inode_no >= afs_sb->inode_table_blocks * per_block)
+    {
+        return -EINVAL;
+    }
+    *block = inode_no / per_block;
+    return (inode_no % per_block) * ASSOOFS_INODE_SIZE;
+}
+
+/**
+ * @brief Indica si una ranura de la tabla guarda el inodo inode_no: está en uso y es la suya
+ */
+static inline bool assoofs_inode_slot_valid(const struct assoofs_inode_info *slot, uint64_t inode_no)
+{
+    return slot->state_flag == ASSOOFS_FLAG_USED && slot->inode_no == inode_no;
+}
+
+/**
+ * @brief Obtiene un puntero a la información persistente (disco) de un inodo concreto (assoofs_inode_info).
+ * El número de inodo indica directamente su ranura en la tabla de inodos, así que basta con leer un bloque.
+ * 
+ * @param sb superbloque al que pertenece el inodo
+ * @param inode_no número del inodo buscado
+ * @param bhp buffer del bloque de la tabla que contiene el inodo; el llamante debe liberarlo con brelse
+ * @return struct assoofs_inode_info* ranura del inodo dentro de *bhp, NULL si el número no es válido o falla la lectura
+ */
+struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, uint64_t inode_no, struct buffer_head **bhp)
+{
+    struct assoofs_super_block_info *afs_sb = &ASSOOFS_SB(sb)->persistent;
+    uint64_t block;
+    int offset;
+
+    offset = assoofs_inode_slot(afs_sb, sb->s_blocksize, inode_no, &block);
+    if (offset < 0)
+    {
+        printk(KERN_ERR "Inode number %llu out of the inode table\n", inode_no);
+        return NULL;
+    }
+
+    *bhp = assoofs_bread(sb, afs_sb->inode_table_start + block);
+    if (!*bhp)
+    {
+        return NULL;
+    }
+    return (struct assoofs_inode_info *)((*bhp)->b_data + offset);
+}
+
+/**
+ * @brief Guarda en disco la información persistente de un nuevo inodo (assoofs_inode_info) 
+ * 
+ * @param sb superbloque al que pertenece el inodo
+ * @param inode inodo a guardar
+ */
+void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode)
+{
+    struct assoofs_inode_info *inode_info;
+    struct buffer_head *bh;
+
+    // Leer de disco el bloque de la tabla de inodos que contiene la ranura del inodo
+    // (el contador de inodos del superbloque ya lo actualizó quien reservó el número)
+    inode_info = assoofs_search_inode_info(sb, inode->inode_no, &bh);
+    if (!inode_info)
+    {
+        return;
+    }
+
+    // Escribir el nuevo inodo en su ranura: el bloqueo del buffer basta, cada inodo tiene la suya
+    if (assoofs_journal_get_access(bh))
+    {
+        brelse(bh);
+        return;
+    }
+    lock_buffer(bh);
+    memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
+    unlock_buffer(bh);
+
+    // Marcar el bloque como sucio
+    assoofs_journal_dirty(bh);
+
+    // Liberar bh
+    brelse(bh);
+}
+
+/**
+ * @brief Copia la información persistente de un inodo (ya creado) en su ranura de la tabla de inodos
+ * y marca el bloque como sucio
+ *
+ * @param sb superbloque al que pertenece el inodo
+ * @param inode_info información persistente a guardar
+ * @param wait si es true se espera a que el bloque llegue a disco
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
+ */
+static int __assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info, bool wait)
+{
+    struct buffer_head *bh;
+    struct assoofs_inode_info *inode_pos;
+    handle_t *handle;
+    int ret;
+
+    // Obtener de disco el bloque de la tabla de inodos con la ranura del inodo (sin recorrer la tabla)
+    inode_pos = assoofs_search_inode_info(sb, inode_info->inode_no, &bh);
+    if (!inode_pos)
+    {
+        return -EIO;
+    }
+
+    handle = assoofs_journal_start(sb, 1);
+    if (IS_ERR(handle))
+    {
+        brelse(bh);
+        return PTR_ERR(handle);
+    }
+
+    // Actualizar el inodo y marcar el bloque como sucio (se escribe ahora solo si se pide esperar).
+    // Otros inodos comparten el bloque, pero cada uno escribe su ranura con el buffer bloqueado
+    ret = assoofs_journal_get_access(bh);
+    if (!ret)
+    {
+        lock_buffer(bh);
+        memcpy(inode_pos, inode_info, sizeof(*inode_pos));
+        unlock_buffer(bh);
+        ret = assoofs_journal_dirty(bh);
+    }
+    assoofs_journal_stop(handle);
+
+    if (!ret && wait)
+    {
+        if (ASSOOFS_SB(sb)->journal)
+        {
+            ret = journal_current_handle() ? 0 : jbd2_journal_force_commit(ASSOOFS_SB(sb)->journal);
+        }
+        else
+        {
+            ret = sync_dirty_buffer(bh);
+        }
+    }
+
+    // Liberar bh
+    brelse(bh);
+    return ret;
+}
+
+/**
+ * @brief Actualiza la información persistente (disco) de un inodo (ya creado). La escritura a disco es diferida
+ *
+ * @param sb superbloque al que pertenece el inodo
+ * @param inode_info información persistente a guardar
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
+ */
+int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info)
+{
+    return __assoofs_save_inode_info(sb, inode_info, false);
+}
+
+/**
+ * @brief obtiene la información persistente (assoofs_inode_info) del inodo número inode_ino perteneciente al superbloque sb
+ * 
+ * @param sb superbloque al que pertenece el inodo
+ * @param inode_no número de inodo
+ * @param info dónde copiar la información persistente (la del inodo en memoria)
+ * @return int 0 si todo fue correcto, -EIO si la ranura no está en uso o no se puede leer
+ */
+int assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *info)
+{
+    struct assoofs_inode_info *inode_info = NULL;
+    struct buffer_head *bh;
+    int ret = -EIO;
+
+    // Acceder a disco para leer el bloque de la tabla de inodos que contiene el inodo inode_no
+    inode_info = assoofs_search_inode_info(sb, inode_no, &bh);
+    if (!inode_info)
+    {
+        return -EIO;
+    }
+
+    // La ranura solo es válida si está en uso y corresponde a ese inodo
+    if (assoofs_inode_slot_valid(inode_info, inode_no))
+    {
+        memcpy(info, inode_info, sizeof(*info));
+        ret = 0;
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/*
+ *  Mapa de extents
+ */
+
+// Nodo del árbol de extents: la raíz está dentro del inodo (bh == NULL), el resto en bloques propios
+struct assoofs_extent_path
+{
+    struct buffer_head *bh;
+    struct assoofs_extent_header *hdr;
+    struct assoofs_extent *ext;
+};
+
+/**
+ * @brief Pide acceso a un bloque de extents antes de modificarlo
+ */
+static int assoofs_extent_access(struct buffer_head *bh)
+{
+    if (!bh)
+    {
+        return 0; // La raíz está en el inodo
+    }
+    return assoofs_journal_get_access(bh);
+}
+
+/**
+ * @brief Marca como sucio un bloque de extents modificado
+ */
+static int assoofs_extent_dirty(struct buffer_head *bh)
+{
+    if (!bh)
+    {
+        return 0; // La raíz se guarda con el resto de la información persistente del inodo
+    }
+    return assoofs_journal_dirty(bh);
+}
+
+/**
+ * @brief Número de entradas que caben en un bloque de extents
+ */
+static int assoofs_extent_block_max(struct super_block *sb)
+{
+    return (sb->s_blocksize - sizeof(struct assoofs_extent_header)) / sizeof(struct assoofs_extent);
+}
+
+/**
+ * @brief Busca (búsqueda binaria) la última entrada del nodo cuyo primer bloque lógico es <= lblk
+ */
+static int assoofs_extent_search(struct assoofs_extent *ext, int entries, uint64_t lblk)
+{
+    int lo = 0, hi = entries - 1, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (ext[mid].block <= lblk)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/**
+ * @brief Lee de disco el nodo del árbol de extents guardado en el bloque block
+ */
+static int assoofs_extent_read_node(struct super_block *sb, uint64_t block, struct assoofs_extent_path *node)
+{
+    node->bh = assoofs_bread(sb, block);
+    if (!node->bh)
+    {
+        return -EIO;
+    }
+    node->hdr = (struct assoofs_extent_header *)node->bh->b_data;
+    node->ext = (struct assoofs_extent *)(node->hdr + 1);
+
+    if (node->hdr->magic != ASSOOFS_EXTENT_MAGIC)
+    {
+        printk(KERN_ERR "Corrupted extent block %llu\n", block);
+        brelse(node->bh);
+        node->bh = NULL;
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Crea un bloque de extents nuevo (a cero) con la cabecera inicializada
+ */
+static struct buffer_head *assoofs_extent_new_node(struct super_block *sb, uint64_t block, uint16_t depth)
+{
+    struct buffer_head *bh;
+    struct assoofs_extent_header *hdr;
+
+    bh = assoofs_getblk(sb, block);
+    if (!bh)
+    {
+        return NULL;
+    }
+    if (assoofs_journal_get_create_access(bh))
+    {
+        brelse(bh);
+        return NULL;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    hdr = (struct assoofs_extent_header *)bh->b_data;
+    hdr->magic = ASSOOFS_EXTENT_MAGIC;
+    hdr->max = assoofs_extent_block_max(sb);
+    hdr->depth = depth;
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    return bh;
+}
+
+/**
+ * @brief Inicializa el mapa de extents de un inodo sin bloques asignados
+ *
+ * @param inode_info información persistente del inodo
+ */
+void assoofs_extent_init(struct assoofs_inode_info *inode_info)
+{
+    inode_info->blocks = 0;
+    inode_info->extent_header.magic = ASSOOFS_EXTENT_MAGIC;
+    inode_info->extent_header.entries = 0;
+    inode_info->extent_header.max = ASSOOFS_INLINE_EXTENTS;
+    inode_info->extent_header.depth = 0;
+    memset(inode_info->extents, 0, sizeof(inode_info->extents));
+}
+
+/**
+ * @brief Traduce un bloque lógico de un inodo al bloque físico que lo contiene
+ *
+ * @param sb superbloque al que pertenece el inodo
+ * @param inode_info información persistente del inodo
+ * @param lblk bloque lógico a traducir
+ * @param block bloque físico correspondiente a lblk
+ * @param count si no es NULL, bloques físicos contiguos a partir de block dentro del mismo extent
+ * @return int 0 si el bloque está asignado, -ENOENT si no lo está, otro valor en caso de error
+ */
+int assoofs_extent_lookup(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t lblk, uint64_t *block, uint64_t *count)
+{
+    struct assoofs_extent_path node = {NULL, &inode_info->extent_header, inode_info->extents};
+    struct buffer_head *parent_bh;
+    struct assoofs_extent *ext;
+    int i, ret;
+
+    // Un inodo en línea no tiene bloques: su mapa de extents está ocupado por el contenido
+    if ((inode_info->flags & ASSOOFS_INODE_INLINE) || lblk >= inode_info->blocks || node.hdr->entries == 0)
+    {
+        return -ENOENT;
+    }
+
+    // Bajamos por los índices hasta la hoja que cubre lblk
+    while (node.hdr->depth > 0)
+    {
+        i = assoofs_extent_search(node.ext, node.hdr->entries, lblk);
+        parent_bh = node.bh;
+        ret = assoofs_extent_read_node(sb, node.ext[i].start, &node);
+        brelse(parent_bh);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    ret = -ENOENT;
+    ext = &node.ext[assoofs_extent_search(node.ext, node.hdr->entries, lblk)];
+    if (lblk >= ext->block && lblk < ext->block + ext->len)
+    {
+        *block = ext->start + (lblk - ext->block);
+        if (count)
+        {
+            *count = ext->len - (lblk - ext->block);
+        }
+        ret = 0;
+    }
+
+    brelse(node.bh);
+    return ret;
+}
+
+/**
+ * @brief Bloque físico correspondiente al bloque lógico lblk, 0 si no está asignado
+ * (el bloque 0 es el superbloque, así que nunca pertenece a un inodo)
+ */
+uint64_t assoofs_bmap(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t lblk)
+{
+    uint64_t block;
+
+    if (assoofs_extent_lookup(sb, inode_info, lblk, &block, NULL))
+    {
+        return 0;
+    }
+    return block;
+}
+
+/**
+ * @brief Baja la raíz del árbol a un bloque nuevo, de forma que el árbol crece un nivel
+ * y la raíz queda con una única entrada libre para seguir creciendo
+ */
+static int assoofs_extent_grow_root(struct super_block *sb, struct assoofs_inode_info *inode_info)
+{
+    struct buffer_head *bh;
+    struct assoofs_extent_header *hdr;
+    uint64_t block;
+    int ret;
+
+    ret = assoofs_sb_get_a_freeblock(sb, &block);
+    if (ret)
+    {
+        return ret;
+    }
+
+    bh = assoofs_extent_new_node(sb, block, inode_info->extent_header.depth);
+    if (!bh)
+    {
+        assoofs_sb_set_freeblocks(sb, block, 1);
+        return -EIO;
+    }
+    hdr = (struct assoofs_extent_header *)bh->b_data;
+    hdr->entries = inode_info->extent_header.entries;
+    memcpy(hdr + 1, inode_info->extents, sizeof(inode_info->extents));
+    ret = assoofs_extent_dirty(bh);
+    brelse(bh);
+    if (ret)
+    {
+        assoofs_sb_set_freeblocks(sb, block, 1);
+        return ret;
+    }
+
+    inode_info->extent_header.depth++;
+    inode_info->extent_header.entries = 1;
+    memset(inode_info->extents, 0, sizeof(inode_info->extents));
+    inode_info->extents[0].start = block;
+    return 0;
+}
+
+/**
+ * @brief Añade al final del mapa la correspondencia de count bloques lógicos (a partir de
+ * inode_info->blocks) con los bloques físicos [block, block + count). Si el último extent es
+ * contiguo simplemente se amplía. Los ficheros no tienen huecos, así que solo se inserta por la derecha.
+ * El llamante debe guardar después la información persistente del inodo.
+ *
+ * @param sb superbloque al que pertenece el inodo
+ * @param inode_info información persistente del inodo
+ * @param block primer bloque físico a añadir
+ * @param count número de bloques físicos contiguos a añadir
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
+ */
+int assoofs_extent_append(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t block, uint64_t count)
+{
+    struct assoofs_extent_path path[ASSOOFS_EXTENT_MAX_DEPTH + 1];
+    struct assoofs_extent *ext;
+    struct buffer_head *bh;
+    uint64_t lblk = inode_info->blocks;
+    uint64_t chain[ASSOOFS_EXTENT_MAX_DEPTH]; // Bloques de los nodos nuevos, para devolverlos si algo falla
+    uint64_t child;
+    int depth, level, i, nodes = 0, ret;
+
+retry:
+    memset(path, 0, sizeof(path));
+    path[0].hdr = &inode_info->extent_header;
+    path[0].ext = inode_info->extents;
+    depth = path[0].hdr->depth;
+
+    // Recorremos el camino más a la derecha del árbol hasta la última hoja
+    for (level = 0; level < depth; level++)
+    {
+        ret = assoofs_extent_read_node(sb, path[level].ext[path[level].hdr->entries - 1].start, &path[level + 1]);
+        if (ret)
+        {
+            goto out;
+        }
+    }
+
+    // Si el último extent acaba justo donde empieza el nuevo, basta con ampliarlo
+    if (path[depth].hdr->entries > 0)
+    {
+        ext = &path[depth].ext[path[depth].hdr->entries - 1];
+        if (ext->block + ext->len == lblk && ext->start + ext->len == block)
+        {
+            ret = assoofs_extent_access(path[depth].bh);
+            if (ret)
+            {
+                goto out;
+            }
+            ext->len += count;
+            ret = assoofs_extent_dirty(path[depth].bh);
+            if (ret)
+            {
+                goto out;
+            }
+            goto done;
+        }
+    }
+
+    // Buscamos el nivel más bajo del camino que tenga hueco para una entrada más
+    for (level = depth; level >= 0; level--)
+    {
+        if (path[level].hdr->entries < path[level].hdr->max)
+        {
+            break;
+        }
+    }
+
+    if (level < 0)
+    {
+        // Todo el camino está lleno: el árbol crece un nivel y volvemos a empezar
+        if (depth == ASSOOFS_EXTENT_MAX_DEPTH)
+        {
+            ret = -EFBIG;
+            goto out;
+        }
+        for (i = 1; i <= depth; i++)
+        {
+            brelse(path[i].bh);
+        }
+        ret = assoofs_extent_grow_root(sb, inode_info);
+        if (ret)
+        {
+            return ret;
+        }
+        goto retry;
+    }
+
+    // Por debajo de level creamos una cadena de nodos nuevos con una única entrada cada uno
+    child = block;
+    for (i = depth; i > level; i--)
+    {
+        ret = assoofs_sb_get_a_freeblock(sb, &chain[nodes]);
+        if (ret)
+        {
+            goto free_chain;
+        }
+        bh = assoofs_extent_new_node(sb, chain[nodes], depth - i);
+        if (!bh)
+        {
+            nodes++;
+            ret = -EIO;
+            goto free_chain;
+        }
+        ext = (struct assoofs_extent *)((struct assoofs_extent_header *)bh->b_data + 1);
+        ext->block = lblk;
+        ext->start = child;
+        ext->len = (i == depth) ? count : 0;
+        ((struct assoofs_extent_header *)bh->b_data)->entries = 1;
+        ret = assoofs_extent_dirty(bh);
+        brelse(bh);
+        if (ret)
+        {
+            nodes++;
+            goto free_chain;
+        }
+        child = chain[nodes++];
+    }
+
+    ret = assoofs_extent_access(path[level].bh);
+    if (ret)
+    {
+        goto free_chain;
+    }
+    ext = &path[level].ext[path[level].hdr->entries++];
+    ext->block = lblk;
+    ext->start = child;
+    ext->len = (level == depth) ? count : 0;
+    ret = assoofs_extent_dirty(path[level].bh);
+    if (ret)
+    {
+        goto out;
+    }
+
+done:
+    inode_info->blocks += count;
+    ret = 0;
+    goto out;
+free_chain:
+    // La cadena no llegó a colgarse del árbol: sus nodos no los ve nadie
+    while (nodes > 0)
+    {
+        assoofs_sb_set_freeblocks(sb, chain[--nodes], 1);
+    }
+out:
+    for (i = 1; i <= depth; i++)
+    {
+        brelse(path[i].bh);
+    }
+    return ret;
+}
+
+/**
+ * @brief Libera recursivamente los bloques de datos y de extents que cuelgan de un nodo
+ */
+static void assoofs_extent_free_node(struct super_block *sb, struct assoofs_extent_header *hdr, struct assoofs_extent *ext, bool metadata)
+{
+    struct assoofs_extent_path child;
+    uint64_t j;
+    int i;
+
+    for (i = 0; i < hdr->entries; i++)
+    {
+        if (hdr->depth == 0)
+        {
+            // Los bloques de un directorio son metadatos
+            for (j = 0; metadata && j < ext[i].len; j++)
+            {
+                assoofs_journal_forget(sb, ext[i].start + j, NULL);
+            }
+            assoofs_sb_set_freeblocks(sb, ext[i].start, ext[i].len);
+            continue;
+        }
+
+        if (!assoofs_extent_read_node(sb, ext[i].start, &child))
+        {
+            assoofs_extent_free_node(sb, child.hdr, child.ext, metadata);
+            assoofs_journal_forget(sb, ext[i].start, child.bh);
+        }
+        assoofs_sb_set_freeblocks(sb, ext[i].start, 1);
+    }
+}
+
+/**
+ * @brief Libera todos los bloques (de datos y de extents) de un inodo y deja su mapa vacío.
+ * Un inodo en línea se queda sin contenido y con el mapa vacío.
+ * El llamante debe guardar después la información persistente del superbloque y del inodo.
+ *
+ * @param sb superbloque al que pertenece el inodo
+ * @param inode_info información persistente del inodo
+ */
+void assoofs_extent_free_all(struct super_block *sb, struct assoofs_inode_info *inode_info)
+{
+    if (inode_info->flags & ASSOOFS_INODE_INLINE)
+    {
+        inode_info->flags &= ~ASSOOFS_INODE_INLINE;
+        assoofs_extent_init(inode_info);
+        return;
+    }
+    assoofs_extent_free_node(sb, &inode_info->extent_header, inode_info->extents, S_ISDIR(inode_info->mode));
+    assoofs_extent_init(inode_info);
+}
+
+/**
+ * @brief Quita de un nodo (y de los que cuelgan de él) todo lo que está en el bloque lógico lblk o más allá.
+ * Las entradas que empiezan antes de lblk se conservan, así que ningún nodo hijo se queda vacío.
+ */
+static int assoofs_extent_truncate_node(struct super_block *sb, struct assoofs_extent_path *node, uint64_t lblk, bool metadata)
+{
+    struct assoofs_extent_header tail = *node->hdr;
+    struct assoofs_extent_path child;
+    struct assoofs_extent *ext;
+    uint64_t cut;
+    int keep, ret;
+
+    keep = assoofs_extent_search(node->ext, node->hdr->entries, lblk);
+    if (node->ext[keep].block < lblk)
+    {
+        keep++;
+    }
+
+    // Primero la última entrada que se conserva, que puede tener parte de sus bloques más allá de lblk
+    if (keep > 0 && node->hdr->depth > 0)
+    {
+        ret = assoofs_extent_read_node(sb, node->ext[keep - 1].start, &child);
+        if (ret)
+        {
+            return ret;
+        }
+        ret = assoofs_extent_truncate_node(sb, &child, lblk, metadata);
+        brelse(child.bh);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    ret = assoofs_extent_access(node->bh);
+    if (ret)
+    {
+        return ret;
+    }
+    if (keep > 0 && node->hdr->depth == 0)
+    {
+        ext = &node->ext[keep - 1];
+        if (ext->block + ext->len > lblk)
+        {
+            cut = lblk - ext->block;
+            assoofs_sb_set_freeblocks(sb, ext->start + cut, ext->len - cut);
+            ext->len = cut;
+        }
+    }
+
+    // Las entradas siguientes quedan enteras fuera: se liberan con todo lo que cuelga de ellas
+    tail.entries = node->hdr->entries - keep;
+    assoofs_extent_free_node(sb, &tail, node->ext + keep, metadata);
+    memset(node->ext + keep, 0, tail.entries * sizeof(struct assoofs_extent));
+    node->hdr->entries = keep;
+    return assoofs_extent_dirty(node->bh);
+}
+
+/**
+ * @brief Libera los bloques de un inodo a partir del bloque lógico lblk, de forma que se queda con lblk bloques.
+ * El llamante debe guardar después la información persistente del superbloque y del inodo.
+ *
+ * @param sb superbloque al que pertenece el inodo
+ * @param inode_info información persistente del inodo
+ * @param lblk número de bloques que conserva el inodo
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
+ */
+int assoofs_extent_truncate(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t lblk)
+{
+    struct assoofs_extent_path root = {NULL, &inode_info->extent_header, inode_info->extents};
+    int ret;
+
+    if ((inode_info->flags & ASSOOFS_INODE_INLINE) || lblk >= inode_info->blocks)
+    {
+        return 0;
+    }
+    if (lblk == 0)
+    {
+        assoofs_extent_free_all(sb, inode_info);
+        return 0;
+    }
+
+    ret = assoofs_extent_truncate_node(sb, &root, lblk, S_ISDIR(inode_info->mode));
+    if (!ret)
+    {
+        inode_info->blocks = lblk;
+    }
+    return ret;
+}
+
+/*
+ *  Operaciones sobre ficheros
+ */
+static ssize_t assoofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+static ssize_t assoofs_file_write_iter(struct kiocb *iocb, struct iov_iter *from);
+const struct file_operations assoofs_file_operations = {
+    .llseek = generic_file_llseek,
+    .read_iter = assoofs_file_read_iter,
+    .write_iter = assoofs_file_write_iter,
+    .mmap = generic_file_mmap,
+    .fsync = assoofs_fsync,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+};
+
+/**
+ * @brief Asigna bloques nuevos (a cero) al final del fichero hasta que el bloque lógico lblk esté asignado.
+ * Se piden tramos contiguos al asignador empezando justo detrás del último bloque del fichero, de forma
+ * que el fichero crezca ampliando su último extent. Se usa para los bloques de los directorios, que se
+ * leen y escriben directamente con assoofs_bread.
+ */
+static int assoofs_extent_grow(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t lblk)
+{
+    struct buffer_head *bh;
+    uint64_t goal, block, count, i;
+    int ret;
+
+    while (inode_info->blocks <= lblk)
+    {
+        goal = inode_info->blocks ? assoofs_bmap(sb, inode_info, inode_info->blocks - 1) + 1 : 0;
+        ret = assoofs_sb_get_freeblocks(sb, goal, lblk - inode_info->blocks + 1, &block, &count);
+        if (ret)
+        {
+            return ret;
+        }
+
+        // Los bloques nuevos no deben dejar ver datos antiguos del disco
+        for (i = 0; i < count; i++)
+        {
+            bh = assoofs_getblk(sb, block + i);
+            if (!bh || assoofs_journal_get_create_access(bh))
+            {
+                brelse(bh);
+                assoofs_sb_set_freeblocks(sb, block, count);
+                return -EIO;
+            }
+            lock_buffer(bh);
+            memset(bh->b_data, 0, sb->s_blocksize);
+            set_buffer_uptodate(bh);
+            unlock_buffer(bh);
+            ret = assoofs_journal_dirty(bh);
+            brelse(bh);
+            if (ret)
+            {
+                assoofs_sb_set_freeblocks(sb, block, count);
+                return ret;
+            }
+        }
+
+        ret = assoofs_extent_append(sb, inode_info, block, count);
+        if (ret)
+        {
+            assoofs_sb_set_freeblocks(sb, block, count);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Traduce bloques lógicos de un fichero a bloques del dispositivo. Es la capa de mapeo común a la
+ * caché de páginas (get_block) y a la E/S directa (iomap). Con create se asignan bloques nuevos, pero solo
+ * justo detrás del último bloque del fichero: los ficheros no tienen huecos y assoofs_file_write_iter
+ * rellena con ceros cualquier salto más allá del final antes de escribir.
+ *
+ * @param inode inodo del fichero
+ * @param lblk primer bloque lógico a traducir
+ * @param wanted número de bloques que se quieren mapear
+ * @param create distinto de 0 si se pueden asignar bloques
+ * @param block primer bloque del dispositivo, 0 si lblk no está asignado (y no se pidió crearlo)
+ * @param count bloques contiguos mapeados a partir de block (como mucho wanted)
+ * @param new a true si los bloques se acaban de asignar y su contenido en disco no es válido
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
+ */
+static int assoofs_map_blocks(struct inode *inode, uint64_t lblk, uint64_t wanted, int create, uint64_t *block, uint64_t *count, bool *new)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_INFO(inode);
+    handle_t *handle = NULL;
+    uint64_t goal;
+    int ret;
+
+    *new = false;
+    wanted = max_t(uint64_t, wanted, 1);
+
+    // Casi siempre el bloque ya existe (lecturas, reescrituras): basta con el cerrojo compartido
+    down_read(assoofs_map_lock(inode));
+    ret = assoofs_extent_lookup(sb, inode_info, lblk, block, count);
+    up_read(assoofs_map_lock(inode));
+    if (ret != -ENOENT || !create)
+    {
+        goto done;
+    }
+
+    // La transacción se abre antes de coger el cerrojo: abrirla puede esperar a que se confirme la anterior
+    handle = assoofs_journal_start(sb, ASSOOFS_ALLOC_CREDITS);
+    if (IS_ERR(handle))
+    {
+        return PTR_ERR(handle);
+    }
+
+    // Otro hilo ha podido asignar el bloque mientras no teníamos el cerrojo
+    down_write(assoofs_map_lock(inode));
+    ret = assoofs_extent_lookup(sb, inode_info, lblk, block, count);
+    if (ret == -ENOENT)
+    {
+        // Los datos de un fichero en línea pasan antes a un bloque (assoofs_inline_to_block)
+        if (inode_info->flags & ASSOOFS_INODE_INLINE)
+        {
+            printk(KERN_ERR "Inode %llu has inline data and no blocks\n", inode_info->inode_no);
+            ret = -EIO;
+            goto out;
+        }
+        if (lblk != inode_info->blocks)
+        {
+            printk(KERN_ERR "Block %llu of inode %llu would leave a hole\n", lblk, inode_info->inode_no);
+            ret = -EIO;
+            goto out;
+        }
+
+        goal = inode_info->blocks ? assoofs_bmap(sb, inode_info, inode_info->blocks - 1) + 1 : 0;
+        ret = assoofs_sb_get_freeblocks(sb, goal, wanted, block, count);
+        if (ret)
+        {
+            goto out;
+        }
+        ret = assoofs_extent_append(sb, inode_info, *block, *count);
+        if (ret)
+        {
+            assoofs_sb_set_freeblocks(sb, *block, *count);
+            goto out;
+        }
+        // Con diario, el mapa de extents del inodo va en la misma transacción que los bloques asignados
+        if (handle)
+        {
+            assoofs_save_inode_info(sb, inode_info);
+        }
+        mark_inode_dirty(inode);
+        *new = true;
+    }
+    else if (ret)
+    {
+        goto out;
+    }
+    *count = min(*count, wanted);
+
+out:
+    up_write(assoofs_map_lock(inode));
+    assoofs_journal_stop(handle);
+    return ret;
+
+done:
+    if (ret == -ENOENT)
+    {
+        *block = 0;
+        *count = 0;
+        return 0;
+    }
+    if (!ret)
+    {
+        *count = min(*count, wanted);
+    }
+    return ret;
+}
+
+/**
+ * @brief get_block para la caché de páginas. Si se pide más de un bloque (b_size) se devuelve el tramo
+ * contiguo del extent; el buffer queda sin mapear si el bloque no existe y no se pidió crearlo.
+ */
+static int assoofs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+{
+    struct super_block *sb = inode->i_sb;
+    uint64_t block, count;
+    bool new;
+    int ret;
+
+    ret = assoofs_map_blocks(inode, iblock, bh_result->b_size >> sb->s_blocksize_bits, create, &block, &count, &new);
+    if (ret || !block)
+    {
+        return ret;
+    }
+
+    // Los bloques nuevos no se leen: la caché de páginas pone a cero lo que no se escriba
+    if (new)
+    {
+        set_buffer_new(bh_result);
+    }
+    map_bh(bh_result, sb, block);
+    bh_result->b_size = count << sb->s_blocksize_bits;
+    return 0;
+}
+
+/**
+ * @brief iomap_begin para la E/S directa: describe el tramo contiguo del dispositivo que corresponde
+ * a [pos, pos + length) del fichero, asignando bloques al escribir detrás del último
+ */
+static int assoofs_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned flags, struct iomap *iomap, struct iomap *srcmap)
+{
+    struct super_block *sb = inode->i_sb;
+    uint64_t lblk = pos >> sb->s_blocksize_bits;
+    uint64_t wanted = ((pos + length - 1) >> sb->s_blocksize_bits) - lblk + 1;
+    uint64_t block, count;
+    bool new;
+    int ret;
+
+    ret = assoofs_map_blocks(inode, lblk, wanted, flags & IOMAP_WRITE, &block, &count, &new);
+    if (ret)
+    {
+        return ret;
+    }
+
+    iomap->bdev = sb->s_bdev;
+    iomap->offset = lblk << sb->s_blocksize_bits;
+    iomap->flags = new ? IOMAP_F_NEW : 0;
+    if (!block)
+    {
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+        iomap->length = wanted << sb->s_blocksize_bits;
+    }
+    else
+    {
+        iomap->type = IOMAP_MAPPED;
+        iomap->addr = block << sb->s_blocksize_bits;
+        iomap->length = count << sb->s_blocksize_bits;
+    }
+    return 0;
+}
+
+static const struct iomap_ops assoofs_iomap_ops = {
+    .iomap_begin = assoofs_iomap_begin,
+};
+
+/**
+ * @brief Fin de una escritura directa: si el fichero ha crecido se actualiza su tamaño
+ */
+static int assoofs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error, unsigned flags)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct assoofs_inode_info *inode_info = ASSOOFS_INFO(inode);
+
+    if (error)
+    {
+        return error;
+    }
+    if (size > 0 && iocb->ki_pos + size > i_size_read(inode))
+    {
+        i_size_write(inode, iocb->ki_pos + size);
+        inode_info->file_size = iocb->ki_pos + size;
+        mark_inode_dirty(inode);
+    }
+    return 0;
+}
+
+static const struct iomap_dio_ops assoofs_dio_write_ops = {
+    .end_io = assoofs_dio_write_end_io,
+};
+
+/*
+ *  Ficheros en línea: mientras caben en ASSOOFS_INLINE_DATA_SIZE bytes sus datos viven en el propio inodo
+ *  y no tienen bloques. En la caché de páginas solo existe la página 0, que se rellena desde el inodo y
+ *  se copia de vuelta en él al escribir. Todo lo que cambia el contenido lo hace con la página 0 bloqueada.
+ */
+
+/**
+ * @brief Rellena una página de un fichero en línea con sus datos (la página 0) o con ceros (el resto)
+ */
+static void assoofs_inline_fill_page(struct inode *inode, struct page *page)
+{
+    size_t len = 0;
+    char *kaddr;
+
+    kaddr = kmap_local_page(page);
+    if (page->index == 0)
+    {
+        len = min_t(loff_t, i_size_read(inode), ASSOOFS_INLINE_DATA_SIZE);
+        memcpy(kaddr, ASSOOFS_INFO(inode)->inline_data, len);
+    }
+    memset(kaddr + len, 0, PAGE_SIZE - len);
+    kunmap_local(kaddr);
+    flush_dcache_page(page);
+    SetPageUptodate(page);
+}
+
+/**
+ * @brief Copia en el inodo los datos de la página 0 de un fichero en línea y marca el inodo como sucio
+ */
+static void assoofs_inline_save_page(struct inode *inode, struct page *page)
+{
+    size_t len = min_t(loff_t, i_size_read(inode), ASSOOFS_INLINE_DATA_SIZE);
+    char *kaddr;
+
+    kaddr = kmap_local_page(page);
+    memcpy(ASSOOFS_INFO(inode)->inline_data, kaddr, len);
+    kunmap_local(kaddr);
+    mark_inode_dirty(inode);
+}
+
+/**
+ * @brief Saca los datos de un fichero en línea a su primer bloque. La página 0 (con los datos) queda sucia
+ * y con el bloque 0 recién asignado detrás, así que la escritura diferida la lleva a disco. Se llama con
+ * el i_rwsem del fichero cogido, antes de una escritura que ya no cabe en el inodo.
+ */
+static int assoofs_inline_to_block(struct inode *inode)
+{
+    struct assoofs_inode_info *inode_info = ASSOOFS_INFO(inode);
+    // Un fichero en línea nunca pasa de ASSOOFS_INLINE_DATA_SIZE bytes (assoofs_setattr), pero el bloque
+    // solo se prepara para los datos que hay en el inodo: nunca más allá de la página 0
+    unsigned size = min_t(loff_t, i_size_read(inode), ASSOOFS_INLINE_DATA_SIZE);
+    struct page *page;
+    int ret;
+
+    trace_assoofs_inline_to_block(inode->i_sb, inode->i_ino, 0);
+    page = grab_cache_page_write_begin(inode->i_mapping, 0);
+    if (!page)
+    {
+        return -ENOMEM;
+    }
+    if (!PageUptodate(page))
+    {
+        assoofs_inline_fill_page(inode, page);
+    }
+
+    down_write(assoofs_map_lock(inode));
+    inode_info->flags &= ~ASSOOFS_INODE_INLINE;
+    assoofs_extent_init(inode_info);
+    up_write(assoofs_map_lock(inode));
+    mark_inode_dirty(inode);
+
+    ret = size ? __block_write_begin(page, 0, size, assoofs_get_block) : 0;
+    if (!ret)
+    {
+        block_commit_write(page, 0, size);
+    }
+    else
+    {
+        // Sin bloque: los datos, que siguen en la página, vuelven al inodo
+        down_write(assoofs_map_lock(inode));
+        assoofs_extent_free_all(inode->i_sb, inode_info);
+        inode_info->flags |= ASSOOFS_INODE_INLINE;
+        assoofs_inline_save_page(inode, page);
+        up_write(assoofs_map_lock(inode));
+    }
+    unlock_page(page);
+    put_page(page);
+    return ret;
+}
+
+static int assoofs_read_folio(struct file *file, struct folio *folio)
+{
+    struct inode *inode = folio->mapping->host;
+
+    if (ASSOOFS_INFO(inode)->flags & ASSOOFS_INODE_INLINE)
+    {
+        assoofs_inline_fill_page(inode, &folio->page);
+        folio_unlock(folio);
+        return 0;
+    }
+    return mpage_read_folio(folio, assoofs_get_block);
+}
+
+static void assoofs_readahead(struct readahead_control *rac)
+{
+    // Un fichero en línea no tiene bloques que leer: read_folio copia sus datos del inodo
+    if (ASSOOFS_INFO(rac->mapping->host)->flags & ASSOOFS_INODE_INLINE)
+    {
+        return;
+    }
+    mpage_readahead(rac, assoofs_get_block);
+}
+
+/**
+ * @brief Escritura diferida de la página 0 de un fichero en línea (modificada a través de mmap):
+ * sus datos se copian en el inodo, que se escribe después con write_inode
+ */
+static int assoofs_inline_writepage(struct page *page, struct writeback_control *wbc, void *data)
+{
+    assoofs_inline_save_page(page->mapping->host, page);
+    set_page_writeback(page);
+    unlock_page(page);
+    end_page_writeback(page);
+    return 0;
+}
+
+static int assoofs_writepage(struct page *page, struct writeback_control *wbc)
+{
+    if (ASSOOFS_INFO(page->mapping->host)->flags & ASSOOFS_INODE_INLINE)
+    {
+        return assoofs_inline_writepage(page, wbc, NULL);
+    }
+    return block_write_full_page(page, assoofs_get_block, wbc);
+}
+
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    if (ASSOOFS_INFO(mapping->host)->flags & ASSOOFS_INODE_INLINE)
+    {
+        return write_cache_pages(mapping, wbc, assoofs_inline_writepage, NULL);
+    }
+    return mpage_writepages(mapping, wbc, assoofs_get_block);
+}
+
+/**
+ * @brief Prepara una escritura en la caché de páginas. En un fichero en línea, si la escritura sigue
+ * cabiendo en el inodo solo hace falta la página 0 al día; si no, antes sus datos pasan a un bloque.
+ */
+static int assoofs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, struct page **pagep, void **fsdata)
+{
+    struct inode *inode = mapping->host;
+    struct page *page;
+    int ret;
+
+    if (ASSOOFS_INFO(inode)->flags & ASSOOFS_INODE_INLINE)
+    {
+        if (pos + len <= ASSOOFS_INLINE_DATA_SIZE)
+        {
+            page = grab_cache_page_write_begin(mapping, 0);
+            if (!page)
+            {
+                return -ENOMEM;
+            }
+            if (!PageUptodate(page))
+            {
+                assoofs_inline_fill_page(inode, page);
+            }
+            *pagep = page;
+            return 0;
+        }
+        ret = assoofs_inline_to_block(inode);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    return block_write_begin(mapping, pos, len, pagep, assoofs_get_block);
+}
+
+/**
+ * @brief Termina una escritura en la caché de páginas y, si el fichero ha crecido, apunta el nuevo tamaño
+ * en su información persistente (el inodo se escribe después con write_inode). En un fichero en línea
+ * los datos se copian de la página al inodo y la página queda limpia.
+ */
+static int assoofs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata)
+{
+    struct inode *inode = mapping->host;
+    struct assoofs_inode_info *inode_info = ASSOOFS_INFO(inode);
+    int ret;
+
+    if (inode_info->flags & ASSOOFS_INODE_INLINE)
+    {
+        if (pos + copied > i_size_read(inode))
+        {
+            i_size_write(inode, pos + copied);
+        }
+        assoofs_inline_save_page(inode, page);
+        unlock_page(page);
+        put_page(page);
+        ret = copied;
+    }
+    else
+    {
+        ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+    }
+    if (inode_info->file_size != i_size_read(inode))
+    {
+        inode_info->file_size = i_size_read(inode);
+        mark_inode_dirty(inode);
+    }
+    return ret;
+}
+
+static sector_t assoofs_bmap_aop(struct address_space *mapping, sector_t block)
+{
+    return generic_block_bmap(mapping, block, assoofs_get_block);
+}
+
+const struct address_space_operations assoofs_aops = {
+    .read_folio = assoofs_read_folio,
+    .readahead = assoofs_readahead,
+    .writepage = assoofs_writepage,
+    .writepages = assoofs_writepages,
+    .write_begin = assoofs_write_begin,
+    .write_end = assoofs_write_end,
+    .dirty_folio = block_dirty_folio,
+    .invalidate_folio = block_invalidate_folio,
+    .bmap = assoofs_bmap_aop,
+    .direct_IO = noop_direct_IO, // La E/S directa va por iomap en read_iter/write_iter
+};
+
+/**
+ * @brief Rellena con ceros, a través de la caché de páginas, el fichero desde su tamaño actual hasta pos.
+ * Como los ficheros no tienen huecos, una escritura que empieza más allá del final necesita antes que
+ * existan (y estén a cero) todos los bloques intermedios.
+ */
+static int assoofs_expand_zero(struct inode *inode, loff_t pos)
+{
+    struct address_space *mapping = inode->i_mapping;
+    struct page *page;
+    loff_t size;
+    unsigned len;
+    int ret;
+
+    while ((size = i_size_read(inode)) < pos)
+    {
+        len = min_t(loff_t, pos - size, PAGE_SIZE - offset_in_page(size));
+        ret = assoofs_write_begin(NULL, mapping, size, len, &page, NULL);
+        if (ret)
+        {
+            return ret;
+        }
+        zero_user(page, offset_in_page(size), len);
+        ret = assoofs_write_end(NULL, mapping, size, len, len, page, NULL);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        balance_dirty_pages_ratelimited(mapping);
+    }
+    return 0;
+}
+
+/**
+ * @brief Bloques de metadatos que modifica un paso de assoofs_truncate_extents. Cada bloque liberado, de datos
+ * o un nodo de extents que se queda vacío, puede estar en un bloque distinto del mapa de bits (y por cada bloque
+ * de datos hay como mucho ASSOOFS_EXTENT_MAX_DEPTH nodos). Además cambian los nodos del camino recortado, la
+ * ranura del inodo, el mapa de inodos y el superbloque
+ */
+static int assoofs_truncate_credits(struct super_block *sb)
+{
+    return min_t(uint64_t, ASSOOFS_SB(sb)->persistent.bitmap_blocks, ASSOOFS_TRUNCATE_STEP * (ASSOOFS_EXTENT_MAX_DEPTH + 1)) + ASSOOFS_EXTENT_MAX_DEPTH + 3;
+}
+
+/**
+ * @brief Libera los bloques de un inodo a partir del bloque lógico lblk dentro de la transacción en curso,
+ * abierta con assoofs_truncate_credits(sb). Si el mapa de bits no cabe entero en una transacción se recorta
+ * desde el final de ASSOOFS_TRUNCATE_STEP en ASSOOFS_TRUNCATE_STEP bloques, guardando el inodo tras cada
+ * paso, y cuando a la transacción no le quedan créditos se continúa en otra
+ */
+static int assoofs_truncate_extents(struct inode *inode, uint64_t lblk)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_INFO(inode);
+    uint64_t step = ASSOOFS_TRUNCATE_STEP, end;
+    int credits = assoofs_truncate_credits(sb);
+    int ret = 0;
+
+    if (ASSOOFS_SB(sb)->persistent.bitmap_blocks <= ASSOOFS_TRUNCATE_STEP * (ASSOOFS_EXTENT_MAX_DEPTH + 1))
+    {
+        step = U64_MAX;
+    }
+
+    while (inode_info->blocks > lblk)
+    {
+        end = (inode_info->blocks - lblk > step) ? inode_info->blocks - step : lblk;
+        down_write(assoofs_map_lock(inode));
+        ret = assoofs_extent_truncate(sb, inode_info, end);
+        up_write(assoofs_map_lock(inode));
+        if (!ret)
+        {
+            ret = assoofs_save_inode_info(sb, inode_info);
+        }
+        if (ret || inode_info->blocks == lblk)
+        {
+            break;
+        }
+        // El inodo ya no apunta a lo liberado: se puede confirmar lo hecho si hace falta otra transacción
+        ret = assoofs_journal_ensure_credits(credits);
+        if (ret)
+        {
+            break;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Encoge un fichero con bloques hasta size bytes: se pone a cero el final del último bloque que
+ * se conserva, se descarta la caché de páginas más allá de size y se liberan los bloques sobrantes
+ * (assoofs_truncate_extents). El tamaño nuevo se guarda con el primer paso.
+ */
+static int assoofs_truncate_blocks(struct inode *inode, loff_t size)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_INFO(inode);
+    handle_t *handle;
+    int ret;
+
+    ret = block_truncate_page(inode->i_mapping, size, assoofs_get_block);
+    if (ret)
+    {
+        return ret;
+    }
+    truncate_setsize(inode, size);
+
+    handle = assoofs_journal_start(sb, assoofs_truncate_credits(sb));
+    if (IS_ERR(handle))
+    {
+        return PTR_ERR(handle);
+    }
+    inode_info->file_size = size;
+    ret = assoofs_truncate_extents(inode, DIV_ROUND_UP(size, sb->s_blocksize));
+    assoofs_save_sb_info(sb);
+    assoofs_journal_stop(handle);
+    return ret;
+}
+
+/**
+ * @brief Cambia los atributos de un inodo. Un cambio de tamaño pasa por la caché de páginas: al crecer
+ * se rellena con ceros (y un fichero en línea que ya no cabe en el inodo pasa a tener bloques); al
+ * encoger, un fichero en línea borra del inodo los bytes que quedan fuera y uno con bloques libera los sobrantes.
+ */
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr)
+{
+    struct inode *inode = d_inode(dentry);
+    struct assoofs_inode_info *inode_info = ASSOOFS_INFO(inode);
+    loff_t size;
+    int ret;
+
+    ret = setattr_prepare(mnt_userns, dentry, attr);
+    if (ret)
+    {
+        return ret;
+    }
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode))
+    {
+        size = attr->ia_size;
+        if (size > i_size_read(inode))
+        {
+            ret = assoofs_expand_zero(inode, size);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        else if (inode_info->flags & ASSOOFS_INODE_INLINE)
+        {
+            truncate_setsize(inode, size);
+            memset(inode_info->inline_data + size, 0, ASSOOFS_INLINE_DATA_SIZE - size);
+        }
+        else
+        {
+            ret = assoofs_truncate_blocks(inode, size);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        inode_info->file_size = i_size_read(inode);
+    }
+
+    setattr_copy(mnt_userns, inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/**
+ * @brief fsync de ficheros y directorios. Los metadatos se escriben de forma diferida, así que además de
+ * los datos del fichero y de su inodo hay que llevar a disco los bloques de metadatos sucios del dispositivo
+ * (mapa de bits, tabla de inodos, extents y directorios) y vaciar la caché de escritura del disco.
+ */
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    struct inode *inode = file->f_mapping->host;
+    struct super_block *sb = inode->i_sb;
+    int ret;
+
+    ret = file_write_and_wait_range(file, start, end);
+    if (ret)
+    {
+        return ret;
+    }
+    ret = sync_inode_metadata(inode, 1);
+    if (ret)
+    {
+        return ret;
+    }
+    // Con diario basta con confirmar la transacción en curso (que puede llevar también cambios de otros
+    // ficheros: se confirman en grupo). Sin él se escriben todos los bloques de metadatos sucios
+    if (ASSOOFS_SB(sb)->journal)
+    {
+        ret = jbd2_journal_force_commit(ASSOOFS_SB(sb)->journal);
+    }
+    else
+    {
+        ret = sync_blockdev(sb->s_bdev);
+    }
+    if (ret)
+    {
+        return ret;
+    }
+    return blkdev_issue_flush(sb->s_bdev);
+}
+
+/**
+ * @brief Lectura de un fichero. Con O_DIRECT los datos van del dispositivo al buffer de usuario sin
+ * pasar por la caché de páginas; si no, se usa la caché (generic_file_read_iter)
+ */
+static ssize_t __assoofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    // Un fichero en línea no tiene bloques que leer directamente: sus datos se sirven desde la caché de páginas
+    if (ASSOOFS_INFO(inode)->flags & ASSOOFS_INODE_INLINE)
+    {
+        iocb->ki_flags &= ~IOCB_DIRECT;
+    }
+    if (!(iocb->ki_flags & IOCB_DIRECT))
+    {
+        return generic_file_read_iter(iocb, to);
+    }
+    if (!iov_iter_count(to))
+    {
+        return 0;
+    }
+
+    inode_lock_shared(inode);
+    ret = iomap_dio_rw(iocb, to, &assoofs_iomap_ops, NULL, 0, NULL, 0);
+    inode_unlock_shared(inode);
+    file_accessed(iocb->ki_filp);
+    return ret;
+}
+
+/**
+ * @brief Lectura de un fichero, con su latencia en las estadísticas y en el tracepoint assoofs_read
+ */
+static ssize_t assoofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    uint64_t begin = ktime_get_ns(), ns;
+    ssize_t ret;
+
+    ret = __assoofs_file_read_iter(iocb, to);
+    ns = assoofs_stat_end(inode->i_sb, ASSOOFS_OP_READ, begin);
+    trace_assoofs_read(inode, pos, count, ret, ns);
+    return ret;
+}
+
+/**
+ * @brief Escritura directa (O_DIRECT) con iomap. Las escrituras que amplían el fichero se completan
+ * de forma síncrona para que el nuevo tamaño se guarde antes de volver. Si no se puede invalidar la
+ * caché de páginas del rango (-ENOTBLK) se escribe a través de ella.
+ */
+static ssize_t assoofs_file_dio_write(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    unsigned int dio_flags = 0;
+    loff_t pos = iocb->ki_pos;
+    ssize_t ret;
+
+    ret = file_modified(file);
+    if (ret)
+    {
+        return ret;
+    }
+
+    if (pos + iov_iter_count(from) > i_size_read(inode))
+    {
+        dio_flags |= IOMAP_DIO_FORCE_WAIT;
+    }
+    ret = iomap_dio_rw(iocb, from, &assoofs_iomap_ops, &assoofs_dio_write_ops, dio_flags, NULL, 0);
+    if (ret != -ENOTBLK)
+    {
+        return ret;
+    }
+
+    iocb->ki_flags &= ~IOCB_DIRECT;
+    ret = __generic_file_write_iter(iocb, from);
+    if (ret > 0 && filemap_write_and_wait_range(file->f_mapping, pos, pos + ret - 1))
+    {
+        ret = -EIO;
+    }
+    return ret;
+}
+
+/**
+ * @brief Escritura en un fichero, a través de la caché de páginas (generic_file_write_iter) o directa
+ * con O_DIRECT. Si la escritura empieza más allá del final del fichero, antes se rellena el salto con ceros.
+ */
+static ssize_t __assoofs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    ssize_t ret;
+    int err;
+
+    inode_lock(inode);
+    ret = generic_write_checks(iocb, from);
+    if (ret > 0 && iocb->ki_pos > i_size_read(inode))
+    {
+        err = assoofs_expand_zero(inode, iocb->ki_pos);
+        if (err)
+        {
+            ret = err;
+        }
+    }
+    if (ret > 0)
+    {
+        // Como en la lectura, un fichero en línea se escribe siempre a través de la caché de páginas
+        if (ASSOOFS_INFO(inode)->flags & ASSOOFS_INODE_INLINE)
+        {
+            iocb->ki_flags &= ~IOCB_DIRECT;
+        }
+        if (iocb->ki_flags & IOCB_DIRECT)
+        {
+            ret = assoofs_file_dio_write(iocb, from);
+        }
+        else
+        {
+            ret = __generic_file_write_iter(iocb, from);
+        }
+    }
+    inode_unlock(inode);
+
+    if (ret > 0)
+    {
+        ret = generic_write_sync(iocb, ret);
+    }
+    return ret;
+}
+
+/**
+ * @brief Escritura en un fichero, con su latencia en las estadísticas y en el tracepoint assoofs_write
+ */
+static ssize_t assoofs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    uint64_t begin = ktime_get_ns(), ns;
+    ssize_t ret;
+
+    ret = __assoofs_file_write_iter(iocb, from);
+    ns = assoofs_stat_end(inode->i_sb, ASSOOFS_OP_WRITE, begin);
+    trace_assoofs_write(inode, pos, count, ret, ns);
+    return ret;
+}
+
+/*
+ *  Entradas de directorio e índice hash
+ */
+
+// Entrada viva de una hoja, usada para ordenarlas por hash al dividirla
+struct assoofs_dir_sort_entry
+{
+    uint32_t hash;
+    uint16_t offset;
+    uint16_t size;
+};
+
+/**
+ * @brief Tipo de fichero que se guarda en la entrada de directorio según el modo del inodo
+ */
+static inline uint8_t assoofs_file_type(mode_t mode)
+{
+    if (S_ISDIR(mode))
+        return ASSOOFS_FT_DIR;
+    if (S_ISREG(mode))
+        return ASSOOFS_FT_REG;
+    return ASSOOFS_FT_UNKNOWN;
+}
+
+/**
+ * @brief Comprueba que una entrada leída de disco está dentro del bloque (de size bytes) y es coherente
+ */
+static bool assoofs_dir_entry_valid(struct assoofs_dir_entry *de, unsigned int offset, unsigned int size)
+{
+    if (de->rec_len < ASSOOFS_DIR_ENTRY_SIZE(0) || (de->rec_len & 7) || offset + de->rec_len > size)
+    {
+        printk(KERN_ERR "Corrupted directory entry at offset %u\n", offset);
+        return false;
+    }
+    return !de->inode_no || ASSOOFS_DIR_ENTRY_SIZE(de->name_len) <= de->rec_len;
+}
+
+/**
+ * @brief Deja un bloque de directorio (de size bytes) vacío: una única entrada libre que lo ocupa entero
+ */
+static void assoofs_dir_init_block(char *data, unsigned int size)
+{
+    memset(data, 0, size);
+    ((struct assoofs_dir_entry *)data)->rec_len = size;
+}
+
+/**
+ * @brief Indica si la entrada de directorio de corresponde con el nombre (y su hash)
+ */
+static inline bool assoofs_dir_match(struct assoofs_dir_entry *de, const struct qstr *name, uint32_t hash)
+{
+    return de->inode_no && de->hash == hash && de->name_len == name->len && !memcmp(de->name, name->name, name->len);
+}
+
+/*
+ *  Operaciones sobre un bloque de entradas ya en memoria (un bloque del directorio o el contenido de un
+ *  directorio en línea). Solo recorren y modifican las entradas: pedir acceso al diario y bloquear el
+ *  buffer antes de modificarlas es cosa de quien las llama
+ */
+
+/**
+ * @brief Busca en un bloque de entradas la entrada en uso con ese nombre (y su hash)
+ *
+ * @param data entradas del bloque
+ * @param size bytes del bloque
+ * @param name nombre buscado
+ * @param hash hash del nombre
+ * @param prev si no es NULL, entrada anterior a la encontrada (NULL si es la primera del bloque)
+ * @return struct assoofs_dir_entry* entrada encontrada, NULL si no está o el bloque está corrupto
+ */
+static struct assoofs_dir_entry *assoofs_dir_block_find(char *data, unsigned int size, const struct qstr *name, uint32_t hash, struct assoofs_dir_entry **prev)
+{
+    struct assoofs_dir_entry *de, *last = NULL;
+    unsigned int offset;
+
+    for (offset = 0; offset < size; offset += de->rec_len)
+    {
+        de = (struct assoofs_dir_entry *)(data + offset);
+        if (!assoofs_dir_entry_valid(de, offset, size))
+        {
+            break;
+        }
+        if (assoofs_dir_match(de, name, hash))
+        {
+            if (prev)
+            {
+                *prev = last;
+            }
+            return de;
+        }
+        last = de;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Busca en un bloque de entradas sitio para una entrada de needed bytes: una entrada libre o el
+ * espacio que sobra al final de una en uso
+ *
+ * @return struct assoofs_dir_entry* entrada con sitio, NULL si no cabe o ERR_PTR(-EIO) si el bloque está corrupto
+ */
+static struct assoofs_dir_entry *assoofs_dir_block_space(char *data, unsigned int size, unsigned int needed)
+{
+    struct assoofs_dir_entry *de;
+    unsigned int offset, used;
+
+    for (offset = 0; offset < size; offset += de->rec_len)
+    {
+        de = (struct assoofs_dir_entry *)(data + offset);
+        if (!assoofs_dir_entry_valid(de, offset, size))
+        {
+            return ERR_PTR(-EIO);
+        }
+        used = de->inode_no ? ASSOOFS_DIR_ENTRY_SIZE(de->name_len) : 0;
+        if (de->rec_len - used >= needed)
+        {
+            return de;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Escribe una entrada nueva en el sitio que encontró assoofs_dir_block_space: si de está en uso,
+ * la entrada nueva ocupa lo que le sobra
+ */
+static void assoofs_dir_block_fill(struct assoofs_dir_entry *de, const struct qstr *name, uint64_t inode_no, uint8_t file_type, uint32_t hash)
+{
+    struct assoofs_dir_entry *new;
+    unsigned int used = de->inode_no ? ASSOOFS_DIR_ENTRY_SIZE(de->name_len) : 0;
+
+    if (used)
+    {
+        new = (struct assoofs_dir_entry *)((char *)de + used);
+        new->rec_len = de->rec_len - used;
+        de->rec_len = used;
+        de = new;
+    }
+    de->inode_no = inode_no;
+    de->name_len = name->len;
+    de->file_type = file_type;
+    de->hash = hash;
+    memcpy(de->name, name->name, name->len);
+}
+
+/**
+ * @brief Quita una entrada de su bloque: su espacio pasa a la entrada anterior o, si es la primera
+ * (prev NULL), queda como entrada libre
+ */
+static void assoofs_dir_block_remove(struct assoofs_dir_entry *de, struct assoofs_dir_entry *prev)
+{
+    if (prev)
+    {
+        prev->rec_len += de->rec_len;
+    }
+    else
+    {
+        de->inode_no = 0;
+    }
+}
+
+/**
+ * @brief Lee el bloque lógico lblk de un directorio
+ */
+static struct buffer_head *assoofs_dir_bread(struct super_block *sb, struct assoofs_inode_info *dir_info, uint64_t lblk)
+{
+    uint64_t block = assoofs_bmap(sb, dir_info, lblk);
+
+    if (!block)
+    {
+        printk(KERN_ERR "Block %llu of directory %llu is not mapped\n", lblk, dir_info->inode_no);
+        return NULL;
+    }
+    return assoofs_bread(sb, block);
+}
+
+// Bloque de entradas de un directorio: un bloque del dispositivo o, si el directorio está en línea,
+// el contenido del propio inodo (bh a NULL)
+struct assoofs_dir_block
+{
+    struct buffer_head *bh;
+    char *data;
+    unsigned int size;
+};
+
+/**
+ * @brief Obtiene el bloque de entradas lblk de un directorio; se libera con assoofs_dir_put_block
+ */
+static int assoofs_dir_get_block(struct super_block *sb, struct assoofs_inode_info *dir_info, uint64_t lblk, struct assoofs_dir_block *db)
+{
+    if (dir_info->flags & ASSOOFS_INODE_INLINE)
+    {
+        db->bh = NULL;
+        db->data = dir_info->inline_data;
+        db->size = ASSOOFS_INLINE_DATA_SIZE;
+        return 0;
+    }
+    db->bh = assoofs_dir_bread(sb, dir_info, lblk);
+    if (!db->bh)
+    {
+        return -EIO;
+    }
+    db->data = db->bh->b_data;
+    db->size = sb->s_blocksize;
+    return 0;
+}
+
+static inline void assoofs_dir_put_block(struct assoofs_dir_block *db)
+{
+    brelse(db->bh);
+}
+
+/**
+ * @brief Pide acceso para modificar un bloque de entradas y lo bloquea. Las entradas en línea no necesitan
+ * cerrojo propio: solo se modifican con el i_rwsem del directorio cogido en exclusiva
+ */
+static int assoofs_dir_begin_change(struct assoofs_dir_block *db)
+{
+    if (!db->bh)
+    {
+        return 0;
+    }
+    if (assoofs_journal_get_access(db->bh))
+    {
+        return -EIO;
+    }
+    lock_buffer(db->bh);
+    return 0;
+}
+
+/**
+ * @brief Termina la modificación de un bloque de entradas: se marca sucio el buffer o, si las entradas
+ * están en línea, se guarda la información persistente del directorio
+ */
+static void assoofs_dir_end_change(struct super_block *sb, struct assoofs_inode_info *dir_info, struct assoofs_dir_block *db)
+{
+    if (!db->bh)
+    {
+        assoofs_save_inode_info(sb, dir_info);
+        return;
+    }
+    unlock_buffer(db->bh);
+    assoofs_journal_dirty(db->bh);
+}
+
+/**
+ * @brief Posición (búsqueda binaria) de la última entrada del índice cuyo hash es <= hash
+ */
+static int assoofs_dir_index_search(struct assoofs_dir_index_header *hdr, uint32_t hash)
+{
+    struct assoofs_dir_index_entry *entries = (struct assoofs_dir_index_entry *)(hdr + 1);
+    int lo = 0, hi = hdr->count - 1, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (entries[mid].hash <= hash)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/**
+ * @brief Cabecera del índice de un bloque: al principio en la raíz y detrás de la entrada libre en los nodos
+ */
+static inline struct assoofs_dir_index_header *assoofs_dir_index(struct buffer_head *bh, bool node)
+{
+    return (struct assoofs_dir_index_header *)(bh->b_data + (node ? ASSOOFS_DIR_NODE_OFFSET : 0));
+}
+
+static inline struct assoofs_dir_index_entry *assoofs_dir_index_entries(struct assoofs_dir_index_header *hdr)
+{
+    return (struct assoofs_dir_index_entry *)(hdr + 1);
+}
+
+// Bloques de directorio que se piden por adelantado al listar
+#define ASSOOFS_DIR_READAHEAD 16
+
+/**
+ * @brief Pide por adelantado (sin esperar) los bloques lógicos [lblk, lblk + count) de un directorio.
+ * Los tramos contiguos del mapa de extents se recorren de una vez
+ */
+static void assoofs_dir_readahead(struct super_block *sb, struct assoofs_inode_info *dir_info, uint64_t lblk, uint64_t count)
+{
+    uint64_t end = min(lblk + count, dir_info->blocks);
+    uint64_t block, len, i;
+
+    while (lblk < end)
+    {
+        if (assoofs_extent_lookup(sb, dir_info, lblk, &block, &len))
+        {
+            return;
+        }
+        len = min(len, end - lblk);
+        for (i = 0; i < len; i++)
+        {
+            assoofs_breadahead(sb, block + i);
+        }
+        lblk += len;
+    }
+}
+
+// Un hash más que el mayor posible: cota superior de la última hoja
+#define ASSOOFS_DIR_HASH_END (1ULL << 32)
+
+/**
+ * @brief Recorre el índice de un directorio hasta la hoja que cubre un hash. En un directorio lineal es
+ * siempre el bloque 0; en uno indexado se consulta el índice del bloque 0 y, si tiene nodos intermedios,
+ * el nodo que cubre ese hash.
+ *
+ * @param sb superbloque al que pertenece el directorio
+ * @param dir_info información persistente del directorio
+ * @param hash hash buscado
+ * @param lblk bloque lógico de la hoja
+ * @param next si no es NULL, menor hash de la hoja siguiente (ASSOOFS_DIR_HASH_END si es la última)
+ * @param ra hojas siguientes a la encontrada que se piden por adelantado
+ * @return int 0 si todo fue correcto, -EIO si el índice está dañado
+ */
+static int assoofs_dir_walk(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t hash, uint64_t *lblk, uint64_t *next, unsigned int ra)
+{
+    struct buffer_head *bh;
+    struct assoofs_dir_index_header *hdr;
+    struct assoofs_dir_index_entry *entries;
+    uint32_t level, levels = 0, i, pos;
+    uint64_t bound = ASSOOFS_DIR_HASH_END;
+
+    *lblk = 0;
+    if (!(dir_info->flags & ASSOOFS_INODE_INDEXED))
+    {
+        if (next)
+        {
+            *next = bound;
+        }
+        return 0;
+    }
+
+    for (level = 0; level <= levels; level++)
+    {
+        bh = assoofs_dir_bread(sb, dir_info, *lblk);
+        if (!bh)
+        {
+            return -EIO;
+        }
+        hdr = assoofs_dir_index(bh, level > 0);
+        if (level == 0)
+        {
+            levels = hdr->levels;
+        }
+        if (hdr->magic != ASSOOFS_DIR_INDEX_MAGIC || hdr->count == 0 || levels > ASSOOFS_DIR_INDEX_MAX_LEVELS)
+        {
+            printk(KERN_ERR "Corrupted index in directory %llu\n", dir_info->inode_no);
+            brelse(bh);
+            return -EIO;
+        }
+        entries = assoofs_dir_index_entries(hdr);
+        pos = assoofs_dir_index_search(hdr, hash);
+        *lblk = entries[pos].block;
+        // Los rangos de cada nivel están dentro del de su padre: la cota es la menor de todas
+        if (pos + 1 < hdr->count)
+        {
+            bound = min_t(uint64_t, bound, entries[pos + 1].hash);
+        }
+        if (level == levels)
+        {
+            for (i = pos + 1; i < hdr->count && i <= pos + ra; i++)
+            {
+                assoofs_dir_readahead(sb, dir_info, entries[i].block, 1);
+            }
+        }
+        brelse(bh);
+    }
+
+    if (next)
+    {
+        if (bound <= hash)
+        {
+            printk(KERN_ERR "Corrupted index in directory %llu\n", dir_info->inode_no);
+            return -EIO;
+        }
+        *next = bound;
+    }
+    return 0;
+}
+
+/**
+ * @brief Calcula el bloque lógico del directorio donde está (o debe ir) un nombre con ese hash
+ */
+static inline int assoofs_dir_leaf(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t hash, uint64_t *lblk)
+{
+    return assoofs_dir_walk(sb, dir_info, hash, lblk, NULL, 0);
+}
+
+/**
+ * @brief Busca una entrada en uso por su nombre. Solo se lee la hoja que corresponde al hash
+ * del nombre y solo se comparan los nombres de las entradas que tienen ese mismo hash.
+ *
+ * @param sb superbloque al que pertenece el directorio
+ * @param dir_info información persistente del directorio
+ * @param name nombre buscado
+ * @param db bloque que contiene la entrada; el llamante debe liberarlo con assoofs_dir_put_block
+ * @return struct assoofs_dir_entry* entrada dentro de db, NULL si no existe
  */
-int assoofs_destroy_inode(struct inode *inode);
-static int assoofs_remove(struct inode *dir, struct dentry *dentry);
-void assoofs_set_a_freeblock(struct assoofs_super_block_info *sb_info, uint64_t data_block_number);
-static int assoofs_move_file(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int excl);
+static struct assoofs_dir_entry *assoofs_dir_find_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const struct qstr *name, struct assoofs_dir_block *db)
+{
+    struct assoofs_dir_entry *de;
+    uint32_t hash = assoofs_name_hash(name->name, name->len);
+    uint64_t lblk;
+
+    if (name->len > ASSOOFS_FILENAME_MAXLEN || assoofs_dir_leaf(sb, dir_info, hash, &lblk))
+    {
+        return NULL;
+    }
+
+    if (assoofs_dir_get_block(sb, dir_info, lblk, db))
+    {
+        return NULL;
+    }
+
+    de = assoofs_dir_block_find(db->data, db->size, name, hash, NULL);
+    if (!de)
+    {
+        assoofs_dir_put_block(db);
+    }
+    return de;
+}
 
 /**
- * @brief Actualiza la información persistente del superbloque.
- * Es conveniente llamar a esta función cuando se produzcan cambios en el superbloque
- * 
+ * @brief Añade un bloque nuevo y vacío al final de un directorio
  */
-void assoofs_save_sb_info(struct super_block *vsb)
+static int assoofs_dir_new_block(struct super_block *sb, struct assoofs_inode_info *dir_info, uint64_t *lblk)
 {
     struct buffer_head *bh;
-    struct assoofs_super_block_info *sb;
-
-    printk(KERN_INFO "assoofs_save_sb_info request\n");
+    int ret;
 
-    sb = vsb->s_fs_info; // Información persistente del superbloque en memoria
-    bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-    bh->b_data = (char *)sb; // Sobreescribimos los datos de disco con la información en memoria
+    *lblk = dir_info->blocks;
+    ret = assoofs_extent_grow(sb, dir_info, *lblk);
+    if (ret)
+    {
+        return ret;
+    }
 
-    // Para que el cambio pase a disco, marcamos como sucio y sincronizamos:
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    bh = assoofs_dir_bread(sb, dir_info, *lblk);
+    if (!bh)
+    {
+        return -EIO;
+    }
+    ret = assoofs_journal_get_access(bh);
+    if (!ret)
+    {
+        lock_buffer(bh);
+        assoofs_dir_init_block(bh->b_data, sb->s_blocksize);
+        unlock_buffer(bh);
+        ret = assoofs_journal_dirty(bh);
+    }
     brelse(bh);
+    return ret;
 }
 
 /**
- * @brief Gives a free block to the given inode and updates the superblock info
- *
+ * @brief Convierte un directorio lineal en indexado: las entradas del bloque 0 pasan a una hoja
+ * nueva y el bloque 0 se reescribe como índice con una única entrada (hash 0 -> hoja)
  */
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block)
+static int assoofs_dir_make_indexed(struct super_block *sb, struct assoofs_inode_info *dir_info)
 {
-    int i;
-    struct assoofs_super_block_info *assoofs_sb;
-    // Información persistente del superbloque (campo s_fs_info)
+    struct buffer_head *root_bh, *leaf_bh;
+    struct assoofs_dir_index_header *hdr;
+    struct assoofs_dir_index_entry *entries;
+    uint64_t leaf;
+    int ret;
 
-    printk(KERN_INFO "assoofs_sb_get_a_freeblock request\n");
+    trace_assoofs_dir_make_indexed(sb, dir_info->inode_no, dir_info->blocks);
 
-    // Extra: como vamos a utilizar el superbloque para buscar bloques libres,
-    // necesitamos el mutex del superbloque
+    ret = assoofs_dir_new_block(sb, dir_info, &leaf);
+    if (ret)
+    {
+        return ret;
+    }
 
-    if (mutex_lock_interruptible(&assoofs_sb_lock))
+    root_bh = assoofs_dir_bread(sb, dir_info, 0);
+    leaf_bh = assoofs_dir_bread(sb, dir_info, leaf);
+    if (!root_bh || !leaf_bh || assoofs_journal_get_access(root_bh) || assoofs_journal_get_access(leaf_bh))
     {
-        // Al mutex le llegó una señal
-        printk(KERN_ERR "Signal arrived while waiting to get the sb mutex\n");
-        return -EINTR; // EINTR es la valor de que llego una señal mientras la llamada estaba en proceso
+        brelse(root_bh);
+        brelse(leaf_bh);
+        return -EIO;
     }
 
-    assoofs_sb = sb->s_fs_info;
+    lock_buffer(leaf_bh);
+    memcpy(leaf_bh->b_data, root_bh->b_data, sb->s_blocksize);
+    unlock_buffer(leaf_bh);
+    ret = assoofs_journal_dirty(leaf_bh);
+    brelse(leaf_bh);
+    if (ret)
+    {
+        brelse(root_bh);
+        return ret;
+    }
 
-    // Recorremos en busca de un bloque libre:
-    for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
+    lock_buffer(root_bh);
+    memset(root_bh->b_data, 0, sb->s_blocksize);
+    hdr = assoofs_dir_index(root_bh, false);
+    hdr->magic = ASSOOFS_DIR_INDEX_MAGIC;
+    hdr->count = 1;
+    hdr->limit = (sb->s_blocksize - sizeof(*hdr)) / sizeof(*entries);
+    hdr->levels = 0;
+    entries = assoofs_dir_index_entries(hdr);
+    entries[0].hash = 0;
+    entries[0].block = leaf;
+    unlock_buffer(root_bh);
+    ret = assoofs_journal_dirty(root_bh);
+    brelse(root_bh);
+    if (ret)
     {
-        if (assoofs_sb->free_blocks & (1 << i))
-        {
-            break;
-            // Cuando aparece el primer bit 1 en free_block paramos, porque i tendrá la posición del primer bloque libre
-        }
+        return ret;
     }
-    *block = i; // Guardamos el valor del bloque que se ocupará
 
-    // Actualizamos free_blocks
-    assoofs_sb->free_blocks &= ~(1 << i);
-    assoofs_save_sb_info(sb);
+    dir_info->flags |= ASSOOFS_INODE_INDEXED;
+    return 0;
+}
 
-    // Liberamos el mutex
-    mutex_unlock(&assoofs_sb_lock);
+/**
+ * @brief Inserta (hash, block) en un bloque del índice justo detrás de la entrada que cubre after.
+ * El llamante ya ha pedido acceso al buffer y comprobado que hay hueco
+ */
+static void assoofs_dir_index_add(struct assoofs_dir_index_header *hdr, uint32_t after, uint32_t hash, uint64_t block)
+{
+    struct assoofs_dir_index_entry *entries = assoofs_dir_index_entries(hdr);
+    int pos = assoofs_dir_index_search(hdr, after) + 1;
 
-    return 0; // Todo ha ido bien
+    memmove(&entries[pos + 1], &entries[pos], (hdr->count - pos) * sizeof(*entries));
+    entries[pos].hash = hash;
+    entries[pos].block = block;
+    hdr->count++;
 }
 
 /**
- * @brief Guarda en disco la información persistente de un nuevo inodo (assoofs_inode_info) 
- * 
- * @param sb superbloque al que pertenece el inodo
- * @param inode inodo a guardar
+ * @brief Crea un nodo intermedio del índice con las entradas entries[0, count)
+ *
+ * @param lblk bloque lógico del nodo nuevo
  */
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode)
+static int assoofs_dir_new_node(struct super_block *sb, struct assoofs_inode_info *dir_info, struct assoofs_dir_index_entry *entries, int count, uint64_t *lblk)
 {
-    struct assoofs_super_block_info *assoofs_sb;
-    struct assoofs_inode_info *inode_info;
+    struct assoofs_dir_index_header *hdr;
     struct buffer_head *bh;
+    int ret;
+
+    // assoofs_dir_new_block ya deja la entrada libre que ocupa todo el bloque
+    ret = assoofs_dir_new_block(sb, dir_info, lblk);
+    if (ret)
+    {
+        return ret;
+    }
+    bh = assoofs_dir_bread(sb, dir_info, *lblk);
+    if (!bh || assoofs_journal_get_access(bh))
+    {
+        brelse(bh);
+        return -EIO;
+    }
+
+    lock_buffer(bh);
+    hdr = assoofs_dir_index(bh, true);
+    hdr->magic = ASSOOFS_DIR_INDEX_MAGIC;
+    hdr->count = count;
+    hdr->limit = (sb->s_blocksize - ASSOOFS_DIR_NODE_OFFSET - sizeof(*hdr)) / sizeof(*entries);
+    hdr->levels = 0;
+    memcpy(assoofs_dir_index_entries(hdr), entries, count * sizeof(*entries));
+    unlock_buffer(bh);
+    ret = assoofs_journal_dirty(bh);
+    brelse(bh);
+    return ret;
+}
 
-    printk(KERN_INFO "assoofs_add_inode_info request\n");
+/**
+ * @brief La raíz del índice está llena: sus entradas se reparten entre dos nodos intermedios nuevos
+ * y la raíz pasa a apuntar a ellos (un nivel más)
+ */
+static int assoofs_dir_index_grow(struct super_block *sb, struct assoofs_inode_info *dir_info, struct buffer_head *root_bh)
+{
+    struct assoofs_dir_index_header *root = assoofs_dir_index(root_bh, false);
+    struct assoofs_dir_index_entry *entries = assoofs_dir_index_entries(root);
+    int mid = root->count / 2;
+    uint64_t left, right;
+    int ret;
 
-    // Acceder a la información persistente del superbloque para obtener el contador de inodos:
-    assoofs_sb = sb->s_fs_info;
+    trace_assoofs_dir_index_grow(sb, dir_info->inode_no, dir_info->blocks);
 
-    // Leer de disco el bloque que contiene el almacén de inodos:
-    // Extra: para ello necesitamos el mutex correspondiente:
-    if (mutex_lock_interruptible(&assoofs_inodes_lock))
+    ret = assoofs_dir_new_node(sb, dir_info, entries, mid, &left);
+    if (!ret)
     {
-        // Al mutex le llegó una señal
-        printk(KERN_ERR "Signal arrived while waiting to get the inodes mutex\n");
-        return;
+        ret = assoofs_dir_new_node(sb, dir_info, &entries[mid], root->count - mid, &right);
+    }
+    if (ret || assoofs_journal_get_access(root_bh))
+    {
+        return ret ? ret : -EIO;
     }
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
 
-    // Obtener un puntero al final del almacén y escribir un nuevo valor al final
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
-    inode_info += assoofs_sb->inodes_count;
-    memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
+    lock_buffer(root_bh);
+    entries[1].hash = entries[mid].hash;
+    entries[1].block = right;
+    entries[0].hash = 0;
+    entries[0].block = left;
+    root->count = 2;
+    root->levels = 1;
+    unlock_buffer(root_bh);
+    return assoofs_journal_dirty(root_bh);
+}
 
-    // Marcar el bloque como sucio y sincronizar
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+/**
+ * @brief Añade al índice la hoja new_lblk (nombres con hash >= new_hash) justo detrás de la hoja que
+ * contiene old_hash. Si se llena la raíz, el índice crece un nivel; si se llena un nodo intermedio,
+ * se divide en dos y el nuevo entra en la raíz.
+ *
+ * @param sb superbloque al que pertenece el directorio
+ * @param dir_info información persistente del directorio
+ * @param old_hash un hash de la hoja que se ha dividido
+ * @param new_hash menor hash de la hoja nueva
+ * @param new_lblk bloque lógico de la hoja nueva
+ * @return int 0 si todo fue correcto, -ENOSPC si el índice no admite más hojas
+ */
+static int assoofs_dir_index_insert(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t old_hash, uint32_t new_hash, uint64_t new_lblk)
+{
+    struct buffer_head *root_bh, *node_bh = NULL;
+    struct assoofs_dir_index_header *root, *node;
+    struct assoofs_dir_index_entry *entries;
+    uint64_t node_lblk;
+    int mid, ret = 0;
+
+    root_bh = assoofs_dir_bread(sb, dir_info, 0);
+    if (!root_bh)
+    {
+        return -EIO;
+    }
+    root = assoofs_dir_index(root_bh, false);
 
-    // Liberar bh
-    brelse(bh);
+    if (root->levels == 0)
+    {
+        if (root->count < root->limit)
+        {
+            if (assoofs_journal_get_access(root_bh))
+            {
+                ret = -EIO;
+                goto out;
+            }
+            lock_buffer(root_bh);
+            assoofs_dir_index_add(root, old_hash, new_hash, new_lblk);
+            unlock_buffer(root_bh);
+            ret = assoofs_journal_dirty(root_bh);
+            goto out;
+        }
+        ret = assoofs_dir_index_grow(sb, dir_info, root_bh);
+        if (ret)
+        {
+            goto out;
+        }
+    }
 
-    // Actualizar el contador de inodos de la información persistente del superbloque y guardar los cambios:
-    // Extra para ello necesito el mutex del superbloque
-    if (mutex_lock_interruptible(&assoofs_sb_lock))
+    node_lblk = assoofs_dir_index_entries(root)[assoofs_dir_index_search(root, old_hash)].block;
+    node_bh = assoofs_dir_bread(sb, dir_info, node_lblk);
+    if (!node_bh)
     {
-        // Al mutex le llegó una señal
-        printk(KERN_ERR "Signal arrived while waiting to get the sb mutex\n");
-        return;
+        ret = -EIO;
+        goto out;
+    }
+    node = assoofs_dir_index(node_bh, true);
+
+    if (node->count >= node->limit)
+    {
+        if (root->count >= root->limit)
+        {
+            printk(KERN_ERR "Index of directory %llu is full\n", dir_info->inode_no);
+            ret = -ENOSPC;
+            goto out;
+        }
+
+        // La mitad superior del nodo pasa a un nodo nuevo, que entra en la raíz detrás de él
+        entries = assoofs_dir_index_entries(node);
+        mid = node->count / 2;
+        ret = assoofs_dir_new_node(sb, dir_info, &entries[mid], node->count - mid, &node_lblk);
+        if (ret || assoofs_journal_get_access(node_bh) || assoofs_journal_get_access(root_bh))
+        {
+            ret = ret ? ret : -EIO;
+            goto out;
+        }
+        lock_buffer(root_bh);
+        assoofs_dir_index_add(root, entries[0].hash, entries[mid].hash, node_lblk);
+        unlock_buffer(root_bh);
+        ret = assoofs_journal_dirty(root_bh);
+        if (ret)
+        {
+            goto out;
+        }
+        lock_buffer(node_bh);
+        node->count = mid;
+        unlock_buffer(node_bh);
+        ret = assoofs_journal_dirty(node_bh);
+        if (ret)
+        {
+            goto out;
+        }
+
+        if (old_hash >= entries[mid].hash)
+        {
+            brelse(node_bh);
+            node_bh = assoofs_dir_bread(sb, dir_info, node_lblk);
+            if (!node_bh)
+            {
+                ret = -EIO;
+                goto out;
+            }
+            node = assoofs_dir_index(node_bh, true);
+        }
     }
-    assoofs_sb->inodes_count++;
-    assoofs_save_sb_info(sb);
 
-    // Extra: libero ambos mutex
-    mutex_unlock(&assoofs_sb_lock);
-    mutex_unlock(&assoofs_inodes_lock);
+    if (assoofs_journal_get_access(node_bh))
+    {
+        ret = -EIO;
+        goto out;
+    }
+    lock_buffer(node_bh);
+    assoofs_dir_index_add(node, old_hash, new_hash, new_lblk);
+    unlock_buffer(node_bh);
+    ret = assoofs_journal_dirty(node_bh);
+
+out:
+    brelse(node_bh);
+    brelse(root_bh);
+    return ret;
 }
 
 /**
- * @brief Obtiene un puntero a la información persistente (disco) de un inodo concreto (assoofs_inode_info)
- * 
- * @param sb superbloque al que pertenece el inodo
- * @param start inodo donde comenzar la búsqueda
- * @param search inodo buscado
- * @return struct assoofs_inode_info* inodo buscado, NULL si no se encuentra
+ * @brief Orden de las entradas por hash y, con el mismo hash, por posición en el bloque. Así las entradas
+ * que comparten hash conservan su orden relativo al repartirse una hoja y el listado puede contarlas
  */
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search)
+static int assoofs_dir_cmp_hash(const void *a, const void *b)
 {
-    uint64_t count = 0;
-    printk(KERN_INFO "assoofs_search_inode_info request\n");
-    /*Recorremos el almacén de inodos desde start (principio del almacén)
-    hasta encontrar los datos del inodo "search" o hasta el final del almacén
-    */
-    while (start->inode_no != search->inode_no && count < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count)
+    const struct assoofs_dir_sort_entry *ea = a, *eb = b;
+
+    if (ea->hash != eb->hash)
     {
-        count++;
-        start++;
+        return ea->hash < eb->hash ? -1 : 1;
     }
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+/**
+ * @brief Escribe de forma compacta en dst las entradas map[from, to) copiadas de src.
+ * La última entrada se alarga hasta el final del bloque.
+ */
+static void assoofs_dir_pack(struct super_block *sb, char *dst, const char *src, struct assoofs_dir_sort_entry *map, int from, int to)
+{
+    struct assoofs_dir_entry *de = NULL;
+    unsigned int offset = 0;
+    int i;
 
-    if (start->inode_no == search->inode_no)
+    assoofs_dir_init_block(dst, sb->s_blocksize);
+    for (i = from; i < to; i++)
     {
-        return start;
+        de = (struct assoofs_dir_entry *)(dst + offset);
+        memcpy(de, src + map[i].offset, map[i].size);
+        de->rec_len = map[i].size;
+        offset += map[i].size;
     }
-    else
+    if (de)
     {
-        return NULL;
+        de->rec_len += sb->s_blocksize - offset;
     }
 }
 
 /**
- * @brief Actualiza la información persistente (disco) de un inodo (ya creado)
- * 
- * @param sb superbloque al que pertenece el inodo
- * @param inode_info información persistente a guardar
+ * @brief Divide una hoja de un directorio indexado en la que no cabe un nombre: ordena sus entradas
+ * por hash, mueve la mitad superior (en bytes) a una hoja nueva y la añade al índice. Las entradas con
+ * el mismo hash nunca se reparten entre dos hojas, así que una búsqueda siempre mira una sola hoja.
+ *
+ * @param sb superbloque al que pertenece el directorio
+ * @param dir_info información persistente del directorio
+ * @param hash hash del nombre que se quiere insertar
+ * @param lblk hoja a dividir; a la salida, hoja donde debe ir el nombre con hash hash
  * @return int 0 si todo fue correcto, otro valor en caso contrario
  */
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info)
+static int assoofs_dir_split_leaf(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t hash, uint64_t *lblk)
 {
-    struct buffer_head *bh;
-    struct assoofs_inode_info *inode_pos;
+    struct buffer_head *leaf_bh = NULL, *new_bh = NULL;
+    struct assoofs_dir_sort_entry *map = NULL;
+    struct assoofs_dir_entry *de;
+    char *copy = NULL;
+    unsigned int offset, total = 0, acc = 0;
+    uint64_t new_lblk;
+    int n = 0, mid, pos, ret;
+
+    leaf_bh = assoofs_dir_bread(sb, dir_info, *lblk);
+    copy = kmalloc(sb->s_blocksize, GFP_NOFS);
+    map = kmalloc_array(sb->s_blocksize / ASSOOFS_DIR_ENTRY_SIZE(0), sizeof(*map), GFP_NOFS);
+    if (!leaf_bh || !copy || !map)
+    {
+        ret = leaf_bh ? -ENOMEM : -EIO;
+        goto out;
+    }
 
-    printk(KERN_INFO "assoofs_save_inode_info request\n");
+    // Trabajamos sobre una copia de la hoja con sus entradas vivas ordenadas por hash
+    memcpy(copy, leaf_bh->b_data, sb->s_blocksize);
+    for (offset = 0; offset < sb->s_blocksize; offset += de->rec_len)
+    {
+        de = (struct assoofs_dir_entry *)(copy + offset);
+        if (!assoofs_dir_entry_valid(de, offset, sb->s_blocksize))
+        {
+            ret = -EIO;
+            goto out;
+        }
+        if (de->inode_no)
+        {
+            map[n].hash = de->hash;
+            map[n].offset = offset;
+            map[n].size = ASSOOFS_DIR_ENTRY_SIZE(de->name_len);
+            total += map[n].size;
+            n++;
+        }
+    }
+    sort(map, n, sizeof(*map), assoofs_dir_cmp_hash, NULL);
 
-    // Obtener de disco el almacén de inodos (leer)
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    // Punto de corte: la mitad de los bytes, desplazado para no separar entradas con el mismo hash
+    for (mid = 0; mid < n && acc < total / 2; mid++)
+    {
+        acc += map[mid].size;
+    }
+    if (mid == 0)
+    {
+        mid = 1;
+    }
+    pos = mid;
+    while (mid < n && map[mid].hash == map[mid - 1].hash)
+    {
+        mid++;
+    }
+    if (mid == n)
+    {
+        mid = pos;
+        while (mid > 0 && map[mid].hash == map[mid - 1].hash)
+        {
+            mid--;
+        }
+    }
+    if (mid == 0 || mid == n)
+    {
+        printk(KERN_ERR "Too many names with the same hash in directory %llu\n", dir_info->inode_no);
+        ret = -ENOSPC;
+        goto out;
+    }
 
-    // Buscar los datos de inode_info en el almacén con una función auxiliar:
-    inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
+    ret = assoofs_dir_new_block(sb, dir_info, &new_lblk);
+    if (ret)
+    {
+        goto out;
+    }
+    new_bh = assoofs_dir_bread(sb, dir_info, new_lblk);
+    if (!new_bh || assoofs_journal_get_access(new_bh) || assoofs_journal_get_access(leaf_bh))
+    {
+        ret = -EIO;
+        goto out;
+    }
 
-    // Actualizar el inodo, marcar el bloque como sucio y sincronizar
-    // Extra: para ello necesitamos el mutex del superbloque
-    if (mutex_lock_interruptible(&assoofs_sb_lock))
+    // La hoja nueva entra en el índice justo detrás de la que se divide. Se hace antes de repartir
+    // las entradas: si el índice está lleno la hoja se queda como estaba
+    ret = assoofs_dir_index_insert(sb, dir_info, map[0].hash, map[mid].hash, new_lblk);
+    if (ret)
     {
-        // Al mutex le llegó una señal
-        printk(KERN_ERR "Signal arrived while waiting to get the sb mutex\n");
-        return -EINTR; // EINTR es la valor de que llego una señal mientras la llamada estaba en proceso
+        goto out;
     }
-    memcpy(inode_pos, inode_info, sizeof(*inode_pos));
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
 
-    // Extra: liberamos el mutex
-    mutex_unlock(&assoofs_sb_lock);
+    lock_buffer(leaf_bh);
+    assoofs_dir_pack(sb, leaf_bh->b_data, copy, map, 0, mid);
+    unlock_buffer(leaf_bh);
+    lock_buffer(new_bh);
+    assoofs_dir_pack(sb, new_bh->b_data, copy, map, mid, n);
+    unlock_buffer(new_bh);
 
-    // Liberar bh
-    brelse(bh);
+    ret = assoofs_journal_dirty(new_bh);
+    if (!ret)
+    {
+        ret = assoofs_journal_dirty(leaf_bh);
+    }
+    if (ret)
+    {
+        goto out;
+    }
+
+    if (hash >= map[mid].hash)
+    {
+        *lblk = new_lblk;
+    }
+    ret = 0;
+
+out:
+    kfree(map);
+    kfree(copy);
+    brelse(new_bh);
+    brelse(leaf_bh);
+    return ret;
+}
+
+/**
+ * @brief Inserta una entrada en un bloque de directorio si hay hueco: reutiliza una entrada libre
+ * o parte el espacio sobrante al final de una entrada en uso
+ *
+ * @return int 0 si se ha insertado, -ENOSPC si no cabe en el bloque
+ */
+static int assoofs_dir_insert_in_block(struct assoofs_dir_block *db, const struct qstr *name, uint64_t inode_no, uint8_t file_type, uint32_t hash)
+{
+    struct assoofs_dir_entry *de;
+
+    de = assoofs_dir_block_space(db->data, db->size, ASSOOFS_DIR_ENTRY_SIZE(name->len));
+    if (IS_ERR_OR_NULL(de))
+    {
+        return de ? PTR_ERR(de) : -ENOSPC;
+    }
+    if (assoofs_dir_begin_change(db))
+    {
+        return -EIO;
+    }
+    assoofs_dir_block_fill(de, name, inode_no, file_type, hash);
     return 0;
 }
 
 /**
- * @brief obtiene la información persistente (assoofs_inode_info) del inodo número inode_ino perteneciente al superbloque sb
- * 
- * @param sb superbloque al que pertenece el inodo
- * @param inode_no número de inodo
- * @return struct assoofs_inode_info* información persistente del inodo número inode_ino del superbloque sb
+ * @brief Saca las entradas de un directorio en línea a su primer bloque. Las entradas se copian al
+ * principio del bloque y el resto queda como una entrada libre. Si no se puede asignar el bloque
+ * el directorio sigue en línea.
  */
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no)
+static int assoofs_dir_inline_to_block(struct super_block *sb, struct assoofs_inode_info *dir_info)
 {
-    struct assoofs_inode_info *inode_info = NULL;
+    char entries[ASSOOFS_INLINE_DATA_SIZE];
+    struct assoofs_dir_entry *de;
     struct buffer_head *bh;
+    uint64_t lblk;
+    int ret;
 
-    struct assoofs_super_block_info *afs_sb = sb->s_fs_info;
-    struct assoofs_inode_info *buffer = NULL;
-
-    int i;
-    printk(KERN_INFO "assoofs_get_inode_info request\n");
-    // Acceder a disco para leer el bloque con el almacén de inodos
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
+    trace_assoofs_inline_to_block(sb, dir_info->inode_no, 0);
+    memcpy(entries, dir_info->inline_data, sizeof(entries));
+    dir_info->flags &= ~ASSOOFS_INODE_INLINE;
+    assoofs_extent_init(dir_info);
 
-    // Recorrer almacén de inodos en busca del nodo inode_no:
-    for (i = 0; i < afs_sb->inodes_count; i++)
+    ret = assoofs_dir_new_block(sb, dir_info, &lblk);
+    bh = ret ? NULL : assoofs_dir_bread(sb, dir_info, lblk);
+    if (!bh || assoofs_journal_get_access(bh))
     {
-        if (inode_info->inode_no == inode_no)
-        {
-            // buffer = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-            // Extra: con cache de inodos, esto cambia a lo siguiente:
-            buffer = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-            memcpy(buffer, inode_info, sizeof(*buffer));
-            break;
-        }
-        inode_info++;
+        brelse(bh);
+        assoofs_extent_free_all(sb, dir_info);
+        memcpy(dir_info->inline_data, entries, sizeof(entries));
+        dir_info->flags |= ASSOOFS_INODE_INLINE;
+        return ret ? ret : -EIO;
     }
 
+    lock_buffer(bh);
+    memcpy(bh->b_data, entries, sizeof(entries));
+    de = (struct assoofs_dir_entry *)(bh->b_data + sizeof(entries));
+    de->inode_no = 0;
+    de->rec_len = sb->s_blocksize - sizeof(entries);
+    unlock_buffer(bh);
+    ret = assoofs_journal_dirty(bh);
     brelse(bh);
-    return buffer;
+    return ret;
 }
 
-/*
- *  Operaciones sobre ficheros
- */
-ssize_t assoofs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos);
-ssize_t assoofs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos);
-const struct file_operations assoofs_file_operations = {
-    .read = assoofs_read,
-    .write = assoofs_write,
-};
-
 /**
- * @brief Permite leer de un archivo
- * 
- * @param filp fichero a leer
- * @param buf buffer de usuario donde poner los datos leídos
- * @param len longitud a leer
- * @param ppos desplazamiento de comienzo de lectura. Desde dónde empiezo a leer
- * @return ssize_t bytes leídos
+ * @brief Añade la entrada (name, inode_no) a un directorio. Un directorio en línea pasa a su primer bloque
+ * cuando sus entradas ya no caben en el inodo, y uno lineal se convierte en indexado cuando su único
+ * bloque se llena; en uno indexado solo se toca la hoja del hash del nombre (y el índice si hay que
+ * dividirla). El llamante debe guardar después la información del directorio.
+ *
+ * @param sb superbloque al que pertenece el directorio
+ * @param dir_info información persistente del directorio
+ * @param name nombre de la nueva entrada
+ * @param inode_no inodo de la nueva entrada
+ * @param file_type tipo de fichero de la nueva entrada (ASSOOFS_FT_*)
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
  */
-ssize_t assoofs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+static int assoofs_dir_add_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const struct qstr *name, uint64_t inode_no, uint8_t file_type)
 {
-    struct assoofs_inode_info *inode_info;
-    struct buffer_head *bh;
-    char *buffer;
-    int nbytes;
-    int bytesPorLeerError;
-
-    printk(KERN_INFO "Read request\n");
-
-    // Obtengo la información persistente del inodo con filp
-    inode_info = filp->f_path.dentry->d_inode->i_private;
+    struct assoofs_dir_block db;
+    uint32_t hash = assoofs_name_hash(name->name, name->len);
+    uint64_t lblk;
+    int ret;
 
-    // Compruebo el valor de ppos por si se alcanza el final del fichero
-    if (*ppos >= inode_info->file_size)
+    if (name->len > ASSOOFS_FILENAME_MAXLEN)
     {
-        return 0;
+        return -ENAMETOOLONG;
     }
 
-    // Accedo al contenido del fichero
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-    buffer = (char *)bh->b_data;
+    ret = assoofs_dir_leaf(sb, dir_info, hash, &lblk);
+    while (!ret)
+    {
+        ret = assoofs_dir_get_block(sb, dir_info, lblk, &db);
+        if (ret)
+        {
+            return ret;
+        }
+
+        ret = assoofs_dir_insert_in_block(&db, name, inode_no, file_type, hash);
+        if (!ret)
+        {
+            assoofs_dir_end_change(sb, dir_info, &db);
+        }
+        assoofs_dir_put_block(&db);
+        if (ret != -ENOSPC)
+        {
+            return ret;
+        }
 
-    // Con copy_to_user copio lo leído en el buffer
-    buffer += *ppos;                                                  // Incremento el buffer para que lea a partir de donde se quedó
-    nbytes = min((size_t)inode_info->file_size - (size_t)*ppos, len); // Se compara len con el tamaño del fichero menos los bytes leídos hasta el momento por si llegamos al final del fichero
+        // No cabe: un directorio en línea pasa a un bloque, uno lineal a indexado (y después se divide la hoja)
+        if (dir_info->flags & ASSOOFS_INODE_INLINE)
+        {
+            ret = assoofs_dir_inline_to_block(sb, dir_info);
+            lblk = 0;
+            continue;
+        }
+        if (!(dir_info->flags & ASSOOFS_INODE_INDEXED))
+        {
+            ret = assoofs_dir_make_indexed(sb, dir_info);
+            if (!ret)
+            {
+                ret = assoofs_dir_leaf(sb, dir_info, hash, &lblk);
+            }
+            continue;
+        }
+        ret = assoofs_dir_split_leaf(sb, dir_info, hash, &lblk);
+    }
+    return ret;
+}
 
-    bytesPorLeerError = copy_to_user(buf, buffer, nbytes);
+/**
+ * @brief Borra la entrada (name, inode_no) de un directorio. Su espacio pasa a la entrada anterior
+ * del bloque o, si es la primera, queda como entrada libre.
+ *
+ * @return int 0 si todo fue correcto, -ENOENT si la entrada no existe
+ */
+static int assoofs_dir_remove_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const struct qstr *name, uint64_t inode_no)
+{
+    struct assoofs_dir_entry *de, *prev;
+    struct assoofs_dir_block db;
+    uint32_t hash = assoofs_name_hash(name->name, name->len);
+    uint64_t lblk;
 
-    if (bytesPorLeerError != 0)
+    if (assoofs_dir_leaf(sb, dir_info, hash, &lblk) || assoofs_dir_get_block(sb, dir_info, lblk, &db))
     {
-        printk(KERN_ERR "%d bytes couldn't be read\n", bytesPorLeerError);
+        return -EIO;
     }
-    else
+
+    // Los nombres de un directorio no se repiten: si la entrada no apunta a inode_no, no es la buscada
+    de = assoofs_dir_block_find(db.data, db.size, name, hash, &prev);
+    if (!de || de->inode_no != inode_no)
     {
-        printk(KERN_INFO "Bytes were read correctly\n");
+        assoofs_dir_put_block(&db);
+        return -ENOENT;
     }
-    *ppos += nbytes;
-
-    // Liberar bh
-    brelse(bh);
-    printk(KERN_INFO "Finished reading \n");
-    return nbytes;
+    if (assoofs_dir_begin_change(&db))
+    {
+        assoofs_dir_put_block(&db);
+        return -EIO;
+    }
+    assoofs_dir_block_remove(de, prev);
+    assoofs_dir_end_change(sb, dir_info, &db);
+    assoofs_dir_put_block(&db);
+    return 0;
 }
 
 /**
- * @brief Permite escribir en un archivo
- * 
- * @param filp fichero a escribir
- * @param buf contenido a escribir
- * @param len longitud a escribir (de buf)
- * @param ppos desplazamiento respecto al inicio del fichero donde comenzará la escritura. Desde dónde empiezo a escribir
- * @return ssize_t bytes escritos
+ * @brief Hace que la entrada name del directorio, que ahora apunta a old_ino, apunte a new_ino.
+ * Se reescribe en su sitio: el nombre (y por tanto su hash y su hoja) no cambia
+ *
+ * @param sb superbloque
+ * @param dir_info información persistente del directorio
+ * @param name nombre de la entrada
+ * @param old_ino inodo al que apunta ahora la entrada
+ * @param new_ino inodo al que debe apuntar
+ * @param file_type tipo (ASSOOFS_FT_*) del inodo new_ino
+ * @return int 0 si todo fue correcto, -ENOENT si no existe la entrada
  */
-ssize_t assoofs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
+static int assoofs_dir_set_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const struct qstr *name, uint64_t old_ino, uint64_t new_ino, uint8_t file_type)
 {
-    char *buffer;
-    struct buffer_head *bh;
-    struct assoofs_inode_info *inode_info;
-    int bytesNoEscritos;
-    struct super_block *sb;
-    printk(KERN_INFO "Write request\n");
+    struct assoofs_dir_entry *de;
+    struct assoofs_dir_block db;
 
-    // Compruebo que la escritura entre en el archivo (que no sea superior al tamaño máx de bloque)
-    if (*ppos + len >= ASSOOFS_DEFAULT_BLOCK_SIZE)
+    de = assoofs_dir_find_entry(sb, dir_info, name, &db);
+    if (!de)
     {
-        printk(KERN_ERR "No hay suficiente espacio en el disco para escribir.\n");
-        return -ENOSPC; // Return EOF en write()
+        return -ENOENT;
     }
-
-    // Inicializo inode_info y bh como en assoofs_read
-    inode_info = filp->f_path.dentry->d_inode->i_private;
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-
-    // Escribo en el fichero con copy_from_user:
-    buffer = (char *)bh->b_data;
-    buffer += *ppos;
-    bytesNoEscritos = copy_from_user(buffer, buf, len);
-
-    if (bytesNoEscritos != 0)
+    if (de->inode_no != old_ino)
     {
-        printk(KERN_ERR "%d bytes couldn't be written\n", bytesNoEscritos);
+        assoofs_dir_put_block(&db);
+        return -ENOENT;
     }
-    else
+    if (assoofs_dir_begin_change(&db))
     {
-        printk(KERN_INFO "Bytes were written correctly\n");
+        assoofs_dir_put_block(&db);
+        return -EIO;
     }
+    de->inode_no = new_ino;
+    de->file_type = file_type;
+    assoofs_dir_end_change(sb, dir_info, &db);
+    assoofs_dir_put_block(&db);
+    return 0;
+}
 
-    // Incrementar el valor de ppos, marcar el bloque como sucio y sincronizar
-    *ppos += len;
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+/**
+ * @brief Deja un directorio vacío (o uno recién creado) en línea: sin bloques y con una única
+ * entrada libre que ocupa todo su contenido
+ */
+static void assoofs_dir_init_inline(struct assoofs_inode_info *dir_info)
+{
+    dir_info->flags &= ~ASSOOFS_INODE_INDEXED;
+    dir_info->flags |= ASSOOFS_INODE_INLINE;
+    dir_info->blocks = 0;
+    assoofs_dir_init_block(dir_info->inline_data, ASSOOFS_INLINE_DATA_SIZE);
+}
 
-    // Liberar bh
-    brelse(bh);
+/**
+ * @brief Devuelve los bloques de un directorio que se ha quedado vacío: se liberan todos (hojas e índice)
+ * y vuelve a estar en línea, o a un único bloque con ASSOOFS_FEATURE_BLOCK_DIRS. Se llama con el i_rwsem
+ * del directorio cogido.
+ *
+ * @param sb superbloque
+ * @param dir_info información persistente del directorio (vacío)
+ */
+static void assoofs_dir_shrink(struct super_block *sb, struct assoofs_inode_info *dir_info)
+{
+    bool block_dirs = ASSOOFS_SB(sb)->persistent.features & ASSOOFS_FEATURE_BLOCK_DIRS;
+
+    if (dir_info->dir_children_count || (dir_info->flags & ASSOOFS_INODE_INLINE) || (block_dirs && dir_info->blocks <= 1))
+    {
+        return;
+    }
 
-    // Actualizar la información persistente del inodo y devolver los bytes escritos
-    // Extra: para ello necesitamos el mutex del almaceń de inodos
-    if (mutex_lock_interruptible(&assoofs_inodes_lock))
+    trace_assoofs_dir_shrink(sb, dir_info->inode_no, dir_info->blocks);
+    assoofs_extent_free_all(sb, dir_info);
+    assoofs_dir_init_inline(dir_info);
+    if (block_dirs)
     {
-        // Al mutex le llegó una señal
-        printk(KERN_ERR "Signal arrived while waiting to get the inodes mutex\n");
-        return -EINTR; // EINTR es la valor de que llego una señal mientras la llamada estaba en proceso
+        assoofs_dir_inline_to_block(sb, dir_info);
     }
-    inode_info->file_size = *ppos;
-    sb = filp->f_path.dentry->d_inode->i_sb;
-    assoofs_save_inode_info(sb, inode_info);
-    mutex_unlock(&assoofs_inodes_lock);
-    return len;
 }
 
 /*
  *  Operaciones sobre directorios
  */
 static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
+static loff_t assoofs_dir_llseek(struct file *filp, loff_t offset, int whence);
 const struct file_operations assoofs_dir_operations = {
     .owner = THIS_MODULE,
-    .iterate = assoofs_iterate,
+    .llseek = assoofs_dir_llseek,
+    .read = generic_read_dir,
+    .iterate_shared = assoofs_iterate,
+    .fsync = assoofs_fsync,
 };
 
 /**
- * @brief Sirve para mostrar el contenido de un directorio. Para representar dicho contenido se utiliza un struct dir_context
+ * @brief Tipo de una entrada de directorio (ASSOOFS_FT_*) en el formato de getdents (DT_*)
+ */
+static inline unsigned char assoofs_dir_dtype(uint8_t file_type)
+{
+    switch (file_type)
+    {
+    case ASSOOFS_FT_REG:
+        return DT_REG;
+    case ASSOOFS_FT_DIR:
+        return DT_DIR;
+    default:
+        return DT_UNKNOWN;
+    }
+}
+
+// ctx->pos de un directorio: el hash de la siguiente entrada y, en los bits bajos, cuántas entradas con
+// ese mismo hash se han devuelto ya. No depende de dónde estén las entradas, que se mueven al dividir las hojas
+#define ASSOOFS_DIR_POS_SKIP_BITS 8
+#define ASSOOFS_DIR_POS_SKIP_MAX ((1U << ASSOOFS_DIR_POS_SKIP_BITS) - 1)
+#define ASSOOFS_DIR_POS(hash, skip) (((loff_t)(hash) << ASSOOFS_DIR_POS_SKIP_BITS) | min_t(uint32_t, skip, ASSOOFS_DIR_POS_SKIP_MAX))
+#define ASSOOFS_DIR_POS_EOF ((loff_t)ASSOOFS_DIR_HASH_END << ASSOOFS_DIR_POS_SKIP_BITS)
+
+/**
+ * @brief Sirve para mostrar el contenido de un directorio. Para representar dicho contenido se utiliza un struct dir_context.
+ * Las entradas se devuelven en orden de hash, hoja a hoja siguiendo el índice, y ctx->pos guarda el hash de la siguiente
+ * (ASSOOFS_DIR_POS), así que un listado largo puede repartirse entre varias llamadas a getdents aunque entre ellas se
+ * dividan hojas o el directorio pase a estar indexado. Solo necesita el i_rwsem del directorio en modo compartido.
  * 
  * @param filp 
  * @param ctx 
@@ -418,55 +3796,115 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx)
     struct inode *inode;
     struct super_block *sb;
     struct assoofs_inode_info *inode_info;
-    struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-    int i;
-
-    printk(KERN_INFO "Iterate request\n");
+    struct assoofs_dir_block db;
+    struct assoofs_dir_entry *de;
+    struct assoofs_dir_sort_entry *map;
+    unsigned int offset, leaves = 0;
+    uint64_t hash, next, lblk;
+    uint32_t skip, group, seen;
+    int n, i, ret = 0;
 
     // Accedo al inodo, a la información persistente del inodo y al superbloque correspondiente al argumento filp
-    inode = filp->f_path.dentry->d_inode;
+    inode = file_inode(filp);
     sb = inode->i_sb;
-    inode_info = inode->i_private;
-
-    // Compruebo si el contexto del directorio está creado. Miro si ctx no es cero:
-    if (ctx->pos)
-    {
-        return 0;
-    }
+    inode_info = ASSOOFS_INFO(inode);
 
     // Compruebo que el inodo que obtuve antes es un directorio:
     if (!S_ISDIR(inode_info->mode))
     {
         printk(KERN_INFO "Iterate request on non-directory\n");
-        return -1;
+        return -ENOTDIR;
     }
 
-    // Accedo al bloque donde se encuentra almacenado el directorio
-    // y con la información que contiene inicializo el contexto ctx
-    bh = sb_bread(sb, inode_info->data_block_number);
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
+    if (ctx->pos < 0 || ctx->pos >= ASSOOFS_DIR_POS_EOF)
+    {
+        return 0;
+    }
+    map = kmalloc_array(sb->s_blocksize / ASSOOFS_DIR_ENTRY_SIZE(0), sizeof(*map), GFP_KERNEL);
+    if (!map)
+    {
+        return -ENOMEM;
+    }
 
-    for (i = 0; i < inode_info->dir_children_count; i++)
+    // Continuamos donde se quedó la llamada anterior: por la hoja que cubre el hash guardado en ctx->pos.
+    // Cada hoja se lee entera (un directorio en línea tiene un único "bloque", el del propio inodo) y las
+    // siguientes del índice se van pidiendo por adelantado para que la lectura no espere a cada una
+    hash = ctx->pos >> ASSOOFS_DIR_POS_SKIP_BITS;
+    skip = ctx->pos & ASSOOFS_DIR_POS_SKIP_MAX;
+    while (hash < ASSOOFS_DIR_HASH_END)
     {
-        // dir_emit nos permite añadir nuevas entradas al contexto. Cada vez que añadimos
-        // una etrada al contexto, debemos incrementar el valor de pos con el tamaño de la
-        // nueva entrada
-        // Extra: con el borrado tenemos que comprobar que se esté usando
-        if (record->state_flag == ASSOOFS_FLAG_USED)
+        ret = assoofs_dir_walk(sb, inode_info, hash, &lblk, &next, leaves++ % (ASSOOFS_DIR_READAHEAD / 2) ? 0 : ASSOOFS_DIR_READAHEAD);
+        if (!ret)
+        {
+            ret = assoofs_dir_get_block(sb, inode_info, lblk, &db);
+        }
+        if (ret)
+        {
+            break;
+        }
+
+        // Entradas en uso de la hoja desde el hash guardado, ordenadas por hash
+        n = 0;
+        for (offset = 0; offset < db.size; offset += de->rec_len)
         {
-            dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN);
-            ctx->pos += sizeof(struct assoofs_dir_record_entry);
+            de = (struct assoofs_dir_entry *)(db.data + offset);
+            if (!assoofs_dir_entry_valid(de, offset, db.size))
+            {
+                break;
+            }
+            // Extra: con el borrado tenemos que comprobar que se esté usando
+            if (de->inode_no && de->hash >= hash)
+            {
+                map[n].hash = de->hash;
+                map[n].offset = offset;
+                map[n++].size = de->rec_len;
+            }
         }
-        else if (record->state_flag == ASSOOFS_FLAG_FREE)
+        sort(map, n, sizeof(*map), assoofs_dir_cmp_hash, NULL);
+
+        // Las primeras skip entradas con el hash guardado ya se devolvieron en la llamada anterior
+        group = hash;
+        seen = 0;
+        for (i = 0; i < n; i++)
         {
-            i--; // Ese no era un hijo, ya que está borrado
-            printk(KERN_INFO "Iterate passed through a deleted file\n");
+            de = (struct assoofs_dir_entry *)(db.data + map[i].offset);
+            if (map[i].hash != group)
+            {
+                group = map[i].hash;
+                seen = 0;
+            }
+            if (group == hash && seen < skip)
+            {
+                seen++;
+                continue;
+            }
+            // dir_emit nos permite añadir nuevas entradas al contexto. Si el buffer del usuario
+            // se llena, pos se queda en esta entrada y la siguiente llamada empieza por ella
+            ctx->pos = ASSOOFS_DIR_POS(group, seen);
+            if (!dir_emit(ctx, de->name, de->name_len, de->inode_no, assoofs_dir_dtype(de->file_type)))
+            {
+                assoofs_dir_put_block(&db);
+                goto out;
+            }
+            seen++;
         }
-        record++;
+        assoofs_dir_put_block(&db);
+        hash = next;
+        skip = 0;
+        ctx->pos = hash << ASSOOFS_DIR_POS_SKIP_BITS;
     }
-    brelse(bh);
-    return 0;
+
+out:
+    kfree(map);
+    return ret;
+}
+
+/**
+ * @brief Las posiciones de un directorio son hashes (ASSOOFS_DIR_POS), no bytes: llegan hasta ASSOOFS_DIR_POS_EOF
+ */
+static loff_t assoofs_dir_llseek(struct file *filp, loff_t offset, int whence)
+{
+    return generic_file_llseek_size(filp, offset, whence, ASSOOFS_DIR_POS_EOF, ASSOOFS_DIR_POS_EOF);
 }
 
 /*
@@ -475,6 +3913,7 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx)
 static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
 static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr);
 static struct inode_operations assoofs_inode_ops = {
     .create = assoofs_create,
     .lookup = assoofs_lookup,
@@ -484,24 +3923,42 @@ static struct inode_operations assoofs_inode_ops = {
     .rmdir = assoofs_remove,
     // Extra: el move de ficheros
     .rename = assoofs_move_file,
+    .setattr = assoofs_setattr,
 };
 
 /**
- * @brief Obtiene un puntero al inodo número ino perteneciente al superbloque sb
+ * @brief Obtiene un puntero al inodo número ino perteneciente al superbloque sb. Si ya está en la
+ * caché de inodos se devuelve ese mismo (sin leer de disco); si no, se crea y se lee su ranura
  * 
  * @param sb superbloque al que pertenece el inodo
  * @param ino número de inodo del que obtener un puntero
- * @return struct inode* puntero al inodo número ino del superbloque sb
+ * @return struct inode* puntero al inodo número ino del superbloque sb, ERR_PTR en caso de error
  */
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino)
+static struct inode *assoofs_get_inode(struct super_block *sb, uint64_t ino)
 {
-    struct assoofs_inode_info *info = assoofs_get_inode_info(sb, ino);
-    struct inode *new = new_inode(sb);
-    new->i_ino = ino;
-    new->i_sb = sb;
-    new->i_op = &assoofs_inode_ops;
+    struct assoofs_inode_info *info;
+    struct inode *new;
+    int ret;
+
+    new = iget_locked(sb, ino);
+    if (!new)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+    if (!(new->i_state & I_NEW))
+    {
+        return new;
+    }
 
-    printk(KERN_INFO "Getting inode.\n");
+    info = ASSOOFS_INFO(new);
+    ret = assoofs_get_inode_info(sb, ino, info);
+    if (ret)
+    {
+        printk(KERN_ERR "Inode %llu not found in the inode table\n", ino);
+        iget_failed(new);
+        return ERR_PTR(ret);
+    }
+    new->i_op = &assoofs_inode_ops;
 
     // Para i_fop tenemos que sabe si es un fichero o directorio:
     if (S_ISDIR(info->mode))
@@ -511,17 +3968,19 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino)
     else if (S_ISREG(info->mode))
     {
         new->i_fop = &assoofs_file_operations;
+        new->i_mapping->a_ops = &assoofs_aops;
+        new->i_size = info->file_size;
     }
     else
     {
         printk(KERN_ERR "Unknown inode type. Neither a directory nor a file.\n");
     }
 
-    // Para las fechas del inodo:
+    // Propietarios, permisos y fechas del inodo:
+    inode_init_owner(sb->s_user_ns, new, NULL, info->mode);
     new->i_atime = new->i_mtime = new->i_ctime = current_time(new);
-    // Guardamos en i_private la información persistente
-    new->i_private = info;
 
+    unlock_new_inode(new);
     return new;
 }
 
@@ -534,96 +3993,109 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino)
  * @param flags
  * @return struct dentry* en el caso de ASSOOFS, NULL tanto si se encuentra como si no se encuentra
  */
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags)
+static struct dentry *__assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags)
 {
     struct assoofs_inode_info *parent_info;
     struct super_block *sb;
-    struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-    int i;
-
-    printk(KERN_INFO "Lookup request\n");
-
-    // Acceder al bloque de disco con el contenido del directorio apuntado por parent_inode
-    parent_info = parent_inode->i_private;
-    sb = parent_inode->i_sb;
-    bh = sb_bread(sb, parent_info->data_block_number);
+    struct assoofs_dir_block db;
+    struct assoofs_dir_entry *de;
 
-    // Recorrer el contenido del directorio buscando la entrada cuyo nombre se corresponda con el que buscamos.
+    // Buscar en el directorio apuntado por parent_inode la entrada cuyo nombre se corresponda con el que buscamos.
+    // Solo se lee el bloque que corresponde al hash del nombre.
     // Cuando se localiza la entrada, se contruye el inodo correspondiente.
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
-    for (i = 0; i < parent_info->dir_children_count; i++)
+    parent_info = ASSOOFS_INFO(parent_inode);
+    sb = parent_inode->i_sb;
+    if (child_dentry->d_name.len > ASSOOFS_FILENAME_MAXLEN)
     {
-        if (!strcmp(record->filename, child_dentry->d_name.name))
-        {
-            struct inode *inode = assoofs_get_inode(sb, record->inode_no);
-            inode_init_owner(sb->s_user_ns, inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode);
-            d_add(child_dentry, inode);
-            return NULL;
-        }
+        return ERR_PTR(-ENAMETOOLONG);
+    }
 
-        // Extra: para no contar hijos borrados
-        if (record->state_flag == ASSOOFS_FLAG_FREE)
+    de = assoofs_dir_find_entry(sb, parent_info, &child_dentry->d_name, &db);
+    if (de)
+    {
+        struct inode *inode = assoofs_get_inode(sb, de->inode_no);
+        assoofs_dir_put_block(&db);
+        if (IS_ERR(inode))
         {
-            printk(KERN_INFO "Lookup passed through a deleted file\n");
-            i--; // Ese no es hijo, porque no existe.
+            return ERR_CAST(inode);
         }
-        record++;
+        d_add(child_dentry, inode);
+        return NULL;
     }
 
-    printk(KERN_INFO "No inode found with name {%s}\n", child_dentry->d_name.name);
-
-    // Liberar bh
-    brelse(bh);
     return NULL;
 }
 
+/**
+ * @brief lookup con su latencia en las estadísticas y en el tracepoint assoofs_lookup
+ */
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags)
+{
+    uint64_t begin = ktime_get_ns(), ns;
+    struct dentry *ret;
+
+    ret = __assoofs_lookup(parent_inode, child_dentry, flags);
+    ns = assoofs_stat_end(parent_inode->i_sb, ASSOOFS_OP_LOOKUP, begin);
+    trace_assoofs_lookup(parent_inode, child_dentry, d_really_is_positive(child_dentry) ? d_inode(child_dentry)->i_ino : 0, PTR_ERR_OR_ZERO(ret), ns);
+    return ret;
+}
+
 /**
  * @brief Crea un nuevo inodo. El campo isDir se utilza para diferenciar si es un fichero normal (false) o un directorio (true)
  *
  */
-static int assoofs_create_inode(bool isDir, struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
+static int __assoofs_create_inode(bool isDir, struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
 {
     struct inode *inode;
     struct super_block *sb;
-    uint64_t count;
+    uint64_t ino;
     struct assoofs_inode_info *inode_info;
 
     struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
 
-    struct buffer_head *bh;
+    int ret;
 
-    int i;
+    if (dentry->d_name.len > ASSOOFS_FILENAME_MAXLEN)
+    {
+        return -ENAMETOOLONG;
+    }
 
-    sb = dir->i_sb;                                                           // puntero al superbloque desde dir
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // número de inodos de la información persistente del superbloque
-    inode = new_inode(sb);
-    inode->i_sb = sb;
-    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-    inode->i_op = &assoofs_inode_ops;
-    inode->i_ino = count + 1; // Asignar nuevo número al inodo a partir de count
+    sb = dir->i_sb; // puntero al superbloque desde dir
 
-    if (count > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+    // Reservar una ranura libre de la tabla de inodos (también cuenta el inodo en el superbloque)
+    ret = assoofs_new_inode_no(sb, &ino);
+    if (ret)
     {
-        printk(KERN_ERR "Max filesystem objects created\n");
-        return -ENOSPC;
+        return ret;
     }
-    else
+
+    inode = new_inode(sb);
+    if (!inode)
     {
-        printk(KERN_INFO "Filesystem objects less/equal than maximum\n");
+        assoofs_free_inode_no(sb, ino);
+        return -ENOMEM;
     }
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+    inode->i_op = &assoofs_inode_ops;
+    inode->i_ino = ino; // Asignar al inodo el número reservado
 
-    // Código normal
-    // inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-    // Para la caché de inodos:
-    inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-    printk(KERN_INFO "Cache space reserved\n");
-
+    // La información persistente va dentro del inodo en memoria (assoofs_alloc_inode)
+    inode_info = ASSOOFS_INFO(inode);
+    memset(inode_info, 0, sizeof(*inode_info));
     inode_info->inode_no = inode->i_ino;
-    inode->i_private = inode_info;
     inode_info->state_flag = ASSOOFS_FLAG_USED; // Extra: el inodo está usándose
 
+    // En la caché de inodos (y bloqueado hasta que esté completo). Falla si el número sigue en uso
+    if (insert_inode_locked(inode) < 0)
+    {
+        printk(KERN_ERR "Inode %lu is still in use\n", inode->i_ino);
+        inode_info->state_flag = ASSOOFS_FLAG_FREE; // Su número se libera aquí, no en evict_inode
+        clear_nlink(inode);
+        iput(inode);
+        assoofs_free_inode_no(sb, ino);
+        return -EIO;
+    }
+
     if (isDir)
     {
         inode->i_fop = &assoofs_dir_operations;
@@ -636,6 +4108,7 @@ static int assoofs_create_inode(bool isDir, struct user_namespace *mnt_userns, s
     else
     {
         inode->i_fop = &assoofs_file_operations;
+        inode->i_mapping->a_ops = &assoofs_aops;
         inode_info->mode = mode;   // El mode es un argumento;
         inode_info->file_size = 0; // Está en UNION con dir_children_count
 
@@ -643,86 +4116,425 @@ static int assoofs_create_inode(bool isDir, struct user_namespace *mnt_userns, s
         inode_init_owner(sb->s_user_ns, inode, dir, mode);
     }
 
-    d_add(dentry, inode);
-
-    // Obtenemos un nuevo bloque para el inodo:
-    assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
+    // Ficheros y directorios empiezan en línea, sin bloques: su contenido pasa a un bloque cuando
+    // deja de caber en el inodo. Con ASSOOFS_FEATURE_BLOCK_DIRS (mkassoofs -D block) los directorios
+    // pasan ya a su primer bloque; si no hay espacio se quedan en línea, que también es válido
+    if (isDir)
+    {
+        assoofs_dir_init_inline(inode_info);
+        if (ASSOOFS_SB(sb)->persistent.features & ASSOOFS_FEATURE_BLOCK_DIRS)
+        {
+            assoofs_dir_inline_to_block(sb, inode_info);
+        }
+    }
+    else
+    {
+        inode_info->flags |= ASSOOFS_INODE_INLINE;
+    }
 
-    // Guardamos la información persistente
+    // Guardamos la información persistente (y el contador de inodos del superbloque)
     assoofs_add_inode_info(sb, inode_info);
+    assoofs_save_sb_info(sb);
+
+    // PASO 2: modificar el contenido del directorio padre añadiendo una nueva entrada para el nuevo archivo
+    // (inode_info es la información persistente creada antes):
+    parent_inode_info = ASSOOFS_INFO(dir);
+    ret = assoofs_dir_add_entry(sb, parent_inode_info, &dentry->d_name, inode_info->inode_no, assoofs_file_type(inode_info->mode));
+    if (ret)
+    {
+        // Deshacemos la creación del inodo
+        assoofs_extent_free_all(sb, inode_info);
+        inode_info->state_flag = ASSOOFS_FLAG_FREE;
+        assoofs_save_inode_info(sb, inode_info);
+        assoofs_free_inode_no(sb, ino);
+        assoofs_save_sb_info(sb);
+        clear_nlink(inode);
+        discard_new_inode(inode);
+        return ret;
+    }
+    d_instantiate_new(dentry, inode);
+
+    // PASO 3: actualizar la información persistente del inodo padre:
+    // ahora tiene un archivo más (el VFS tiene cogido el i_rwsem del padre)
+    parent_inode_info->dir_children_count++;
+    assoofs_save_inode_info(sb, parent_inode_info);
+
+    return 0;
+}
+
+/**
+ * @brief Crea el inodo dentro de una transacción: la tabla de inodos, el mapa de bits y la entrada
+ * del directorio padre llegan juntos a disco o no llega ninguno
+ */
+static int assoofs_create_inode(bool isDir, struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+    uint64_t begin = ktime_get_ns(), ns;
+    handle_t *handle;
+    int ret;
+
+    handle = assoofs_journal_start(dir->i_sb, ASSOOFS_NAMESPACE_CREDITS);
+    if (IS_ERR(handle))
+    {
+        return PTR_ERR(handle);
+    }
+    ret = __assoofs_create_inode(isDir, mnt_userns, dir, dentry, mode);
+    assoofs_journal_stop(handle);
+    ns = assoofs_stat_end(dir->i_sb, ASSOOFS_OP_CREATE, begin);
+    trace_assoofs_create(dir, dentry, ret ? 0 : d_inode(dentry)->i_ino, ret, ns);
+    return ret;
+}
+
+static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+{
+    //"El último parámetro no lo utilizaremos"
+    return assoofs_create_inode(false, mnt_userns, dir, dentry, mode);
+}
+
+/**
+ * @brief Crea nuevos inodos para directorios
+ * 
+ * @param mnt_userns 
+ * @param dir directorio padre del nuevo directorio (del nuevo inodo)
+ * @param dentry 
+ * @param mode permisos del nuevo directorio
+ * @return int 0 si todo va bien
+ */
+static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+    return assoofs_create_inode(true, mnt_userns, dir, dentry, mode);
+}
+
+/*
+ *  Operaciones sobre el superbloque
+ */
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc);
+static void assoofs_evict_inode(struct inode *inode);
+static int assoofs_sync_fs(struct super_block *sb, int wait);
+static void assoofs_put_super(struct super_block *sb);
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf);
+static const struct super_operations assoofs_sops = {
+    .alloc_inode = assoofs_alloc_inode,
+    .free_inode = assoofs_free_inode,
+    .drop_inode = generic_drop_inode, // Los inodos con enlaces se quedan en la caché de inodos tras el último iput
+    .write_inode = assoofs_write_inode,
+    .evict_inode = assoofs_evict_inode,
+    .sync_fs = assoofs_sync_fs,
+    .put_super = assoofs_put_super,
+    .statfs = assoofs_statfs,
+};
+
+/**
+ * @brief Escribe la información persistente de un inodo sucio en la tabla de inodos. La llaman los hilos
+ * de escritura diferida (que agrupan la E/S) y fsync/sync, que piden esperar con WB_SYNC_ALL.
+ * Con diario, sync no espera inodo a inodo: sync_fs confirma después una sola transacción para todos
+ */
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    bool wait = wbc->sync_mode == WB_SYNC_ALL;
 
-    // PASO 2: modificar el contenido del directorio padre añadiendo una nueva entrada para el nuevo archivo:
+    if (ASSOOFS_SB(inode->i_sb)->journal && wbc->for_sync)
+    {
+        wait = false;
+    }
+    return __assoofs_save_inode_info(inode->i_sb, ASSOOFS_INFO(inode), wait);
+}
 
-    parent_inode_info = dir->i_private;
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
+/**
+ * @brief Libera un inodo en memoria. Si sigue sucio, antes de descartar su caché de páginas se escriben
+ * a disco sus datos y su información persistente. Un inodo limpio ya está en disco: no se abre ninguna
+ * transacción. Un inodo borrado (sin enlaces) devuelve aquí sus bloques, su ranura y su número, cuando
+ * ya nadie lo tiene abierto ni proyectado
+ */
+static void assoofs_evict_inode(struct inode *inode)
+{
+    handle_t *handle;
 
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
+    if (inode->i_nlink && !is_bad_inode(inode) && (inode->i_state & I_DIRTY_ALL))
+    {
+        if (S_ISREG(inode->i_mode))
+        {
+            filemap_write_and_wait(inode->i_mapping);
+        }
+        assoofs_save_inode_info(inode->i_sb, ASSOOFS_INFO(inode));
+    }
+    // Sin la caché de páginas, la escritura diferida ya no puede acabar en los bloques que se liberan.
+    // Se descarta antes de abrir la transacción: con ella abierta no se pueden bloquear páginas
+    truncate_inode_pages_final(&inode->i_data);
 
-    // dir_contents += parent_inode_info->dir_children_count;
-    // Extra: para el remove, la línea anterior cambia por el siguiente bucle
-    for (i = 0; i < parent_inode_info->dir_children_count; i++)
+    // Los inodos a medio crear que fallaron ya se liberaron en assoofs_create_inode (quedan FREE)
+    if (!inode->i_nlink && !is_bad_inode(inode) && ASSOOFS_INFO(inode)->state_flag == ASSOOFS_FLAG_USED)
     {
-        if (dir_contents->state_flag == ASSOOFS_FLAG_FREE)
+        handle = assoofs_journal_start(inode->i_sb, assoofs_truncate_credits(inode->i_sb));
+        if (IS_ERR(handle) || assoofs_release_inode(inode->i_sb, inode))
+        {
+            printk(KERN_ERR "Couldn't release deleted inode %lu\n", inode->i_ino);
+        }
+        if (!IS_ERR(handle))
         {
-            i--;
+            assoofs_save_sb_info(inode->i_sb);
+            assoofs_journal_stop(handle);
         }
-        dir_contents++;
     }
+    clear_inode(inode);
+}
 
-    dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente creada antes
+/**
+ * @brief Lleva a disco el superbloque (sync, syncfs y desmontaje). El resto de bloques de metadatos
+ * sucios los escribe después el VFS al sincronizar el dispositivo. Con diario, esperar supone
+ * confirmar la transacción en curso; si no se espera solo se adelanta su confirmación
+ */
+static int assoofs_sync_fs(struct super_block *sb, int wait)
+{
+    journal_t *journal = ASSOOFS_SB(sb)->journal;
+    int ret;
 
-    strcpy(dir_contents->filename, dentry->d_name.name);
-    dir_contents->state_flag = ASSOOFS_FLAG_USED; // Extra: necesario para el remove
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+    ret = __assoofs_save_sb_info(sb, wait);
+    if (!ret && !wait && journal)
+    {
+        jbd2_journal_start_commit(journal, NULL);
+    }
+    return ret;
+}
 
-    // PASO 3: actualizar la información persistente del inodo padre:
-    // ahora tiene un archivo más
-    // Extra: necesitamos el mutex del almacén de inodos para escribir.
+/**
+ * @brief Al desmontar, deja el superbloque en disco con los contadores finales y cierra el diario
+ * (lo que vacía sus transacciones en su sitio definitivo)
+ */
+static void assoofs_put_super(struct super_block *sb)
+{
+    cancel_delayed_work_sync(&ASSOOFS_SB(sb)->itable_work);
+    __assoofs_save_sb_info(sb, true);
+    assoofs_destroy_journal(sb);
+}
+
+/**
+ * @brief Capacidad y espacio libre del sistema de ficheros (df). Los libres salen de contadores por CPU
+ * que mantienen los asignadores, así que no se recorre el mapa de bits ni se coge sbi->lock; el valor
+ * puede desviarse un poco del exacto mientras haya asignaciones en curso
+ */
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+    struct super_block *sb = dentry->d_sb;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+    buf->f_type = ASSOOFS_MAGIC;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = sbi->persistent.blocks_count;
+    buf->f_bfree = percpu_counter_read_positive(&sbi->free_blocks);
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = assoofs_max_inodes(sb);
+    buf->f_ffree = percpu_counter_read_positive(&sbi->free_inodes);
+    buf->f_namelen = ASSOOFS_FILENAME_MAXLEN;
+    buf->f_fsid = u64_to_fsid(id);
+    return 0;
+}
+
+/*
+ *  Estadísticas en /sys/fs/assoofs/<dispositivo>/: un fichero por operación con el número de llamadas,
+ *  su latencia total y máxima (ns) y el histograma log2 de latencias (ASSOOFS_LAT_BUCKETS cubos)
+ */
+struct assoofs_stat_attr
+{
+    struct attribute attr;
+    enum assoofs_stat_op op;
+};
+
+#define ASSOOFS_STAT_ATTR(_name, _op) \
+    static struct assoofs_stat_attr assoofs_attr_##_name = {.attr = {.name = #_name, .mode = 0444}, .op = _op}
+
+ASSOOFS_STAT_ATTR(read, ASSOOFS_OP_READ);
+ASSOOFS_STAT_ATTR(write, ASSOOFS_OP_WRITE);
+ASSOOFS_STAT_ATTR(lookup, ASSOOFS_OP_LOOKUP);
+ASSOOFS_STAT_ATTR(create, ASSOOFS_OP_CREATE);
+ASSOOFS_STAT_ATTR(unlink, ASSOOFS_OP_UNLINK);
+ASSOOFS_STAT_ATTR(rename, ASSOOFS_OP_RENAME);
+ASSOOFS_STAT_ATTR(alloc, ASSOOFS_OP_ALLOC);
+ASSOOFS_STAT_ATTR(free, ASSOOFS_OP_FREE);
+
+static struct attribute *assoofs_attrs[] = {
+    &assoofs_attr_read.attr,
+    &assoofs_attr_write.attr,
+    &assoofs_attr_lookup.attr,
+    &assoofs_attr_create.attr,
+    &assoofs_attr_unlink.attr,
+    &assoofs_attr_rename.attr,
+    &assoofs_attr_alloc.attr,
+    &assoofs_attr_free.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(assoofs);
+
+/**
+ * @brief Suma las copias de todas las CPUs de las estadísticas de una operación y las muestra
+ */
+static ssize_t assoofs_stat_show(struct kobject *kobj, struct attribute *attr, char *buf)
+{
+    struct assoofs_sb_info *sbi = container_of(kobj, struct assoofs_sb_info, kobj);
+    enum assoofs_stat_op op = container_of(attr, struct assoofs_stat_attr, attr)->op;
+    struct assoofs_op_stats sum = {0}, *st;
+    ssize_t len;
+    int cpu, i;
+
+    for_each_possible_cpu(cpu)
+    {
+        st = &per_cpu_ptr(sbi->stats, cpu)->ops[op];
+        sum.count += st->count;
+        sum.total_ns += st->total_ns;
+        sum.max_ns = max(sum.max_ns, st->max_ns);
+        for (i = 0; i < ASSOOFS_LAT_BUCKETS; i++)
+        {
+            sum.hist[i] += st->hist[i];
+        }
+    }
+
+    len = sysfs_emit(buf, "count %llu\ntotal_ns %llu\nmax_ns %llu\nhist", sum.count, sum.total_ns, sum.max_ns);
+    for (i = 0; i < ASSOOFS_LAT_BUCKETS; i++)
+    {
+        len += sysfs_emit_at(buf, len, " %llu", sum.hist[i]);
+    }
+    len += sysfs_emit_at(buf, len, "\n");
+    return len;
+}
+
+static const struct sysfs_ops assoofs_sysfs_ops = {
+    .show = assoofs_stat_show,
+};
+
+static void assoofs_kobj_release(struct kobject *kobj)
+{
+    struct assoofs_sb_info *sbi = container_of(kobj, struct assoofs_sb_info, kobj);
+
+    complete(&sbi->kobj_unregister);
+}
+
+static struct kobj_type assoofs_ktype = {
+    .default_groups = assoofs_groups,
+    .sysfs_ops = &assoofs_sysfs_ops,
+    .release = assoofs_kobj_release,
+};
+
+/**
+ * @brief Crea las estadísticas del montaje y su directorio /sys/fs/assoofs/<dispositivo>.
+ * Si falla, assoofs_kill_sb deshace lo que se haya hecho
+ */
+static int assoofs_sysfs_register(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    sbi->stats = alloc_percpu(struct assoofs_stats);
+    if (!sbi->stats)
+    {
+        return -ENOMEM;
+    }
+    init_completion(&sbi->kobj_unregister);
+    sbi->kobj.kset = assoofs_kset;
+    return kobject_init_and_add(&sbi->kobj, &assoofs_ktype, NULL, "%s", sb->s_id);
+}
+
+/**
+ * @brief Quita el directorio del montaje en /sys/fs/assoofs y espera a que nadie lo esté leyendo
+ * para liberar las estadísticas
+ */
+static void assoofs_sysfs_unregister(struct assoofs_sb_info *sbi)
+{
+    if (sbi->kobj.state_initialized)
+    {
+        kobject_del(&sbi->kobj);
+        kobject_put(&sbi->kobj);
+        wait_for_completion(&sbi->kobj_unregister);
+    }
+    free_percpu(sbi->stats);
+}
+
+/**
+ * @brief Comprueba los parámetros y la geometría de un superbloque leído del dispositivo. Las cuentas se
+ * hacen con su propio tamaño de bloque, que puede no ser todavía el del montaje
+ *
+ * @param sb superbloque que se está montando
+ * @param assoofs_sb información persistente leída
+ * @return int 0 si es válido, -EINVAL si no
+ */
+static int assoofs_check_super(struct super_block *sb, struct assoofs_super_block_info *assoofs_sb)
+{
+    uint64_t bits = assoofs_sb->block_size * 8;
+    struct
+    {
+        uint64_t start;
+        uint64_t blocks;
+    } regions[] = {
+        {ASSOOFS_SUPERBLOCK_BLOCK_NUMBER, 1},
+        {assoofs_sb->bitmap_start, assoofs_sb->bitmap_blocks},
+        {assoofs_sb->inode_bitmap_start, assoofs_sb->inode_bitmap_blocks},
+        {assoofs_sb->inode_table_start, assoofs_sb->inode_table_blocks},
+        {assoofs_sb->journal_start, assoofs_sb->journal_blocks},
+    };
+    int i, j;
+
+    if (assoofs_sb->magic != ASSOOFS_MAGIC || assoofs_sb->block_size < ASSOOFS_MIN_BLOCK_SIZE || assoofs_sb->block_size > ASSOOFS_MAX_BLOCK_SIZE || !is_power_of_2(assoofs_sb->block_size))
+    {
+        printk(KERN_ERR "Error with superblock parameters\n");
+        return -EINVAL;
+    }
+
+    // El sistema de ficheros no puede acabar más allá del dispositivo
+    if (assoofs_sb->blocks_count > bdev_nr_sectors(sb->s_bdev) >> (ilog2(assoofs_sb->block_size) - SECTOR_SHIFT))
+    {
+        printk(KERN_ERR "Filesystem of %llu blocks is larger than the device\n", assoofs_sb->blocks_count);
+        return -EINVAL;
+    }
+
+    // Superbloque, mapas de bits, tabla de inodos y diario: cada zona dentro del dispositivo y sin pisar a
+    // las demás. Lo que queda son los bloques de datos
+    for (i = 0; i < ARRAY_SIZE(regions); i++)
+    {
+        if (regions[i].start > assoofs_sb->blocks_count || regions[i].blocks > assoofs_sb->blocks_count - regions[i].start)
+        {
+            printk(KERN_ERR "Error with the metadata layout\n");
+            return -EINVAL;
+        }
+        for (j = 0; j < i; j++)
+        {
+            if (regions[i].blocks && regions[j].blocks && regions[i].start < regions[j].start + regions[j].blocks && regions[j].start < regions[i].start + regions[i].blocks)
+            {
+                printk(KERN_ERR "Error with the metadata layout\n");
+                return -EINVAL;
+            }
+        }
+    }
+
+    if (assoofs_sb->bitmap_blocks * bits < assoofs_sb->blocks_count || assoofs_sb->bitmap_start + assoofs_sb->bitmap_blocks > assoofs_sb->blocks_count)
+    {
+        printk(KERN_ERR "Error with the free block bitmap geometry\n");
+        return -EINVAL;
+    }
+
+    if (assoofs_sb->inode_table_start + assoofs_sb->inode_table_blocks > assoofs_sb->blocks_count || assoofs_sb->inode_table_blocks == 0)
+    {
+        printk(KERN_ERR "Error with the inode table geometry\n");
+        return -EINVAL;
+    }
+
+    if (assoofs_sb->inode_bitmap_blocks * bits < assoofs_sb->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(assoofs_sb->block_size) || assoofs_sb->inode_bitmap_start + assoofs_sb->inode_bitmap_blocks > assoofs_sb->blocks_count)
+    {
+        printk(KERN_ERR "Error with the inode bitmap geometry\n");
+        return -EINVAL;
+    }
 
-    if (mutex_lock_interruptible(&assoofs_inodes_lock))
+    if ((assoofs_sb->features & ASSOOFS_FEATURE_LAZY_ITABLE) && assoofs_sb->inode_table_zeroed > assoofs_sb->inode_table_blocks)
     {
-        // Al mutex le llegó una señal
-        printk(KERN_ERR "Signal arrived while waiting to get the inodes mutex\n");
-        return -EINTR; // EINTR es la valor de que llego una señal mientras la llamada estaba en proceso
+        printk(KERN_ERR "Error with the inode table initialization state\n");
+        return -EINVAL;
     }
-    parent_inode_info->dir_children_count++;
-    assoofs_save_inode_info(sb, parent_inode_info);
-    mutex_unlock(&assoofs_inodes_lock);
 
+    if (assoofs_sb->journal_blocks && (assoofs_sb->journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS || assoofs_sb->journal_start + assoofs_sb->journal_blocks > assoofs_sb->blocks_count))
+    {
+        printk(KERN_ERR "Error with the journal geometry\n");
+        return -EINVAL;
+    }
     return 0;
 }
 
-static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
-{
-    //"El último parámetro no lo utilizaremos"
-    printk(KERN_INFO "New file request\n");
-    return assoofs_create_inode(false, mnt_userns, dir, dentry, mode);
-}
-
-/**
- * @brief Crea nuevos inodos para directorios
- * 
- * @param mnt_userns 
- * @param dir directorio padre del nuevo directorio (del nuevo inodo)
- * @param dentry 
- * @param mode permisos del nuevo directorio
- * @return int 0 si todo va bien
- */
-static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
-{
-    printk(KERN_INFO "New directory request\n");
-    return assoofs_create_inode(true, mnt_userns, dir, dentry, mode);
-}
-
-/*
- *  Operaciones sobre el superbloque
- */
-static const struct super_operations assoofs_sops = {
-    .drop_inode = generic_delete_inode,
-};
-
 /**
  *  @brief Inicialización del superbloque
  */
@@ -730,41 +4542,146 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent)
 {
     // Declaraciones juntas para cumplir con ISO C90
     struct buffer_head *bh;
+    struct assoofs_sb_info *sbi;
     struct assoofs_super_block_info *assoofs_sb;
+    int ret;
 
     struct inode *root_inode;
     printk(KERN_INFO "assoofs_fill_super request\n");
     // 1.- Leer la información persistente del superbloque del dispositivo de bloques
+    // y copiarla a memoria (el buffer no puede usarse después de liberarlo)
 
-    bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-    assoofs_sb = (struct assoofs_super_block_info *)bh->b_data;
+    sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+    if (!sbi)
+    {
+        return -ENOMEM;
+    }
+    sb->s_fs_info = sbi;
+    sbi->sb = sb;
+    spin_lock_init(&sbi->lock);
+    mutex_init(&sbi->itable_lock);
+    INIT_DELAYED_WORK(&sbi->itable_work, assoofs_itable_work);
+
+    // El superbloque está al principio del bloque 0 sea cual sea el tamaño de bloque: se lee con el menor
+    // que admitan el formato y el dispositivo, y después se pasa al del sistema de ficheros
+    if (!sb_min_blocksize(sb, ASSOOFS_MIN_BLOCK_SIZE))
+    {
+        printk(KERN_ERR "Unsupported device block size\n");
+        return -EINVAL;
+    }
+    bh = assoofs_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+    if (!bh)
+    {
+        return -EIO;
+    }
+    memcpy(&sbi->persistent, bh->b_data, sizeof(sbi->persistent));
     brelse(bh); // Liberar la memoria
+    assoofs_sb = &sbi->persistent;
 
     // 2.- Comprobar los parámetros del superbloque
-    if (assoofs_sb->magic != ASSOOFS_MAGIC || assoofs_sb->block_size != ASSOOFS_DEFAULT_BLOCK_SIZE)
+    ret = assoofs_check_super(sb, assoofs_sb);
+    if (ret)
+    {
+        return ret;
+    }
+    // Extra: tamaño de bloque elegido al formatear. Falla si es menor que el sector del dispositivo o
+    // mayor que una página
+    if (assoofs_sb->block_size != sb->s_blocksize && !sb_set_blocksize(sb, assoofs_sb->block_size))
+    {
+        printk(KERN_ERR "Block size %llu not supported by the device\n", (unsigned long long)assoofs_sb->block_size);
+        return -EINVAL;
+    }
+
+    // Extra: diario de metadatos. Si el dispositivo no se desmontó bien, recuperarlo reescribe los
+    // metadatos confirmados, superbloque incluido, así que este se vuelve a leer
+    ret = assoofs_load_journal(sb);
+    if (ret)
+    {
+        return ret;
+    }
+    bh = assoofs_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+    if (!bh)
+    {
+        assoofs_destroy_journal(sb);
+        return -EIO;
+    }
+    memcpy(&sbi->persistent, bh->b_data, sizeof(sbi->persistent));
+    brelse(bh);
+    // El superbloque recuperado del diario se comprueba igual que el primero, y debe seguir con el mismo
+    // tamaño de bloque
+    ret = assoofs_check_super(sb, assoofs_sb);
+    if (!ret && assoofs_sb->block_size != sb->s_blocksize)
     {
         printk(KERN_ERR "Error with superblock parameters\n");
-        return -1;
+        ret = -EINVAL;
+    }
+    if (ret)
+    {
+        assoofs_destroy_journal(sb);
+        return ret;
+    }
+
+    // Extra: resumen en memoria del mapa de bits de bloques libres
+    ret = assoofs_load_bitmap(sb);
+    if (ret)
+    {
+        assoofs_destroy_journal(sb);
+        return ret;
+    }
+    sbi->next_inode = ASSOOFS_LAST_RESERVED_INODE + 1;
+
+    // Extra: contadores de bloques e inodos libres para statfs
+    ret = percpu_counter_init(&sbi->free_blocks, sbi->persistent.free_blocks, GFP_KERNEL);
+    if (!ret)
+    {
+        ret = percpu_counter_init(&sbi->free_inodes, assoofs_max_inodes(sb) - sbi->persistent.inodes_count, GFP_KERNEL);
+    }
+    if (ret)
+    {
+        assoofs_destroy_journal(sb);
+        return ret;
+    }
+
+    // Extra: estadísticas de las operaciones en /sys/fs/assoofs/<dispositivo>
+    ret = assoofs_sysfs_register(sb);
+    if (ret)
+    {
+        assoofs_destroy_journal(sb);
+        return ret;
     }
 
     // 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb, incluído el campo s_op con las operaciones que soporta.
     sb->s_magic = ASSOOFS_MAGIC;
-    sb->s_maxbytes = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    sb->s_maxbytes = MAX_LFS_FILESIZE; // El mapa de extents permite ficheros de muchos bloques
     sb->s_op = &assoofs_sops;
-    sb->s_fs_info = assoofs_sb;
     // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
 
-    root_inode = new_inode(sb);                                 // Inicializar una variable inode
-    inode_init_owner(sb->s_user_ns, root_inode, NULL, S_IFDIR); // SIFDIR para directorios, SIFREG para ficheros
-
-    root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER;                                           // Número de inodo
-    root_inode->i_sb = sb;                                                                      // Puntero al superbloque
-    root_inode->i_op = &assoofs_inode_ops;                                                      // Dirección de una variable de tipo struct inode_operations previamente declarada
-    root_inode->i_fop = &assoofs_dir_operations;                                                // Dirección de una variable de tipo struct flie_operations previamente declarada. En la práctica tenemos 2: assoofs_dir_operations y assoofs_file_operations. La primera la utilizaremos cuando creemos inodos para directorios (como el directorio ra´ız) y la segunda cuando creemos inodos para ficheros.
-    root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode); // Fechas
-    root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);           // Información persistente del inodo
+    // El inodo raíz se obtiene como cualquier otro (assoofs_get_inode): queda en la caché de inodos con
+    // las operaciones de directorio y su información persistente
+    root_inode = assoofs_get_inode(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    if (IS_ERR(root_inode) || !S_ISDIR(root_inode->i_mode))
+    {
+        printk(KERN_ERR "Root inode not found in the inode table\n");
+        if (!IS_ERR(root_inode))
+        {
+            iput(root_inode);
+        }
+        assoofs_destroy_journal(sb);
+        return -EINVAL;
+    }
 
     sb->s_root = d_make_root(root_inode);
+    if (!sb->s_root)
+    {
+        assoofs_destroy_journal(sb);
+        return -ENOMEM;
+    }
+
+    // Extra: si mkassoofs dejó parte de la tabla de inodos sin poner a cero, se termina en segundo plano
+    if ((sbi->persistent.features & ASSOOFS_FEATURE_LAZY_ITABLE) && !sb_rdonly(sb))
+    {
+        queue_delayed_work(system_long_wq, &sbi->itable_work, HZ);
+    }
 
     return 0;
 }
@@ -781,6 +4698,25 @@ static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags,
     return ret;
 }
 
+/**
+ * @brief Desmonta el dispositivo y libera la información del superbloque en memoria.
+ * También se llama si assoofs_fill_super falla a medias.
+ */
+static void assoofs_kill_sb(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    kill_block_super(sb);
+    if (sbi)
+    {
+        assoofs_sysfs_unregister(sbi);
+        percpu_counter_destroy(&sbi->free_blocks);
+        percpu_counter_destroy(&sbi->free_inodes);
+        assoofs_put_bitmap(sbi);
+        kfree(sbi);
+    }
+}
+
 /*
  *  assoofs file system type
  */
@@ -788,18 +4724,45 @@ static struct file_system_type assoofs_type = {
     .owner = THIS_MODULE,
     .name = "assoofs",
     .mount = assoofs_mount,
-    .kill_sb = kill_block_super,
+    .kill_sb = assoofs_kill_sb,
 };
 
+/**
+ * @brief Constructor de los objetos de assoofs_inode_cache: lo que solo hay que inicializar una vez
+ */
+static void assoofs_inode_init_once(void *obj)
+{
+    struct assoofs_inode *ai = obj;
+
+    init_rwsem(&ai->map_lock);
+    inode_init_once(&ai->vfs_inode);
+}
+
 static int __init assoofs_init(void)
 {
     int ret;
 
-    // Incializo la caché de inodos
-    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode_info), 0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), NULL);
+    // Incializo la caché de inodos: cada objeto es un inodo del VFS con la información de assoofs
+    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode), 0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT), assoofs_inode_init_once);
+    if (!assoofs_inode_cache)
+    {
+        return -ENOMEM;
+    }
     printk(KERN_INFO "assoofs_init request\n");
+    // Directorio /sys/fs/assoofs, donde cada montaje publica sus estadísticas
+    assoofs_kset = kset_create_and_add("assoofs", NULL, fs_kobj);
+    if (!assoofs_kset)
+    {
+        kmem_cache_destroy(assoofs_inode_cache);
+        return -ENOMEM;
+    }
     ret = register_filesystem(&assoofs_type);
     // Control de errores a partir del valor de ret
+    if (ret)
+    {
+        kset_unregister(assoofs_kset);
+        kmem_cache_destroy(assoofs_inode_cache);
+    }
     return ret;
 }
 
@@ -808,8 +4771,10 @@ static void __exit assoofs_exit(void)
     int ret;
     printk(KERN_INFO "assoofs_exit request\n");
     ret = unregister_filesystem(&assoofs_type);
-    // Libero la memoria de la caché al salir
+    // Libero la memoria de la caché al salir (free_inode libera los inodos tras un periodo RCU)
+    rcu_barrier();
     kmem_cache_destroy(assoofs_inode_cache);
+    kset_unregister(assoofs_kset);
     // Control de errores a partir del valor de ret
 }
 
@@ -820,16 +4785,69 @@ module_exit(assoofs_exit);
  * Implementación de partes opcionales
  */
 
+/**
+ * @brief Reserva un inodo en memoria (con su información persistente) de la caché de inodos de assoofs
+ *
+ * @param sb superbloque al que pertenece el inodo
+ * @return struct inode* el inodo del VFS, NULL si no hay memoria
+ */
+static struct inode *assoofs_alloc_inode(struct super_block *sb)
+{
+    struct assoofs_inode *ai;
+
+    ai = alloc_inode_sb(sb, assoofs_inode_cache, GFP_KERNEL);
+    if (!ai)
+    {
+        return NULL;
+    }
+    return &ai->vfs_inode;
+}
+
 /**
  * @brief Elimina inodos (también de la caché)
  *
  * @param inode inodo a ser eliminado
  */
-int assoofs_destroy_inode(struct inode *inode)
+static void assoofs_free_inode(struct inode *inode)
+{
+    kmem_cache_free(assoofs_inode_cache, ASSOOFS_I(inode));
+}
+
+/**
+ * @brief Libera un inodo borrado: sus bloques, su ranura de la tabla y su número. Lo llama evict_inode
+ * cuando el inodo, ya sin entradas de directorio, deja de estar abierto; mientras lo esté conserva todo
+ * y sigue en la caché de inodos, así que su número no se puede volver a usar. Se llama dentro de una
+ * transacción abierta con assoofs_truncate_credits(sb), con la caché de páginas del inodo ya descartada.
+ *
+ * @param sb superbloque al que pertenece el inodo
+ * @param inode inodo a liberar
+ * @return int 0 si todo fue correcto, otro valor en caso contrario
+ */
+static int assoofs_release_inode(struct super_block *sb, struct inode *inode)
 {
-    struct assoofs_inode *inode_info = inode->i_private;
-    printk(KERN_INFO "Freeing private data of inode %p (%lu)\n", inode_info, inode->i_ino);
-    kmem_cache_free(assoofs_inode_cache, inode_info);
+    struct assoofs_inode_info *inode_info = ASSOOFS_INFO(inode);
+    int ret;
+
+    // Marcamos como libres todos los bloques del inodo, por partes si es grande
+    ret = assoofs_truncate_extents(inode, 0);
+    if (ret)
+    {
+        return ret;
+    }
+    down_write(assoofs_map_lock(inode));
+    assoofs_extent_free_all(sb, inode_info);
+    up_write(assoofs_map_lock(inode));
+
+    // Ponemos la flag como libre
+    inode_info->state_flag = ASSOOFS_FLAG_FREE;
+    ret = assoofs_save_inode_info(sb, inode_info);
+    if (ret)
+    {
+        return ret;
+    }
+
+    // Ahora el superbloque debe contar con un inodo menos y su ranura queda libre
+    assoofs_free_inode_no(sb, inode->i_ino);
     return 0;
 }
 
@@ -841,136 +4859,421 @@ int assoofs_destroy_inode(struct inode *inode)
  * @param dentry entrada a eliminar
  * @return int 0 si todo va bien
  */
-static int assoofs_remove(struct inode *dir, struct dentry *dentry)
+static int __assoofs_remove(struct inode *dir, struct dentry *dentry)
 {
     struct inode *inode;
     struct assoofs_inode_info *parent_inode_info;
     struct assoofs_inode_info *inode_info;
     struct super_block *sb;
-    struct assoofs_super_block_info *sb_info;
-    struct buffer_head *bh;
-    int i;
-    struct assoofs_dir_record_entry *record;
-
-    printk(KERN_INFO "Remove inode request\n");
+    handle_t *handle;
+    int ret;
 
     // Obtener el superbloque
     sb = dentry->d_sb;
-    // Obtener el superblock info
-    sb_info = sb->s_fs_info;
     // Obtener el inodo del directorio
     inode = dentry->d_inode;
     // Obtener el inode_info
-    inode_info = inode->i_private;
+    inode_info = ASSOOFS_INFO(inode);
     // Obtener el inode_info del padre
-    parent_inode_info = dir->i_private;
+    parent_inode_info = ASSOOFS_INFO(dir);
 
-    // Ponemos la flag como libre
-    inode_info->state_flag = ASSOOFS_FLAG_FREE;
+    // Un directorio solo se puede borrar si está vacío
+    if (S_ISDIR(inode_info->mode) && inode_info->dir_children_count > 0)
+    {
+        return -ENOTEMPTY;
+    }
+
+    handle = assoofs_journal_start(sb, ASSOOFS_NAMESPACE_CREDITS);
+    if (IS_ERR(handle))
+    {
+        return PTR_ERR(handle);
+    }
+
+    // Quitamos la entrada del directorio padre (solo se toca la hoja del hash del nombre)
+    ret = assoofs_dir_remove_entry(sb, parent_inode_info, &dentry->d_name, inode->i_ino);
+    if (ret)
+    {
+        assoofs_journal_stop(handle);
+        return ret;
+    }
 
-    // Ahora el padre tiene un hijo menos
+    // Ahora el padre tiene un hijo menos (y si se queda vacío devuelve sus bloques)
     parent_inode_info->dir_children_count--;
+    assoofs_dir_shrink(sb, parent_inode_info);
 
-    // Actualizamos la información del superbloque (padre e hijo)
-    // P: He de usar los mutex aquí también? R: No, mutex solo sobre parte básica
-    assoofs_save_inode_info(sb, inode_info);
+    // El inodo se queda sin enlaces: sus bloques y su número se liberan al salir de memoria
+    // (assoofs_evict_inode), cuando nadie lo tenga abierto
+    clear_nlink(inode);
     assoofs_save_inode_info(sb, parent_inode_info);
 
-    // Marcamos el bloque como libre
-    assoofs_set_a_freeblock(sb_info, inode_info->data_block_number);
-
     /*
     Para esta práctica no hace falta actualizar la información de la caché, porque nos han dicho
     que no es necesario realizar las partes básicas sobre las partes básicas. Por ejemplo, no hace
     falta usar mutex en las partes opcionales.
     */
-    
-
-    // Ahora el superbloque debe contar con un inodo menos
-    sb_info->inodes_count--;
 
     // Actualizamos superbloque
     assoofs_save_sb_info(sb);
+    assoofs_journal_stop(handle);
 
     // Ahora eliminamos el dentry
     d_drop(dentry);
 
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
+    return 0;
+}
+
+/**
+ * @brief unlink y rmdir, con su latencia en las estadísticas y en el tracepoint assoofs_unlink
+ */
+static int assoofs_remove(struct inode *dir, struct dentry *dentry)
+{
+    uint64_t ino = d_inode(dentry)->i_ino;
+    uint64_t begin = ktime_get_ns(), ns;
+    int ret;
+
+    ret = __assoofs_remove(dir, dentry);
+    ns = assoofs_stat_end(dir->i_sb, ASSOOFS_OP_UNLINK, begin);
+    trace_assoofs_unlink(dir, dentry, ino, ret, ns);
+    return ret;
+}
 
-    // Recorro los records del directorio
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
-    for (i = 0; i < parent_inode_info->dir_children_count; i++)
+/**
+ * @brief Devuelve al asignador los bloques de [block, block + count) (dentro de un mismo bloque del mapa)
+ * que estaban pendientes de confirmar
+ */
+static void assoofs_release_pending(struct super_block *sb, uint64_t block, uint64_t count)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    unsigned long bits = ASSOOFS_BITS_PER_BLOCK(sb);
+    struct assoofs_pending_map *pending = &sbi->bitmap_pending[block / bits];
+    unsigned long bit, end = block % bits + count;
+    uint64_t freed = 0;
+
+    spin_lock(&sbi->lock);
+    for (bit = block % bits; bit < end; bit++)
     {
-        if (!strcmp(record->filename, dentry->d_name.name) && record->inode_no == inode->i_ino)
+        if (__test_and_clear_bit_le(bit, pending->bits))
         {
-            printk(KERN_INFO "Found inode dir_record_entry to remove\n");
-            record->state_flag = ASSOOFS_FLAG_FREE;
+            freed++;
         }
+    }
+    pending->count -= freed;
+    sbi->bitmap_free[block / bits] += freed;
+    sbi->persistent.free_blocks += freed;
+    // Los bloques liberados pueden reutilizarse cuanto antes
+    if (block < sbi->next_block)
+    {
+        sbi->next_block = block;
+    }
+    spin_unlock(&sbi->lock);
+    percpu_counter_add(&sbi->free_blocks, freed);
+}
 
-        if (record->state_flag == ASSOOFS_FLAG_FREE)
-        {
-            i--;
-        }
-        record++;
+/**
+ * @brief jbd2 llama a esta función al confirmar una transacción: los bloques que liberó ya no pertenecen
+ * a nadie en disco y pueden volver al asignador
+ */
+static void assoofs_journal_commit_callback(journal_t *journal, transaction_t *transaction)
+{
+    struct super_block *sb = journal->j_private;
+    struct assoofs_pending_free *entry, *next;
+    LIST_HEAD(freed);
+
+    spin_lock(&ASSOOFS_SB(sb)->lock);
+    list_splice_init(&transaction->t_private_list, &freed);
+    spin_unlock(&ASSOOFS_SB(sb)->lock);
+
+    list_for_each_entry_safe(entry, next, &freed, list)
+    {
+        assoofs_release_pending(sb, entry->block, entry->count);
+        kfree(entry);
     }
+}
 
-    // Para sincronizar
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+/**
+ * @brief Mapa de bloques pendientes de confirmar del bloque map del mapa de bits, que se reserva la
+ * primera vez que hace falta
+ *
+ * @return unsigned long* el mapa, NULL si falta memoria
+ */
+static unsigned long *assoofs_pending_bits(struct super_block *sb, uint64_t map)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    unsigned long *bits;
 
-    return 0;
+    bits = READ_ONCE(sbi->bitmap_pending[map].bits);
+    if (bits)
+    {
+        return bits;
+    }
+    bits = kzalloc(sb->s_blocksize, GFP_NOFS);
+    if (!bits)
+    {
+        return NULL;
+    }
+    spin_lock(&sbi->lock);
+    if (sbi->bitmap_pending[map].bits)
+    {
+        kfree(bits);
+        bits = sbi->bitmap_pending[map].bits;
+    }
+    else
+    {
+        sbi->bitmap_pending[map].bits = bits;
+    }
+    spin_unlock(&sbi->lock);
+    return bits;
 }
 
 /**
- * @brief Marca el bloque número data_block_number del superbloque sb_info como libre. Usado al hacer remove.
- * Realiza la operación contraria que assoofs_get_a_freeblock
+ * @brief Marca como libres los bloques [block, block + count) en el mapa de bits. Usado al hacer remove.
+ * Realiza la operación contraria que assoofs_sb_get_freeblocks. Dentro de una transacción los bloques no
+ * vuelven al asignador hasta que se confirma (assoofs_journal_commit_callback): hasta entonces, tras un
+ * fallo, siguen perteneciendo a su dueño anterior. Sin diario se pueden reutilizar enseguida
  * 
- * @param sb_info superbloque donde marcar el bloque como libre
- * @param data_block_number número de bloque a marcar como libre
+ * @param sb superbloque donde marcar los bloques como libres
+ * @param block primer bloque a marcar como libre
+ * @param count número de bloques contiguos a marcar como libres
  */
-void assoofs_set_a_freeblock(struct assoofs_super_block_info *sb_info, uint64_t data_block_number)
+void assoofs_sb_set_freeblocks(struct super_block *sb, uint64_t block, uint64_t count)
 {
-    printk(KERN_INFO "Set a free block request\n");
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    unsigned long bits = ASSOOFS_BITS_PER_BLOCK(sb);
+    handle_t *handle = journal_current_handle();
+    struct assoofs_pending_free *entry;
+    struct buffer_head *bh;
+    uint64_t map, end, freed;
+    unsigned long bit, last;
+    unsigned long *pending;
+    uint64_t begin = ktime_get_ns();
+
+    if (block + count > sbi->persistent.blocks_count || block < sbi->persistent.bitmap_start + sbi->persistent.bitmap_blocks)
+    {
+        printk(KERN_ERR "Trying to free blocks [%llu, %llu) outside the data area\n", block, block + count);
+        return;
+    }
+
+    // Los buffers de metadatos de estos bloques pueden seguir sucios en memoria: se descartan para que
+    // su escritura diferida no pise los datos de quien reciba después los bloques
+    assoofs_clean_aliases(sb, block, count);
+
+    // El tramo puede repartirse entre varios bloques del mapa de bits
+    end = block + count;
+    while (block < end)
+    {
+        map = block / bits;
+        bit = block % bits;
+        last = min_t(uint64_t, bits, bit + (end - block));
+
+        // Sin memoria para retenerlos hasta la confirmación, los bloques se devuelven enseguida
+        entry = NULL;
+        pending = NULL;
+        if (handle)
+        {
+            entry = kmalloc(sizeof(*entry), GFP_NOFS);
+            pending = entry ? assoofs_pending_bits(sb, map) : NULL;
+            if (!pending)
+            {
+                printk(KERN_WARNING "Blocks [%llu, %llu) freed before their transaction commits\n", block, map * bits + last);
+                kfree(entry);
+                entry = NULL;
+            }
+        }
+
+        bh = assoofs_bread(sb, sbi->persistent.bitmap_start + map);
+        if (!bh)
+        {
+            printk(KERN_ERR "Couldn't read bitmap block %llu\n", map);
+            kfree(entry);
+            break;
+        }
+        if (assoofs_journal_get_access(bh))
+        {
+            brelse(bh);
+            kfree(entry);
+            break;
+        }
+
+        lock_buffer(bh);
+        spin_lock(&sbi->lock);
+        freed = assoofs_bitmap_release(bh->b_data, bit, last, pending);
+        if (pending)
+        {
+            sbi->bitmap_pending[map].count += freed;
+        }
+        else
+        {
+            sbi->bitmap_free[map] += freed;
+            sbi->persistent.free_blocks += freed;
+            // Los bloques liberados pueden reutilizarse cuanto antes
+            if (block < sbi->next_block)
+            {
+                sbi->next_block = block;
+            }
+        }
+        spin_unlock(&sbi->lock);
+        unlock_buffer(bh);
+        assoofs_journal_dirty(bh);
+        brelse(bh);
+
+        if (entry)
+        {
+            entry->block = block;
+            entry->count = last - bit;
+            spin_lock(&sbi->lock);
+            list_add_tail(&entry->list, &handle->h_transaction->t_private_list);
+            spin_unlock(&sbi->lock);
+        }
+        else
+        {
+            percpu_counter_add(&sbi->free_blocks, freed);
+        }
+        block = (map + 1) * bits;
+    }
 
-    sb_info->free_blocks |= (1 << data_block_number);
+    assoofs_save_sb_info(sb);
+    assoofs_stat_end(sb, ASSOOFS_OP_FREE, begin);
+    trace_assoofs_free_blocks(sb, end - count, count);
 }
 
 /**
- * @brief Mueve un fichero de lugar. Para ello copia y elimina dicho fichero.
- * Nota: en la práctica solo se pide que funcione con ficheros, no con directorios.
+ * @brief Cambia de nombre (o de directorio) una entrada. Solo se reescriben las entradas de directorio:
+ * el inodo y sus bloques no se tocan, así que el coste no depende del tamaño del fichero.
+ * Si el destino existe se reemplaza (y se libera su inodo); con RENAME_EXCHANGE se intercambian
+ * los dos inodos. Todo va en una transacción, así que tras un fallo se ve el nombre viejo o el nuevo.
  * 
  * @param mnt_userns 
  * @param old_dir inodo del directorio origen
  * @param old_dentry entrada del directorio origen
  * @param new_dir inodo del directorio destino
  * @param new_dentry entrada del directorio destino
- * @param excl 
+ * @param flags RENAME_NOREPLACE o RENAME_EXCHANGE (el VFS ya comprueba que con NOREPLACE no exista el destino)
  * @return int 0 si todo ha ido bien.
  */
-static int assoofs_move_file(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int excl)
+static int __assoofs_move_file(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
 {
-    struct inode *inode;
-    struct assoofs_inode_info *inode_info;
+    struct super_block *sb = old_dir->i_sb;
+    struct inode *inode = d_inode(old_dentry);
+    struct inode *target = d_inode(new_dentry);
+    struct assoofs_inode_info *old_dir_info = ASSOOFS_INFO(old_dir);
+    struct assoofs_inode_info *new_dir_info = ASSOOFS_INFO(new_dir);
+    uint8_t file_type = assoofs_file_type(ASSOOFS_INFO(inode)->mode);
+    handle_t *handle;
+    int ret, err;
+
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+    {
+        return -EINVAL;
+    }
+
+    // Un directorio solo se puede reemplazar si está vacío
+    if (target && !(flags & RENAME_EXCHANGE) && S_ISDIR(target->i_mode) && ASSOOFS_INFO(target)->dir_children_count > 0)
+    {
+        return -ENOTEMPTY;
+    }
+
+    handle = assoofs_journal_start(sb, ASSOOFS_NAMESPACE_CREDITS);
+    if (IS_ERR(handle))
+    {
+        return PTR_ERR(handle);
+    }
+
+    if (flags & RENAME_EXCHANGE)
+    {
+        // Cada entrada pasa a apuntar al inodo de la otra; los contadores de hijos no cambian
+        ret = assoofs_dir_set_entry(sb, old_dir_info, &old_dentry->d_name, inode->i_ino, target->i_ino, assoofs_file_type(ASSOOFS_INFO(target)->mode));
+        if (!ret)
+        {
+            ret = assoofs_dir_set_entry(sb, new_dir_info, &new_dentry->d_name, target->i_ino, inode->i_ino, file_type);
+            // La segunda entrada no ha cambiado: la primera vuelve a apuntar a su inodo. Si ni eso se puede,
+            // se aborta el diario para que no se confirme un intercambio a medias
+            if (ret && assoofs_dir_set_entry(sb, old_dir_info, &old_dentry->d_name, target->i_ino, inode->i_ino, file_type))
+            {
+                assoofs_journal_abort(sb, ret);
+            }
+        }
+        assoofs_journal_stop(handle);
+        return ret;
+    }
 
-    printk(KERN_INFO "Move request\n");
+    if (target)
+    {
+        // La entrada destino ya existe: basta con apuntarla al inodo que se mueve. El reemplazado se libera
+        // (con su caché de páginas) en evict_inode, solo si el rename llega a completarse
+        ret = assoofs_dir_set_entry(sb, new_dir_info, &new_dentry->d_name, target->i_ino, inode->i_ino, file_type);
+    }
+    else
+    {
+        ret = assoofs_dir_add_entry(sb, new_dir_info, &new_dentry->d_name, inode->i_ino, file_type);
+    }
+    if (ret)
+    {
+        // Aunque la entrada no llegara a añadirse, el directorio destino ha podido crecer
+        assoofs_save_inode_info(sb, new_dir_info);
+        assoofs_journal_stop(handle);
+        return ret;
+    }
 
-    inode = old_dentry->d_inode;
-    inode_info = inode->i_private;
-    
-    //Utilizaré el método de borrar y crear el archivo
+    // La entrada origen desaparece
+    ret = assoofs_dir_remove_entry(sb, old_dir_info, &old_dentry->d_name, inode->i_ino);
+    if (ret)
+    {
+        printk(KERN_ERR "Couldn't remove the old entry of inode %lu\n", inode->i_ino);
+        // La entrada destino vuelve a como estaba: el inodo no puede quedar con dos nombres (ni el
+        // reemplazado sin ninguno). Si ni eso se puede, se aborta el diario con el rename a medias
+        if (target)
+        {
+            err = assoofs_dir_set_entry(sb, new_dir_info, &new_dentry->d_name, inode->i_ino, target->i_ino, assoofs_file_type(ASSOOFS_INFO(target)->mode));
+        }
+        else
+        {
+            err = assoofs_dir_remove_entry(sb, new_dir_info, &new_dentry->d_name, inode->i_ino);
+        }
+        if (err)
+        {
+            assoofs_journal_abort(sb, err);
+        }
+        assoofs_save_inode_info(sb, new_dir_info);
+        assoofs_journal_stop(handle);
+        return ret;
+    }
 
-    // A la hora de borrar da igual si es fichero o directorio
-    assoofs_remove(old_dir, old_dentry);
-    
-    // Pero para crear, dependiendo de si es fichero o directorio llamaré a mkdir o assoofs_create:
-    
-    if (inode_info->mode == S_IFREG)
+    if (target)
     {
-        // Es un fichero
-        return assoofs_create(mnt_userns, new_dir, new_dentry, S_IFREG, 0);
-    } else {
-    	// Es un directorio
-        return assoofs_mkdir(mnt_userns, new_dir, new_dentry, S_IFDIR);
+        // Como en remove: el reemplazado se libera al salir de memoria
+        clear_nlink(target);
     }
+    else
+    {
+        new_dir_info->dir_children_count++;
+    }
+    old_dir_info->dir_children_count--;
+    assoofs_dir_shrink(sb, old_dir_info);
+    assoofs_save_inode_info(sb, old_dir_info);
+    if (new_dir != old_dir)
+    {
+        assoofs_save_inode_info(sb, new_dir_info);
+    }
+    assoofs_save_sb_info(sb);
+    assoofs_journal_stop(handle);
+    return 0;
+}
+
+/**
+ * @brief rename, con su latencia en las estadísticas y en el tracepoint assoofs_rename
+ */
+static int assoofs_move_file(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
+{
+    uint64_t begin = ktime_get_ns(), ns;
+    int ret;
+
+    ret = __assoofs_move_file(mnt_userns, old_dir, old_dentry, new_dir, new_dentry, flags);
+    ns = assoofs_stat_end(old_dir->i_sb, ASSOOFS_OP_RENAME, begin);
+    trace_assoofs_rename(old_dir, old_dentry, new_dir, new_dentry, flags, ret, ns);
+    return ret;
 }
+
+// Extra: batería de KUnit (make kunit). Se incluye aquí porque prueba funciones static del módulo
+#ifdef ASSOOFS_KUNIT_TEST
+#include "assoofs_test.c"
+#endif
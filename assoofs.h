@@ -1,13 +1,18 @@
 #define ASSOOFS_MAGIC 0x20200406
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
+// Tamaños de bloque que admite el formato (potencias de 2). El máximo lo pone rec_len, de 16 bits, que en un
+// bloque vacío vale el tamaño del bloque; el módulo además no monta bloques mayores que una página
+#define ASSOOFS_MIN_BLOCK_SIZE 1024
+#define ASSOOFS_MAX_BLOCK_SIZE 32768
 #define ASSOOFS_FILENAME_MAXLEN 255
-#define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER
 #define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_ROOTDIR_INODE_NUMBER
-const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
-const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
-const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;
-const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
-const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
+static const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
+static const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
+
+// Tabla de inodos: el inodo número n ocupa la ranura n (la 0 no se usa), así que su bloque
+// y su desplazamiento se calculan directamente
+#define ASSOOFS_INODE_SIZE 256
+#define ASSOOFS_INODES_PER_BLOCK(block_size) ((block_size) / ASSOOFS_INODE_SIZE)
 
 // Extra: definimos las flags
 #define ASSOOFS_FLAG_FREE 0
@@ -18,24 +23,120 @@ struct assoofs_super_block_info
     uint64_t version;
     uint64_t magic;
     uint64_t block_size;
-    uint64_t inodes_count; // Extra: con el borrado, llevará la cuenta de los inodos reales del sistema
-    uint64_t free_blocks;
+    uint64_t inodes_count;  // Extra: con el borrado, llevará la cuenta de los inodos reales del sistema
+    uint64_t free_blocks;   // Número de bloques libres
+    uint64_t blocks_count;  // Número total de bloques del dispositivo
+    uint64_t bitmap_start;  // Primer bloque del mapa de bits de bloques libres (bit a 1 = ocupado)
+    uint64_t bitmap_blocks; // Bloques que ocupa el mapa de bits
+    uint64_t inode_bitmap_start;  // Primer bloque del mapa de bits de inodos (bit n a 1 = ranura n en uso)
+    uint64_t inode_bitmap_blocks; // Bloques que ocupa el mapa de bits de inodos
+    uint64_t inode_table_start;  // Primer bloque de la tabla de inodos
+    uint64_t inode_table_blocks; // Bloques que ocupa la tabla de inodos
+    uint64_t journal_start;      // Primer bloque del diario (jbd2) de metadatos
+    uint64_t journal_blocks;     // Bloques del diario, 0 si el sistema de ficheros no tiene diario
+    uint64_t features;           // ASSOOFS_FEATURE_*
+    uint64_t inode_table_zeroed; // Con ASSOOFS_FEATURE_LAZY_ITABLE: bloques de la tabla de inodos ya puestos a cero
+    // El resto del bloque 0 no se usa (a ceros): el superbloque cabe en el bloque más pequeño
+};
+
+// Características del sistema de ficheros (campo features del superbloque)
+#define ASSOOFS_FEATURE_BLOCK_DIRS 0x1  // Los directorios nuevos empiezan con un bloque de entradas, no en línea
+#define ASSOOFS_FEATURE_LAZY_ITABLE 0x2 // mkassoofs no puso a cero toda la tabla de inodos: lo termina el módulo
+
+// Tamaño mínimo de un diario jbd2 (JBD2_MIN_JOURNAL_BLOCKS)
+#define ASSOOFS_JOURNAL_MIN_BLOCKS 1024
+
+// Entrada de directorio de longitud variable: cabecera de 16 bytes seguida del nombre (sin '\0'),
+// alineada a 8 bytes. Las entradas de un bloque se encadenan con rec_len y lo cubren entero;
+// una entrada con inode_no 0 está libre y al borrar una entrada su espacio pasa a la anterior
+struct assoofs_dir_entry
+{
+    uint64_t inode_no;  // Inodo de la entrada (0 si está libre)
+    uint16_t rec_len;   // Bytes hasta la siguiente entrada del bloque
+    uint8_t name_len;   // Longitud del nombre
+    uint8_t file_type;  // ASSOOFS_FT_*
+    uint32_t hash;      // Hash del nombre, para descartar entradas sin comparar nombres
+    char name[];
+};
+
+#define ASSOOFS_DIR_ENTRY_SIZE(name_len) ((sizeof(struct assoofs_dir_entry) + (name_len) + 7) & ~7)
 
-    char padding[4056];
+// Tipos de fichero guardados en las entradas de directorio
+#define ASSOOFS_FT_UNKNOWN 0
+#define ASSOOFS_FT_REG 1
+#define ASSOOFS_FT_DIR 2
+
+// Directorios indexados: el bloque lógico 0 deja de tener entradas y pasa a ser un índice
+// ordenado hash -> bloque lógico de la hoja que contiene los nombres con ese hash.
+// Cuando la raíz se llena, sus entradas bajan a nodos intermedios (levels = 1) y la raíz apunta a ellos
+#define ASSOOFS_DIR_INDEX_MAGIC 0x48545245
+#define ASSOOFS_DIR_INDEX_MAX_LEVELS 1
+
+struct assoofs_dir_index_header
+{
+    uint32_t magic;
+    uint32_t count;  // Entradas usadas del índice
+    uint32_t limit;  // Entradas que caben en el bloque
+    uint32_t levels; // Solo en la raíz: niveles de nodos intermedios entre ella y las hojas
 };
 
-struct assoofs_dir_record_entry
+// Los nodos intermedios empiezan con una entrada de directorio libre que ocupa todo el bloque y después
+// llevan la cabecera del índice: quien los recorra como un bloque de entradas no encuentra ninguna
+#define ASSOOFS_DIR_NODE_OFFSET sizeof(struct assoofs_dir_entry)
+
+struct assoofs_dir_index_entry
 {
-    char filename[ASSOOFS_FILENAME_MAXLEN];
-    uint64_t inode_no;
-    uint64_t state_flag; // Controla si el dentry está borrado o usándose
+    uint32_t hash;  // Menor hash de la hoja (la primera entrada siempre tiene hash 0)
+    uint32_t block; // Bloque lógico de la hoja dentro del directorio
 };
 
+/* Hash FNV-1a de 32 bits de un nombre; lo comparten el módulo y las herramientas */
+static inline uint32_t assoofs_name_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Mapa de extents: la raíz vive en el inodo y, cuando se llena, el árbol crece con bloques de extents
+#define ASSOOFS_EXTENT_MAGIC 0xE47E
+#define ASSOOFS_INLINE_EXTENTS 4
+#define ASSOOFS_EXTENT_MAX_DEPTH 5
+
+struct assoofs_extent_header
+{
+    uint16_t magic;
+    uint16_t entries; // Entradas usadas en el nodo
+    uint16_t max;     // Entradas que caben en el nodo
+    uint16_t depth;   // 0 si las entradas son extents de datos, >0 si apuntan a otros nodos
+};
+
+struct assoofs_extent
+{
+    uint64_t block; // Primer bloque lógico cubierto por la entrada
+    uint64_t start; // Primer bloque físico (o bloque del nodo hijo en los índices)
+    uint64_t len;   // Número de bloques (0 en los índices)
+};
+
+// Flags de los inodos
+#define ASSOOFS_INODE_INDEXED 0x1 // Directorio con índice hash en su bloque lógico 0
+#define ASSOOFS_INODE_INLINE 0x2  // Contenido (datos o entradas de directorio) dentro del propio inodo, sin bloques
+
+// Bytes del inodo que ocupa el mapa de extents y que, en los inodos en línea, guardan el contenido
+#define ASSOOFS_INLINE_DATA_SIZE (ASSOOFS_INODE_SIZE - 40)
+
 struct assoofs_inode_info
 {
     mode_t mode;
+    uint32_t flags;
     uint64_t inode_no;
-    uint64_t data_block_number;
+    uint64_t blocks; // Bloques lógicos asignados (de 0 a blocks - 1, sin huecos)
 
     union
     {
@@ -43,4 +144,19 @@ struct assoofs_inode_info
         uint64_t dir_children_count;
     };
     uint64_t state_flag; // Controla si el inodo está borrado o usándose
+
+    // Hasta ocupar ASSOOFS_INODE_SIZE bytes: el mapa de extents o, con ASSOOFS_INODE_INLINE, el contenido.
+    // Un fichero en línea tiene file_size <= ASSOOFS_INLINE_DATA_SIZE y un directorio en línea tiene sus
+    // entradas encadenadas igual que en un bloque, pero de ASSOOFS_INLINE_DATA_SIZE bytes
+    union
+    {
+        struct
+        {
+            struct assoofs_extent_header extent_header;
+            struct assoofs_extent extents[ASSOOFS_INLINE_EXTENTS];
+        };
+        char inline_data[ASSOOFS_INLINE_DATA_SIZE];
+    };
 };
+
+_Static_assert(sizeof(struct assoofs_inode_info) == ASSOOFS_INODE_SIZE, "assoofs_inode_info must fill an inode table slot");
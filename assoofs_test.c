@@ -0,0 +1,1313 @@
+/*
+ *  Batería de KUnit de assoofs. Las funciones del módulo (asignador de bloques, mapa de extents, tabla de
+ *  inodos y directorios: inserción, división de hojas y crecimiento del índice) se ejecutan sobre un superbloque
+ *  montado en bloques en memoria, sin dispositivo, y se comprueban sus resultados con cada tamaño de bloque
+ *  admitido. Las medidas repiten esas operaciones con 1e2 a 1e6 objetos y dan ns/op, así que un cambio de
+ *  orden de complejidad se ve en los tiempos (y los fallos en los resultados).
+ *
+ *  Se compila dentro del módulo (lo incluye assoofs.c para llegar a sus funciones static) con `make kunit`,
+ *  en un kernel con CONFIG_KUNIT. Al cargar el módulo se ejecuta la suite "assoofs": los resultados y las
+ *  medidas salen en dmesg y en /sys/kernel/debug/kunit/assoofs/results.
+ */
+
+#include <kunit/test.h>
+
+// Tamaños de bloque del formato y, para los directorios, también el contenido de un directorio en línea
+static const unsigned long assoofs_test_block_sizes[] = {ASSOOFS_MIN_BLOCK_SIZE, ASSOOFS_DEFAULT_BLOCK_SIZE, ASSOOFS_MAX_BLOCK_SIZE};
+static const unsigned long assoofs_test_dir_sizes[] = {ASSOOFS_INLINE_DATA_SIZE, ASSOOFS_MIN_BLOCK_SIZE, ASSOOFS_DEFAULT_BLOCK_SIZE, ASSOOFS_MAX_BLOCK_SIZE};
+
+// Número de objetos de las medidas
+static const unsigned long assoofs_test_counts[] = {100, 1000, 10000, 100000, 1000000};
+
+static void assoofs_test_size_desc(const unsigned long *size, char *desc)
+{
+    snprintf(desc, KUNIT_PARAM_DESC_SIZE, "%lu bytes", *size);
+}
+
+static void assoofs_test_count_desc(const unsigned long *count, char *desc)
+{
+    snprintf(desc, KUNIT_PARAM_DESC_SIZE, "%lu objects", *count);
+}
+
+KUNIT_ARRAY_PARAM(assoofs_test_block_size, assoofs_test_block_sizes, assoofs_test_size_desc);
+KUNIT_ARRAY_PARAM(assoofs_test_dir_size, assoofs_test_dir_sizes, assoofs_test_size_desc);
+KUNIT_ARRAY_PARAM(assoofs_test_count, assoofs_test_counts, assoofs_test_count_desc);
+
+// Los nombres de las pruebas son el número en hexadecimal con 8 cifras: todos distintos y de la misma longitud
+#define ASSOOFS_TEST_NAME_LEN 8
+
+// Paso para recorrer 0..n-1 en un orden disperso: primo y sin factores comunes con las potencias de 10
+#define ASSOOFS_TEST_STRIDE 7919
+
+static inline unsigned long assoofs_test_perm(unsigned long i, unsigned long n)
+{
+    return (uint64_t)i * ASSOOFS_TEST_STRIDE % n;
+}
+
+/**
+ * @brief Escribe en buf (de al menos ASSOOFS_TEST_NAME_LEN + 1 bytes) el nombre número n y lo apunta desde name
+ */
+static void assoofs_test_name(struct qstr *name, char *buf, unsigned long n)
+{
+    snprintf(buf, ASSOOFS_TEST_NAME_LEN + 1, "%08lx", n);
+    name->name = (const unsigned char *)buf;
+    name->len = ASSOOFS_TEST_NAME_LEN;
+}
+
+/*
+ *  Disco en memoria: un superbloque con el formato de mkassoofs (sin diario) cuyos bloques son buffer_heads
+ *  sobre memoria del kernel. assoofs_bread y assoofs_getblk los sacan de aquí, así que las pruebas llaman
+ *  a las funciones del módulo tal cual: asignador, tabla de inodos y directorios
+ */
+struct assoofs_test_disk
+{
+    struct buffer_head **blocks; // Cada bloque se reserva (a cero) la primera vez que se usa
+    uint64_t count;
+    bool nomem;                  // No se pudo reservar algún bloque
+};
+
+// Montaje de prueba: lo guarda test->priv y lo libera assoofs_test_exit
+struct assoofs_test_fs
+{
+    struct super_block sb;
+    struct assoofs_sb_info sbi;
+    struct assoofs_test_disk disk;
+    bool counters; // Los percpu_counter de sbi están inicializados
+};
+
+/**
+ * @brief Buffer del bloque block del disco en memoria, con una referencia para el llamante (brelse)
+ */
+static struct buffer_head *assoofs_test_getblk(struct super_block *sb, sector_t block)
+{
+    struct assoofs_test_disk *disk = ASSOOFS_SB(sb)->test_disk;
+    struct buffer_head *bh;
+
+    if (block >= disk->count)
+    {
+        return NULL;
+    }
+
+    bh = disk->blocks[block];
+    if (!bh)
+    {
+        bh = alloc_buffer_head(GFP_NOFS);
+        if (bh)
+        {
+            bh->b_data = kzalloc(sb->s_blocksize, GFP_NOFS);
+        }
+        if (!bh || !bh->b_data)
+        {
+            if (bh)
+            {
+                free_buffer_head(bh);
+            }
+            disk->nomem = true;
+            return NULL;
+        }
+        bh->b_size = sb->s_blocksize;
+        bh->b_blocknr = block;
+        set_buffer_mapped(bh);
+        set_buffer_uptodate(bh);
+        get_bh(bh); // La referencia del propio disco
+        disk->blocks[block] = bh;
+    }
+
+    // Siempre sucio: así mark_buffer_dirty no busca una página que no existe (bforget lo limpia)
+    set_buffer_dirty(bh);
+    get_bh(bh);
+    return bh;
+}
+
+/**
+ * @brief Marca como ocupados los bits [from, to) de un mapa de bits del disco en memoria
+ */
+static int assoofs_test_set_bits(struct super_block *sb, uint64_t map_start, uint64_t from, uint64_t to)
+{
+    unsigned long bits = ASSOOFS_BITS_PER_BLOCK(sb);
+    struct buffer_head *bh;
+
+    for (; from < to; from++)
+    {
+        bh = assoofs_bread(sb, map_start + from / bits);
+        if (!bh)
+        {
+            return -ENOMEM;
+        }
+        __set_bit_le(from % bits, bh->b_data);
+        brelse(bh);
+    }
+    return 0;
+}
+
+/**
+ * @brief Formatea y monta un disco en memoria con data_blocks bloques de datos y sitio en la tabla para
+ * al menos inodes inodos además del raíz. Se desmonta solo al acabar la prueba
+ *
+ * @return struct super_block* superbloque montado, NULL si falta memoria
+ */
+static struct super_block *assoofs_test_mount(struct kunit *test, unsigned long blocksize, uint64_t data_blocks, uint64_t inodes)
+{
+    unsigned long bits = blocksize * 8;
+    uint64_t per_block = ASSOOFS_INODES_PER_BLOCK(blocksize), meta;
+    struct assoofs_super_block_info *afs_sb;
+    struct assoofs_test_fs *fs;
+    struct super_block *sb;
+
+    fs = kzalloc(sizeof(*fs), GFP_KERNEL);
+    if (!fs)
+    {
+        return NULL;
+    }
+    test->priv = fs;
+    sb = &fs->sb;
+    sb->s_blocksize = blocksize;
+    sb->s_blocksize_bits = ilog2(blocksize);
+    sb->s_fs_info = &fs->sbi;
+    strscpy(sb->s_id, "assoofs-test", sizeof(sb->s_id));
+    fs->sbi.sb = sb;
+    fs->sbi.test_disk = &fs->disk;
+    spin_lock_init(&fs->sbi.lock);
+    mutex_init(&fs->sbi.itable_lock);
+
+    // La disposición de mkassoofs: superbloque, mapa de bits, mapa de inodos, tabla de inodos y datos
+    afs_sb = &fs->sbi.persistent;
+    afs_sb->version = 1;
+    afs_sb->magic = ASSOOFS_MAGIC;
+    afs_sb->block_size = blocksize;
+    afs_sb->inodes_count = 1; // El directorio raíz
+    afs_sb->inode_table_blocks = DIV_ROUND_UP(inodes + 2, per_block);
+    afs_sb->inode_bitmap_blocks = DIV_ROUND_UP(afs_sb->inode_table_blocks * per_block, bits);
+    meta = 1 + afs_sb->inode_bitmap_blocks + afs_sb->inode_table_blocks;
+    afs_sb->bitmap_blocks = DIV_ROUND_UP(meta + data_blocks, bits);
+    while (afs_sb->bitmap_blocks * bits < meta + afs_sb->bitmap_blocks + data_blocks)
+    {
+        afs_sb->bitmap_blocks++;
+    }
+    afs_sb->blocks_count = meta + afs_sb->bitmap_blocks + data_blocks;
+    afs_sb->bitmap_start = 1;
+    afs_sb->inode_bitmap_start = afs_sb->bitmap_start + afs_sb->bitmap_blocks;
+    afs_sb->inode_table_start = afs_sb->inode_bitmap_start + afs_sb->inode_bitmap_blocks;
+
+    fs->disk.count = afs_sb->blocks_count;
+    fs->disk.blocks = kvcalloc(fs->disk.count, sizeof(*fs->disk.blocks), GFP_KERNEL);
+    fs->sbi.stats = alloc_percpu(struct assoofs_stats);
+    if (!fs->disk.blocks || !fs->sbi.stats)
+    {
+        return NULL;
+    }
+
+    // Ocupados: los metadatos, las ranuras 0 y 1 (el raíz) y los bits que quedan más allá del dispositivo o de la tabla
+    if (assoofs_test_set_bits(sb, afs_sb->bitmap_start, 0, afs_sb->inode_table_start + afs_sb->inode_table_blocks) ||
+        assoofs_test_set_bits(sb, afs_sb->bitmap_start, afs_sb->blocks_count, afs_sb->bitmap_blocks * bits) ||
+        assoofs_test_set_bits(sb, afs_sb->inode_bitmap_start, 0, ASSOOFS_LAST_RESERVED_INODE + 1) ||
+        assoofs_test_set_bits(sb, afs_sb->inode_bitmap_start, afs_sb->inode_table_blocks * per_block, afs_sb->inode_bitmap_blocks * bits))
+    {
+        return NULL;
+    }
+
+    if (assoofs_load_bitmap(sb) || percpu_counter_init(&fs->sbi.free_blocks, afs_sb->free_blocks, GFP_KERNEL))
+    {
+        return NULL;
+    }
+    if (percpu_counter_init(&fs->sbi.free_inodes, assoofs_max_inodes(sb) - afs_sb->inodes_count, GFP_KERNEL))
+    {
+        percpu_counter_destroy(&fs->sbi.free_blocks);
+        return NULL;
+    }
+    fs->counters = true;
+    return sb;
+}
+
+static void assoofs_test_exit(struct kunit *test)
+{
+    struct assoofs_test_fs *fs = test->priv;
+    uint64_t i;
+
+    if (!fs)
+    {
+        return;
+    }
+    if (fs->counters)
+    {
+        percpu_counter_destroy(&fs->sbi.free_blocks);
+        percpu_counter_destroy(&fs->sbi.free_inodes);
+    }
+    free_percpu(fs->sbi.stats);
+    assoofs_put_bitmap(&fs->sbi);
+    for (i = 0; fs->disk.blocks && i < fs->disk.count; i++)
+    {
+        if (fs->disk.blocks[i])
+        {
+            kfree(fs->disk.blocks[i]->b_data);
+            free_buffer_head(fs->disk.blocks[i]);
+        }
+    }
+    kvfree(fs->disk.blocks);
+    kfree(fs);
+}
+
+/**
+ * @brief Bloques del disco en memoria que siguen con alguna referencia (un brelse que falta)
+ */
+static uint64_t assoofs_test_held(struct super_block *sb)
+{
+    struct assoofs_test_disk *disk = ASSOOFS_SB(sb)->test_disk;
+    uint64_t i, held = 0;
+
+    for (i = 0; i < disk->count; i++)
+    {
+        if (disk->blocks[i] && atomic_read(&disk->blocks[i]->b_count) != 1)
+        {
+            held++;
+        }
+    }
+    return held;
+}
+
+// Primer bloque de datos del disco en memoria
+static inline uint64_t assoofs_test_data_start(struct super_block *sb)
+{
+    return ASSOOFS_SB(sb)->persistent.inode_table_start + ASSOOFS_SB(sb)->persistent.inode_table_blocks;
+}
+
+/*
+ *  Mapas de bits
+ */
+
+static void assoofs_test_bitmap_alloc(struct kunit *test)
+{
+    unsigned long bits = *(const unsigned long *)test->param_value * 8;
+    unsigned long got = 0;
+    void *map, *pending;
+
+    map = kunit_kzalloc(test, bits / 8, GFP_KERNEL);
+    pending = kunit_kzalloc(test, bits / 8, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, map);
+    KUNIT_ASSERT_NOT_NULL(test, pending);
+
+    // Mapa vacío: el primer bit, y un tramo nunca pasa del final del bloque
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_alloc(map, bits, 0, 1, &got), 0UL);
+    KUNIT_EXPECT_EQ(test, got, 1UL);
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_alloc(map, bits, 0, 2 * bits, &got), 1UL);
+    KUNIT_EXPECT_EQ(test, got, bits - 1);
+
+    // Mapa lleno: no hay bit libre desde ningún punto
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_alloc(map, bits, 0, 1, &got), bits);
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_alloc(map, bits, bits - 1, 1, &got), bits);
+
+    // Liberar cuenta solo los bits que estaban ocupados
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_release(map, 0, bits, NULL), bits);
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_release(map, 0, bits, NULL), 0UL);
+
+    // Los bits liberados (y solo esos) quedan apuntados en pending, para retenerlos hasta que se confirme la transacción
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_alloc(map, bits, 3, 2, &got), 3UL);
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_release(map, 0, 8, pending), 2UL);
+    KUNIT_EXPECT_EQ(test, memweight(pending, bits / 8), (size_t)2);
+    KUNIT_EXPECT_TRUE(test, test_bit_le(3, pending) && test_bit_le(4, pending));
+
+    // El tramo se corta en el primer bit ocupado
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_alloc(map, bits, 10, 1, &got), 10UL);
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_alloc(map, bits, 0, 64, &got), 0UL);
+    KUNIT_EXPECT_EQ(test, got, 10UL);
+
+    // Solo el último bit libre: se encuentra aunque se pidan más, y antes de from no se busca
+    memset(map, 0xff, bits / 8);
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_release(map, bits - 1, bits, NULL), 1UL);
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_release(map, 5, 6, NULL), 1UL);
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_alloc(map, bits, 6, 8, &got), bits - 1);
+    KUNIT_EXPECT_EQ(test, got, 1UL);
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_alloc(map, bits, 6, 1, &got), bits);
+    KUNIT_EXPECT_EQ(test, assoofs_bitmap_alloc(map, bits, 0, 1, &got), 5UL);
+}
+
+/**
+ * @brief El asignador de bloques del módulo sobre tres bloques de mapa de bits (el último a medias): el
+ * resumen en memoria, el cursor next-fit, los tramos que llegan al final de un bloque del mapa y la
+ * liberación de tramos que cruzan dos
+ */
+static void assoofs_test_blocks(struct kunit *test)
+{
+    unsigned long bits = *(const unsigned long *)test->param_value * 8;
+    uint64_t data_start, total, last_free, block = 0, count = 0, got = 0;
+    struct assoofs_sb_info *sbi;
+    struct super_block *sb;
+
+    sb = assoofs_test_mount(test, bits / 8, 2 * bits + bits / 2, 16);
+    KUNIT_ASSERT_NOT_NULL(test, sb);
+    sbi = ASSOOFS_SB(sb);
+    KUNIT_ASSERT_EQ(test, sbi->persistent.bitmap_blocks, 3ULL);
+    data_start = assoofs_test_data_start(sb);
+    total = sbi->persistent.blocks_count - data_start;
+    last_free = sbi->persistent.blocks_count - 2 * bits;
+
+    // El resumen cuenta los bloques libres de cada bloque del mapa
+    KUNIT_EXPECT_EQ(test, sbi->persistent.free_blocks, total);
+    KUNIT_EXPECT_EQ(test, (uint64_t)sbi->bitmap_free[0], bits - data_start);
+    KUNIT_EXPECT_EQ(test, (uint64_t)sbi->bitmap_free[1], (uint64_t)bits);
+    KUNIT_EXPECT_EQ(test, (uint64_t)sbi->bitmap_free[2], last_free);
+
+    // Next-fit: el primer bloque de datos y después el siguiente
+    KUNIT_EXPECT_EQ(test, assoofs_sb_get_freeblocks(sb, 0, 1, &block, &count), 0);
+    KUNIT_EXPECT_EQ(test, block, data_start);
+    KUNIT_EXPECT_EQ(test, count, 1ULL);
+    KUNIT_EXPECT_EQ(test, assoofs_sb_get_a_freeblock(sb, &block), 0);
+    KUNIT_EXPECT_EQ(test, block, data_start + 1);
+
+    // Un tramo acaba en el final del bloque del mapa, y el cursor sigue detrás: el bloque 1 del mapa entero
+    KUNIT_EXPECT_EQ(test, assoofs_sb_get_freeblocks(sb, bits - 10, 100, &block, &count), 0);
+    KUNIT_EXPECT_EQ(test, block, (uint64_t)bits - 10);
+    KUNIT_EXPECT_EQ(test, count, 10ULL);
+    KUNIT_EXPECT_EQ(test, assoofs_sb_get_freeblocks(sb, 0, bits, &block, &count), 0);
+    KUNIT_EXPECT_EQ(test, block, (uint64_t)bits);
+    KUNIT_EXPECT_EQ(test, count, (uint64_t)bits);
+    KUNIT_EXPECT_EQ(test, (uint64_t)sbi->bitmap_free[1], 0ULL);
+
+    // Un objetivo dentro de un bloque del mapa lleno salta al siguiente
+    KUNIT_EXPECT_EQ(test, assoofs_sb_get_freeblocks(sb, bits + 5, 1, &block, &count), 0);
+    KUNIT_EXPECT_EQ(test, block, 2ULL * bits);
+
+    // Liberar un tramo que cruza dos bloques del mapa: cada uno recupera lo suyo y el cursor vuelve atrás
+    assoofs_sb_set_freeblocks(sb, 2 * bits - 8, 16);
+    KUNIT_EXPECT_EQ(test, (uint64_t)sbi->bitmap_free[1], 8ULL);
+    KUNIT_EXPECT_EQ(test, (uint64_t)sbi->bitmap_free[2], last_free);
+    KUNIT_EXPECT_EQ(test, sbi->next_block, 2ULL * bits - 8);
+    KUNIT_EXPECT_EQ(test, assoofs_sb_get_freeblocks(sb, 0, 100, &block, &count), 0);
+    KUNIT_EXPECT_EQ(test, block, 2ULL * bits - 8);
+    KUNIT_EXPECT_EQ(test, count, 8ULL);
+
+    // Fuera de la zona de datos no se libera nada
+    count = sbi->persistent.free_blocks;
+    assoofs_sb_set_freeblocks(sb, 0, 1);
+    assoofs_sb_set_freeblocks(sb, sbi->persistent.blocks_count - 1, 2);
+    KUNIT_EXPECT_EQ(test, sbi->persistent.free_blocks, count);
+
+    // Se agota todo lo que queda (hay 2 + 10 + bits bloques ocupados) y después no hay más
+    while (!assoofs_sb_get_freeblocks(sb, 0, bits, &block, &count))
+    {
+        got += count;
+    }
+    KUNIT_EXPECT_EQ(test, got, total - 2 - 10 - bits);
+    KUNIT_EXPECT_EQ(test, sbi->persistent.free_blocks, 0ULL);
+    KUNIT_EXPECT_EQ(test, percpu_counter_sum(&sbi->free_blocks), 0LL);
+    KUNIT_EXPECT_EQ(test, sbi->bitmap_free[0] + sbi->bitmap_free[1] + sbi->bitmap_free[2], 0U);
+
+    // Liberarlo todo deja el mapa como al montar
+    assoofs_sb_set_freeblocks(sb, data_start, total);
+    KUNIT_EXPECT_EQ(test, sbi->persistent.free_blocks, total);
+    KUNIT_EXPECT_EQ(test, percpu_counter_sum(&sbi->free_blocks), (s64)total);
+    KUNIT_EXPECT_EQ(test, (uint64_t)sbi->bitmap_free[0], bits - data_start);
+    KUNIT_EXPECT_EQ(test, (uint64_t)sbi->bitmap_free[2], last_free);
+    KUNIT_EXPECT_EQ(test, sbi->next_block, data_start);
+    KUNIT_EXPECT_EQ(test, assoofs_test_held(sb), 0ULL);
+}
+
+/**
+ * @brief ns/op de reservar n bloques de uno en uno con assoofs_sb_get_a_freeblock y de liberarlos con
+ * assoofs_sb_set_freeblocks en orden disperso, en un disco con n bloques de datos
+ */
+static void assoofs_test_bench_blocks(struct kunit *test)
+{
+    unsigned long n = *(const unsigned long *)test->param_value;
+    uint64_t data_start, block = 0, begin, alloc_ns, free_ns;
+    struct super_block *sb;
+    unsigned long i;
+
+    sb = assoofs_test_mount(test, ASSOOFS_DEFAULT_BLOCK_SIZE, n, 16);
+    KUNIT_ASSERT_NOT_NULL(test, sb);
+    data_start = assoofs_test_data_start(sb);
+
+    begin = ktime_get_ns();
+    for (i = 0; i < n; i++)
+    {
+        if (assoofs_sb_get_a_freeblock(sb, &block) || block != data_start + i)
+        {
+            break;
+        }
+    }
+    alloc_ns = ktime_get_ns() - begin;
+    KUNIT_EXPECT_EQ(test, i, n);
+    KUNIT_EXPECT_EQ(test, assoofs_sb_get_a_freeblock(sb, &block), -ENOSPC);
+
+    begin = ktime_get_ns();
+    for (i = 0; i < n; i++)
+    {
+        assoofs_sb_set_freeblocks(sb, data_start + assoofs_test_perm(i, n), 1);
+    }
+    free_ns = ktime_get_ns() - begin;
+    KUNIT_EXPECT_EQ(test, ASSOOFS_SB(sb)->persistent.free_blocks, (uint64_t)n);
+    KUNIT_EXPECT_EQ(test, percpu_counter_sum(&ASSOOFS_SB(sb)->free_blocks), (s64)n);
+    KUNIT_EXPECT_EQ(test, assoofs_test_held(sb), 0ULL);
+
+    kunit_info(test, "allocator %lu blocks: alloc %llu ns/op, free %llu ns/op\n", n, div64_u64(alloc_ns, n), div64_u64(free_ns, n));
+}
+
+/*
+ *  Mapa de extents
+ */
+
+/**
+ * @brief Comprueba que el mapa tiene exactamente blocks bloques y que cada uno es el de phys
+ */
+static void assoofs_test_extent_check(struct kunit *test, struct super_block *sb, struct assoofs_inode_info *info, uint64_t *phys, uint64_t blocks)
+{
+    uint64_t lblk, mapped = 0, block = 0;
+
+    KUNIT_EXPECT_EQ(test, info->blocks, blocks);
+    for (lblk = 0; lblk < blocks; lblk++)
+    {
+        if (!assoofs_extent_lookup(sb, info, lblk, &block, NULL) && block == phys[lblk])
+        {
+            mapped++;
+        }
+    }
+    KUNIT_EXPECT_EQ(test, mapped, blocks);
+    KUNIT_EXPECT_EQ(test, assoofs_extent_lookup(sb, info, blocks, &block, NULL), -ENOENT);
+}
+
+/**
+ * @brief Un fichero con extents de dos bloques separados por huecos, suficientes para que el árbol tenga
+ * dos niveles de bloques de extents, recortado por partes con assoofs_extent_truncate: dentro de un extent,
+ * en el límite entre extents, dentro de la raíz y a cero. Cada recorte devuelve al asignador los bloques
+ * de datos sobrantes y el fichero sigue pudiendo crecer por el final
+ */
+static void assoofs_test_extents(struct kunit *test)
+{
+    unsigned long blocksize = *(const unsigned long *)test->param_value;
+    uint64_t extents = ASSOOFS_INLINE_EXTENTS * ((blocksize - sizeof(struct assoofs_extent_header)) / sizeof(struct assoofs_extent)) + 1;
+    uint64_t *phys, *fillers, block = 0, count = 0, free_blocks, i;
+    struct assoofs_inode_info info = {0};
+    struct super_block *sb;
+
+    sb = assoofs_test_mount(test, blocksize, 4 * extents, 16);
+    KUNIT_ASSERT_NOT_NULL(test, sb);
+    phys = kunit_kcalloc(test, 2 * extents + 1, sizeof(*phys), GFP_KERNEL);
+    fillers = kunit_kcalloc(test, extents, sizeof(*fillers), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, phys);
+    KUNIT_ASSERT_NOT_NULL(test, fillers);
+    info.mode = S_IFREG | 0644;
+    assoofs_extent_init(&info);
+    free_blocks = ASSOOFS_SB(sb)->persistent.free_blocks;
+
+    // Cada extent tiene dos bloques y detrás un bloque ocupado que impide que se junte con el siguiente
+    for (i = 0; i < extents; i++)
+    {
+        KUNIT_ASSERT_EQ(test, assoofs_sb_get_freeblocks(sb, 0, 2, &block, &count), 0);
+        KUNIT_ASSERT_EQ(test, count, 2ULL);
+        KUNIT_ASSERT_EQ(test, assoofs_extent_append(sb, &info, block, 2), 0);
+        phys[2 * i] = block;
+        phys[2 * i + 1] = block + 1;
+        KUNIT_ASSERT_EQ(test, assoofs_sb_get_a_freeblock(sb, &fillers[i]), 0);
+    }
+    KUNIT_EXPECT_EQ(test, info.extent_header.depth, 2);
+    assoofs_test_extent_check(test, sb, &info, phys, 2 * extents);
+
+    // Recortar lo que ya no existe no cambia nada
+    KUNIT_EXPECT_EQ(test, assoofs_extent_truncate(sb, &info, 2 * extents), 0);
+    assoofs_test_extent_check(test, sb, &info, phys, 2 * extents);
+
+    // Dentro del último extent: se libera su segundo bloque
+    count = ASSOOFS_SB(sb)->persistent.free_blocks;
+    KUNIT_EXPECT_EQ(test, assoofs_extent_truncate(sb, &info, 2 * extents - 1), 0);
+    assoofs_test_extent_check(test, sb, &info, phys, 2 * extents - 1);
+    KUNIT_EXPECT_EQ(test, ASSOOFS_SB(sb)->persistent.free_blocks, count + 1);
+
+    // En el límite entre dos extents de la mitad del árbol: las hojas de la derecha se liberan enteras
+    count = ASSOOFS_SB(sb)->persistent.free_blocks;
+    KUNIT_EXPECT_EQ(test, assoofs_extent_truncate(sb, &info, extents + 1), 0);
+    assoofs_test_extent_check(test, sb, &info, phys, extents + 1);
+    KUNIT_EXPECT_GE(test, ASSOOFS_SB(sb)->persistent.free_blocks, count + extents - 2);
+
+    // El fichero vuelve a crecer por el final: el bloque nuevo sigue al extent recortado
+    KUNIT_EXPECT_EQ(test, assoofs_sb_get_a_freeblock(sb, &phys[extents + 1]), 0);
+    KUNIT_EXPECT_EQ(test, assoofs_extent_append(sb, &info, phys[extents + 1], 1), 0);
+    assoofs_test_extent_check(test, sb, &info, phys, extents + 2);
+
+    // Dentro del primer extent y después a cero: el mapa queda vacío
+    KUNIT_EXPECT_EQ(test, assoofs_extent_truncate(sb, &info, 1), 0);
+    assoofs_test_extent_check(test, sb, &info, phys, 1);
+    KUNIT_EXPECT_EQ(test, assoofs_extent_truncate(sb, &info, 0), 0);
+    assoofs_test_extent_check(test, sb, &info, phys, 0);
+    KUNIT_EXPECT_EQ(test, info.extent_header.entries, 0);
+
+    // Sin los bloques de relleno el disco vuelve a estar como al montar: no se ha perdido ningún bloque de extents
+    for (i = 0; i < extents; i++)
+    {
+        assoofs_sb_set_freeblocks(sb, fillers[i], 1);
+    }
+    KUNIT_EXPECT_EQ(test, ASSOOFS_SB(sb)->persistent.free_blocks, free_blocks);
+    KUNIT_EXPECT_EQ(test, assoofs_test_held(sb), 0ULL);
+}
+
+/*
+ *  Tabla de inodos
+ */
+
+static void assoofs_test_inode_slot(struct kunit *test)
+{
+    unsigned long blocksize = *(const unsigned long *)test->param_value;
+    uint64_t per_block = ASSOOFS_INODES_PER_BLOCK(blocksize);
+    struct assoofs_super_block_info afs_sb = {.inode_table_blocks = 3};
+    struct assoofs_inode_info slot = {0};
+    uint64_t block = 0;
+
+    // La ranura 0 no se usa y la tabla acaba en la ranura 3 * per_block - 1
+    KUNIT_EXPECT_EQ(test, assoofs_inode_slot(&afs_sb, blocksize, 0, &block), -EINVAL);
+    KUNIT_EXPECT_EQ(test, assoofs_inode_slot(&afs_sb, blocksize, 1, &block), ASSOOFS_INODE_SIZE);
+    KUNIT_EXPECT_EQ(test, block, 0ULL);
+    KUNIT_EXPECT_EQ(test, assoofs_inode_slot(&afs_sb, blocksize, per_block - 1, &block), (int)((per_block - 1) * ASSOOFS_INODE_SIZE));
+    KUNIT_EXPECT_EQ(test, block, 0ULL);
+    KUNIT_EXPECT_EQ(test, assoofs_inode_slot(&afs_sb, blocksize, per_block, &block), 0);
+    KUNIT_EXPECT_EQ(test, block, 1ULL);
+    KUNIT_EXPECT_EQ(test, assoofs_inode_slot(&afs_sb, blocksize, 3 * per_block - 1, &block), (int)((per_block - 1) * ASSOOFS_INODE_SIZE));
+    KUNIT_EXPECT_EQ(test, block, 2ULL);
+    KUNIT_EXPECT_EQ(test, assoofs_inode_slot(&afs_sb, blocksize, 3 * per_block, &block), -EINVAL);
+
+    // Una ranura solo vale si está en uso y guarda ese número
+    KUNIT_EXPECT_FALSE(test, assoofs_inode_slot_valid(&slot, 0));
+    slot.inode_no = 7;
+    KUNIT_EXPECT_FALSE(test, assoofs_inode_slot_valid(&slot, 7));
+    slot.state_flag = ASSOOFS_FLAG_USED;
+    KUNIT_EXPECT_TRUE(test, assoofs_inode_slot_valid(&slot, 7));
+    KUNIT_EXPECT_FALSE(test, assoofs_inode_slot_valid(&slot, 8));
+}
+
+/**
+ * @brief Guarda en la tabla un inodo en uso con el número ino (para las pruebas, file_size = 10 * ino)
+ */
+static void assoofs_test_add_inode(struct super_block *sb, uint64_t ino)
+{
+    struct assoofs_inode_info info = {0};
+
+    info.mode = S_IFREG | 0644;
+    info.inode_no = ino;
+    info.file_size = 10 * ino;
+    info.state_flag = ASSOOFS_FLAG_USED;
+    assoofs_add_inode_info(sb, &info);
+}
+
+/**
+ * @brief La tabla de inodos del módulo llena (tres bloques): reserva de números por orden, cada inodo
+ * en su ranura, números fuera de la tabla y ranuras liberadas que se reutilizan
+ */
+static void assoofs_test_inodes(struct kunit *test)
+{
+    unsigned long blocksize = *(const unsigned long *)test->param_value;
+    uint64_t per_block = ASSOOFS_INODES_PER_BLOCK(blocksize), max, ino = 0, i;
+    struct assoofs_inode_info info = {0};
+    struct assoofs_inode_info *slot;
+    struct assoofs_sb_info *sbi;
+    struct buffer_head *bh;
+    struct super_block *sb;
+
+    sb = assoofs_test_mount(test, blocksize, 64, 3 * per_block - 2);
+    KUNIT_ASSERT_NOT_NULL(test, sb);
+    sbi = ASSOOFS_SB(sb);
+    max = assoofs_max_inodes(sb);
+    KUNIT_ASSERT_EQ(test, max, 3 * per_block - 1);
+
+    // Los números salen por orden a partir del primero después del raíz, hasta llenar la tabla
+    for (i = ASSOOFS_LAST_RESERVED_INODE + 1; i <= max; i++)
+    {
+        if (assoofs_new_inode_no(sb, &ino) || ino != i)
+        {
+            break;
+        }
+        assoofs_test_add_inode(sb, ino);
+    }
+    KUNIT_EXPECT_EQ(test, i, max + 1);
+    KUNIT_EXPECT_EQ(test, assoofs_new_inode_no(sb, &ino), -ENOSPC);
+    KUNIT_EXPECT_EQ(test, sbi->persistent.inodes_count, max);
+    KUNIT_EXPECT_EQ(test, percpu_counter_sum(&sbi->free_inodes), 0LL);
+
+    // Cada inodo está en su ranura y se lee entero
+    for (i = ASSOOFS_LAST_RESERVED_INODE + 1; i <= max; i++)
+    {
+        slot = assoofs_search_inode_info(sb, i, &bh);
+        KUNIT_ASSERT_NOT_NULL(test, slot);
+        KUNIT_EXPECT_EQ(test, (uint64_t)bh->b_blocknr, sbi->persistent.inode_table_start + i / per_block);
+        KUNIT_EXPECT_PTR_EQ(test, (char *)slot, bh->b_data + (i % per_block) * ASSOOFS_INODE_SIZE);
+        brelse(bh);
+        KUNIT_EXPECT_EQ(test, assoofs_get_inode_info(sb, i, &info), 0);
+        KUNIT_EXPECT_EQ(test, info.inode_no, i);
+        KUNIT_EXPECT_EQ(test, info.file_size, 10 * i);
+    }
+
+    // Fuera de la tabla no hay ranura, y la del raíz (que nadie ha escrito) no está en uso
+    KUNIT_EXPECT_NULL(test, assoofs_search_inode_info(sb, 0, &bh));
+    KUNIT_EXPECT_NULL(test, assoofs_search_inode_info(sb, max + 1, &bh));
+    KUNIT_EXPECT_EQ(test, assoofs_get_inode_info(sb, max + 1, &info), -EIO);
+    KUNIT_EXPECT_EQ(test, assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER, &info), -EIO);
+
+    // Un inodo borrado deja de leerse y su número es el siguiente en salir
+    ino = per_block + 1;
+    KUNIT_EXPECT_EQ(test, assoofs_get_inode_info(sb, ino, &info), 0);
+    info.state_flag = ASSOOFS_FLAG_FREE;
+    KUNIT_EXPECT_EQ(test, assoofs_save_inode_info(sb, &info), 0);
+    assoofs_free_inode_no(sb, ino);
+    KUNIT_EXPECT_EQ(test, assoofs_get_inode_info(sb, ino, &info), -EIO);
+    KUNIT_EXPECT_EQ(test, sbi->persistent.inodes_count, max - 1);
+    KUNIT_EXPECT_EQ(test, assoofs_new_inode_no(sb, &i), 0);
+    KUNIT_EXPECT_EQ(test, i, ino);
+    KUNIT_EXPECT_EQ(test, assoofs_test_held(sb), 0ULL);
+}
+
+/**
+ * @brief ns/op de crear n inodos (assoofs_new_inode_no y assoofs_add_inode_info) y de leerlos en orden
+ * disperso con assoofs_get_inode_info, con bloques de tamaño por defecto
+ */
+static void assoofs_test_bench_inode(struct kunit *test)
+{
+    unsigned long n = *(const unsigned long *)test->param_value;
+    struct assoofs_inode_info info = {0};
+    uint64_t ino = 0, begin, create_ns, lookup_ns;
+    unsigned long i, found = 0;
+    struct super_block *sb;
+
+    sb = assoofs_test_mount(test, ASSOOFS_DEFAULT_BLOCK_SIZE, 16, n);
+    KUNIT_ASSERT_NOT_NULL(test, sb);
+
+    begin = ktime_get_ns();
+    for (i = 0; i < n; i++)
+    {
+        if (assoofs_new_inode_no(sb, &ino) || ino != i + ASSOOFS_LAST_RESERVED_INODE + 1)
+        {
+            break;
+        }
+        assoofs_test_add_inode(sb, ino);
+    }
+    create_ns = ktime_get_ns() - begin;
+    if (ASSOOFS_SB(sb)->test_disk->nomem)
+    {
+        kunit_mark_skipped(test, "not enough memory for %lu inodes", n);
+        return;
+    }
+    KUNIT_EXPECT_EQ(test, i, n);
+
+    begin = ktime_get_ns();
+    for (i = 0; i < n; i++)
+    {
+        ino = assoofs_test_perm(i, n) + ASSOOFS_LAST_RESERVED_INODE + 1;
+        if (!assoofs_get_inode_info(sb, ino, &info) && info.inode_no == ino && info.file_size == 10 * ino)
+        {
+            found++;
+        }
+    }
+    lookup_ns = ktime_get_ns() - begin;
+    KUNIT_EXPECT_EQ(test, found, n);
+    KUNIT_EXPECT_EQ(test, assoofs_test_held(sb), 0ULL);
+
+    kunit_info(test, "inode table %lu inodes: create %llu ns/op, lookup %llu ns/op\n", n, div64_u64(create_ns, n), div64_u64(lookup_ns, n));
+}
+
+/*
+ *  Directorios
+ */
+
+/**
+ * @brief Comprueba que las entradas de un bloque se encadenan sin salirse y lo cubren entero
+ *
+ * @return unsigned long entradas en uso del bloque, o size + 1 si la cadena está rota
+ */
+static unsigned long assoofs_test_dir_walk(char *data, unsigned int size)
+{
+    struct assoofs_dir_entry *de;
+    unsigned int offset;
+    unsigned long used = 0;
+
+    for (offset = 0; offset < size; offset += de->rec_len)
+    {
+        de = (struct assoofs_dir_entry *)(data + offset);
+        if (!assoofs_dir_entry_valid(de, offset, size))
+        {
+            return size + 1;
+        }
+        if (de->inode_no)
+        {
+            used++;
+        }
+    }
+    return offset == size ? used : size + 1;
+}
+
+static void assoofs_test_dir_block(struct kunit *test)
+{
+    unsigned int size = *(const unsigned long *)test->param_value;
+    struct assoofs_dir_entry *de, *prev, *first;
+    char buf[ASSOOFS_TEST_NAME_LEN + 1];
+    char long_name[ASSOOFS_FILENAME_MAXLEN];
+    struct qstr name, big = {0};
+    unsigned long i, count;
+    uint32_t hash;
+    char *data;
+
+    data = kunit_kzalloc(test, size, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, data);
+    assoofs_dir_init_block(data, size);
+    first = (struct assoofs_dir_entry *)data;
+    KUNIT_EXPECT_EQ(test, (unsigned int)first->rec_len, size);
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_walk(data, size), 0UL);
+
+    // Llenamos el bloque: caben exactamente size / tamaño de entrada
+    for (count = 0;; count++)
+    {
+        assoofs_test_name(&name, buf, count);
+        de = assoofs_dir_block_space(data, size, ASSOOFS_DIR_ENTRY_SIZE(name.len));
+        KUNIT_ASSERT_FALSE(test, IS_ERR(de));
+        if (!de)
+        {
+            break;
+        }
+        assoofs_dir_block_fill(de, &name, count + 1, ASSOOFS_FT_REG, assoofs_name_hash(buf, name.len));
+    }
+    KUNIT_EXPECT_EQ(test, count, (unsigned long)(size / ASSOOFS_DIR_ENTRY_SIZE(ASSOOFS_TEST_NAME_LEN)));
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_walk(data, size), count);
+
+    // Todas se encuentran, con su entrada anterior; un nombre que no está, no
+    for (i = 0; i < count; i++)
+    {
+        assoofs_test_name(&name, buf, i);
+        de = assoofs_dir_block_find(data, size, &name, assoofs_name_hash(buf, name.len), &prev);
+        KUNIT_ASSERT_NOT_NULL(test, de);
+        KUNIT_EXPECT_EQ(test, de->inode_no, (uint64_t)(i + 1));
+        KUNIT_EXPECT_TRUE(test, i ? (char *)prev + prev->rec_len == (char *)de : prev == NULL);
+    }
+    assoofs_test_name(&name, buf, count);
+    KUNIT_EXPECT_NULL(test, assoofs_dir_block_find(data, size, &name, assoofs_name_hash(buf, name.len), NULL));
+
+    // Borrar la primera la deja libre; borrar otra pasa su espacio a la anterior
+    assoofs_test_name(&name, buf, 0);
+    hash = assoofs_name_hash(buf, name.len);
+    de = assoofs_dir_block_find(data, size, &name, hash, &prev);
+    KUNIT_ASSERT_NOT_NULL(test, de);
+    assoofs_dir_block_remove(de, prev);
+    KUNIT_EXPECT_EQ(test, first->inode_no, 0ULL);
+    KUNIT_EXPECT_NULL(test, assoofs_dir_block_find(data, size, &name, hash, NULL));
+    assoofs_test_name(&name, buf, 2);
+    de = assoofs_dir_block_find(data, size, &name, assoofs_name_hash(buf, name.len), &prev);
+    KUNIT_ASSERT_NOT_NULL(test, de);
+    assoofs_dir_block_remove(de, prev);
+    KUNIT_EXPECT_EQ(test, (unsigned int)prev->rec_len, 2 * ASSOOFS_DIR_ENTRY_SIZE(ASSOOFS_TEST_NAME_LEN));
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_walk(data, size), count - 2);
+
+    // El hueco liberado se vuelve a usar
+    assoofs_test_name(&name, buf, 0);
+    de = assoofs_dir_block_space(data, size, ASSOOFS_DIR_ENTRY_SIZE(name.len));
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, de);
+    assoofs_dir_block_fill(de, &name, 1, ASSOOFS_FT_REG, hash);
+    KUNIT_EXPECT_NOT_NULL(test, assoofs_dir_block_find(data, size, &name, hash, NULL));
+
+    // Un nombre de la longitud máxima cabe en cualquier bloque vacío, pero no en un directorio en línea
+    memset(long_name, 'a', sizeof(long_name));
+    big.name = (const unsigned char *)long_name;
+    big.len = sizeof(long_name);
+    assoofs_dir_init_block(data, size);
+    de = assoofs_dir_block_space(data, size, ASSOOFS_DIR_ENTRY_SIZE(big.len));
+    KUNIT_EXPECT_FALSE(test, IS_ERR(de));
+    if (size < ASSOOFS_DIR_ENTRY_SIZE(ASSOOFS_FILENAME_MAXLEN))
+    {
+        KUNIT_EXPECT_NULL(test, de);
+    }
+    else
+    {
+        KUNIT_ASSERT_NOT_NULL(test, de);
+        assoofs_dir_block_fill(de, &big, 2, ASSOOFS_FT_DIR, assoofs_name_hash(long_name, big.len));
+        KUNIT_EXPECT_NOT_NULL(test, assoofs_dir_block_find(data, size, &big, assoofs_name_hash(long_name, big.len), NULL));
+        KUNIT_EXPECT_EQ(test, assoofs_test_dir_walk(data, size), 1UL);
+    }
+
+    // Un bloque con la cadena rota no se recorre
+    first->rec_len = 0;
+    KUNIT_EXPECT_PTR_EQ(test, assoofs_dir_block_space(data, size, ASSOOFS_DIR_ENTRY_SIZE(1)), ERR_PTR(-EIO));
+    KUNIT_EXPECT_NULL(test, assoofs_dir_block_find(data, size, &big, 0, NULL));
+}
+
+/**
+ * @brief Comprueba una hoja de un directorio indexado: bien encadenada y con nombres cuyo hash (bien
+ * calculado) cae en el tramo [lo, hi) que le da el índice
+ *
+ * @return long entradas en uso de la hoja, -1 si algo no cuadra
+ */
+static long assoofs_test_dir_check_leaf(struct super_block *sb, struct assoofs_inode_info *dir, uint64_t lblk, uint64_t lo, uint64_t hi)
+{
+    struct assoofs_dir_entry *de;
+    struct buffer_head *bh;
+    unsigned int offset;
+    long used;
+
+    bh = assoofs_dir_bread(sb, dir, lblk);
+    if (!bh)
+    {
+        return -1;
+    }
+    used = assoofs_test_dir_walk(bh->b_data, sb->s_blocksize);
+    if (used > sb->s_blocksize)
+    {
+        used = -1;
+    }
+    for (offset = 0; used >= 0 && offset < sb->s_blocksize; offset += de->rec_len)
+    {
+        de = (struct assoofs_dir_entry *)(bh->b_data + offset);
+        if (de->inode_no && (de->hash < lo || de->hash >= hi || de->hash != assoofs_name_hash(de->name, de->name_len)))
+        {
+            used = -1;
+        }
+    }
+    brelse(bh);
+    return used;
+}
+
+/**
+ * @brief Recorre el índice de un directorio desde el bloque lblk (la raíz o un nodo intermedio) que cubre
+ * los hashes [lo, hi): entradas ordenadas, la primera con el hash lo y cada hoja dentro de su tramo
+ *
+ * @return long entradas en uso de todas las hojas de ese bloque del índice, -1 si algo no cuadra
+ */
+static long assoofs_test_dir_check_index(struct super_block *sb, struct assoofs_inode_info *dir, uint64_t lblk, bool node, uint64_t lo, uint64_t hi)
+{
+    struct assoofs_dir_index_header *hdr;
+    struct assoofs_dir_index_entry *entries;
+    struct buffer_head *bh;
+    uint64_t next;
+    long used, total = 0;
+    uint32_t i, levels;
+
+    bh = assoofs_dir_bread(sb, dir, lblk);
+    if (!bh)
+    {
+        return -1;
+    }
+    hdr = assoofs_dir_index(bh, node);
+    entries = assoofs_dir_index_entries(hdr);
+    levels = node ? 0 : hdr->levels;
+    if (hdr->magic != ASSOOFS_DIR_INDEX_MAGIC || hdr->count == 0 || hdr->count > hdr->limit || entries[0].hash != lo)
+    {
+        total = -1;
+    }
+    for (i = 0; total >= 0 && i < hdr->count; i++)
+    {
+        next = i + 1 < hdr->count ? entries[i + 1].hash : hi;
+        if (next <= entries[i].hash || next > hi)
+        {
+            total = -1;
+            break;
+        }
+        if (levels)
+        {
+            used = assoofs_test_dir_check_index(sb, dir, entries[i].block, true, entries[i].hash, next);
+        }
+        else
+        {
+            used = assoofs_test_dir_check_leaf(sb, dir, entries[i].block, entries[i].hash, next);
+        }
+        total = used < 0 ? -1 : total + used;
+    }
+    brelse(bh);
+    return total;
+}
+
+/**
+ * @brief Entradas en uso de un directorio (en línea, lineal o indexado) tras comprobar que está bien formado
+ *
+ * @return long número de entradas, -1 si el directorio está mal formado
+ */
+static long assoofs_test_dir_count(struct super_block *sb, struct assoofs_inode_info *dir)
+{
+    struct buffer_head *bh;
+    unsigned long used;
+
+    if (dir->flags & ASSOOFS_INODE_INLINE)
+    {
+        used = assoofs_test_dir_walk(dir->inline_data, ASSOOFS_INLINE_DATA_SIZE);
+        return used > ASSOOFS_INLINE_DATA_SIZE ? -1 : (long)used;
+    }
+    if (dir->flags & ASSOOFS_INODE_INDEXED)
+    {
+        return assoofs_test_dir_check_index(sb, dir, 0, false, 0, (uint64_t)U32_MAX + 1);
+    }
+    bh = assoofs_dir_bread(sb, dir, 0);
+    if (!bh)
+    {
+        return -1;
+    }
+    used = assoofs_test_dir_walk(bh->b_data, sb->s_blocksize);
+    brelse(bh);
+    return used > sb->s_blocksize ? -1 : (long)used;
+}
+
+/**
+ * @brief Crea en la tabla un directorio vacío en línea, como assoofs_mkdir sin ASSOOFS_FEATURE_BLOCK_DIRS
+ */
+static int assoofs_test_mkdir(struct super_block *sb, struct assoofs_inode_info *dir)
+{
+    int ret;
+
+    memset(dir, 0, sizeof(*dir));
+    ret = assoofs_new_inode_no(sb, &dir->inode_no);
+    if (ret)
+    {
+        return ret;
+    }
+    dir->mode = S_IFDIR | 0755;
+    dir->state_flag = ASSOOFS_FLAG_USED;
+    assoofs_dir_init_inline(dir);
+    assoofs_add_inode_info(sb, dir);
+    return 0;
+}
+
+/**
+ * @brief Añade a un directorio el nombre número i (apunta al inodo i + 2) con assoofs_dir_add_entry
+ */
+static int assoofs_test_dir_add(struct super_block *sb, struct assoofs_inode_info *dir, unsigned long i)
+{
+    char buf[ASSOOFS_TEST_NAME_LEN + 1];
+    struct qstr name;
+    int ret;
+
+    assoofs_test_name(&name, buf, i);
+    ret = assoofs_dir_add_entry(sb, dir, &name, i + 2, ASSOOFS_FT_REG);
+    if (!ret)
+    {
+        dir->dir_children_count++;
+    }
+    return ret;
+}
+
+/**
+ * @brief Busca en un directorio el nombre número i con assoofs_dir_find_entry
+ *
+ * @return uint64_t inodo al que apunta, 0 si no está
+ */
+static uint64_t assoofs_test_dir_find(struct super_block *sb, struct assoofs_inode_info *dir, unsigned long i)
+{
+    char buf[ASSOOFS_TEST_NAME_LEN + 1];
+    struct assoofs_dir_entry *de;
+    struct assoofs_dir_block db;
+    struct qstr name;
+    uint64_t ino;
+
+    assoofs_test_name(&name, buf, i);
+    de = assoofs_dir_find_entry(sb, dir, &name, &db);
+    if (!de)
+    {
+        return 0;
+    }
+    ino = de->inode_no;
+    assoofs_dir_put_block(&db);
+    return ino;
+}
+
+/**
+ * @brief Borra de un directorio el nombre número i, que debe apuntar al inodo ino, con assoofs_dir_remove_entry
+ */
+static int assoofs_test_dir_remove(struct super_block *sb, struct assoofs_inode_info *dir, unsigned long i, uint64_t ino)
+{
+    char buf[ASSOOFS_TEST_NAME_LEN + 1];
+    struct qstr name;
+    int ret;
+
+    assoofs_test_name(&name, buf, i);
+    ret = assoofs_dir_remove_entry(sb, dir, &name, ino);
+    if (!ret)
+    {
+        dir->dir_children_count--;
+    }
+    return ret;
+}
+
+// Nombres de la prueba de directorios: con bloques menores que los de por defecto bastan para que el índice crezca un nivel
+#define ASSOOFS_TEST_DIR_NAMES 20000
+
+/**
+ * @brief Un directorio del módulo desde vacío: en línea, su primer bloque, indexado y con hojas que se
+ * dividen (y con bloques pequeños, nodos intermedios); después se borra la mitad y el resto, y al
+ * quedarse vacío devuelve todos sus bloques
+ */
+static void assoofs_test_dir(struct kunit *test)
+{
+    unsigned long blocksize = *(const unsigned long *)test->param_value;
+    unsigned long inline_max = ASSOOFS_INLINE_DATA_SIZE / ASSOOFS_DIR_ENTRY_SIZE(ASSOOFS_TEST_NAME_LEN);
+    unsigned long block_max = blocksize / ASSOOFS_DIR_ENTRY_SIZE(ASSOOFS_TEST_NAME_LEN);
+    unsigned long n = ASSOOFS_TEST_DIR_NAMES, i, found = 0;
+    struct assoofs_inode_info dir;
+    struct buffer_head *bh;
+    struct super_block *sb;
+    uint64_t free_blocks;
+
+    sb = assoofs_test_mount(test, blocksize, n * 96 / blocksize + 64, 16);
+    KUNIT_ASSERT_NOT_NULL(test, sb);
+    KUNIT_ASSERT_EQ(test, assoofs_test_mkdir(sb, &dir), 0);
+    free_blocks = ASSOOFS_SB(sb)->persistent.free_blocks;
+
+    // En línea mientras caben; el siguiente nombre lo pasa a un bloque
+    for (i = 0; i < inline_max; i++)
+    {
+        KUNIT_ASSERT_EQ(test, assoofs_test_dir_add(sb, &dir, i), 0);
+    }
+    KUNIT_EXPECT_TRUE(test, dir.flags & ASSOOFS_INODE_INLINE);
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_count(sb, &dir), (long)inline_max);
+    KUNIT_ASSERT_EQ(test, assoofs_test_dir_add(sb, &dir, i++), 0);
+    KUNIT_EXPECT_FALSE(test, dir.flags & ASSOOFS_INODE_INLINE);
+    KUNIT_EXPECT_EQ(test, dir.blocks, 1ULL);
+
+    // Lineal mientras cabe en el bloque; el siguiente nombre lo convierte en indexado
+    for (; i < block_max; i++)
+    {
+        KUNIT_ASSERT_EQ(test, assoofs_test_dir_add(sb, &dir, i), 0);
+    }
+    KUNIT_EXPECT_FALSE(test, dir.flags & ASSOOFS_INODE_INDEXED);
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_count(sb, &dir), (long)block_max);
+    KUNIT_ASSERT_EQ(test, assoofs_test_dir_add(sb, &dir, i++), 0);
+    KUNIT_EXPECT_TRUE(test, dir.flags & ASSOOFS_INODE_INDEXED);
+
+    // El resto divide hojas y, con bloques pequeños, también la raíz del índice y sus nodos
+    for (; i < n; i++)
+    {
+        if (assoofs_test_dir_add(sb, &dir, i))
+        {
+            break;
+        }
+    }
+    KUNIT_EXPECT_EQ(test, i, n);
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_count(sb, &dir), (long)n);
+    bh = assoofs_dir_bread(sb, &dir, 0);
+    KUNIT_ASSERT_NOT_NULL(test, bh);
+    if (blocksize < ASSOOFS_DEFAULT_BLOCK_SIZE)
+    {
+        KUNIT_EXPECT_EQ(test, assoofs_dir_index(bh, false)->levels, 1U);
+    }
+    brelse(bh);
+
+    // Todos los nombres se encuentran y apuntan a su inodo; uno que no está, no
+    for (i = 0; i < n; i++)
+    {
+        if (assoofs_test_dir_find(sb, &dir, i) == i + 2)
+        {
+            found++;
+        }
+    }
+    KUNIT_EXPECT_EQ(test, found, n);
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_find(sb, &dir, n), 0ULL);
+
+    // Borrar exige que la entrada apunte a ese inodo; borrada la mitad, la otra mitad sigue ahí
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_remove(sb, &dir, 0, 3), -ENOENT);
+    for (i = 0; i < n; i += 2)
+    {
+        KUNIT_EXPECT_EQ(test, assoofs_test_dir_remove(sb, &dir, i, i + 2), 0);
+    }
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_remove(sb, &dir, 0, 2), -ENOENT);
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_count(sb, &dir), (long)(n / 2));
+    for (i = 0, found = 0; i < n; i++)
+    {
+        if (assoofs_test_dir_find(sb, &dir, i) == (i % 2 ? i + 2 : 0))
+        {
+            found++;
+        }
+    }
+    KUNIT_EXPECT_EQ(test, found, n);
+
+    // Vacío, el directorio vuelve a estar en línea y devuelve todos sus bloques
+    for (i = 1; i < n; i += 2)
+    {
+        KUNIT_EXPECT_EQ(test, assoofs_test_dir_remove(sb, &dir, i, i + 2), 0);
+    }
+    KUNIT_EXPECT_EQ(test, dir.dir_children_count, 0ULL);
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_count(sb, &dir), 0L);
+    assoofs_dir_shrink(sb, &dir);
+    KUNIT_EXPECT_TRUE(test, dir.flags & ASSOOFS_INODE_INLINE);
+    KUNIT_EXPECT_EQ(test, dir.blocks, 0ULL);
+    KUNIT_EXPECT_EQ(test, ASSOOFS_SB(sb)->persistent.free_blocks, free_blocks);
+    KUNIT_EXPECT_EQ(test, assoofs_test_held(sb), 0ULL);
+}
+
+// Listado de la prueba de assoofs_iterate: cuántas veces ha salido cada nombre y cuántos caben aún en el buffer
+struct assoofs_test_dir_ctx
+{
+    struct dir_context ctx;
+    unsigned long *seen;
+    unsigned long n;
+    unsigned long room;
+};
+
+static bool assoofs_test_filldir(struct dir_context *ctx, const char *name, int len, loff_t pos, u64 ino, unsigned int type)
+{
+    struct assoofs_test_dir_ctx *list = container_of(ctx, struct assoofs_test_dir_ctx, ctx);
+    char buf[ASSOOFS_TEST_NAME_LEN + 1];
+    unsigned long i;
+
+    if (!list->room)
+    {
+        return false;
+    }
+    list->room--;
+    memcpy(buf, name, min(len, ASSOOFS_TEST_NAME_LEN));
+    buf[min(len, ASSOOFS_TEST_NAME_LEN)] = 0;
+    if (len == ASSOOFS_TEST_NAME_LEN && !kstrtoul(buf, 16, &i) && i < list->n && ino == i + 2)
+    {
+        list->seen[i]++;
+    }
+    return true;
+}
+
+// Nombres de la prueba del listado y cuántos se añaden y se listan en cada paso
+#define ASSOOFS_TEST_LIST_NAMES 4000
+#define ASSOOFS_TEST_LIST_ADD 50
+#define ASSOOFS_TEST_LIST_ROOM 5
+
+/**
+ * @brief Un listado con assoofs_iterate repartido en muchas llamadas mientras el directorio crece: entre
+ * una y otra se añaden nombres, el directorio pasa a estar indexado y sus hojas se dividen. Los nombres
+ * que ya estaban al empezar salen exactamente una vez y los añadidos durante el listado, como mucho una
+ */
+static void assoofs_test_dir_iterate(struct kunit *test)
+{
+    unsigned long blocksize = *(const unsigned long *)test->param_value;
+    unsigned long first = blocksize / ASSOOFS_DIR_ENTRY_SIZE(ASSOOFS_TEST_NAME_LEN);
+    unsigned long n = ASSOOFS_TEST_LIST_NAMES, i, j, once = 0, twice = 0;
+    struct assoofs_test_dir_ctx list = {.n = n};
+    struct assoofs_inode *dir;
+    struct super_block *sb;
+    struct file *file;
+
+    sb = assoofs_test_mount(test, blocksize, n * 96 / blocksize + 64, 16);
+    KUNIT_ASSERT_NOT_NULL(test, sb);
+    dir = kunit_kzalloc(test, sizeof(*dir), GFP_KERNEL);
+    file = kunit_kzalloc(test, sizeof(*file), GFP_KERNEL);
+    list.seen = kunit_kcalloc(test, n, sizeof(*list.seen), GFP_KERNEL);
+    KUNIT_ASSERT_TRUE(test, dir && file && list.seen);
+    KUNIT_ASSERT_EQ(test, assoofs_test_mkdir(sb, &dir->info), 0);
+    dir->vfs_inode.i_sb = sb;
+    file->f_inode = &dir->vfs_inode;
+    list.ctx.actor = assoofs_test_filldir;
+
+    // Al empezar el directorio es lineal y tiene el bloque casi lleno: el primer paso ya lo indexa
+    for (i = 0; i < first - 1; i++)
+    {
+        KUNIT_ASSERT_EQ(test, assoofs_test_dir_add(sb, &dir->info, i), 0);
+    }
+    KUNIT_ASSERT_FALSE(test, dir->info.flags & ASSOOFS_INODE_INDEXED);
+
+    // El listado acaba cuando una llamada termina sin llenar el buffer
+    do
+    {
+        list.room = ASSOOFS_TEST_LIST_ROOM;
+        KUNIT_ASSERT_EQ(test, assoofs_iterate(file, &list.ctx), 0);
+        for (j = 0; list.room == 0 && j < ASSOOFS_TEST_LIST_ADD && i < n; j++, i++)
+        {
+            KUNIT_ASSERT_EQ(test, assoofs_test_dir_add(sb, &dir->info, i), 0);
+        }
+    } while (list.room == 0);
+    KUNIT_EXPECT_TRUE(test, dir->info.flags & ASSOOFS_INODE_INDEXED);
+    KUNIT_EXPECT_EQ(test, i, n);
+    KUNIT_EXPECT_EQ(test, list.ctx.pos, ASSOOFS_DIR_POS_EOF);
+
+    for (i = 0; i < n; i++)
+    {
+        once += i < first - 1 && list.seen[i] == 1;
+        twice += list.seen[i] > 1;
+    }
+    KUNIT_EXPECT_EQ(test, once, first - 1);
+    KUNIT_EXPECT_EQ(test, twice, 0UL);
+
+    // Desde el principio, con el directorio ya quieto, salen todos una vez
+    memset(list.seen, 0, n * sizeof(*list.seen));
+    list.ctx.pos = 0;
+    list.room = n + 1;
+    KUNIT_EXPECT_EQ(test, assoofs_iterate(file, &list.ctx), 0);
+    KUNIT_EXPECT_EQ(test, list.room, 1UL);
+    for (i = 0, once = 0; i < n; i++)
+    {
+        once += list.seen[i] == 1;
+    }
+    KUNIT_EXPECT_EQ(test, once, n);
+}
+
+/**
+ * @brief ns/op de insertar, buscar y borrar n nombres en un directorio del módulo (assoofs_dir_add_entry,
+ * assoofs_dir_find_entry y assoofs_dir_remove_entry) con bloques de tamaño por defecto. Se busca y se
+ * borra en órdenes dispersos distintos
+ */
+static void assoofs_test_bench_dir(struct kunit *test)
+{
+    unsigned long n = *(const unsigned long *)test->param_value;
+    uint64_t begin, insert_ns, lookup_ns, remove_ns, free_blocks, blocks;
+    unsigned long i, j, found = 0, removed = 0;
+    struct assoofs_inode_info dir;
+    struct super_block *sb;
+
+    sb = assoofs_test_mount(test, ASSOOFS_DEFAULT_BLOCK_SIZE, n * 96 / ASSOOFS_DEFAULT_BLOCK_SIZE + 64, 16);
+    KUNIT_ASSERT_NOT_NULL(test, sb);
+    KUNIT_ASSERT_EQ(test, assoofs_test_mkdir(sb, &dir), 0);
+    free_blocks = ASSOOFS_SB(sb)->persistent.free_blocks;
+
+    begin = ktime_get_ns();
+    for (i = 0; i < n; i++)
+    {
+        if (assoofs_test_dir_add(sb, &dir, i))
+        {
+            break;
+        }
+    }
+    insert_ns = ktime_get_ns() - begin;
+    if (ASSOOFS_SB(sb)->test_disk->nomem)
+    {
+        kunit_mark_skipped(test, "not enough memory for %lu names", n);
+        return;
+    }
+    KUNIT_EXPECT_EQ(test, i, n);
+    KUNIT_EXPECT_EQ(test, assoofs_test_dir_count(sb, &dir), (long)n);
+    blocks = dir.blocks;
+
+    begin = ktime_get_ns();
+    for (i = 0; i < n; i++)
+    {
+        j = assoofs_test_perm(i, n);
+        if (assoofs_test_dir_find(sb, &dir, j) == j + 2)
+        {
+            found++;
+        }
+    }
+    lookup_ns = ktime_get_ns() - begin;
+    KUNIT_EXPECT_EQ(test, found, n);
+
+    begin = ktime_get_ns();
+    for (i = 0; i < n; i++)
+    {
+        j = n - 1 - assoofs_test_perm(i, n);
+        if (!assoofs_test_dir_remove(sb, &dir, j, j + 2))
+        {
+            removed++;
+        }
+    }
+    remove_ns = ktime_get_ns() - begin;
+    KUNIT_EXPECT_EQ(test, removed, n);
+    assoofs_dir_shrink(sb, &dir);
+    KUNIT_EXPECT_EQ(test, ASSOOFS_SB(sb)->persistent.free_blocks, free_blocks);
+    KUNIT_EXPECT_EQ(test, assoofs_test_held(sb), 0ULL);
+
+    kunit_info(test, "directory %lu names in %llu blocks: insert %llu ns/op, lookup %llu ns/op, remove %llu ns/op\n",
+               n, blocks, div64_u64(insert_ns, n), div64_u64(lookup_ns, n), div64_u64(remove_ns, n));
+}
+
+static struct kunit_case assoofs_test_cases[] = {
+    KUNIT_CASE_PARAM(assoofs_test_bitmap_alloc, assoofs_test_block_size_gen_params),
+    KUNIT_CASE_PARAM(assoofs_test_inode_slot, assoofs_test_block_size_gen_params),
+    KUNIT_CASE_PARAM(assoofs_test_dir_block, assoofs_test_dir_size_gen_params),
+    KUNIT_CASE_PARAM(assoofs_test_blocks, assoofs_test_block_size_gen_params),
+    KUNIT_CASE_PARAM(assoofs_test_extents, assoofs_test_block_size_gen_params),
+    KUNIT_CASE_PARAM(assoofs_test_inodes, assoofs_test_block_size_gen_params),
+    KUNIT_CASE_PARAM(assoofs_test_dir, assoofs_test_block_size_gen_params),
+    KUNIT_CASE_PARAM(assoofs_test_dir_iterate, assoofs_test_block_size_gen_params),
+    KUNIT_CASE_PARAM(assoofs_test_bench_blocks, assoofs_test_count_gen_params),
+    KUNIT_CASE_PARAM(assoofs_test_bench_inode, assoofs_test_count_gen_params),
+    KUNIT_CASE_PARAM(assoofs_test_bench_dir, assoofs_test_count_gen_params),
+    {}
+};
+
+static struct kunit_suite assoofs_test_suite = {
+    .name = "assoofs",
+    .exit = assoofs_test_exit,
+    .test_cases = assoofs_test_cases,
+};
+
+kunit_test_suite(assoofs_test_suite);
@@ -0,0 +1,232 @@
+/*
+ *  Tracepoints de assoofs (/sys/kernel/tracing/events/assoofs/). Los eventos de las operaciones llevan
+ *  su latencia en nanosegundos, así que se pueden filtrar (por ejemplo "ns > 1000000") para encontrar
+ *  los casos lentos. Con el trazado desactivado cada tracepoint es un salto que no se toma.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM assoofs
+
+#if !defined(_ASSOOFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASSOOFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Lecturas y escrituras de un fichero (read_iter, write_iter)
+DECLARE_EVENT_CLASS(assoofs_io_class,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret, u64 ns),
+    TP_ARGS(inode, pos, count, ret, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, ino)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("dev %d,%d ino %lu pos %lld count %zu ret %zd ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+              __entry->pos, __entry->count, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(assoofs_io_class, assoofs_read,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret, u64 ns),
+    TP_ARGS(inode, pos, count, ret, ns)
+);
+
+DEFINE_EVENT(assoofs_io_class, assoofs_write,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret, u64 ns),
+    TP_ARGS(inode, pos, count, ret, ns)
+);
+
+// Operaciones sobre una entrada de un directorio: ino es el inodo encontrado, creado o borrado (0 si no hay)
+DECLARE_EVENT_CLASS(assoofs_name_class,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino, int ret, u64 ns),
+    TP_ARGS(dir, dentry, ino, ret, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __field(u64, ino)
+        __field(int, ret)
+        __field(u64, ns)
+        __string(name, dentry->d_name.name)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = ino;
+        __entry->ret = ret;
+        __entry->ns = ns;
+        __assign_str(name, dentry->d_name.name);
+    ),
+    TP_printk("dev %d,%d dir %lu name %s ino %llu ret %d ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+              __get_str(name), __entry->ino, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(assoofs_name_class, assoofs_lookup,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino, int ret, u64 ns),
+    TP_ARGS(dir, dentry, ino, ret, ns)
+);
+
+DEFINE_EVENT(assoofs_name_class, assoofs_create,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino, int ret, u64 ns),
+    TP_ARGS(dir, dentry, ino, ret, ns)
+);
+
+DEFINE_EVENT(assoofs_name_class, assoofs_unlink,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino, int ret, u64 ns),
+    TP_ARGS(dir, dentry, ino, ret, ns)
+);
+
+TRACE_EVENT(assoofs_rename,
+    TP_PROTO(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags, int ret, u64 ns),
+    TP_ARGS(old_dir, old_dentry, new_dir, new_dentry, flags, ret, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, old_dir)
+        __field(ino_t, new_dir)
+        __field(unsigned int, flags)
+        __field(int, ret)
+        __field(u64, ns)
+        __string(old_name, old_dentry->d_name.name)
+        __string(new_name, new_dentry->d_name.name)
+    ),
+    TP_fast_assign(
+        __entry->dev = old_dir->i_sb->s_dev;
+        __entry->old_dir = old_dir->i_ino;
+        __entry->new_dir = new_dir->i_ino;
+        __entry->flags = flags;
+        __entry->ret = ret;
+        __entry->ns = ns;
+        __assign_str(old_name, old_dentry->d_name.name);
+        __assign_str(new_name, new_dentry->d_name.name);
+    ),
+    TP_printk("dev %d,%d %lu/%s -> %lu/%s flags 0x%x ret %d ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->old_dir, __get_str(old_name),
+              (unsigned long)__entry->new_dir, __get_str(new_name), __entry->flags, __entry->ret, __entry->ns)
+);
+
+// Asignador de bloques: tramo pedido (goal, wanted) y obtenido (block, count)
+TRACE_EVENT(assoofs_alloc_blocks,
+    TP_PROTO(struct super_block *sb, u64 goal, u64 wanted, u64 block, u64 count, int ret, u64 ns),
+    TP_ARGS(sb, goal, wanted, block, count, ret, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, goal)
+        __field(u64, wanted)
+        __field(u64, block)
+        __field(u64, count)
+        __field(int, ret)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->goal = goal;
+        __entry->wanted = wanted;
+        __entry->block = block;
+        __entry->count = count;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("dev %d,%d goal %llu wanted %llu block %llu count %llu ret %d ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal, __entry->wanted,
+              __entry->block, __entry->count, __entry->ret, __entry->ns)
+);
+
+TRACE_EVENT(assoofs_free_blocks,
+    TP_PROTO(struct super_block *sb, u64 block, u64 count),
+    TP_ARGS(sb, block, count),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, block)
+        __field(u64, count)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->block = block;
+        __entry->count = count;
+    ),
+    TP_printk("dev %d,%d block %llu count %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->block, __entry->count)
+);
+
+// Números de inodo reservados y liberados en el mapa de bits de inodos
+DECLARE_EVENT_CLASS(assoofs_ino_class,
+    TP_PROTO(struct super_block *sb, u64 ino),
+    TP_ARGS(sb, ino),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, ino)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->ino = ino;
+    ),
+    TP_printk("dev %d,%d ino %llu", MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino)
+);
+
+DEFINE_EVENT(assoofs_ino_class, assoofs_alloc_ino,
+    TP_PROTO(struct super_block *sb, u64 ino),
+    TP_ARGS(sb, ino)
+);
+
+DEFINE_EVENT(assoofs_ino_class, assoofs_free_ino,
+    TP_PROTO(struct super_block *sb, u64 ino),
+    TP_ARGS(sb, ino)
+);
+
+// Cambios de forma de un inodo: datos en línea que pasan a un bloque, directorios que pasan a
+// indexados, índices que crecen un nivel y directorios vacíos que devuelven sus bloques
+DECLARE_EVENT_CLASS(assoofs_layout_class,
+    TP_PROTO(struct super_block *sb, u64 ino, u64 blocks),
+    TP_ARGS(sb, ino, blocks),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, ino)
+        __field(u64, blocks)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->ino = ino;
+        __entry->blocks = blocks;
+    ),
+    TP_printk("dev %d,%d ino %llu blocks %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->blocks)
+);
+
+DEFINE_EVENT(assoofs_layout_class, assoofs_inline_to_block,
+    TP_PROTO(struct super_block *sb, u64 ino, u64 blocks),
+    TP_ARGS(sb, ino, blocks)
+);
+
+DEFINE_EVENT(assoofs_layout_class, assoofs_dir_make_indexed,
+    TP_PROTO(struct super_block *sb, u64 ino, u64 blocks),
+    TP_ARGS(sb, ino, blocks)
+);
+
+DEFINE_EVENT(assoofs_layout_class, assoofs_dir_index_grow,
+    TP_PROTO(struct super_block *sb, u64 ino, u64 blocks),
+    TP_ARGS(sb, ino, blocks)
+);
+
+DEFINE_EVENT(assoofs_layout_class, assoofs_dir_shrink,
+    TP_PROTO(struct super_block *sb, u64 ino, u64 blocks),
+    TP_ARGS(sb, ino, blocks)
+);
+
+#endif /* _ASSOOFS_TRACE_H */
+
+// El módulo se compila fuera del árbol del kernel: la cabecera está junto a assoofs.c (ver Makefile)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE assoofs_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/fs.h>
+#include "libassoofs.h"
+
+/* Los datos de la imagen no son de fiar: todo número de bloque o desplazamiento que se lee de ella se
+ * comprueba antes de usarlo, y lo que no cuadra se devuelve como EIO */
+#define CORRUPTED(ret) (errno = EIO, (ret))
+
+int assoofs_image_open(struct assoofs_image *img, const char *path)
+{
+    const struct assoofs_super_block_info *sb;
+    struct stat st;
+    void *data;
+    uint64_t size, bs;
+    int fd, err;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1)
+        goto fail;
+    size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == -1)
+        goto fail;
+    if (size < sizeof(*sb))
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+    data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+        goto fail;
+
+    /* Misma geometría que exige el módulo al montar */
+    sb = data;
+    bs = sb->block_size;
+    if (sb->magic != ASSOOFS_MAGIC || bs < ASSOOFS_MIN_BLOCK_SIZE || bs > ASSOOFS_MAX_BLOCK_SIZE || (bs & (bs - 1)) ||
+        sb->blocks_count > size / bs || sb->inode_table_start >= sb->blocks_count ||
+        sb->inode_table_blocks > sb->blocks_count - sb->inode_table_start ||
+        sb->inode_bitmap_blocks * bs * 8 < sb->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(bs) ||
+        sb->inode_bitmap_start + sb->inode_bitmap_blocks > sb->inode_table_start)
+    {
+        munmap(data, size);
+        errno = EINVAL;
+        goto fail;
+    }
+    /* Las herramientas suelen recorrer la imagen entera y en orden */
+    madvise(data, size, MADV_WILLNEED);
+
+    img->fd = fd;
+    img->data = data;
+    img->size = size;
+    img->sb = sb;
+    img->block_size = bs;
+    img->inodes = sb->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(bs);
+    return 0;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+void assoofs_image_close(struct assoofs_image *img)
+{
+    munmap((void *)img->data, img->size);
+    close(img->fd);
+}
+
+static const unsigned char *image_block(const struct assoofs_image *img, uint64_t block)
+{
+    if (block >= img->sb->blocks_count)
+        return CORRUPTED(NULL);
+    return img->data + block * img->block_size;
+}
+
+const struct assoofs_inode_info *assoofs_image_inode(const struct assoofs_image *img, uint64_t ino)
+{
+    const unsigned char *ibitmap = img->data + img->sb->inode_bitmap_start * img->block_size;
+    const struct assoofs_inode_info *info;
+
+    /* Con la tabla a medio poner a cero, una ranura libre puede tener cualquier cosa: manda el mapa de bits */
+    if (ino == 0 || ino >= img->inodes || !(ibitmap[ino / 8] & (1 << (ino % 8))))
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+    info = (const struct assoofs_inode_info *)(img->data + img->sb->inode_table_start * img->block_size) + ino;
+    if (info->inode_no != ino || info->state_flag != ASSOOFS_FLAG_USED)
+        return CORRUPTED(NULL);
+    return info;
+}
+
+/* Nodo del árbol de extents: cabecera coherente y, si no es la raíz del inodo, dentro de su bloque */
+static int extent_node_valid(const struct assoofs_image *img, const struct assoofs_extent_header *hdr, int root)
+{
+    uint64_t max = root ? ASSOOFS_INLINE_EXTENTS : (img->block_size - sizeof(*hdr)) / sizeof(struct assoofs_extent);
+
+    return hdr->magic == ASSOOFS_EXTENT_MAGIC && hdr->max <= max && hdr->entries <= hdr->max;
+}
+
+const unsigned char *assoofs_image_block(const struct assoofs_image *img, const struct assoofs_inode_info *info, uint64_t lblk)
+{
+    const struct assoofs_extent_header *hdr = &info->extent_header;
+    const struct assoofs_extent *ext = info->extents;
+    int level, lo, hi, mid;
+
+    if ((info->flags & ASSOOFS_INODE_INLINE) || lblk >= info->blocks)
+        return CORRUPTED(NULL);
+
+    for (level = 0; level <= ASSOOFS_EXTENT_MAX_DEPTH; level++)
+    {
+        if (!extent_node_valid(img, hdr, level == 0) || hdr->entries == 0)
+            return CORRUPTED(NULL);
+        /* Última entrada que empieza en lblk o antes */
+        lo = 0;
+        hi = hdr->entries - 1;
+        while (lo < hi)
+        {
+            mid = (lo + hi + 1) / 2;
+            if (ext[mid].block <= lblk)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        if (hdr->depth == 0)
+        {
+            if (lblk < ext[lo].block || lblk - ext[lo].block >= ext[lo].len)
+                return CORRUPTED(NULL);
+            return image_block(img, ext[lo].start + (lblk - ext[lo].block));
+        }
+        hdr = (const struct assoofs_extent_header *)image_block(img, ext[lo].start);
+        if (!hdr)
+            return NULL;
+        ext = (const struct assoofs_extent *)(hdr + 1);
+    }
+    return CORRUPTED(NULL);
+}
+
+/* Recorre las entradas en uso de un bloque de directorio (o del contenido de un inodo en línea) */
+static int block_entries(const unsigned char *data, size_t size, assoofs_dir_fn fn, void *arg)
+{
+    const struct assoofs_dir_entry *de;
+    size_t offset;
+    int ret;
+
+    for (offset = 0; offset < size; offset += de->rec_len)
+    {
+        de = (const struct assoofs_dir_entry *)(data + offset);
+        if (de->rec_len < ASSOOFS_DIR_ENTRY_SIZE(0) || (de->rec_len & 7) || offset + de->rec_len > size ||
+            (de->inode_no && ASSOOFS_DIR_ENTRY_SIZE(de->name_len) > de->rec_len))
+            return CORRUPTED(-1);
+        if (de->inode_no && (ret = fn(arg, de)))
+            return ret;
+    }
+    return 0;
+}
+
+static const struct assoofs_inode_info *image_dir(const struct assoofs_image *img, uint64_t ino)
+{
+    const struct assoofs_inode_info *info = assoofs_image_inode(img, ino);
+
+    if (info && !S_ISDIR(info->mode))
+    {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    return info;
+}
+
+/* Entrada del índice que cubre hash en un nodo (la raíz en el bloque 0 o uno intermedio) */
+static int index_search(const struct assoofs_image *img, const unsigned char *data, int node, uint32_t hash, uint64_t *lblk, uint32_t *levels)
+{
+    const struct assoofs_dir_index_header *hdr = (const struct assoofs_dir_index_header *)(data + (node ? ASSOOFS_DIR_NODE_OFFSET : 0));
+    const struct assoofs_dir_index_entry *entries = (const struct assoofs_dir_index_entry *)(hdr + 1);
+    uint64_t limit = (img->block_size - (node ? ASSOOFS_DIR_NODE_OFFSET : 0) - sizeof(*hdr)) / sizeof(*entries);
+    uint32_t lo = 0, hi, mid;
+
+    if (hdr->magic != ASSOOFS_DIR_INDEX_MAGIC || hdr->count == 0 || hdr->count > limit || hdr->levels > ASSOOFS_DIR_INDEX_MAX_LEVELS)
+        return CORRUPTED(-1);
+    hi = hdr->count - 1;
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (entries[mid].hash <= hash)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    *lblk = entries[lo].block;
+    *levels = hdr->levels;
+    return 0;
+}
+
+struct lookup
+{
+    const char *name;
+    size_t len;
+    uint32_t hash;
+    uint64_t ino;
+};
+
+static int lookup_entry(void *arg, const struct assoofs_dir_entry *de)
+{
+    struct lookup *l = arg;
+
+    if (de->hash != l->hash || de->name_len != l->len || memcmp(de->name, l->name, l->len))
+        return 0;
+    l->ino = de->inode_no;
+    return 1;
+}
+
+int assoofs_image_lookup(const struct assoofs_image *img, uint64_t dir, const char *name, size_t len, uint64_t *ino)
+{
+    const struct assoofs_inode_info *info = image_dir(img, dir);
+    struct lookup l = {name, len, assoofs_name_hash(name, len), 0};
+    const unsigned char *data;
+    uint32_t levels;
+    uint64_t lblk = 0;
+    int ret;
+
+    if (!info)
+        return -1;
+    if (len > ASSOOFS_FILENAME_MAXLEN)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (info->flags & ASSOOFS_INODE_INLINE)
+    {
+        ret = block_entries((const unsigned char *)info->inline_data, ASSOOFS_INLINE_DATA_SIZE, lookup_entry, &l);
+    }
+    else
+    {
+        /* Como en el módulo: solo se lee la hoja que corresponde al hash del nombre */
+        if (info->flags & ASSOOFS_INODE_INDEXED)
+        {
+            data = assoofs_image_block(img, info, 0);
+            if (!data || index_search(img, data, 0, l.hash, &lblk, &levels))
+                return -1;
+            if (levels)
+            {
+                data = assoofs_image_block(img, info, lblk);
+                if (!data || index_search(img, data, 1, l.hash, &lblk, &levels))
+                    return -1;
+            }
+        }
+        data = assoofs_image_block(img, info, lblk);
+        if (!data)
+            return -1;
+        ret = block_entries(data, img->block_size, lookup_entry, &l);
+    }
+    if (ret < 0)
+        return -1;
+    if (!ret)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    *ino = l.ino;
+    return 0;
+}
+
+int assoofs_image_resolve(const struct assoofs_image *img, const char *path, uint64_t *ino)
+{
+    uint64_t cur = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    const char *end;
+    size_t len;
+
+    for (;;)
+    {
+        while (*path == '/')
+            path++;
+        if (!*path)
+            break;
+        end = strchr(path, '/');
+        len = end ? (size_t)(end - path) : strlen(path);
+        if ((len != 1 || *path != '.') && assoofs_image_lookup(img, cur, path, len, &cur))
+            return -1;
+        path += len;
+    }
+    if (!assoofs_image_inode(img, cur))
+        return -1;
+    *ino = cur;
+    return 0;
+}
+
+int assoofs_image_readdir(const struct assoofs_image *img, uint64_t dir, assoofs_dir_fn fn, void *arg)
+{
+    const struct assoofs_inode_info *info = image_dir(img, dir);
+    const unsigned char *data;
+    uint64_t lblk;
+    int ret;
+
+    if (!info)
+        return -1;
+    if (info->flags & ASSOOFS_INODE_INLINE)
+        return block_entries((const unsigned char *)info->inline_data, ASSOOFS_INLINE_DATA_SIZE, fn, arg);
+
+    /* En un directorio indexado el bloque 0 es la raíz del índice; los nodos intermedios empiezan con
+     * una entrada libre que ocupa todo el bloque, así que se recorren como hojas sin entradas */
+    for (lblk = (info->flags & ASSOOFS_INODE_INDEXED) ? 1 : 0; lblk < info->blocks; lblk++)
+    {
+        data = assoofs_image_block(img, info, lblk);
+        if (!data)
+            return -1;
+        ret = block_entries(data, img->block_size, fn, arg);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/* Recorre en orden los extents de datos de un nodo del árbol hasta cubrir size bytes */
+static int walk_extents(const struct assoofs_image *img, const struct assoofs_extent_header *hdr, int level, uint64_t *pos, uint64_t size, assoofs_data_fn fn, void *arg)
+{
+    const struct assoofs_extent *ext = (const struct assoofs_extent *)(hdr + 1);
+    const struct assoofs_extent_header *child;
+    uint64_t bs = img->block_size, len;
+    int i, ret;
+
+    if (level > ASSOOFS_EXTENT_MAX_DEPTH || !extent_node_valid(img, hdr, level == 0))
+        return CORRUPTED(-1);
+    for (i = 0; i < hdr->entries && *pos < size; i++)
+    {
+        /* Los extents cubren los bloques lógicos seguidos, sin huecos */
+        if (ext[i].block * bs != *pos)
+            return CORRUPTED(-1);
+        if (hdr->depth)
+        {
+            child = (const struct assoofs_extent_header *)image_block(img, ext[i].start);
+            if (!child || child->depth != hdr->depth - 1)
+                return CORRUPTED(-1);
+            ret = walk_extents(img, child, level + 1, pos, size, fn, arg);
+            if (ret)
+                return ret;
+            continue;
+        }
+        if (ext[i].start >= img->sb->blocks_count || ext[i].len > img->sb->blocks_count - ext[i].start)
+            return CORRUPTED(-1);
+        len = ext[i].len * bs < size - *pos ? ext[i].len * bs : size - *pos;
+        ret = fn(arg, *pos, ext[i].start * bs, len);
+        if (ret)
+            return ret;
+        *pos += len;
+    }
+    return 0;
+}
+
+int assoofs_image_file_extents(const struct assoofs_image *img, uint64_t ino, assoofs_data_fn fn, void *arg)
+{
+    const struct assoofs_inode_info *info = assoofs_image_inode(img, ino);
+    uint64_t pos = 0;
+    int ret;
+
+    if (!info)
+        return -1;
+    if (!S_ISREG(info->mode))
+    {
+        errno = EISDIR;
+        return -1;
+    }
+    if (info->flags & ASSOOFS_INODE_INLINE)
+    {
+        if (info->file_size > ASSOOFS_INLINE_DATA_SIZE)
+            return CORRUPTED(-1);
+        if (!info->file_size)
+            return 0;
+        return fn(arg, 0, (const unsigned char *)info->inline_data - img->data, info->file_size);
+    }
+
+    ret = walk_extents(img, &info->extent_header, 0, &pos, info->file_size, fn, arg);
+    if (!ret && pos < info->file_size)
+        return CORRUPTED(-1);
+    return ret;
+}
+
+struct copy
+{
+    const struct assoofs_image *img;
+    int out;
+    int method; /* 0 copy_file_range, 1 sendfile, 2 write desde la proyección */
+};
+
+static int copy_extent(void *arg, uint64_t pos, uint64_t offset, uint64_t len)
+{
+    struct copy *c = arg;
+    loff_t off = offset;
+    ssize_t n;
+
+    (void)pos;
+    while (len > 0)
+    {
+        if (c->method == 0)
+            n = copy_file_range(c->img->fd, &off, c->out, NULL, len, 0);
+        else if (c->method == 1)
+            n = sendfile(c->out, c->img->fd, &off, len);
+        else
+            n = write(c->out, c->img->data + off, len);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            /* out_fd no admite este método (otro sistema de ficheros, una tubería, O_APPEND...): el siguiente */
+            if (c->method < 2 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+            {
+                c->method++;
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0)
+            return CORRUPTED(-1);
+        if (c->method == 2)
+            off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int assoofs_image_copy(const struct assoofs_image *img, uint64_t ino, int out_fd)
+{
+    struct copy c = {img, out_fd, 0};
+
+    return assoofs_image_file_extents(img, ino, copy_extent, &c);
+}
@@ -0,0 +1,61 @@
+#ifndef LIBASSOOFS_H
+#define LIBASSOOFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "assoofs.h"
+
+/*
+ * Lectura de imágenes assoofs desde espacio de usuario, sin el módulo. La imagen se proyecta entera en
+ * memoria (solo lectura): los bloques, los inodos y las entradas de directorio se leen directamente de
+ * la proyección, sin copiarlos ni hacer una llamada al sistema por bloque. Las estructuras son las de
+ * assoofs.h y los directorios se recorren igual que en el módulo (por el índice hash si lo tienen).
+ *
+ * Todas las funciones que pueden fallar devuelven -1 (o NULL) y dejan el motivo en errno: ENOENT si
+ * no existe, ENOTDIR o EISDIR si el inodo no es del tipo pedido y EIO si la imagen está corrupta.
+ */
+
+struct assoofs_image
+{
+    int fd;
+    const unsigned char *data;                 /* Proyección de toda la imagen */
+    uint64_t size;
+    const struct assoofs_super_block_info *sb; /* Dentro de la proyección */
+    uint64_t block_size;
+    uint64_t inodes;                           /* Ranuras de la tabla de inodos */
+};
+
+/* Abre y proyecta una imagen (fichero o dispositivo de bloques) tras comprobar su superbloque */
+int assoofs_image_open(struct assoofs_image *img, const char *path);
+void assoofs_image_close(struct assoofs_image *img);
+
+/* Inodo en uso número ino */
+const struct assoofs_inode_info *assoofs_image_inode(const struct assoofs_image *img, uint64_t ino);
+
+/* Bloque lógico lblk de un inodo, buscado en su mapa de extents */
+const unsigned char *assoofs_image_block(const struct assoofs_image *img, const struct assoofs_inode_info *info, uint64_t lblk);
+
+/* Inodo de la entrada name (de len bytes) del directorio dir */
+int assoofs_image_lookup(const struct assoofs_image *img, uint64_t dir, const char *name, size_t len, uint64_t *ino);
+
+/* Inodo de una ruta ("/" o "" es la raíz; no admite "..") */
+int assoofs_image_resolve(const struct assoofs_image *img, const char *path, uint64_t *ino);
+
+/* Llama a fn con cada entrada en uso del directorio dir; si fn devuelve algo distinto de 0 se para
+ * y se devuelve ese valor */
+typedef int (*assoofs_dir_fn)(void *arg, const struct assoofs_dir_entry *de);
+int assoofs_image_readdir(const struct assoofs_image *img, uint64_t dir, assoofs_dir_fn fn, void *arg);
+
+/* Llama a fn con cada tramo contiguo del contenido del fichero ino: pos es su posición en el fichero y
+ * offset en la imagen (los datos están en img->data + offset). El último tramo acaba en el tamaño del
+ * fichero. Si fn devuelve algo distinto de 0 se para y se devuelve ese valor */
+typedef int (*assoofs_data_fn)(void *arg, uint64_t pos, uint64_t offset, uint64_t len);
+int assoofs_image_file_extents(const struct assoofs_image *img, uint64_t ino, assoofs_data_fn fn, void *arg);
+
+/* Escribe el contenido del fichero ino en out_fd (desde su posición actual). Los datos pasan de la
+ * imagen a out_fd dentro del kernel (copy_file_range o, si no se puede, sendfile); solo si ninguna de
+ * las dos admite out_fd se escriben desde la proyección */
+int assoofs_image_copy(const struct assoofs_image *img, uint64_t ino, int out_fd);
+
+#endif /* LIBASSOOFS_H */
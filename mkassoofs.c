@@ -6,171 +6,1120 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <linux/fs.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "assoofs.h"
 
-#define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
 #define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1)
+#define BITMAP_START_BLOCK (ASSOOFS_SUPERBLOCK_BLOCK_NUMBER + 1)
+#define BITS_PER_BITMAP_BLOCK (block_size * 8)
+#define INODES_PER_BLOCK ASSOOFS_INODES_PER_BLOCK(block_size)
+#define BYTES_PER_INODE 16384    /* Por defecto, un inodo por cada 16 KiB de dispositivo */
+#define JOURNAL_RATIO 64         /* El diario ocupa 1/64 del dispositivo... */
+#define JOURNAL_MAX_BYTES (128 << 20) /* ...con un máximo de 128 MiB */
+#define ZERO_CHUNK (1 << 20)     /* Tamaño del buffer de ceros con el que se limpian las zonas grandes */
+#define EXIT_USAGE 2             /* Código de salida con opciones o argumentos incorrectos */
 
-static int write_superblock(int fd)
+/* Superbloque de un diario jbd2 (campos en big-endian), ver include/linux/jbd2.h */
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+#define JBD2_SUPERBLOCK_V2 4
+struct jbd2_superblock
 {
-    struct assoofs_super_block_info sb = {
-        .version = 1,
-        .magic = ASSOOFS_MAGIC,
-        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
-        .inodes_count = WELCOMEFILE_INODE_NUMBER,
-        .free_blocks = (~0) & ~(15),
-    };
-    ssize_t ret;
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+    uint32_t s_blocksize;
+    uint32_t s_maxlen;
+    uint32_t s_first;
+    uint32_t s_sequence;
+    uint32_t s_start;
+    int32_t s_errno;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t s_uuid[16];
+    uint32_t s_nr_users;
+};
 
-    ret = write(fd, &sb, sizeof(sb));
-    if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE)
+/* Opciones de la línea de órdenes (ver usage) */
+static uint64_t block_size = ASSOOFS_DEFAULT_BLOCK_SIZE;
+static uint64_t device_size;        /* -s, 0 para usar el tamaño del dispositivo */
+static uint64_t inodes_wanted;      /* -N, 0 para calcularlo con bytes_per_inode */
+static uint64_t bytes_per_inode = BYTES_PER_INODE;
+static int64_t journal_wanted = -1; /* -J, -1 para calcularlo con el tamaño del dispositivo */
+static int block_dirs;              /* -D block: directorios con bloque propio en vez de en línea */
+static int lazy_itable_init = 1;    /* -E lazy_itable_init=: la tabla de inodos la termina de poner a cero el módulo */
+static int welcome_file = 1;        /* -e lo desactiva: sistema de ficheros vacío, sin README.txt */
+static const char *source_dir;      /* -d: directorio del anfitrión que se copia en la imagen */
+
+/* Geometría del dispositivo: superbloque, mapas de bits (bloques e inodos), tabla de inodos, diario y bloques de datos */
+static uint64_t blocks_count;
+static uint64_t bitmap_blocks;
+static uint64_t inode_bitmap_start;
+static uint64_t inode_bitmap_blocks;
+static uint64_t inode_table_start;
+static uint64_t inode_table_blocks;
+static uint64_t journal_start;
+static uint64_t journal_blocks;
+static uint64_t rootdir_block;      /* Bloque del directorio raíz, 0 si está en línea */
+static uint64_t first_data_block;   /* Primer bloque detrás de los metadatos fijos */
+static uint64_t tree_blocks;        /* Bloques de datos y de directorios del árbol de -d, desde first_data_block */
+static uint64_t tree_inodes;        /* Inodos del árbol de -d, raíz incluida */
+static uint64_t last_inode;         /* Último inodo creado por mkassoofs */
+static uint64_t itable_head_blocks; /* Bloques de la tabla de inodos con los inodos iniciales */
+static uint64_t itable_zeroed;      /* Bloques de la tabla de inodos que se ponen a cero aquí (el resto, el módulo) */
+
+static void usage(void)
+{
+    printf("Usage: mkassoofs [options] <device>\n"
+           "  -s size          filesystem size (K, M, G or T suffixes); default: the whole device.\n"
+           "                   A regular file is created or extended to this size\n"
+           "  -b block-size    block size in bytes (%d to %d)\n"
+           "  -N inodes        number of inodes\n"
+           "  -i bytes         bytes per inode when -N is not given (default %d)\n"
+           "  -J blocks        journal blocks, 0 for no journal (default 1/%d of the device, up to 128 MiB)\n"
+           "  -D inline|block  directory format: new directories start inside their inode (default) or with a block\n"
+           "  -E lazy_itable_init=0|1  leave zeroing the inode table to the module (default 1)\n"
+           "  -e               empty filesystem, without the README.txt welcome file\n"
+           "  -d dir           copy the files and directories of dir into the filesystem (instead of README.txt).\n"
+           "                   Without -s, a new or empty image file gets the size the tree needs\n",
+           ASSOOFS_MIN_BLOCK_SIZE, ASSOOFS_MAX_BLOCK_SIZE, BYTES_PER_INODE, JOURNAL_RATIO);
+}
+
+/* Tamaño con sufijo opcional K, M, G o T (potencias de 1024) */
+static int parse_size(const char *arg, uint64_t *size)
+{
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 0);
+    int shift = 0;
+
+    switch (*end)
     {
-        printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
-        return -1;
+    case 'T': case 't': shift += 10; /* fall through */
+    case 'G': case 'g': shift += 10; /* fall through */
+    case 'M': case 'm': shift += 10; /* fall through */
+    case 'K': case 'k': shift += 10; end++; break;
     }
+    if (end == arg || *end != '\0' || (shift && value > (UINT64_MAX >> shift)))
+        return -1;
+    *size = (uint64_t)value << shift;
+    return 0;
+}
+
+/* Tamaño del dispositivo: el de un fichero normal o, para un dispositivo de bloques, el que da el kernel */
+static int get_device_size(int fd, uint64_t *size)
+{
+    struct stat st;
 
-    printf("Super block written succesfully.\n");
+    if (fstat(fd, &st) == -1)
+        return -1;
+    if (S_ISBLK(st.st_mode))
+        return ioctl(fd, BLKGETSIZE64, size);
+    *size = st.st_size;
     return 0;
 }
 
-static int write_root_inode(int fd)
+/* Calculamos la geometría a partir del tamaño del dispositivo y de las opciones. Con quiet no se
+ * avisa de que el dispositivo es pequeño (al buscar el tamaño de una imagen para -d) */
+static int compute_geometry(int quiet)
 {
-    ssize_t ret;
+    uint64_t inodes;
 
-    struct assoofs_inode_info root_inode;
+    blocks_count = device_size / block_size;
+    bitmap_blocks = (blocks_count + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK;
 
-    root_inode.mode = S_IFDIR;
-    root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
-    root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
-    root_inode.dir_children_count = 1;
+    inodes = inodes_wanted ? inodes_wanted : device_size / bytes_per_inode;
+    if (inodes < WELCOMEFILE_INODE_NUMBER)
+        inodes = WELCOMEFILE_INODE_NUMBER;
+    if (inodes < tree_inodes)
+    {
+        if (inodes_wanted)
+        {
+            printf("%llu inodes are not enough for the %llu files and directories of %s.\n",
+                   (unsigned long long)inodes_wanted, (unsigned long long)tree_inodes, source_dir);
+            return -1;
+        }
+        inodes = tree_inodes;
+    }
+    inode_table_blocks = (inodes + 1 + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK; /* La ranura 0 no se usa */
+    inode_bitmap_start = BITMAP_START_BLOCK + bitmap_blocks;
+    inode_bitmap_blocks = (inode_table_blocks * INODES_PER_BLOCK + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK;
+    inode_table_start = inode_bitmap_start + inode_bitmap_blocks;
 
-    ret = write(fd, &root_inode, sizeof(root_inode));
+    journal_start = inode_table_start + inode_table_blocks;
+    if (journal_wanted >= 0)
+    {
+        journal_blocks = journal_wanted;
+        if (journal_blocks && journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS)
+        {
+            printf("The journal needs at least %d blocks.\n", ASSOOFS_JOURNAL_MIN_BLOCKS);
+            return -1;
+        }
+    }
+    else
+    {
+        journal_blocks = blocks_count / JOURNAL_RATIO;
+        if (journal_blocks > JOURNAL_MAX_BYTES / block_size)
+            journal_blocks = JOURNAL_MAX_BYTES / block_size;
+        if (journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS)
+            journal_blocks = 0; /* Dispositivos pequeños: sin diario */
+    }
 
-    if (ret != sizeof(root_inode))
+    /* Con directorios en línea el directorio raíz no ocupa ningún bloque; con -d es uno más del árbol */
+    rootdir_block = (block_dirs && !source_dir) ? journal_start + journal_blocks : 0;
+    first_data_block = journal_start + journal_blocks + (rootdir_block ? 1 : 0);
+    if (blocks_count <= first_data_block + tree_blocks)
     {
-        printf("The inode store was not written properly.\n");
+        if (!quiet)
+            printf("The device is too small (%llu blocks, %llu needed).\n", (unsigned long long)blocks_count,
+                   (unsigned long long)(first_data_block + tree_blocks + 1));
         return -1;
     }
 
-    printf("root directory inode written succesfully.\n");
+    /* Con la inicialización diferida solo se escriben los bloques de la tabla con los inodos iniciales */
+    if (source_dir)
+        last_inode = tree_inodes;
+    else
+        last_inode = welcome_file ? WELCOMEFILE_INODE_NUMBER : ASSOOFS_ROOTDIR_INODE_NUMBER;
+    itable_head_blocks = last_inode / INODES_PER_BLOCK + 1;
+    itable_zeroed = lazy_itable_init ? itable_head_blocks : inode_table_blocks;
     return 0;
 }
 
-static int write_welcome_inode(int fd, const struct assoofs_inode_info *i)
+/* Marca como ocupados los bits [from, to) de un mapa de bits, byte a byte solo en los extremos */
+static void set_bits(unsigned char *bitmap, uint64_t from, uint64_t to)
 {
-    off_t nbytes;
-    ssize_t ret;
-
-    ret = write(fd, i, sizeof(*i));
-    if (ret != sizeof(*i))
+    for (; from < to && from % 8; from++)
+        bitmap[from / 8] |= 1 << (from % 8);
+    if (to - from >= 8)
     {
-        printf("The welcomefile inode was not written properly.\n");
+        memset(bitmap + from / 8, 0xff, (to - from) / 8);
+        from += (to - from) & ~7ULL;
+    }
+    for (; from < to; from++)
+        bitmap[from / 8] |= 1 << (from % 8);
+}
+
+/* Entradas de un directorio (un bloque o el contenido de un inodo en línea): una única entrada, libre si
+ * name es NULL, que se extiende hasta el final */
+static void init_dir_entries(char *data, size_t size, const char *name, uint64_t inode_no, uint8_t file_type)
+{
+    struct assoofs_dir_entry *de = (struct assoofs_dir_entry *)data;
+
+    memset(data, 0, size);
+    de->rec_len = size;
+    if (!name)
+        return;
+    de->inode_no = inode_no;
+    de->name_len = strlen(name);
+    de->file_type = file_type;
+    de->hash = assoofs_name_hash(name, de->name_len);
+    memcpy(de->name, name, de->name_len);
+}
+
+/* Mapa de extents de un inodo con sus bloques de datos contiguos */
+static void init_extent(struct assoofs_inode_info *i, uint64_t block, uint64_t count)
+{
+    i->blocks = count;
+    i->extent_header.magic = ASSOOFS_EXTENT_MAGIC;
+    i->extent_header.entries = 1;
+    i->extent_header.max = ASSOOFS_INLINE_EXTENTS;
+    i->extent_header.depth = 0;
+    i->extents[0].block = 0;
+    i->extents[0].start = block;
+    i->extents[0].len = count;
+}
+
+static void *alloc_blocks(uint64_t count)
+{
+    void *buf;
+
+    if (posix_memalign(&buf, block_size, count * block_size))
+        return NULL;
+    memset(buf, 0, count * block_size);
+    return buf;
+}
+
+static int write_all(int fd, const void *buf, size_t len, uint64_t block)
+{
+    return pwrite(fd, buf, len, (off_t)(block * block_size)) == (ssize_t)len ? 0 : -1;
+}
+
+/* Pone a cero una zona grande del dispositivo con un único buffer de ceros y escrituras vectoriales */
+static int write_zeroes(int fd, uint64_t block, uint64_t count)
+{
+    struct iovec iov[64];
+    uint64_t off = block * block_size, left = count * block_size;
+    void *zero;
+    int i, n, ret = 0;
+
+    if (posix_memalign(&zero, block_size, ZERO_CHUNK))
         return -1;
+    memset(zero, 0, ZERO_CHUNK);
+    for (i = 0; i < 64; i++)
+    {
+        iov[i].iov_base = zero;
+        iov[i].iov_len = ZERO_CHUNK;
     }
-    printf("welcomefile inode written succesfully.\n");
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 2);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1)
+    while (left && !ret)
     {
-        printf("The padding bytes are not written properly.\n");
-        return -1;
+        ssize_t len = 0, done;
+
+        for (n = 0; n < 64 && (uint64_t)len < left; n++)
+        {
+            iov[n].iov_len = left - len < ZERO_CHUNK ? left - len : ZERO_CHUNK;
+            len += iov[n].iov_len;
+        }
+        done = pwritev(fd, iov, n, off);
+        if (done != len)
+            ret = -1;
+        off += len;
+        left -= len;
+    }
+    free(zero);
+    return ret;
+}
+
+static void fill_superblock(struct assoofs_super_block_info *sb)
+{
+    sb->version = 1;
+    sb->magic = ASSOOFS_MAGIC;
+    sb->block_size = block_size;
+    sb->inodes_count = last_inode;
+    sb->free_blocks = blocks_count - first_data_block - tree_blocks;
+    sb->blocks_count = blocks_count;
+    sb->bitmap_start = BITMAP_START_BLOCK;
+    sb->bitmap_blocks = bitmap_blocks;
+    sb->inode_bitmap_start = inode_bitmap_start;
+    sb->inode_bitmap_blocks = inode_bitmap_blocks;
+    sb->inode_table_start = inode_table_start;
+    sb->inode_table_blocks = inode_table_blocks;
+    sb->journal_start = journal_start;
+    sb->journal_blocks = journal_blocks;
+    sb->features = block_dirs ? ASSOOFS_FEATURE_BLOCK_DIRS : 0;
+    sb->inode_table_zeroed = itable_zeroed;
+    if (itable_zeroed < inode_table_blocks)
+        sb->features |= ASSOOFS_FEATURE_LAZY_ITABLE;
+}
+
+/* Inodos iniciales: el directorio raíz (con la entrada del fichero de bienvenida) y el fichero de bienvenida.
+ * Los dos van en línea salvo el directorio raíz con -D block, que ocupa rootdir_block */
+static void fill_inodes(struct assoofs_inode_info *table, char *rootdir_data)
+{
+    static const char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
+    struct assoofs_inode_info *root = &table[ASSOOFS_ROOTDIR_INODE_NUMBER];
+    struct assoofs_inode_info *welcome = &table[WELCOMEFILE_INODE_NUMBER];
+    const char *name = welcome_file ? "README.txt" : NULL;
+
+    root->mode = S_IFDIR;
+    root->inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    root->dir_children_count = welcome_file ? 1 : 0;
+    root->state_flag = ASSOOFS_FLAG_USED;
+    if (block_dirs)
+    {
+        init_extent(root, rootdir_block, 1);
+        init_dir_entries(rootdir_data, block_size, name, WELCOMEFILE_INODE_NUMBER, ASSOOFS_FT_REG);
+    }
+    else
+    {
+        root->flags = ASSOOFS_INODE_INLINE;
+        init_dir_entries(root->inline_data, ASSOOFS_INLINE_DATA_SIZE, name, WELCOMEFILE_INODE_NUMBER, ASSOOFS_FT_REG);
+    }
+
+    if (!welcome_file)
+        return;
+    /* El fichero de bienvenida es pequeño: sus datos van en línea dentro del inodo, sin bloque */
+    welcome->mode = S_IFREG;
+    welcome->inode_no = WELCOMEFILE_INODE_NUMBER;
+    welcome->file_size = sizeof(welcomefile_body);
+    welcome->state_flag = ASSOOFS_FLAG_USED;
+    welcome->flags = ASSOOFS_INODE_INLINE;
+    memcpy(welcome->inline_data, welcomefile_body, welcome->file_size);
+}
+
+/*
+ * Copia de un árbol del anfitrión (-d). Se recorre entero antes de calcular la geometría: cada fichero o
+ * directorio recibe su número de inodo (los de un mismo directorio, seguidos) y cada directorio se
+ * construye en memoria con el mismo formato que deja el módulo (en línea, un bloque o indexado).
+ * Después los bloques se reparten de forma contigua desde first_data_block, primero los de los
+ * directorios y luego los de los ficheros, y los ficheros se copian en paralelo mientras se escriben
+ * los directorios. La tabla de inodos y los mapas de bits se escriben con el resto de metadatos.
+ */
+#define COPY_CHUNK (1 << 20) /* Buffer de cada hilo para copiar los ficheros */
+#define MAX_COPY_THREADS 32
+
+struct node
+{
+    char *path;             /* Ruta en el anfitrión */
+    const char *name;       /* Nombre dentro de su directorio (apunta dentro de path) */
+    mode_t mode;
+    uint64_t size;          /* Bytes de un fichero */
+    uint64_t ino;
+    uint32_t flags;         /* ASSOOFS_INODE_* */
+    uint64_t start;         /* Primer bloque de sus datos (o de su directorio) */
+    uint64_t blocks;        /* Bloques que ocupa, 0 si está en línea */
+    struct node **children; /* Entradas de un directorio, ordenadas por nombre */
+    size_t nchildren;
+    char *dir_data;         /* Contenido de un directorio: sus bloques o, en línea, el del inodo */
+};
+
+static struct node **tree; /* tree[ino - 1]: el árbol en orden de número de inodo */
+static atomic_size_t next_copy;
+static atomic_int copy_failed;
+
+static struct node *new_node(const char *path, size_t name_offset, const struct stat *st)
+{
+    struct node *n = calloc(1, sizeof(*n));
+
+    if (!n || !(n->path = strdup(path)))
+    {
+        free(n);
+        return NULL;
     }
+    n->name = n->path + name_offset;
+    n->mode = st->st_mode;
+    n->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+    return n;
+}
+
+/* Da a un nodo el siguiente número de inodo */
+static int tree_number(struct node *n)
+{
+    struct node **grown;
 
-    printf("inode store padding bytes (after two inodes) written sucessfully.\n");
+    if (tree_inodes % 1024 == 0)
+    {
+        grown = realloc(tree, (tree_inodes + 1024) * sizeof(*tree));
+        if (!grown)
+            return -1;
+        tree = grown;
+    }
+    n->ino = ++tree_inodes;
+    tree[n->ino - 1] = n;
     return 0;
 }
 
-int write_dirent(int fd, const struct assoofs_dir_record_entry *record)
+static int cmp_name(const void *a, const void *b)
+{
+    return strcmp((*(struct node *const *)a)->name, (*(struct node *const *)b)->name);
+}
+
+/* Lee las entradas de un directorio del anfitrión y, después de numerarlas todas, baja a sus subdirectorios */
+static int tree_scan(struct node *dir)
 {
-    ssize_t nbytes = sizeof(*record), ret;
+    struct dirent *de;
+    struct stat st;
+    struct node *child, **grown;
+    size_t len = strlen(dir->path), cap = 0, i;
+    char path[PATH_MAX];
+    DIR *d;
 
-    ret = write(fd, record, nbytes);
-    if (ret != nbytes)
+    d = opendir(dir->path);
+    if (!d)
     {
-        printf("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed.\n");
+        perror(dir->path);
         return -1;
     }
-    printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
+    while ((de = readdir(d)))
+    {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (strlen(de->d_name) > ASSOOFS_FILENAME_MAXLEN || len + 1 + strlen(de->d_name) >= sizeof(path))
+        {
+            printf("Name too long: %s/%s\n", dir->path, de->d_name);
+            closedir(d);
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir->path, de->d_name);
+        if (lstat(path, &st) == -1)
+        {
+            perror(path);
+            closedir(d);
+            return -1;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+        {
+            printf("Skipping %s: only regular files and directories are supported.\n", path);
+            continue;
+        }
+        if (dir->nchildren == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            grown = realloc(dir->children, cap * sizeof(*grown));
+            if (!grown)
+            {
+                closedir(d);
+                return -1;
+            }
+            dir->children = grown;
+        }
+        child = new_node(path, len + 1, &st);
+        if (!child)
+        {
+            closedir(d);
+            return -1;
+        }
+        dir->children[dir->nchildren++] = child;
+    }
+    closedir(d);
+
+    /* Los números de inodo se dan después de ordenar: el resultado no depende del orden de readdir */
+    qsort(dir->children, dir->nchildren, sizeof(*dir->children), cmp_name);
+    for (i = 0; i < dir->nchildren; i++)
+    {
+        if (tree_number(dir->children[i]))
+            return -1;
+    }
+    for (i = 0; i < dir->nchildren; i++)
+    {
+        if (S_ISDIR(dir->children[i]->mode) && tree_scan(dir->children[i]))
+            return -1;
+    }
+    return 0;
+}
+
+/* Copia en un bloque (o en el contenido de un inodo) las entradas children[from, to), seguidas; la última
+ * se alarga hasta el final y, si no hay ninguna, queda una entrada libre que lo ocupa todo */
+static void pack_entries(char *data, size_t size, struct node **children, size_t from, size_t to)
+{
+    struct assoofs_dir_entry *de = NULL;
+    size_t offset = 0, i;
+
+    memset(data, 0, size);
+    ((struct assoofs_dir_entry *)data)->rec_len = size;
+    for (i = from; i < to; i++)
+    {
+        de = (struct assoofs_dir_entry *)(data + offset);
+        de->inode_no = children[i]->ino;
+        de->name_len = strlen(children[i]->name);
+        de->rec_len = ASSOOFS_DIR_ENTRY_SIZE(de->name_len);
+        de->file_type = S_ISDIR(children[i]->mode) ? ASSOOFS_FT_DIR : ASSOOFS_FT_REG;
+        de->hash = assoofs_name_hash(children[i]->name, de->name_len);
+        memcpy(de->name, children[i]->name, de->name_len);
+        offset += de->rec_len;
+    }
+    if (de)
+        de->rec_len += size - offset;
+}
+
+static uint32_t node_hash(const struct node *n)
+{
+    return assoofs_name_hash(n->name, strlen(n->name));
+}
+
+static int cmp_hash(const void *a, const void *b)
+{
+    uint32_t ha = node_hash(*(struct node *const *)a), hb = node_hash(*(struct node *const *)b);
+
+    return ha < hb ? -1 : ha > hb ? 1 : cmp_name(a, b);
+}
+
+static void put_index_header(struct assoofs_dir_index_header *hdr, uint32_t count, uint32_t limit, uint32_t levels)
+{
+    hdr->magic = ASSOOFS_DIR_INDEX_MAGIC;
+    hdr->count = count;
+    hdr->limit = limit;
+    hdr->levels = levels;
+}
+
+/*
+ * Directorio indexado, como lo dejaría el módulo tras ir dividiendo hojas: bloque lógico 0 con la raíz del
+ * índice, después las hojas (entradas ordenadas por hash, sin repartir un mismo hash entre dos) y, si la
+ * raíz no basta, los nodos intermedios detrás de las hojas
+ */
+static int build_indexed_dir(struct node *dir)
+{
+    uint32_t root_limit = (block_size - sizeof(struct assoofs_dir_index_header)) / sizeof(struct assoofs_dir_index_entry);
+    uint32_t node_limit = (block_size - ASSOOFS_DIR_NODE_OFFSET - sizeof(struct assoofs_dir_index_header)) / sizeof(struct assoofs_dir_index_entry);
+    struct node **sorted;
+    size_t *first, leaves = 0, nodes = 0, used = 0, i, j, group;
+    struct assoofs_dir_index_header *hdr;
+    struct assoofs_dir_index_entry *entries;
+    char *block;
+
+    sorted = malloc(dir->nchildren * sizeof(*sorted));
+    first = malloc((dir->nchildren + 1) * sizeof(*first));
+    if (!sorted || !first)
+        goto fail;
+    memcpy(sorted, dir->children, dir->nchildren * sizeof(*sorted));
+    qsort(sorted, dir->nchildren, sizeof(*sorted), cmp_hash);
+
+    /* Reparto en hojas: first[k] es la primera entrada de la hoja k */
+    for (i = 0; i < dir->nchildren; i = j)
+    {
+        for (j = i, group = 0; j < dir->nchildren && node_hash(sorted[j]) == node_hash(sorted[i]); j++)
+            group += ASSOOFS_DIR_ENTRY_SIZE(strlen(sorted[j]->name));
+        if (group > block_size)
+        {
+            printf("Too many names with the same hash in %s.\n", dir->path);
+            goto fail;
+        }
+        if (leaves == 0 || used + group > block_size)
+        {
+            first[leaves++] = i;
+            used = 0;
+        }
+        used += group;
+    }
+    first[leaves] = dir->nchildren;
+    if (leaves > root_limit)
+    {
+        nodes = (leaves + node_limit - 1) / node_limit;
+        if (nodes > root_limit)
+        {
+            printf("Directory %s has too many entries.\n", dir->path);
+            goto fail;
+        }
+    }
+
+    dir->blocks = 1 + leaves + nodes;
+    dir->flags = ASSOOFS_INODE_INDEXED;
+    dir->dir_data = calloc(dir->blocks, block_size);
+    if (!dir->dir_data)
+        goto fail;
+
+    for (i = 0; i < leaves; i++)
+        pack_entries(dir->dir_data + (1 + i) * block_size, block_size, sorted, first[i], first[i + 1]);
+
+    /* La raíz apunta a las hojas o, con un nivel más, a nodos de node_limit hojas como mucho */
+    hdr = (struct assoofs_dir_index_header *)dir->dir_data;
+    put_index_header(hdr, nodes ? nodes : leaves, root_limit, nodes ? 1 : 0);
+    entries = (struct assoofs_dir_index_entry *)(hdr + 1);
+    for (i = 0; i < hdr->count; i++)
+    {
+        size_t leaf = nodes ? i * node_limit : i;
+
+        entries[i].hash = leaf ? node_hash(sorted[first[leaf]]) : 0;
+        entries[i].block = nodes ? 1 + leaves + i : 1 + i;
+    }
+    for (i = 0; i < nodes; i++)
+    {
+        size_t from = i * node_limit, count = leaves - from < node_limit ? leaves - from : node_limit;
+
+        block = dir->dir_data + (1 + leaves + i) * block_size;
+        ((struct assoofs_dir_entry *)block)->rec_len = block_size;
+        hdr = (struct assoofs_dir_index_header *)(block + ASSOOFS_DIR_NODE_OFFSET);
+        put_index_header(hdr, count, node_limit, 0);
+        entries = (struct assoofs_dir_index_entry *)(hdr + 1);
+        for (j = 0; j < count; j++)
+        {
+            entries[j].hash = from + j ? node_hash(sorted[first[from + j]]) : 0;
+            entries[j].block = 1 + from + j;
+        }
+    }
+    free(first);
+    free(sorted);
+    return 0;
+
+fail:
+    free(first);
+    free(sorted);
+    return -1;
+}
+
+/* Construye el contenido de un directorio con el formato más pequeño en el que caben sus entradas */
+static int build_dir(struct node *dir)
+{
+    size_t total = 0, i;
+
+    for (i = 0; i < dir->nchildren; i++)
+        total += ASSOOFS_DIR_ENTRY_SIZE(strlen(dir->children[i]->name));
+
+    if (total <= ASSOOFS_INLINE_DATA_SIZE && !block_dirs)
+    {
+        dir->flags = ASSOOFS_INODE_INLINE;
+        dir->dir_data = malloc(ASSOOFS_INLINE_DATA_SIZE);
+        if (!dir->dir_data)
+            return -1;
+        pack_entries(dir->dir_data, ASSOOFS_INLINE_DATA_SIZE, dir->children, 0, dir->nchildren);
+        return 0;
+    }
+    if (total <= block_size)
+    {
+        dir->blocks = 1;
+        dir->dir_data = malloc(block_size);
+        if (!dir->dir_data)
+            return -1;
+        pack_entries(dir->dir_data, block_size, dir->children, 0, dir->nchildren);
+        return 0;
+    }
+    return build_indexed_dir(dir);
+}
+
+/* Recorre source_dir, construye sus directorios y cuenta los inodos y bloques que necesita */
+static int tree_load(void)
+{
+    struct stat st;
+    struct node *n;
+    size_t i;
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1)
+    if (stat(source_dir, &st) == -1 || !S_ISDIR(st.st_mode))
     {
-        printf("Writing the padding for rootdirectory children datablock has failed.\n");
+        printf("%s is not a directory.\n", source_dir);
         return -1;
     }
-    printf("Padding after the rootdirectory children written succesfully.\n");
+    n = new_node(source_dir, strlen(source_dir), &st);
+    if (!n || tree_number(n) || tree_scan(n))
+        return -1;
+
+    for (i = 0; i < tree_inodes; i++)
+    {
+        n = tree[i];
+        if (S_ISDIR(n->mode))
+        {
+            if (build_dir(n))
+                return -1;
+        }
+        else if (n->size <= ASSOOFS_INLINE_DATA_SIZE)
+        {
+            n->flags = ASSOOFS_INODE_INLINE;
+        }
+        else
+        {
+            n->blocks = (n->size + block_size - 1) / block_size;
+        }
+        tree_blocks += n->blocks;
+    }
+    printf("%s: %llu files and directories, %llu blocks.\n", source_dir, (unsigned long long)tree_inodes, (unsigned long long)tree_blocks);
     return 0;
 }
 
-int write_block(int fd, char *block, size_t len)
+/* Tamaño de una imagen nueva para -d: el mínimo en el que cabe el árbol, más un octavo libre */
+static uint64_t tree_image_size(void)
 {
-    ssize_t ret;
+    uint64_t blocks = tree_blocks + tree_blocks / 8 + 64;
 
-    ret = write(fd, block, len);
-    if (ret != len)
+    device_size = blocks * block_size;
+    while (compute_geometry(1))
     {
-        printf("Writing file body has failed.\n");
+        blocks += blocks / 8;
+        device_size = blocks * block_size;
+    }
+    return device_size;
+}
+
+/* Reparte los bloques del árbol desde first_data_block: primero todos los directorios, luego los ficheros */
+static void tree_place(void)
+{
+    uint64_t next = first_data_block;
+    size_t i;
+    int dirs;
+
+    for (dirs = 1; dirs >= 0; dirs--)
+    {
+        for (i = 0; i < tree_inodes; i++)
+        {
+            if (!S_ISDIR(tree[i]->mode) == !dirs && tree[i]->blocks)
+            {
+                tree[i]->start = next;
+                next += tree[i]->blocks;
+            }
+        }
+    }
+}
+
+static void tree_fill_inodes(struct assoofs_inode_info *table)
+{
+    struct assoofs_inode_info *info;
+    struct node *n;
+    size_t i;
+
+    for (i = 0; i < tree_inodes; i++)
+    {
+        n = tree[i];
+        info = &table[n->ino];
+        info->mode = n->mode;
+        info->inode_no = n->ino;
+        info->state_flag = ASSOOFS_FLAG_USED;
+        if (S_ISDIR(n->mode))
+            info->dir_children_count = n->nchildren;
+        else
+            info->file_size = n->size;
+        if (n->blocks)
+            init_extent(info, n->start, n->blocks);
+        info->flags = n->flags;
+        if (S_ISDIR(n->mode) && (n->flags & ASSOOFS_INODE_INLINE))
+            memcpy(info->inline_data, n->dir_data, ASSOOFS_INLINE_DATA_SIZE);
+    }
+}
+
+/* Copia un fichero: los pequeños van a su inodo y el resto a sus bloques, con el final del último a cero */
+static int copy_file(int fd, struct node *n, struct assoofs_inode_info *table, char *buf)
+{
+    uint64_t done = 0, len = n->blocks * block_size;
+    ssize_t got = 1;
+    int src;
+
+    src = open(n->path, O_RDONLY);
+    if (src == -1)
+    {
+        perror(n->path);
         return -1;
     }
-    printf("block has been written succesfully.\n");
+    if (!n->blocks)
+    {
+        got = n->size ? read(src, table[n->ino].inline_data, n->size) : 0;
+        close(src);
+        if (got != (ssize_t)n->size)
+        {
+            printf("%s changed while copying it.\n", n->path);
+            return -1;
+        }
+        return 0;
+    }
+
+    posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (done < len)
+    {
+        size_t want = len - done < COPY_CHUNK ? len - done : COPY_CHUNK;
+        size_t have = 0;
+
+        /* No se lee más allá del tamaño con el que se contó el fichero, aunque haya crecido */
+        while (got > 0 && have < want && done + have < n->size)
+        {
+            got = read(src, buf + have, (want - have < n->size - done - have) ? want - have : n->size - done - have);
+            if (got > 0)
+                have += got;
+        }
+        if (got < 0 || (done + have < n->size && have < want))
+        {
+            printf("%s changed while copying it.\n", n->path);
+            close(src);
+            return -1;
+        }
+        memset(buf + have, 0, want - have);
+        if (pwrite(fd, buf, want, (off_t)(n->start * block_size + done)) != (ssize_t)want)
+        {
+            perror("Error writing file data");
+            close(src);
+            return -1;
+        }
+        done += want;
+    }
+    close(src);
     return 0;
 }
 
-int main(int argc, char *argv[])
+struct copy_args
 {
     int fd;
-    ssize_t ret;
-    char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
+    struct assoofs_inode_info *table;
+};
 
-    struct assoofs_inode_info welcome = {
-        .mode = S_IFREG,
-        .inode_no = WELCOMEFILE_INODE_NUMBER,
-        .data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
-        .file_size = sizeof(welcomefile_body),
-    };
+/* Hilo de copia: va cogiendo el siguiente fichero pendiente hasta que no quedan */
+static void *copy_thread(void *arg)
+{
+    struct copy_args *args = arg;
+    char *buf;
+    size_t i;
 
-    struct assoofs_dir_record_entry record = {
-        .filename = "README.txt",
-        .inode_no = WELCOMEFILE_INODE_NUMBER,
-        .state_flag = ASSOOFS_FLAG_USED,
-    };
+    if (posix_memalign((void **)&buf, block_size, COPY_CHUNK))
+    {
+        atomic_store(&copy_failed, 1);
+        return NULL;
+    }
+    while (!atomic_load(&copy_failed) && (i = atomic_fetch_add(&next_copy, 1)) < tree_inodes)
+    {
+        if (S_ISREG(tree[i]->mode) && copy_file(args->fd, tree[i], args->table, buf))
+            atomic_store(&copy_failed, 1);
+    }
+    free(buf);
+    return NULL;
+}
 
-    if (argc != 2)
+/* Copia los ficheros en paralelo mientras este hilo escribe los bloques de los directorios, que son contiguos */
+static int tree_write(int fd, struct assoofs_inode_info *table)
+{
+    pthread_t threads[MAX_COPY_THREADS];
+    struct copy_args args = {fd, table};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus < 4 ? 4 : cpus > MAX_COPY_THREADS ? MAX_COPY_THREADS : cpus;
+    int started, ret = 0;
+    size_t i;
+
+    tree_fill_inodes(table);
+    for (started = 0; started < nthreads; started++)
     {
-        printf("Usage: mkassoofs <device>\n");
-        return -1;
+        if (pthread_create(&threads[started], NULL, copy_thread, &args))
+            break;
     }
+    if (started == 0)
+        copy_thread(&args);
 
-    fd = open(argv[1], O_RDWR);
-    if (fd == -1)
+    for (i = 0; i < tree_inodes && !ret; i++)
     {
-        perror("Error opening the device");
+        if (S_ISDIR(tree[i]->mode) && tree[i]->blocks && write_all(fd, tree[i]->dir_data, tree[i]->blocks * block_size, tree[i]->start))
+        {
+            printf("Writing the blocks of directory %s has failed.\n", tree[i]->path);
+            ret = -1;
+            atomic_store(&copy_failed, 1);
+        }
+    }
+    while (started > 0)
+        pthread_join(threads[--started], NULL);
+
+    if (ret || atomic_load(&copy_failed))
         return -1;
+    printf("%s copied succesfully.\n", source_dir);
+    return 0;
+}
+
+/* Diario vacío: su superbloque, con s_start = 0 (no hay nada que recuperar). La secuencia inicial y el uuid
+ * son aleatorios para que los bloques de un diario anterior en el mismo dispositivo no pasen por propios */
+static void fill_journal_superblock(struct jbd2_superblock *jsb)
+{
+    uint32_t sequence = 1;
+
+    if (getrandom(&sequence, sizeof(sequence), 0) != sizeof(sequence) ||
+        getrandom(jsb->s_uuid, sizeof(jsb->s_uuid), 0) != sizeof(jsb->s_uuid))
+        printf("No random numbers for the journal: its blocks are zeroed anyway.\n");
+    jsb->h_magic = htonl(JBD2_MAGIC_NUMBER);
+    jsb->h_blocktype = htonl(JBD2_SUPERBLOCK_V2);
+    jsb->s_blocksize = htonl(block_size);
+    jsb->s_maxlen = htonl(journal_blocks);
+    jsb->s_first = htonl(1);
+    jsb->s_sequence = htonl(sequence);
+    jsb->s_nr_users = htonl(1);
+}
+
+/*
+ * Todos los metadatos desde el superbloque hasta los primeros bloques de la tabla de inodos son contiguos:
+ * se construyen en un único buffer y se escriben de una vez. El resto de la tabla se pone a cero aquí o,
+ * con la inicialización diferida, lo hace el módulo. El diario se escribe entero: su superbloque y ceros.
+ */
+static int write_metadata(int fd)
+{
+    uint64_t head_blocks = inode_table_start + itable_head_blocks;
+    struct assoofs_super_block_info sb = {0};
+    char *head, *block = NULL;
+    unsigned char *bitmap, *inode_bitmap;
+    int ret = -1;
+
+    head = alloc_blocks(head_blocks);
+    if (!head || !(block = alloc_blocks(1)))
+    {
+        printf("Not enough memory for the metadata.\n");
+        goto out;
     }
 
-    ret = 1;
-    do
+    fill_superblock(&sb);
+    memcpy(head, &sb, sizeof(sb) < block_size ? sizeof(sb) : block_size);
+
+    /* Mapa de bits de bloques libres: ocupados los bloques de metadatos y los que caen fuera del dispositivo */
+    bitmap = (unsigned char *)head + BITMAP_START_BLOCK * block_size;
+    set_bits(bitmap, 0, first_data_block + tree_blocks);
+    set_bits(bitmap, blocks_count, bitmap_blocks * BITS_PER_BITMAP_BLOCK);
+
+    /* Mapa de bits de inodos: ocupadas la ranura 0 (no se usa), las de los inodos iniciales y las que no existen */
+    inode_bitmap = (unsigned char *)head + inode_bitmap_start * block_size;
+    set_bits(inode_bitmap, 0, last_inode + 1);
+    set_bits(inode_bitmap, inode_table_blocks * INODES_PER_BLOCK, inode_bitmap_blocks * BITS_PER_BITMAP_BLOCK);
+
+    /* Tabla de inodos: el inodo número n ocupa la ranura n. Con -d, los ficheros pequeños se copian
+     * directamente en su ranura, así que el buffer se escribe después de copiar el árbol */
+    if (source_dir)
     {
-        if (write_superblock(fd))
-            break;
+        if (tree_write(fd, (struct assoofs_inode_info *)(head + inode_table_start * block_size)))
+            goto out;
+    }
+    else
+    {
+        fill_inodes((struct assoofs_inode_info *)(head + inode_table_start * block_size), block);
+    }
 
-        if (write_root_inode(fd))
-            break;
+    if (write_all(fd, head, head_blocks * block_size, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER))
+    {
+        printf("Writing the superblock, bitmaps and inode table has failed.\n");
+        goto out;
+    }
+    printf("super block, free block bitmap (%llu blocks) and inode bitmap (%llu blocks) written succesfully.\n",
+           (unsigned long long)bitmap_blocks, (unsigned long long)inode_bitmap_blocks);
 
-        if (write_welcome_inode(fd, &welcome))
-            break;
+    if (itable_zeroed < inode_table_blocks)
+    {
+        printf("inode table (%llu blocks): %llu written, the rest is zeroed by the module after mounting.\n",
+               (unsigned long long)inode_table_blocks, (unsigned long long)itable_zeroed);
+    }
+    else if (write_zeroes(fd, inode_table_start + itable_head_blocks, inode_table_blocks - itable_head_blocks))
+    {
+        printf("The inode table was not written properly.\n");
+        goto out;
+    }
+    else
+    {
+        printf("inode table (%llu blocks) written succesfully.\n", (unsigned long long)inode_table_blocks);
+    }
 
-        if (write_dirent(fd, &record))
-            break;
+    if (rootdir_block)
+    {
+        if (write_all(fd, block, block_size, rootdir_block))
+        {
+            printf("Writing the root directory datablock has failed.\n");
+            goto out;
+        }
+        printf("root directory datablock written succesfully.\n");
+    }
+
+    if (journal_blocks == 0)
+    {
+        printf("No journal.\n");
+    }
+    else
+    {
+        memset(block, 0, block_size);
+        fill_journal_superblock((struct jbd2_superblock *)block);
+        if (write_all(fd, block, block_size, journal_start))
+        {
+            printf("Writing the journal superblock has failed.\n");
+            goto out;
+        }
+        /* Sin restos de otro formato: la recuperación nunca encuentra bloques que parezcan del diario */
+        if (write_zeroes(fd, journal_start + 1, journal_blocks - 1))
+        {
+            printf("The journal was not written properly.\n");
+            goto out;
+        }
+        printf("journal (%llu blocks) written succesfully.\n", (unsigned long long)journal_blocks);
+    }
+
+    ret = fsync(fd);
+    if (ret)
+        perror("Error flushing the device");
+out:
+    free(block);
+    free(head);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t size, value;
+    int fd, opt, ret;
 
-        if (write_block(fd, welcomefile_body, welcome.file_size))
+    while ((opt = getopt(argc, argv, "s:b:N:i:J:D:E:d:eh")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (parse_size(optarg, &device_size) || device_size == 0)
+            {
+                printf("Invalid size: %s\n", optarg);
+                return EXIT_USAGE;
+            }
+            break;
+        case 'b':
+            if (parse_size(optarg, &block_size) || block_size < ASSOOFS_MIN_BLOCK_SIZE || block_size > ASSOOFS_MAX_BLOCK_SIZE || (block_size & (block_size - 1)))
+            {
+                printf("Invalid block size: %s (it must be a power of 2 from %d to %d)\n", optarg, ASSOOFS_MIN_BLOCK_SIZE, ASSOOFS_MAX_BLOCK_SIZE);
+                return EXIT_USAGE;
+            }
+            break;
+        case 'N':
+            if (parse_size(optarg, &inodes_wanted) || inodes_wanted == 0)
+            {
+                printf("Invalid number of inodes: %s\n", optarg);
+                return EXIT_USAGE;
+            }
+            break;
+        case 'i':
+            if (parse_size(optarg, &bytes_per_inode) || bytes_per_inode < ASSOOFS_INODE_SIZE)
+            {
+                printf("Invalid bytes per inode: %s\n", optarg);
+                return EXIT_USAGE;
+            }
+            break;
+        case 'J':
+            if (parse_size(optarg, &value) || value > UINT32_MAX)
+            {
+                printf("Invalid journal size: %s\n", optarg);
+                return EXIT_USAGE;
+            }
+            journal_wanted = value;
+            break;
+        case 'D':
+            if (strcmp(optarg, "inline") && strcmp(optarg, "block"))
+            {
+                printf("Invalid directory format: %s\n", optarg);
+                return EXIT_USAGE;
+            }
+            block_dirs = !strcmp(optarg, "block");
+            break;
+        case 'E':
+            if (strcmp(optarg, "lazy_itable_init=0") && strcmp(optarg, "lazy_itable_init=1"))
+            {
+                printf("Invalid extended option: %s\n", optarg);
+                return EXIT_USAGE;
+            }
+            lazy_itable_init = optarg[strlen(optarg) - 1] == '1';
+            break;
+        case 'e':
+            welcome_file = 0;
             break;
+        case 'd':
+            source_dir = optarg;
+            welcome_file = 0;
+            break;
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        default:
+            usage();
+            return EXIT_USAGE;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage();
+        return EXIT_USAGE;
+    }
+
+    /* El árbol de -d se recorre antes de nada: la geometría depende de los inodos y bloques que necesita */
+    if (source_dir && tree_load())
+        return EXIT_FAILURE;
+
+    /* Con -s o -d se puede crear (o ampliar) una imagen en un fichero normal */
+    fd = open(argv[optind], O_RDWR | ((device_size || source_dir) ? O_CREAT : 0), 0644);
+    if (fd == -1)
+    {
+        perror("Error opening the device");
+        return EXIT_FAILURE;
+    }
 
-        ret = 0;
-    } while (0);
+    if (get_device_size(fd, &size) == -1)
+    {
+        perror("Error getting the device size");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if (!device_size && size == 0 && source_dir)
+    {
+        device_size = tree_image_size();
+    }
+    else if (!device_size)
+    {
+        device_size = size;
+    }
+    if (device_size > size && ftruncate(fd, device_size) == -1)
+    {
+        perror("Error growing the device to the requested size");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    ret = compute_geometry(0);
+    if (!ret)
+    {
+        tree_place();
+        ret = write_metadata(fd);
+    }
 
     close(fd);
-    return ret;
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 }